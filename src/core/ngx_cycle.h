@@ -20,6 +20,8 @@
 typedef struct ngx_shm_zone_s ngx_shm_zone_t;
 
 typedef ngx_int_t (*ngx_shm_zone_init_pt)(ngx_shm_zone_t *zone, void *data);
+typedef ngx_uint_t (*ngx_shm_zone_unlock_pt)(ngx_shm_zone_t *zone,
+    ngx_pid_t pid);
 
 struct ngx_shm_zone_s
 {
@@ -28,6 +30,9 @@ struct ngx_shm_zone_s
     ngx_shm_zone_init_pt init;
     void *tag;
     ngx_uint_t noreuse; /* unsigned  noreuse:1; */
+
+    /* unlocks the mutexes of the zone besides the slab pool one */
+    ngx_shm_zone_unlock_pt unlock;
 };
 
 struct ngx_cycle_s
@@ -9,6 +9,10 @@
 #include <ngx_core.h>
 #include <ngx_event.h>
 
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
 
 /*
  * open file cache caches
@@ -21,6 +25,18 @@
 #define NGX_MIN_READ_AHEAD  (128 * 1024)
 
 
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_str_t                name;
+    ngx_open_file_info_t     of;
+    ngx_int_t                rc;
+    ngx_uint_t               test;  /* unsigned test:1 */
+} ngx_open_file_thread_ctx_t;
+
+#endif
+
+
 static void ngx_open_file_cache_cleanup(void *data);
 #if (NGX_HAVE_OPENAT)
 static ngx_fd_t ngx_openat_file_owner(ngx_fd_t at_fd, const u_char *name,
@@ -37,6 +53,14 @@ static ngx_int_t ngx_file_info_wrapper(ngx_str_t *name,
     ngx_open_file_info_t *of, ngx_file_info_t *fi, ngx_log_t *log);
 static ngx_int_t ngx_open_and_stat_file(ngx_str_t *name,
     ngx_open_file_info_t *of, ngx_log_t *log);
+static ngx_int_t ngx_test_file(ngx_str_t *name, ngx_open_file_info_t *of,
+    ngx_log_t *log);
+static ngx_int_t ngx_open_and_stat_file_async(ngx_str_t *name,
+    ngx_open_file_info_t *of, ngx_uint_t test, ngx_pool_t *pool);
+#if (NGX_THREADS)
+static void ngx_open_file_thread_handler(void *data, ngx_log_t *log);
+static void ngx_open_file_thread_cleanup(void *data);
+#endif
 static void ngx_open_file_add_event(ngx_open_file_cache_t *cache,
     ngx_cached_open_file_t *file, ngx_open_file_info_t *of, ngx_log_t *log);
 static void ngx_open_file_cleanup(void *data);
@@ -51,6 +75,22 @@ static ngx_cached_open_file_t *
     ngx_open_file_lookup(ngx_open_file_cache_t *cache, ngx_str_t *name,
     uint32_t hash);
 static void ngx_open_file_cache_remove(ngx_event_t *ev);
+#if (NGX_HAVE_INOTIFY)
+static void ngx_open_file_inotify_add(ngx_open_file_cache_t *cache,
+    ngx_cached_open_file_t *file, ngx_log_t *log);
+static ngx_int_t ngx_open_file_inotify_init(ngx_open_file_cache_t *cache,
+    ngx_log_t *log);
+static void ngx_open_file_inotify_del(ngx_open_file_cache_event_t *fev);
+static ngx_open_file_cache_event_t *ngx_open_file_inotify_lookup(
+    ngx_open_file_cache_t *cache, int wd);
+static void ngx_open_file_inotify_handler(ngx_event_t *rev);
+static void ngx_open_file_inotify_close(ngx_open_file_cache_t *cache);
+
+
+static ngx_queue_t  ngx_open_file_inotify_caches = {
+    &ngx_open_file_inotify_caches, &ngx_open_file_inotify_caches
+};
+#endif
 
 
 ngx_open_file_cache_t *
@@ -73,6 +113,12 @@ ngx_open_file_cache_init(ngx_pool_t *pool, ngx_uint_t max, time_t inactive)
     cache->max = max;
     cache->inactive = inactive;
 
+#if (NGX_HAVE_INOTIFY)
+    cache->inotify = NULL;
+    ngx_rbtree_init(&cache->watches, &cache->watches_sentinel,
+                    ngx_rbtree_insert_value);
+#endif
+
     cln = ngx_pool_cleanup_add(pool, 0);
     if (cln == NULL) {
         return NULL;
@@ -137,6 +183,10 @@ ngx_open_file_cache_cleanup(void *data)
                       "rbtree still is not empty in open file cache");
 
     }
+
+#if (NGX_HAVE_INOTIFY)
+    ngx_open_file_inotify_close(cache);
+#endif
 }
 
 
@@ -147,7 +197,6 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
     time_t                          now;
     uint32_t                        hash;
     ngx_int_t                       rc;
-    ngx_file_info_t                 fi;
     ngx_pool_cleanup_t             *cln;
     ngx_cached_open_file_t         *file;
     ngx_pool_cleanup_file_t        *clnf;
@@ -159,23 +208,7 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
     if (cache == NULL) {
 
         if (of->test_only) {
-
-            if (ngx_file_info_wrapper(name, of, &fi, pool->log)
-                == NGX_FILE_ERROR)
-            {
-                return NGX_ERROR;
-            }
-
-            of->uniq = ngx_file_uniq(&fi);
-            of->mtime = ngx_file_mtime(&fi);
-            of->size = ngx_file_size(&fi);
-            of->fs_size = ngx_file_fs_size(&fi);
-            of->is_dir = ngx_is_dir(&fi);
-            of->is_file = ngx_is_file(&fi);
-            of->is_link = ngx_is_link(&fi);
-            of->is_exec = ngx_is_exec(&fi);
-
-            return NGX_OK;
+            return ngx_open_and_stat_file_async(name, of, 1, pool);
         }
 
         cln = ngx_pool_cleanup_add(pool, sizeof(ngx_pool_cleanup_file_t));
@@ -183,7 +216,7 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
             return NGX_ERROR;
         }
 
-        rc = ngx_open_and_stat_file(name, of, pool->log);
+        rc = ngx_open_and_stat_file_async(name, of, 0, pool);
 
         if (rc == NGX_OK && !of->is_dir) {
             cln->handler = ngx_pool_cleanup_file;
@@ -218,7 +251,13 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
 
             /* file was not used often enough to keep open */
 
-            rc = ngx_open_and_stat_file(name, of, pool->log);
+            rc = ngx_open_and_stat_file_async(name, of, 0, pool);
+
+            if (rc == NGX_AGAIN) {
+                file->uses--;
+                ngx_queue_insert_head(&cache->expire_queue, &file->queue);
+                return NGX_AGAIN;
+            }
 
             if (rc != NGX_OK && (of->err == 0 || !of->errors)) {
                 goto failed;
@@ -351,7 +390,11 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
 
     /* not found */
 
-    rc = ngx_open_and_stat_file(name, of, pool->log);
+    rc = ngx_open_and_stat_file_async(name, of, 0, pool);
+
+    if (rc == NGX_AGAIN) {
+        return NGX_AGAIN;
+    }
 
     if (rc != NGX_OK && (of->err == 0 || !of->errors)) {
         goto failed;
@@ -945,6 +988,172 @@ done:
 }
 
 
+static ngx_int_t
+ngx_test_file(ngx_str_t *name, ngx_open_file_info_t *of, ngx_log_t *log)
+{
+    ngx_file_info_t  fi;
+
+    if (ngx_file_info_wrapper(name, of, &fi, log) == NGX_FILE_ERROR) {
+        return NGX_ERROR;
+    }
+
+    of->uniq = ngx_file_uniq(&fi);
+    of->mtime = ngx_file_mtime(&fi);
+    of->size = ngx_file_size(&fi);
+    of->fs_size = ngx_file_fs_size(&fi);
+    of->is_dir = ngx_is_dir(&fi);
+    of->is_file = ngx_is_file(&fi);
+    of->is_link = ngx_is_link(&fi);
+    of->is_exec = ngx_is_exec(&fi);
+
+    return NGX_OK;
+}
+
+
+/*
+ * with of->thread_handler set, open() and stat() are posted to a thread
+ * and NGX_AGAIN is returned; the caller is expected to repeat the call
+ * with the same name when the task is completed
+ */
+
+static ngx_int_t
+ngx_open_and_stat_file_async(ngx_str_t *name, ngx_open_file_info_t *of,
+    ngx_uint_t test, ngx_pool_t *pool)
+{
+#if (NGX_THREADS)
+    ngx_thread_task_t           *task;
+    ngx_pool_cleanup_t          *cln;
+    ngx_open_file_thread_ctx_t  *ctx;
+
+    if (of->thread_handler == NULL) {
+        goto sync;
+    }
+
+    task = of->thread_task;
+
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(pool, sizeof(ngx_open_file_thread_ctx_t));
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln = ngx_pool_cleanup_add(pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_open_file_thread_cleanup;
+        cln->data = task;
+
+        ctx = task->ctx;
+        ctx->of.fd = NGX_INVALID_FILE;
+
+        of->thread_task = task;
+    }
+
+    ctx = task->ctx;
+
+    if (task->event.active) {
+        return NGX_AGAIN;
+    }
+
+    if (task->event.complete) {
+        task->event.complete = 0;
+
+        if (ctx->test == test
+            && ctx->name.len == name->len
+            && ngx_memcmp(ctx->name.data, name->data, name->len) == 0)
+        {
+            *of = ctx->of;
+            ctx->of.fd = NGX_INVALID_FILE;
+
+            return ctx->rc;
+        }
+
+        /* the result for another name is not needed */
+
+        if (ctx->of.fd != NGX_INVALID_FILE) {
+            if (ngx_close_file(ctx->of.fd) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_ALERT, pool->log, ngx_errno,
+                              ngx_close_file_n " \"%V\" failed", &ctx->name);
+            }
+
+            ctx->of.fd = NGX_INVALID_FILE;
+        }
+    }
+
+    ctx->name.len = name->len;
+    ctx->name.data = ngx_pnalloc(pool, name->len + 1);
+    if (ctx->name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_cpystrn(ctx->name.data, name->data, name->len + 1);
+
+    ctx->of = *of;
+    ctx->test = test;
+
+    task->handler = ngx_open_file_thread_handler;
+
+    if (of->thread_handler(task, of) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+
+sync:
+
+#endif
+
+    if (test) {
+        return ngx_test_file(name, of, pool->log);
+    }
+
+    return ngx_open_and_stat_file(name, of, pool->log);
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_open_file_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_open_file_thread_ctx_t *ctx = data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                   "thread open: \"%V\"", &ctx->name);
+
+    if (ctx->test) {
+        ctx->rc = ngx_test_file(&ctx->name, &ctx->of, log);
+
+    } else {
+        ctx->rc = ngx_open_and_stat_file(&ctx->name, &ctx->of, log);
+    }
+}
+
+
+static void
+ngx_open_file_thread_cleanup(void *data)
+{
+    ngx_thread_task_t *task = data;
+
+    ngx_open_file_thread_ctx_t  *ctx;
+
+    ctx = task->ctx;
+
+    /* a descriptor opened for a request that was finalized meanwhile */
+
+    if (!task->event.active && ctx->of.fd != NGX_INVALID_FILE) {
+        if (ngx_close_file(ctx->of.fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                          ngx_close_file_n " \"%V\" failed", &ctx->name);
+        }
+    }
+}
+
+#endif
+
+
 /*
  * we ignore any possible event setting error and
  * fallback to usual periodic file retests
@@ -956,8 +1165,7 @@ ngx_open_file_add_event(ngx_open_file_cache_t *cache,
 {
     ngx_open_file_cache_event_t  *fev;
 
-    if (!(ngx_event_flags & NGX_USE_VNODE_EVENT)
-        || !of->events
+    if (!of->events
         || file->event
         || of->fd == NGX_INVALID_FILE
         || file->uses < of->min_uses)
@@ -965,6 +1173,13 @@ ngx_open_file_add_event(ngx_open_file_cache_t *cache,
         return;
     }
 
+    if (!(ngx_event_flags & NGX_USE_VNODE_EVENT)) {
+#if (NGX_HAVE_INOTIFY)
+        ngx_open_file_inotify_add(cache, file, log);
+#endif
+        return;
+    }
+
     file->use_event = 0;
 
     file->event = ngx_calloc(sizeof(ngx_event_t), log);
@@ -1081,8 +1296,16 @@ ngx_open_file_del_event(ngx_cached_open_file_t *file)
         return;
     }
 
-    (void) ngx_del_event(file->event, NGX_VNODE_EVENT,
-                         file->count ? NGX_FLUSH_EVENT : NGX_CLOSE_EVENT);
+#if (NGX_HAVE_INOTIFY)
+    if (!(ngx_event_flags & NGX_USE_VNODE_EVENT)) {
+        ngx_open_file_inotify_del(file->event->data);
+
+    } else
+#endif
+    {
+        (void) ngx_del_event(file->event, NGX_VNODE_EVENT,
+                             file->count ? NGX_FLUSH_EVENT : NGX_CLOSE_EVENT);
+    }
 
     ngx_free(file->event->data);
     ngx_free(file->event);
@@ -1251,3 +1474,295 @@ ngx_open_file_cache_remove(ngx_event_t *ev)
     ngx_free(ev->data);
     ngx_free(ev);
 }
+
+
+#if (NGX_HAVE_INOTIFY)
+
+/*
+ * inotify watches the name rather than the descriptor, so as with
+ * vnode events the file is trusted only after one revalidation
+ */
+
+static void
+ngx_open_file_inotify_add(ngx_open_file_cache_t *cache,
+    ngx_cached_open_file_t *file, ngx_log_t *log)
+{
+    int                           wd;
+    ngx_open_file_cache_event_t  *fev;
+
+    if (cache->inotify == NULL
+        && ngx_open_file_inotify_init(cache, log) != NGX_OK)
+    {
+        return;
+    }
+
+    wd = inotify_add_watch(cache->inotify->fd, (char *) file->name,
+                           IN_MODIFY|IN_ATTRIB|IN_MOVE_SELF|IN_DELETE_SELF);
+
+    if (wd == -1) {
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, ngx_errno,
+                       "inotify_add_watch(\"%s\") failed, fd:%d",
+                       file->name, file->fd);
+        return;
+    }
+
+    file->use_event = 0;
+
+    file->event = ngx_calloc(sizeof(ngx_event_t), log);
+    if (file->event == NULL) {
+        goto failed;
+    }
+
+    fev = ngx_calloc(sizeof(ngx_open_file_cache_event_t), log);
+    if (fev == NULL) {
+        ngx_free(file->event);
+        file->event = NULL;
+        goto failed;
+    }
+
+    fev->fd = file->fd;
+    fev->file = file;
+    fev->cache = cache;
+
+    file->event->handler = ngx_open_file_cache_remove;
+    file->event->data = fev;
+    file->event->log = ngx_cycle->log;
+
+    /* several names of the same file share a watch descriptor */
+
+    fev->watch.key = (ngx_rbtree_key_t) wd;
+    ngx_rbtree_insert(&cache->watches, &fev->watch);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "inotify watch %d: %s", wd, file->name);
+
+    return;
+
+failed:
+
+    if (ngx_open_file_inotify_lookup(cache, wd) == NULL) {
+        (void) inotify_rm_watch(cache->inotify->fd, wd);
+    }
+}
+
+
+static ngx_int_t
+ngx_open_file_inotify_init(ngx_open_file_cache_t *cache, ngx_log_t *log)
+{
+    int                fd;
+    ngx_event_t       *rev;
+    ngx_connection_t  *c;
+
+    fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+
+    if (fd == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "inotify_init1() failed");
+        return NGX_ERROR;
+    }
+
+    c = ngx_get_connection(fd, ngx_cycle->log);
+    if (c == NULL) {
+        if (close(fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "inotify close() failed");
+        }
+
+        return NGX_ERROR;
+    }
+
+    c->data = cache;
+
+    rev = c->read;
+    rev->handler = ngx_open_file_inotify_handler;
+    rev->log = ngx_cycle->log;
+
+    if (ngx_add_event(rev, NGX_READ_EVENT, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        return NGX_ERROR;
+    }
+
+    cache->inotify = c;
+
+    ngx_queue_insert_tail(&ngx_open_file_inotify_caches,
+                          &cache->inotify_queue);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_open_file_inotify_close(ngx_open_file_cache_t *cache)
+{
+    if (cache->inotify == NULL) {
+        return;
+    }
+
+    ngx_queue_remove(&cache->inotify_queue);
+
+    ngx_close_connection(cache->inotify);
+    cache->inotify = NULL;
+}
+
+
+/*
+ * the caches live in the cycle pool, which a worker destroys only after
+ * it has checked for connections left open, so the inotify descriptors
+ * are closed on process exit instead
+ */
+
+void
+ngx_open_file_cache_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_queue_t            *q;
+    ngx_open_file_cache_t  *cache;
+
+    while (!ngx_queue_empty(&ngx_open_file_inotify_caches)) {
+        q = ngx_queue_head(&ngx_open_file_inotify_caches);
+        cache = ngx_queue_data(q, ngx_open_file_cache_t, inotify_queue);
+
+        ngx_open_file_inotify_close(cache);
+    }
+}
+
+
+static void
+ngx_open_file_inotify_del(ngx_open_file_cache_event_t *fev)
+{
+    int                     wd;
+    ngx_open_file_cache_t  *cache;
+
+    cache = fev->cache;
+    wd = (int) fev->watch.key;
+
+    ngx_rbtree_delete(&cache->watches, &fev->watch);
+
+    if (cache->inotify && ngx_open_file_inotify_lookup(cache, wd) == NULL) {
+        (void) inotify_rm_watch(cache->inotify->fd, wd);
+    }
+}
+
+
+static ngx_open_file_cache_event_t *
+ngx_open_file_inotify_lookup(ngx_open_file_cache_t *cache, int wd)
+{
+    ngx_rbtree_key_t    key;
+    ngx_rbtree_node_t  *node, *sentinel;
+
+    key = (ngx_rbtree_key_t) wd;
+
+    node = cache->watches.root;
+    sentinel = cache->watches.sentinel;
+
+    while (node != sentinel) {
+
+        if (key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        return (ngx_open_file_cache_event_t *)
+                   ((u_char *) node
+                    - offsetof(ngx_open_file_cache_event_t, watch));
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_open_file_inotify_handler(ngx_event_t *rev)
+{
+    int                           wd;
+    u_char                       *p, *last;
+    ssize_t                       n;
+    ngx_err_t                     err;
+    ngx_connection_t             *c;
+    ngx_rbtree_node_t            *root;
+    struct inotify_event         *ie;
+    ngx_open_file_cache_t        *cache;
+    ngx_open_file_cache_event_t  *fev;
+    uint32_t                      buf[1024];
+
+    c = rev->data;
+    cache = c->data;
+
+    for ( ;; ) {
+        n = read(c->fd, buf, sizeof(buf));
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err != NGX_EAGAIN && err != NGX_EINTR) {
+                ngx_log_error(NGX_LOG_ALERT, rev->log, err,
+                              "inotify read() failed");
+            }
+
+            return;
+        }
+
+        if (n == 0) {
+            return;
+        }
+
+        p = (u_char *) buf;
+        last = p + n;
+
+        while (p < last) {
+            ie = (struct inotify_event *) p;
+            p += sizeof(struct inotify_event) + ie->len;
+
+            ngx_log_debug2(NGX_LOG_DEBUG_CORE, rev->log, 0,
+                           "inotify event %d: %08XD", ie->wd, ie->mask);
+
+            if (ie->mask & IN_Q_OVERFLOW) {
+
+                /* events were lost, so drop all watched files */
+
+                while (cache->watches.root != cache->watches.sentinel) {
+                    root = cache->watches.root;
+
+                    fev = (ngx_open_file_cache_event_t *)
+                              ((u_char *) root
+                               - offsetof(ngx_open_file_cache_event_t, watch));
+
+                    wd = (int) root->key;
+
+                    ngx_rbtree_delete(&cache->watches, root);
+
+                    if (ngx_open_file_inotify_lookup(cache, wd) == NULL) {
+                        (void) inotify_rm_watch(c->fd, wd);
+                    }
+
+                    ngx_open_file_cache_remove(fev->file->event);
+                }
+
+                continue;
+            }
+
+            wd = ie->wd;
+
+            for ( ;; ) {
+                fev = ngx_open_file_inotify_lookup(cache, wd);
+                if (fev == NULL) {
+                    break;
+                }
+
+                ngx_rbtree_delete(&cache->watches, &fev->watch);
+
+                ngx_open_file_cache_remove(fev->file->event);
+            }
+
+            if (!(ie->mask & IN_IGNORED)) {
+                (void) inotify_rm_watch(c->fd, wd);
+            }
+        }
+    }
+}
+
+#endif
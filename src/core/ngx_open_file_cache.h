@@ -16,7 +16,9 @@
 #define NGX_OPEN_FILE_DIRECTIO_OFF  NGX_MAX_OFF_T_VALUE
 
 
-typedef struct {
+typedef struct ngx_open_file_info_s  ngx_open_file_info_t;
+
+struct ngx_open_file_info_s {
     ngx_fd_t                 fd;
     ngx_file_uniq_t          uniq;
     time_t                   mtime;
@@ -37,6 +39,13 @@ typedef struct {
     unsigned                 disable_symlinks:2;
 #endif
 
+#if (NGX_THREADS || NGX_COMPAT)
+    ngx_thread_task_t       *thread_task;
+    ngx_int_t              (*thread_handler)(ngx_thread_task_t *task,
+                                             ngx_open_file_info_t *of);
+    void                    *thread_ctx;
+#endif
+
     unsigned                 test_dir:1;
     unsigned                 test_only:1;
     unsigned                 log:1;
@@ -48,7 +57,7 @@ typedef struct {
     unsigned                 is_link:1;
     unsigned                 is_exec:1;
     unsigned                 is_directio:1;
-} ngx_open_file_info_t;
+};
 
 
 typedef struct ngx_cached_open_file_s  ngx_cached_open_file_t;
@@ -96,6 +105,13 @@ typedef struct {
     ngx_uint_t               current;
     ngx_uint_t               max;
     time_t                   inactive;
+
+#if (NGX_HAVE_INOTIFY)
+    ngx_connection_t        *inotify;
+    ngx_queue_t              inotify_queue;
+    ngx_rbtree_t             watches;
+    ngx_rbtree_node_t        watches_sentinel;
+#endif
 } ngx_open_file_cache_t;
 
 
@@ -117,11 +133,18 @@ typedef struct {
 
     ngx_cached_open_file_t  *file;
     ngx_open_file_cache_t   *cache;
+
+#if (NGX_HAVE_INOTIFY)
+    ngx_rbtree_node_t        watch;       /* key is the watch descriptor */
+#endif
 } ngx_open_file_cache_event_t;
 
 
 ngx_open_file_cache_t *ngx_open_file_cache_init(ngx_pool_t *pool,
     ngx_uint_t max, time_t inactive);
+#if (NGX_HAVE_INOTIFY)
+void ngx_open_file_cache_exit_process(ngx_cycle_t *cycle);
+#endif
 ngx_int_t ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
     ngx_open_file_info_t *of, ngx_pool_t *pool);
 
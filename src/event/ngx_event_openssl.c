@@ -9,24 +9,57 @@
 #include <ngx_core.h>
 #include <ngx_event.h>
 
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
 
 #define NGX_SSL_PASSWORD_BUFFER_SIZE  4096
 
+/* the minimum size of a session cache shard, in pages */
+#define NGX_SSL_SESSION_SHARD_PAGES   64
+
 
 typedef struct {
     ngx_uint_t  engine;   /* unsigned  engine:1; */
 } ngx_openssl_conf_t;
 
 
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_connection_t  *connection;
+
+    int                n;
+    int                sslerr;
+    ngx_err_t          err;
+    ngx_uint_t         closed;    /* unsigned  closed:1; */
+
+    /* set in the event loop only */
+    ngx_uint_t         events;    /* unsigned  events:1; */
+} ngx_ssl_handshake_ctx_t;
+
+#endif
+
+
 static int ngx_ssl_password_callback(char *buf, int size, int rwflag,
     void *userdata);
 static int ngx_ssl_verify_callback(int ok, X509_STORE_CTX *x509_store);
 static void ngx_ssl_info_callback(const ngx_ssl_conn_t *ssl_conn, int where,
     int ret);
 static void ngx_ssl_passwords_cleanup(void *data);
+static ngx_int_t ngx_ssl_handshake_done(ngx_connection_t *c);
+static ngx_int_t ngx_ssl_handshake_wait(ngx_connection_t *c, int sslerr);
+#if (NGX_THREADS)
+static ngx_int_t ngx_ssl_thread_handshake(ngx_connection_t *c);
+static void ngx_ssl_thread_handshake_handler(void *data, ngx_log_t *log);
+static void ngx_ssl_thread_handshake_event_handler(ngx_event_t *ev);
+#endif
 static void ngx_ssl_handshake_handler(ngx_event_t *ev);
 static ngx_int_t ngx_ssl_handle_recv(ngx_connection_t *c, int n);
 static void ngx_ssl_write_handler(ngx_event_t *wev);
+static ssize_t ngx_ssl_sendfile(ngx_connection_t *c, ngx_buf_t *file,
+    size_t size);
 static void ngx_ssl_read_handler(ngx_event_t *rev);
 static void ngx_ssl_shutdown_handler(ngx_event_t *ev);
 static void ngx_ssl_connection_error(ngx_connection_t *c, int sslerr,
@@ -36,6 +69,8 @@ static void ngx_ssl_clear_error(ngx_log_t *log);
 static ngx_int_t ngx_ssl_session_id_context(ngx_ssl_t *ssl,
     ngx_str_t *sess_ctx);
 ngx_int_t ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_uint_t ngx_ssl_session_cache_unlock(ngx_shm_zone_t *shm_zone,
+    ngx_pid_t pid);
 static int ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn,
     ngx_ssl_session_t *sess);
 static ngx_ssl_session_t *ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
@@ -44,7 +79,7 @@ static ngx_ssl_session_t *ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 #endif
     u_char *id, int len, int *copy);
 static void ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess);
-static void ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
+static void ngx_ssl_expire_sessions(ngx_ssl_session_shard_t *shard,
     ngx_slab_pool_t *shpool, ngx_uint_t n);
 static void ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
@@ -53,6 +88,12 @@ static void ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
 static int ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
     unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx,
     HMAC_CTX *hctx, int enc);
+static ngx_int_t ngx_ssl_rotate_session_ticket_keys(SSL_CTX *ssl_ctx,
+    ngx_ssl_session_ticket_rotation_t *rotation, ngx_array_t *keys,
+    ngx_ssl_session_ticket_key_t *ring, ngx_log_t *log);
+#if (NGX_THREADS)
+static void ngx_ssl_session_ticket_rotation_cleanup(void *data);
+#endif
 #endif
 
 #ifndef X509_CHECK_FLAG_ALWAYS_CHECK_SUBJECT
@@ -110,6 +151,7 @@ int  ngx_ssl_connection_index;
 int  ngx_ssl_server_conf_index;
 int  ngx_ssl_session_cache_index;
 int  ngx_ssl_session_ticket_keys_index;
+int  ngx_ssl_session_ticket_rotation_index;
 int  ngx_ssl_certificate_index;
 int  ngx_ssl_next_certificate_index;
 int  ngx_ssl_certificate_name_index;
@@ -195,6 +237,14 @@ ngx_ssl_init(ngx_log_t *log)
         return NGX_ERROR;
     }
 
+    ngx_ssl_session_ticket_rotation_index = SSL_CTX_get_ex_new_index(0, NULL,
+                                                         NULL, NULL, NULL);
+    if (ngx_ssl_session_ticket_rotation_index == -1) {
+        ngx_ssl_error(NGX_LOG_ALERT, log, 0,
+                      "SSL_CTX_get_ex_new_index() failed");
+        return NGX_ERROR;
+    }
+
     ngx_ssl_certificate_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
                                                          NULL);
     if (ngx_ssl_certificate_index == -1) {
@@ -1166,6 +1216,10 @@ ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c, ngx_uint_t flags)
     sc->buffer = ((flags & NGX_SSL_BUFFER) != 0);
     sc->buffer_size = ssl->buffer_size;
 
+#if (NGX_THREADS)
+    sc->thread_pool = ssl->thread_pool;
+#endif
+
     sc->session_ctx = ssl->ctx;
 
     sc->connection = SSL_new(ssl->ctx);
@@ -1218,6 +1272,12 @@ ngx_ssl_handshake(ngx_connection_t *c)
     int        n, sslerr;
     ngx_err_t  err;
 
+#if (NGX_THREADS)
+    if (c->ssl->thread_pool) {
+        return ngx_ssl_thread_handshake(c);
+    }
+#endif
+
     ngx_ssl_clear_error(c->log);
 
     n = SSL_do_handshake(c->ssl->connection);
@@ -1225,127 +1285,237 @@ ngx_ssl_handshake(ngx_connection_t *c)
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_do_handshake: %d", n);
 
     if (n == 1) {
+        return ngx_ssl_handshake_done(c);
+    }
 
-        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
-            return NGX_ERROR;
-        }
+    sslerr = SSL_get_error(c->ssl->connection, n);
 
-        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
-            return NGX_ERROR;
-        }
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d", sslerr);
+
+    if (sslerr == SSL_ERROR_WANT_READ || sslerr == SSL_ERROR_WANT_WRITE) {
+        return ngx_ssl_handshake_wait(c, sslerr);
+    }
+
+    err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+
+    c->ssl->no_wait_shutdown = 1;
+    c->ssl->no_send_shutdown = 1;
+    c->read->eof = 1;
+
+    if (sslerr == SSL_ERROR_ZERO_RETURN || ERR_peek_error() == 0) {
+        ngx_connection_error(c, err,
+                             "peer closed connection in SSL handshake");
+
+        return NGX_ERROR;
+    }
+
+    c->read->error = 1;
+
+    ngx_ssl_connection_error(c, sslerr, err, "SSL_do_handshake() failed");
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_ssl_handshake_done(ngx_connection_t *c)
+{
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
 #if (NGX_DEBUG)
-        {
-        char         buf[129], *s, *d;
+    {
+    char         buf[129], *s, *d;
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L
-        const
+    const
 #endif
-        SSL_CIPHER  *cipher;
-
-        cipher = SSL_get_current_cipher(c->ssl->connection);
+    SSL_CIPHER  *cipher;
 
-        if (cipher) {
-            SSL_CIPHER_description(cipher, &buf[1], 128);
-
-            for (s = &buf[1], d = buf; *s; s++) {
-                if (*s == ' ' && *d == ' ') {
-                    continue;
-                }
+    cipher = SSL_get_current_cipher(c->ssl->connection);
 
-                if (*s == LF || *s == CR) {
-                    continue;
-                }
+    if (cipher) {
+        SSL_CIPHER_description(cipher, &buf[1], 128);
 
-                *++d = *s;
+        for (s = &buf[1], d = buf; *s; s++) {
+            if (*s == ' ' && *d == ' ') {
+                continue;
             }
 
-            if (*d != ' ') {
-                d++;
+            if (*s == LF || *s == CR) {
+                continue;
             }
 
-            *d = '\0';
+            *++d = *s;
+        }
 
-            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                           "SSL: %s, cipher: \"%s\"",
-                           SSL_get_version(c->ssl->connection), &buf[1]);
+        if (*d != ' ') {
+            d++;
+        }
 
-            if (SSL_session_reused(c->ssl->connection)) {
-                ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                               "SSL reused session");
-            }
+        *d = '\0';
 
-        } else {
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL: %s, cipher: \"%s\"",
+                       SSL_get_version(c->ssl->connection), &buf[1]);
+
+        if (SSL_session_reused(c->ssl->connection)) {
             ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                           "SSL no shared ciphers");
-        }
+                           "SSL reused session");
         }
+
+    } else {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL no shared ciphers");
+    }
+    }
 #endif
 
-        c->ssl->handshaked = 1;
+    c->ssl->handshaked = 1;
 
-        c->recv = ngx_ssl_recv;
-        c->send = ngx_ssl_write;
-        c->recv_chain = ngx_ssl_recv_chain;
-        c->send_chain = ngx_ssl_send_chain;
+    c->recv = ngx_ssl_recv;
+    c->send = ngx_ssl_write;
+    c->recv_chain = ngx_ssl_recv_chain;
+    c->send_chain = ngx_ssl_send_chain;
+
+#ifdef BIO_get_ktls_send
+
+    /* the keys were passed to the kernel, files can be sent as is */
+
+    if (BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection)) == 1) {
+        c->ssl->sendfile = 1;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL kernel TLS send:%d recv:%d",
+                   BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection)),
+                   BIO_get_ktls_recv(SSL_get_rbio(c->ssl->connection)));
+#endif
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 #ifdef SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS
 
-        /* initial handshake done, disable renegotiation (CVE-2009-3555) */
-        if (c->ssl->connection->s3) {
-            c->ssl->connection->s3->flags |= SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS;
-        }
+    /* initial handshake done, disable renegotiation (CVE-2009-3555) */
+    if (c->ssl->connection->s3) {
+        c->ssl->connection->s3->flags |= SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS;
+    }
 
 #endif
 #endif
 
-        return NGX_OK;
-    }
-
-    sslerr = SSL_get_error(c->ssl->connection, n);
+    return NGX_OK;
+}
 
-    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d", sslerr);
 
+static ngx_int_t
+ngx_ssl_handshake_wait(ngx_connection_t *c, int sslerr)
+{
     if (sslerr == SSL_ERROR_WANT_READ) {
         c->read->ready = 0;
-        c->read->handler = ngx_ssl_handshake_handler;
-        c->write->handler = ngx_ssl_handshake_handler;
 
-        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
-            return NGX_ERROR;
-        }
+    } else {
+        c->write->ready = 0;
+    }
 
-        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
-            return NGX_ERROR;
-        }
+    c->read->handler = ngx_ssl_handshake_handler;
+    c->write->handler = ngx_ssl_handshake_handler;
 
-        return NGX_AGAIN;
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    if (sslerr == SSL_ERROR_WANT_WRITE) {
-        c->write->ready = 0;
-        c->read->handler = ngx_ssl_handshake_handler;
-        c->write->handler = ngx_ssl_handshake_handler;
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+    return NGX_AGAIN;
+}
+
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_ssl_thread_handshake(ngx_connection_t *c)
+{
+    ngx_thread_task_t        *task;
+    ngx_ssl_handshake_ctx_t  *ctx;
+
+    task = c->ssl->handshake_task;
+
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(c->pool,
+                                     sizeof(ngx_ssl_handshake_ctx_t));
+        if (task == NULL) {
             return NGX_ERROR;
         }
 
-        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        task->handler = ngx_ssl_thread_handshake_handler;
+        task->event.data = c;
+        task->event.handler = ngx_ssl_thread_handshake_event_handler;
+
+        ctx = task->ctx;
+        ctx->connection = c;
+
+        c->ssl->handshake_task = task;
+    }
+
+    ctx = task->ctx;
+
+    if (!task->event.complete) {
+
+        /*
+         * the connection is not touched until the task is completed,
+         * see ngx_ssl_handshake_handler()
+         */
+
+        ctx->events = 0;
+
+        if (ngx_thread_task_post(c->ssl->thread_pool, task) != NGX_OK) {
             return NGX_ERROR;
         }
 
+        c->read->handler = ngx_ssl_handshake_handler;
+        c->write->handler = ngx_ssl_handshake_handler;
+
         return NGX_AGAIN;
     }
 
-    err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+    task->event.complete = 0;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "thread SSL_do_handshake: %d", ctx->n);
+
+    if (ctx->n == 1) {
+        return ngx_ssl_handshake_done(c);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d",
+                   ctx->sslerr);
+
+    if (ctx->sslerr == SSL_ERROR_WANT_READ
+        || ctx->sslerr == SSL_ERROR_WANT_WRITE)
+    {
+        if (ctx->events) {
+
+            /* the events were ignored while the task was running */
+
+            ngx_post_event(c->read, &ngx_posted_events);
+            return NGX_AGAIN;
+        }
+
+        return ngx_ssl_handshake_wait(c, ctx->sslerr);
+    }
 
     c->ssl->no_wait_shutdown = 1;
     c->ssl->no_send_shutdown = 1;
     c->read->eof = 1;
 
-    if (sslerr == SSL_ERROR_ZERO_RETURN || ERR_peek_error() == 0) {
-        ngx_connection_error(c, err,
+    if (ctx->closed) {
+        ngx_connection_error(c, ctx->err,
                              "peer closed connection in SSL handshake");
 
         return NGX_ERROR;
@@ -1353,22 +1523,95 @@ ngx_ssl_handshake(ngx_connection_t *c)
 
     c->read->error = 1;
 
-    ngx_ssl_connection_error(c, sslerr, err, "SSL_do_handshake() failed");
-
     return NGX_ERROR;
 }
 
 
+static void
+ngx_ssl_thread_handshake_handler(void *data, ngx_log_t *log)
+{
+    ngx_ssl_handshake_ctx_t *ctx = data;
+
+    ngx_connection_t  *c;
+
+    c = ctx->connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "thread SSL handshake");
+
+    ngx_ssl_clear_error(c->log);
+
+    ctx->n = SSL_do_handshake(c->ssl->connection);
+
+    if (ctx->n == 1) {
+        return;
+    }
+
+    ctx->sslerr = SSL_get_error(c->ssl->connection, ctx->n);
+    ctx->err = (ctx->sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+
+    if (ctx->sslerr == SSL_ERROR_WANT_READ
+        || ctx->sslerr == SSL_ERROR_WANT_WRITE)
+    {
+        return;
+    }
+
+    /* the error queue is per thread, so the error is logged here */
+
+    if (ctx->sslerr == SSL_ERROR_ZERO_RETURN || ERR_peek_error() == 0) {
+        ctx->closed = 1;
+        return;
+    }
+
+    ctx->closed = 0;
+
+    ngx_ssl_connection_error(c, ctx->sslerr, ctx->err,
+                             "SSL_do_handshake() failed");
+}
+
+
+static void
+ngx_ssl_thread_handshake_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    ngx_ssl_handshake_handler(c->read);
+}
+
+#endif
+
+
 static void
 ngx_ssl_handshake_handler(ngx_event_t *ev)
 {
     ngx_connection_t  *c;
+#if (NGX_THREADS)
+    ngx_thread_task_t        *task;
+    ngx_ssl_handshake_ctx_t  *ctx;
+#endif
 
     c = ev->data;
 
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
                    "SSL handshake handler: %d", ev->write);
 
+#if (NGX_THREADS)
+
+    task = c->ssl->handshake_task;
+
+    if (task && task->event.active) {
+
+        /* timeouts are handled as well once the task is completed */
+
+        ctx = task->ctx;
+        ctx->events = 1;
+
+        return;
+    }
+
+#endif
+
     if (ev->timedout) {
         c->ssl->handler(c);
         return;
@@ -1636,10 +1879,12 @@ ngx_ssl_write_handler(ngx_event_t *wev)
 ngx_chain_t *
 ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 {
-    int          n;
-    ngx_uint_t   flush;
-    ssize_t      send, size;
-    ngx_buf_t   *buf;
+    int           n;
+    size_t        file_size;
+    ngx_uint_t    flush;
+    ssize_t       send, size;
+    ngx_buf_t    *buf;
+    ngx_chain_t  *cl;
 
     if (!c->ssl->buffer) {
 
@@ -1713,6 +1958,11 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
                 continue;
             }
 
+            if (in->buf->in_file && c->ssl->sendfile) {
+                flush = 1;
+                break;
+            }
+
             size = in->buf->last - in->buf->pos;
 
             if (size > buf->end - buf->last) {
@@ -1744,6 +1994,33 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
         size = buf->last - buf->pos;
 
         if (size == 0) {
+
+            if (in && in->buf->in_file && send < limit) {
+
+                /* coalesce the neighbouring file bufs */
+
+                cl = in;
+                file_size = (size_t) ngx_chain_coalesce_file(&cl,
+                                                             limit - send);
+
+                n = ngx_ssl_sendfile(c, in->buf, file_size);
+
+                if (n == NGX_ERROR) {
+                    return NGX_CHAIN_ERROR;
+                }
+
+                if (n == NGX_AGAIN) {
+                    break;
+                }
+
+                in = ngx_chain_update_sent(in, n);
+
+                send += n;
+                flush = 0;
+
+                continue;
+            }
+
             buf->flush = 0;
             c->buffered &= ~NGX_SSL_BUFFERED;
             return in;
@@ -1867,33 +2144,139 @@ ngx_ssl_write(ngx_connection_t *c, u_char *data, size_t size)
 }
 
 
-static void
-ngx_ssl_read_handler(ngx_event_t *rev)
+static ssize_t
+ngx_ssl_sendfile(ngx_connection_t *c, ngx_buf_t *file, size_t size)
 {
-    ngx_connection_t  *c;
+#ifdef BIO_get_ktls_send
 
-    c = rev->data;
+    int        sslerr;
+    ssize_t    n;
+    ngx_err_t  err;
 
-    c->write->handler(c->write);
-}
+    ngx_ssl_clear_error(c->log);
 
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL to sendfile: @%O %uz", file->file_pos, size);
 
-void
-ngx_ssl_free_buffer(ngx_connection_t *c)
-{
-    if (c->ssl->buf && c->ssl->buf->start) {
-        if (ngx_pfree(c->pool, c->ssl->buf->start) == NGX_OK) {
-            c->ssl->buf->start = NULL;
-        }
-    }
-}
+    ngx_set_errno(0);
 
+    n = SSL_sendfile(c->ssl->connection, file->file->fd, file->file_pos,
+                     size, 0);
 
-ngx_int_t
-ngx_ssl_shutdown(ngx_connection_t *c)
-{
-    int        n, sslerr, mode;
-    ngx_err_t  err;
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_sendfile: %z", n);
+
+    if (n > 0) {
+
+        if (c->ssl->saved_read_handler) {
+
+            c->read->handler = c->ssl->saved_read_handler;
+            c->ssl->saved_read_handler = NULL;
+            c->read->ready = 1;
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            ngx_post_event(c->read, &ngx_posted_events);
+        }
+
+        c->sent += n;
+
+        return n;
+    }
+
+    if (n == 0) {
+
+        /*
+         * if sendfile returns zero, then someone has truncated the file,
+         * so the offset became beyond the end of the file
+         */
+
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "SSL_sendfile() reported that \"%s\" was truncated at %O",
+                      file->file->name.data, file->file_pos);
+
+        return NGX_ERROR;
+    }
+
+    sslerr = SSL_get_error(c->ssl->connection, n);
+
+    err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d", sslerr);
+
+    if (sslerr == SSL_ERROR_WANT_WRITE) {
+        c->write->ready = 0;
+        return NGX_AGAIN;
+    }
+
+    if (sslerr == SSL_ERROR_WANT_READ) {
+
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "peer started SSL renegotiation");
+
+        c->read->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        /*
+         * we do not set the timer because there is already
+         * the write event timer
+         */
+
+        if (c->ssl->saved_read_handler == NULL) {
+            c->ssl->saved_read_handler = c->read->handler;
+            c->read->handler = ngx_ssl_read_handler;
+        }
+
+        return NGX_AGAIN;
+    }
+
+    c->ssl->no_wait_shutdown = 1;
+    c->ssl->no_send_shutdown = 1;
+    c->write->error = 1;
+
+    ngx_ssl_connection_error(c, sslerr, err, "SSL_sendfile() failed");
+
+#else
+
+    ngx_log_error(NGX_LOG_ALERT, c->log, 0, "SSL_sendfile() not available");
+
+#endif
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_ssl_read_handler(ngx_event_t *rev)
+{
+    ngx_connection_t  *c;
+
+    c = rev->data;
+
+    c->write->handler(c->write);
+}
+
+
+void
+ngx_ssl_free_buffer(ngx_connection_t *c)
+{
+    if (c->ssl->buf && c->ssl->buf->start) {
+        if (ngx_pfree(c->pool, c->ssl->buf->start) == NGX_OK) {
+            c->ssl->buf->start = NULL;
+        }
+    }
+}
+
+
+ngx_int_t
+ngx_ssl_shutdown(ngx_connection_t *c)
+{
+    int        n, sslerr, mode;
+    ngx_err_t  err;
 
     if (SSL_in_init(c->ssl->connection)) {
         /*
@@ -2371,10 +2754,15 @@ failed:
 ngx_int_t
 ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
-    size_t                    len;
-    ngx_slab_pool_t          *shpool;
+    u_char                   *p;
+    size_t                    len, size;
+    ngx_uint_t                i, n;
+    ngx_slab_pool_t          *shpool, *sp;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
 
+    shm_zone->unlock = ngx_ssl_session_cache_unlock;
+
     if (data) {
         shm_zone->data = data;
         return NGX_OK;
@@ -2387,7 +2775,7 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
         return NGX_OK;
     }
 
-    cache = ngx_slab_alloc(shpool, sizeof(ngx_ssl_session_cache_t));
+    cache = ngx_slab_calloc(shpool, sizeof(ngx_ssl_session_cache_t));
     if (cache == NULL) {
         return NGX_ERROR;
     }
@@ -2395,11 +2783,6 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
     shpool->data = cache;
     shm_zone->data = cache;
 
-    ngx_rbtree_init(&cache->session_rbtree, &cache->sentinel,
-                    ngx_ssl_session_rbtree_insert_value);
-
-    ngx_queue_init(&cache->expire_queue);
-
     len = sizeof(" in SSL session shared cache \"\"") + shm_zone->shm.name.len;
 
     shpool->log_ctx = ngx_slab_alloc(shpool, len);
@@ -2412,10 +2795,109 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     shpool->log_nomem = 0;
 
+    /*
+     * the rest of the zone is split into shards, each with its own
+     * slab pool and mutex; a session is stored in the shard selected
+     * by the hash of its id
+     */
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    n = shpool->pfree / NGX_SSL_SESSION_SHARD_PAGES;
+
+    if (n > NGX_SSL_SESSION_CACHE_SHARDS) {
+        n = NGX_SSL_SESSION_CACHE_SHARDS;
+    }
+
+    if (n == 0) {
+        n = 1;
+    }
+
+#else
+
+    n = 1;
+
+#endif
+
+    size = (shpool->pfree / n) << ngx_pagesize_shift;
+
+    for (i = 0; i < n; i++) {
+
+        p = ngx_slab_alloc(shpool, size);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        sp = (ngx_slab_pool_t *) p;
+
+        ngx_memzero(sp, sizeof(ngx_slab_pool_t));
+
+        sp->end = p + size;
+        sp->min_shift = 3;
+        sp->addr = p;
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+        if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+#else
+
+        /* the lock file of the zone */
+        sp->mutex = shpool->mutex;
+
+#endif
+
+        ngx_slab_init(sp);
+
+        shard = ngx_slab_alloc(sp, sizeof(ngx_ssl_session_shard_t));
+        if (shard == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(&shard->session_rbtree, &shard->sentinel,
+                        ngx_ssl_session_rbtree_insert_value);
+
+        ngx_queue_init(&shard->expire_queue);
+
+        sp->data = shard;
+        sp->log_ctx = shpool->log_ctx;
+        sp->log_nomem = 0;
+
+        cache->shards[i] = sp;
+    }
+
+    cache->nshards = n;
+
     return NGX_OK;
 }
 
 
+static ngx_uint_t
+ngx_ssl_session_cache_unlock(ngx_shm_zone_t *shm_zone, ngx_pid_t pid)
+{
+    ngx_uint_t                i, locked;
+    ngx_ssl_session_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (cache == NULL) {
+        return 0;
+    }
+
+    locked = 0;
+
+    for (i = 0; i < cache->nshards; i++) {
+        if (ngx_shmtx_force_unlock(&cache->shards[i]->mutex, pid)) {
+            locked = 1;
+        }
+    }
+
+    return locked;
+}
+
+
 /*
  * The length of the session id is 16 bytes for SSLv2 sessions and
  * between 1 and 32 bytes for SSLv3/TLSv1, typically 32 bytes.
@@ -2445,6 +2927,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
     ngx_connection_t         *c;
     ngx_slab_pool_t          *shpool;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
     u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
 
@@ -2464,13 +2947,27 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
     ssl_ctx = c->ssl->session_ctx;
     shm_zone = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_cache_index);
 
+#if OPENSSL_VERSION_NUMBER >= 0x0090800fL
+
+    session_id = (u_char *) SSL_SESSION_get_id(sess, &session_id_length);
+
+#else
+
+    session_id = sess->session_id;
+    session_id_length = sess->session_id_length;
+
+#endif
+
+    hash = ngx_crc32_short(session_id, session_id_length);
+
     cache = shm_zone->data;
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    shpool = cache->shards[hash % cache->nshards];
+    shard = shpool->data;
 
     ngx_shmtx_lock(&shpool->mutex);
 
     /* drop one or two expired sessions */
-    ngx_ssl_expire_sessions(cache, shpool, 1);
+    ngx_ssl_expire_sessions(shard, shpool, 1);
 
     cached_sess = ngx_slab_alloc_locked(shpool, len);
 
@@ -2478,7 +2975,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
         /* drop the oldest non-expired session and try once more */
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+        ngx_ssl_expire_sessions(shard, shpool, 0);
 
         cached_sess = ngx_slab_alloc_locked(shpool, len);
 
@@ -2494,7 +2991,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
         /* drop the oldest non-expired session and try once more */
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+        ngx_ssl_expire_sessions(shard, shpool, 0);
 
         sess_id = ngx_slab_alloc_locked(shpool, sizeof(ngx_ssl_sess_id_t));
 
@@ -2503,17 +3000,6 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
         }
     }
 
-#if OPENSSL_VERSION_NUMBER >= 0x0090800fL
-
-    session_id = (u_char *) SSL_SESSION_get_id(sess, &session_id_length);
-
-#else
-
-    session_id = sess->session_id;
-    session_id_length = sess->session_id_length;
-
-#endif
-
 #if (NGX_PTR_SIZE == 8)
 
     id = sess_id->sess_id;
@@ -2526,7 +3012,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
         /* drop the oldest non-expired session and try once more */
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+        ngx_ssl_expire_sessions(shard, shpool, 0);
 
         id = ngx_slab_alloc_locked(shpool, session_id_length);
 
@@ -2541,8 +3027,6 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
     ngx_memcpy(id, session_id, session_id_length);
 
-    hash = ngx_crc32_short(session_id, session_id_length);
-
     ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
                    "ssl new session: %08XD:%ud:%d",
                    hash, session_id_length, len);
@@ -2555,9 +3039,9 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
     sess_id->expire = ngx_time() + SSL_CTX_get_timeout(ssl_ctx);
 
-    ngx_queue_insert_head(&cache->expire_queue, &sess_id->queue);
+    ngx_queue_insert_head(&shard->expire_queue, &sess_id->queue);
 
-    ngx_rbtree_insert(&cache->session_rbtree, &sess_id->node);
+    ngx_rbtree_insert(&shard->session_rbtree, &sess_id->node);
 
     ngx_shmtx_unlock(&shpool->mutex);
 
@@ -2600,6 +3084,7 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
     ngx_rbtree_node_t        *node, *sentinel;
     ngx_ssl_session_t        *sess;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
     u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
     ngx_connection_t         *c;
@@ -2619,12 +3104,13 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 
     sess = NULL;
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    shpool = cache->shards[hash % cache->nshards];
+    shard = shpool->data;
 
     ngx_shmtx_lock(&shpool->mutex);
 
-    node = cache->session_rbtree.root;
-    sentinel = cache->session_rbtree.sentinel;
+    node = shard->session_rbtree.root;
+    sentinel = shard->session_rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -2660,7 +3146,7 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 
             ngx_queue_remove(&sess_id->queue);
 
-            ngx_rbtree_delete(&cache->session_rbtree, node);
+            ngx_rbtree_delete(&shard->session_rbtree, node);
 
             ngx_slab_free_locked(shpool, sess_id->session);
 #if (NGX_PTR_SIZE == 4)
@@ -2704,6 +3190,7 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
     ngx_slab_pool_t          *shpool;
     ngx_rbtree_node_t        *node, *sentinel;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
 
     shm_zone = SSL_CTX_get_ex_data(ssl, ngx_ssl_session_cache_index);
@@ -2730,12 +3217,13 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
                    "ssl remove session: %08XD:%ud", hash, len);
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    shpool = cache->shards[hash % cache->nshards];
+    shard = shpool->data;
 
     ngx_shmtx_lock(&shpool->mutex);
 
-    node = cache->session_rbtree.root;
-    sentinel = cache->session_rbtree.sentinel;
+    node = shard->session_rbtree.root;
+    sentinel = shard->session_rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -2759,7 +3247,7 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
 
             ngx_queue_remove(&sess_id->queue);
 
-            ngx_rbtree_delete(&cache->session_rbtree, node);
+            ngx_rbtree_delete(&shard->session_rbtree, node);
 
             ngx_slab_free_locked(shpool, sess_id->session);
 #if (NGX_PTR_SIZE == 4)
@@ -2780,7 +3268,7 @@ done:
 
 
 static void
-ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
+ngx_ssl_expire_sessions(ngx_ssl_session_shard_t *shard,
     ngx_slab_pool_t *shpool, ngx_uint_t n)
 {
     time_t              now;
@@ -2791,11 +3279,11 @@ ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
 
     while (n < 3) {
 
-        if (ngx_queue_empty(&cache->expire_queue)) {
+        if (ngx_queue_empty(&shard->expire_queue)) {
             return;
         }
 
-        q = ngx_queue_last(&cache->expire_queue);
+        q = ngx_queue_last(&shard->expire_queue);
 
         sess_id = ngx_queue_data(q, ngx_ssl_sess_id_t, queue);
 
@@ -2808,7 +3296,7 @@ ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
         ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
                        "expire session: %08Xi", sess_id->node.key);
 
-        ngx_rbtree_delete(&cache->session_rbtree, &sess_id->node);
+        ngx_rbtree_delete(&shard->session_rbtree, &sess_id->node);
 
         ngx_slab_free_locked(shpool, sess_id->session);
 #if (NGX_PTR_SIZE == 4)
@@ -2951,6 +3439,8 @@ ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *paths)
             ngx_memcpy(key->aes_key, buf + 48, 32);
         }
 
+        key->expire = 0;
+
         if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
             ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
                           ngx_close_file_n " \"%V\" failed", &file.name);
@@ -2989,21 +3479,231 @@ failed:
 }
 
 
+ngx_int_t
+ngx_ssl_session_ticket_key_rotation(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    time_t lifetime)
+{
+    ngx_array_t                        *keys;
+#if (NGX_THREADS)
+    ngx_pool_cleanup_t                 *cln;
+#endif
+    ngx_ssl_session_ticket_key_t       *key;
+    ngx_ssl_session_ticket_rotation_t  *rotation;
+
+    if (SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_session_cache_index) == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"ssl_session_ticket_key_lifetime\" requires "
+                      "shared \"ssl_session_cache\"");
+        return NGX_ERROR;
+    }
+
+    if (SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_session_ticket_keys_index)) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"ssl_session_ticket_key_lifetime\" cannot be used "
+                      "with \"ssl_session_ticket_key\"");
+        return NGX_ERROR;
+    }
+
+    /*
+     * a key encrypts tickets for its lifetime and is then kept for
+     * NGX_SSL_SESSION_TICKET_KEYS - 1 more lifetimes to decrypt them
+     */
+
+    if (lifetime * (NGX_SSL_SESSION_TICKET_KEYS - 1)
+        < SSL_CTX_get_timeout(ssl->ctx))
+    {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"ssl_session_ticket_key_lifetime\" must be at "
+                      "least 1/%d of \"ssl_session_timeout\"",
+                      NGX_SSL_SESSION_TICKET_KEYS - 1);
+        return NGX_ERROR;
+    }
+
+    /*
+     * the keys are generated in the session cache zone and copied
+     * to this array on rotation, see ngx_ssl_rotate_session_ticket_keys();
+     * with handshakes in threads the array is guarded by a mutex
+     */
+
+    keys = ngx_array_create(cf->pool, NGX_SSL_SESSION_TICKET_KEYS,
+                            sizeof(ngx_ssl_session_ticket_key_t));
+    if (keys == NULL) {
+        return NGX_ERROR;
+    }
+
+    key = ngx_array_push_n(keys, NGX_SSL_SESSION_TICKET_KEYS);
+    if (key == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(key, NGX_SSL_SESSION_TICKET_KEYS
+                     * sizeof(ngx_ssl_session_ticket_key_t));
+
+    rotation = ngx_palloc(cf->pool, sizeof(ngx_ssl_session_ticket_rotation_t));
+    if (rotation == NULL) {
+        return NGX_ERROR;
+    }
+
+    rotation->lifetime = lifetime;
+
+#if (NGX_THREADS)
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_thread_mutex_create(&rotation->mutex, cf->log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_ssl_session_ticket_rotation_cleanup;
+    cln->data = rotation;
+
+#endif
+
+    if (SSL_CTX_set_ex_data(ssl->ctx, ngx_ssl_session_ticket_keys_index, keys)
+        == 0
+        || SSL_CTX_set_ex_data(ssl->ctx, ngx_ssl_session_ticket_rotation_index,
+                               rotation)
+           == 0)
+    {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_set_ex_data() failed");
+        return NGX_ERROR;
+    }
+
+    if (SSL_CTX_set_tlsext_ticket_key_cb(ssl->ctx,
+                                         ngx_ssl_session_ticket_key_callback)
+        == 0)
+    {
+        ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                      "nginx was built with Session Tickets support, however, "
+                      "now it is linked dynamically to an OpenSSL library "
+                      "which has no tlsext support, therefore Session Tickets "
+                      "are not available");
+    }
+
+    return NGX_OK;
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_ssl_session_ticket_rotation_cleanup(void *data)
+{
+    ngx_ssl_session_ticket_rotation_t  *rotation = data;
+
+    (void) ngx_thread_mutex_destroy(&rotation->mutex, ngx_cycle->log);
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_ssl_rotate_session_ticket_keys(SSL_CTX *ssl_ctx,
+    ngx_ssl_session_ticket_rotation_t *rotation, ngx_array_t *keys,
+    ngx_ssl_session_ticket_key_t *ring, ngx_log_t *log)
+{
+    time_t                         now;
+    ngx_int_t                      rc;
+    ngx_shm_zone_t                *shm_zone;
+    ngx_slab_pool_t               *shpool;
+    ngx_ssl_session_cache_t       *cache;
+    ngx_ssl_session_ticket_key_t  *key, *shkey;
+    u_char                         buf[80];
+
+#if (NGX_THREADS)
+    if (ngx_thread_mutex_lock(&rotation->mutex, log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+#endif
+
+    rc = NGX_OK;
+
+    key = keys->elts;
+    now = ngx_time();
+
+    /* the local copy of the keys is used until the current key expires */
+
+    if (now < key[0].expire) {
+        goto done;
+    }
+
+    shm_zone = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_cache_index);
+
+    cache = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    shkey = cache->ticket_keys;
+
+    if (now >= shkey[0].expire) {
+
+        if (RAND_bytes(buf, 80) != 1) {
+            ngx_shmtx_unlock(&shpool->mutex);
+            ngx_ssl_error(NGX_LOG_ALERT, log, 0, "RAND_bytes() failed");
+            rc = NGX_ERROR;
+            goto done;
+        }
+
+        /* the previous keys are still used to decrypt tickets */
+
+        ngx_memmove(&shkey[1], &shkey[0],
+                    (NGX_SSL_SESSION_TICKET_KEYS - 1)
+                    * sizeof(ngx_ssl_session_ticket_key_t));
+
+        shkey[0].size = 80;
+        ngx_memcpy(shkey[0].name, buf, 16);
+        ngx_memcpy(shkey[0].hmac_key, buf + 16, 32);
+        ngx_memcpy(shkey[0].aes_key, buf + 48, 32);
+        shkey[0].expire = now + rotation->lifetime;
+
+        ngx_memzero(buf, 80);
+
+        ngx_log_error(NGX_LOG_INFO, log, 0, "session ticket key rotated%s",
+                      shpool->log_ctx);
+    }
+
+    ngx_memcpy(key, shkey, NGX_SSL_SESSION_TICKET_KEYS
+                           * sizeof(ngx_ssl_session_ticket_key_t));
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+done:
+
+    /* the caller works on its own copy, the array may be rotated meanwhile */
+
+    ngx_memcpy(ring, key, NGX_SSL_SESSION_TICKET_KEYS
+                          * sizeof(ngx_ssl_session_ticket_key_t));
+
+#if (NGX_THREADS)
+    (void) ngx_thread_mutex_unlock(&rotation->mutex, log);
+#endif
+
+    return rc;
+}
+
+
 static int
 ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
     unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx,
     HMAC_CTX *hctx, int enc)
 {
-    size_t                         size;
-    SSL_CTX                       *ssl_ctx;
-    ngx_uint_t                     i;
-    ngx_array_t                   *keys;
-    ngx_connection_t              *c;
-    ngx_ssl_session_ticket_key_t  *key;
-    const EVP_MD                  *digest;
-    const EVP_CIPHER              *cipher;
+    size_t                              size;
+    SSL_CTX                            *ssl_ctx;
+    ngx_uint_t                          i;
+    ngx_array_t                        *keys;
+    ngx_connection_t                   *c;
+    ngx_ssl_session_ticket_key_t       *key;
+    ngx_ssl_session_ticket_rotation_t  *rotation;
+    const EVP_MD                       *digest;
+    const EVP_CIPHER                   *cipher;
+    ngx_ssl_session_ticket_key_t        ring[NGX_SSL_SESSION_TICKET_KEYS];
 #if (NGX_DEBUG)
-    u_char                         buf[32];
+    u_char                              buf[32];
 #endif
 
     c = ngx_ssl_get_connection(ssl_conn);
@@ -3020,7 +3720,22 @@ ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
         return -1;
     }
 
-    key = keys->elts;
+    rotation = SSL_CTX_get_ex_data(ssl_ctx,
+                                   ngx_ssl_session_ticket_rotation_index);
+
+    if (rotation) {
+        if (ngx_ssl_rotate_session_ticket_keys(ssl_ctx, rotation, keys, ring,
+                                               c->log)
+            != NGX_OK)
+        {
+            return -1;
+        }
+
+        key = ring;
+
+    } else {
+        key = keys->elts;
+    }
 
     if (enc == 1) {
         /* encrypt session ticket */
@@ -3067,6 +3782,12 @@ ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
         /* decrypt session ticket */
 
         for (i = 0; i < keys->nelts; i++) {
+
+            if (key[i].size == 0) {
+                /* rotated keys not generated yet */
+                break;
+            }
+
             if (ngx_memcmp(name, key[i].name, 16) == 0) {
                 goto found;
             }
@@ -3080,6 +3801,16 @@ ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
 
     found:
 
+        if (key[i].expire
+            && key[i].expire + SSL_CTX_get_timeout(ssl_ctx) < ngx_time())
+        {
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "ssl session ticket decrypt, key: \"%*s\" expired",
+                           ngx_hex_dump(buf, key[i].name, 16) - buf, buf);
+
+            return 0;
+        }
+
         ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
                        "ssl session ticket decrypt, key: \"%*s\"%s",
                        ngx_hex_dump(buf, key[i].name, 16) - buf, buf,
@@ -3126,6 +3857,18 @@ ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *paths)
     return NGX_OK;
 }
 
+
+ngx_int_t
+ngx_ssl_session_ticket_key_rotation(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    time_t lifetime)
+{
+    ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                  "\"ssl_session_ticket_key_lifetime\" ignored, "
+                  "not supported");
+
+    return NGX_OK;
+}
+
 #endif
 
 
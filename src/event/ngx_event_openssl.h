@@ -58,6 +58,9 @@ struct ngx_ssl_s {
     SSL_CTX                    *ctx;
     ngx_log_t                  *log;
     size_t                      buffer_size;
+#if (NGX_THREADS || NGX_COMPAT)
+    ngx_thread_pool_t          *thread_pool;
+#endif
 };
 
 
@@ -74,12 +77,18 @@ struct ngx_ssl_connection_s {
     ngx_event_handler_pt        saved_read_handler;
     ngx_event_handler_pt        saved_write_handler;
 
+#if (NGX_THREADS || NGX_COMPAT)
+    ngx_thread_pool_t          *thread_pool;
+    ngx_thread_task_t          *handshake_task;
+#endif
+
     unsigned                    handshaked:1;
     unsigned                    renegotiation:1;
     unsigned                    buffer:1;
     unsigned                    no_wait_shutdown:1;
     unsigned                    no_send_shutdown:1;
     unsigned                    handshake_buffer_set:1;
+    unsigned                    sendfile:1;
 };
 
 
@@ -111,19 +120,41 @@ typedef struct {
     ngx_rbtree_t                session_rbtree;
     ngx_rbtree_node_t           sentinel;
     ngx_queue_t                 expire_queue;
-} ngx_ssl_session_cache_t;
+} ngx_ssl_session_shard_t;
 
 
 #ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
 
+#define NGX_SSL_SESSION_TICKET_KEYS  3
+
 typedef struct {
     size_t                      size;
     u_char                      name[16];
     u_char                      hmac_key[32];
     u_char                      aes_key[32];
+    time_t                      expire;
 } ngx_ssl_session_ticket_key_t;
 
+
+typedef struct {
+    time_t                      lifetime;
+#if (NGX_THREADS)
+    ngx_thread_mutex_t          mutex;
 #endif
+} ngx_ssl_session_ticket_rotation_t;
+
+#endif
+
+
+#define NGX_SSL_SESSION_CACHE_SHARDS  16
+
+typedef struct {
+    ngx_uint_t                  nshards;
+    ngx_slab_pool_t            *shards[NGX_SSL_SESSION_CACHE_SHARDS];
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+    ngx_ssl_session_ticket_key_t  ticket_keys[NGX_SSL_SESSION_TICKET_KEYS];
+#endif
+} ngx_ssl_session_cache_t;
 
 
 #define NGX_SSL_SSLv2    0x0002
@@ -165,6 +196,8 @@ ngx_int_t ngx_ssl_session_cache(ngx_ssl_t *ssl, ngx_str_t *sess_ctx,
     ssize_t builtin_session_cache, ngx_shm_zone_t *shm_zone, time_t timeout);
 ngx_int_t ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_array_t *paths);
+ngx_int_t ngx_ssl_session_ticket_key_rotation(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    time_t lifetime);
 ngx_int_t ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data);
 ngx_int_t ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c,
     ngx_uint_t flags);
@@ -245,6 +278,7 @@ extern int  ngx_ssl_connection_index;
 extern int  ngx_ssl_server_conf_index;
 extern int  ngx_ssl_session_cache_index;
 extern int  ngx_ssl_session_ticket_keys_index;
+extern int  ngx_ssl_session_ticket_rotation_index;
 extern int  ngx_ssl_certificate_index;
 extern int  ngx_ssl_next_certificate_index;
 extern int  ngx_ssl_certificate_name_index;
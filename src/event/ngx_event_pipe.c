@@ -14,6 +14,7 @@
 static ngx_int_t ngx_event_pipe_read_upstream(ngx_event_pipe_t *p);
 static ngx_int_t ngx_event_pipe_write_to_downstream(ngx_event_pipe_t *p);
 
+static ngx_uint_t ngx_event_pipe_grow(ngx_event_pipe_t *p);
 static ngx_int_t ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p);
 static ngx_inline void ngx_event_pipe_remove_shadow_links(ngx_buf_t *buf);
 static ngx_int_t ngx_event_pipe_drain_chains(ngx_event_pipe_t *p);
@@ -261,6 +262,33 @@ ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
 
                 break;
 
+            } else if (p->grow_size && ngx_event_pipe_grow(p)) {
+
+                /*
+                 * the downstream drains fast enough to keep one more buf
+                 * in memory rather than to write the bufs to a temp file
+                 */
+
+                b = ngx_create_temp_buf(p->pool, p->bufs.size);
+                if (b == NULL) {
+                    return NGX_ABORT;
+                }
+
+                p->allocated++;
+                p->grown += p->bufs.size;
+                *p->grow_memory += p->bufs.size;
+
+                chain = ngx_alloc_chain_link(p->pool);
+                if (chain == NULL) {
+                    return NGX_ABORT;
+                }
+
+                chain->buf = b;
+                chain->next = NULL;
+
+                ngx_log_debug1(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                               "pipe grow: %uz", p->grown);
+
             } else if (p->cacheable
                        || p->temp_file->offset < p->max_temp_file_size)
             {
@@ -730,6 +758,37 @@ ngx_event_pipe_write_to_downstream(ngx_event_pipe_t *p)
 }
 
 
+static ngx_uint_t
+ngx_event_pipe_grow(ngx_event_pipe_t *p)
+{
+    off_t       sent, buffered;
+    ngx_msec_t  elapsed;
+
+    if (p->cacheable
+        || p->grown + p->bufs.size > p->grow_size
+        || *p->grow_memory + p->bufs.size > p->grow_budget
+        || p->downstream->write->delayed)
+    {
+        return 0;
+    }
+
+    /*
+     * grow if the data already read would be sent in about a second
+     * at the rate the downstream has been draining them so far
+     */
+
+    sent = p->downstream->sent - p->start_sent;
+    buffered = p->read_length - sent;
+    elapsed = ngx_current_msec - p->start_msec + 1;
+
+    if (sent <= 0 || buffered * (off_t) elapsed > sent * 1000) {
+        return 0;
+    }
+
+    return 1;
+}
+
+
 static ngx_int_t
 ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p)
 {
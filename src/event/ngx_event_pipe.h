@@ -93,6 +93,15 @@ struct ngx_event_pipe_s {
     size_t             limit_rate;
     time_t             start_sec;
 
+    /* bufs allocated over bufs.num instead of writing to a temp file */
+
+    size_t             grow_size;
+    size_t             grown;
+    size_t             grow_budget;
+    size_t            *grow_memory;
+    ngx_msec_t         start_msec;
+    off_t              start_sent;
+
     ngx_temp_file_t   *temp_file;
 
     /* STUB */ int     num;
@@ -23,6 +23,12 @@ typedef struct {
 } ngx_http_index_loc_conf_t;
 
 
+typedef struct {
+    ngx_uint_t               index;
+    ngx_uint_t               dir_tested;  /* unsigned dir_tested:1 */
+} ngx_http_index_ctx_t;
+
+
 #define NGX_HTTP_DEFAULT_INDEX   "index.html"
 
 
@@ -103,6 +109,7 @@ ngx_http_index_handler(ngx_http_request_t *r)
     ngx_uint_t                    i, dir_tested;
     ngx_http_index_t             *index;
     ngx_open_file_info_t          of;
+    ngx_http_index_ctx_t         *ctx;
     ngx_http_script_code_pt       code;
     ngx_http_script_engine_t      e;
     ngx_http_core_loc_conf_t     *clcf;
@@ -127,8 +134,19 @@ ngx_http_index_handler(ngx_http_request_t *r)
     /* suppress MSVC warning */
     path.data = NULL;
 
+    i = 0;
+
+    /* resume after the index file was opened in a thread */
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_index_module);
+
+    if (ctx) {
+        i = ctx->index;
+        dir_tested = ctx->dir_tested;
+    }
+
     index = ilcf->indices->elts;
-    for (i = 0; i < ilcf->indices->nelts; i++) {
+    for ( /* void */ ; i < ilcf->indices->nelts; i++) {
 
         if (index[i].lengths == NULL) {
 
@@ -214,9 +232,29 @@ ngx_http_index_handler(ngx_http_request_t *r)
             return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
 
-        if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool)
-            != NGX_OK)
-        {
+        ngx_http_set_open_file_thread(r, clcf, &of);
+
+        rc = ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool);
+
+        if (rc == NGX_AGAIN) {
+
+            if (ctx == NULL) {
+                ctx = ngx_palloc(r->pool, sizeof(ngx_http_index_ctx_t));
+                if (ctx == NULL) {
+                    return NGX_ERROR;
+                }
+
+                ngx_http_set_ctx(r, ctx, ngx_http_index_module);
+            }
+
+            ctx->index = i;
+            ctx->dir_tested = dir_tested;
+
+            r->main->count++;
+            return NGX_DONE;
+        }
+
+        if (rc != NGX_OK) {
             if (of.err == 0) {
                 return NGX_HTTP_INTERNAL_SERVER_ERROR;
             }
@@ -500,6 +500,13 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_max_range_offset),
       NULL },
 
+    { ngx_string("proxy_cache_slice"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_slice),
+      NULL },
+
     { ngx_string("proxy_cache_use_stale"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
       ngx_conf_set_bitmask_slot,
@@ -572,6 +579,13 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, upstream.max_temp_file_size_conf),
       NULL },
 
+    { ngx_string("proxy_max_buffers_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.max_buffers_size),
+      NULL },
+
     { ngx_string("proxy_temp_file_write_size"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_size_slot,
@@ -600,6 +614,27 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, upstream.next_upstream_timeout),
       NULL },
 
+    { ngx_string("proxy_coalesce"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.coalesce),
+      NULL },
+
+    { ngx_string("proxy_coalesce_key"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.coalesce_key),
+      NULL },
+
+    { ngx_string("proxy_splice"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.splice),
+      NULL },
+
     { ngx_string("proxy_pass_header"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_array_slot,
@@ -768,6 +803,10 @@ static ngx_keyval_t  ngx_http_proxy_headers[] = {
 };
 
 
+static ngx_str_t  ngx_http_proxy_coalesce_key =
+    ngx_string("$scheme$proxy_host$request_uri");
+
+
 static ngx_str_t  ngx_http_proxy_hide_headers[] = {
     ngx_string("Date"),
     ngx_string("Server"),
@@ -1157,6 +1196,9 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
     ngx_http_script_engine_t      e, le;
     ngx_http_proxy_loc_conf_t    *plcf;
     ngx_http_script_len_code_pt   lcode;
+#if (NGX_HTTP_CACHE)
+    ngx_http_cache_slice_t       *slice;
+#endif
 
     u = r->upstream;
 
@@ -1292,6 +1334,25 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
         }
     }
 
+#if (NGX_HTTP_CACHE)
+
+    /* the missing part of a partially cached response */
+
+    slice = (u->cacheable && r->cache) ? r->cache->slice : NULL;
+
+    if (slice && slice->range.len) {
+        len += sizeof("Range: ") - 1 + slice->range.len + sizeof(CRLF) - 1;
+
+        if (slice->if_range.len) {
+            len += sizeof("If-Range: ") - 1 + slice->if_range.len
+                   + sizeof(CRLF) - 1;
+        }
+
+    } else {
+        slice = NULL;
+    }
+
+#endif
 
     b = ngx_create_temp_buf(r->pool, len);
     if (b == NULL) {
@@ -1427,6 +1488,23 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
         }
     }
 
+#if (NGX_HTTP_CACHE)
+
+    if (slice) {
+        b->last = ngx_cpymem(b->last, "Range: ", sizeof("Range: ") - 1);
+        b->last = ngx_copy(b->last, slice->range.data, slice->range.len);
+        *b->last++ = CR; *b->last++ = LF;
+
+        if (slice->if_range.len) {
+            b->last = ngx_cpymem(b->last, "If-Range: ",
+                                 sizeof("If-Range: ") - 1);
+            b->last = ngx_copy(b->last, slice->if_range.data,
+                               slice->if_range.len);
+            *b->last++ = CR; *b->last++ = LF;
+        }
+    }
+
+#endif
 
     /* add "\r\n" at the header end */
     *b->last++ = CR; *b->last++ = LF;
@@ -2842,6 +2920,10 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.force_ranges = NGX_CONF_UNSET;
 
     conf->upstream.local = NGX_CONF_UNSET_PTR;
+    conf->upstream.coalesce = NGX_CONF_UNSET;
+    conf->upstream.coalesce_key = NULL;
+    conf->upstream.splice = NGX_CONF_UNSET;
+    conf->upstream.max_buffers_size = NGX_CONF_UNSET_SIZE;
 
     conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
     conf->upstream.send_timeout = NGX_CONF_UNSET_MSEC;
@@ -2863,6 +2945,7 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.cache = NGX_CONF_UNSET;
     conf->upstream.cache_min_uses = NGX_CONF_UNSET_UINT;
     conf->upstream.cache_max_range_offset = NGX_CONF_UNSET;
+    conf->upstream.cache_slice = NGX_CONF_UNSET_SIZE;
     conf->upstream.cache_bypass = NGX_CONF_UNSET_PTR;
     conf->upstream.no_cache = NGX_CONF_UNSET_PTR;
     conf->upstream.cache_valid = NGX_CONF_UNSET_PTR;
@@ -2921,6 +3004,8 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_http_proxy_rewrite_t   *pr;
     ngx_http_script_compile_t   sc;
 
+    ngx_http_compile_complex_value_t  ccv;
+
 #if (NGX_HTTP_CACHE)
 
     if (conf->upstream.store > 0) {
@@ -2962,6 +3047,37 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_ptr_value(conf->upstream.local,
                               prev->upstream.local, NULL);
 
+    ngx_conf_merge_value(conf->upstream.coalesce,
+                              prev->upstream.coalesce, 0);
+
+    if (conf->upstream.coalesce_key == NULL) {
+        conf->upstream.coalesce_key = prev->upstream.coalesce_key;
+    }
+
+    ngx_conf_merge_value(conf->upstream.splice,
+                              prev->upstream.splice, 0);
+
+    ngx_conf_merge_size_value(conf->upstream.max_buffers_size,
+                              prev->upstream.max_buffers_size, 0);
+
+    if (conf->upstream.coalesce && conf->upstream.coalesce_key == NULL) {
+        conf->upstream.coalesce_key = ngx_palloc(cf->pool,
+                                              sizeof(ngx_http_complex_value_t));
+        if (conf->upstream.coalesce_key == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &ngx_http_proxy_coalesce_key;
+        ccv.complex_value = conf->upstream.coalesce_key;
+
+        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
     ngx_conf_merge_msec_value(conf->upstream.connect_timeout,
                               prev->upstream.connect_timeout, 60000);
 
@@ -3129,6 +3245,9 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
                               prev->upstream.cache_max_range_offset,
                               NGX_MAX_OFF_T_VALUE);
 
+    ngx_conf_merge_size_value(conf->upstream.cache_slice,
+                              prev->upstream.cache_slice, 0);
+
     ngx_conf_merge_bitmask_value(conf->upstream.cache_use_stale,
                               prev->upstream.cache_use_stale,
                               (NGX_CONF_BITMASK_SET
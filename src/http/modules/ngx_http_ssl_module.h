@@ -20,6 +20,9 @@ typedef struct {
     ngx_ssl_t                       ssl;
 
     ngx_flag_t                      prefer_server_ciphers;
+    ngx_flag_t                      ktls;
+
+    ngx_thread_pool_t              *thread_pool;
 
     ngx_uint_t                      protocols;
 
@@ -49,6 +52,7 @@ typedef struct {
 
     ngx_flag_t                      session_tickets;
     ngx_array_t                    *session_ticket_keys;
+    time_t                          session_ticket_key_lifetime;
 
     ngx_flag_t                      stapling;
     ngx_flag_t                      stapling_verify;
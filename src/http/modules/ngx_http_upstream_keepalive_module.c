@@ -12,9 +12,15 @@
 
 typedef struct {
     ngx_uint_t                         max_cached;
+    ngx_uint_t                         max_per_peer;
+    ngx_uint_t                         requests;
+    ngx_msec_t                         timeout;
 
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
+    ngx_queue_t                        peers;
+
+    ngx_pool_t                        *pool;
 
     ngx_http_upstream_init_pt          original_init_upstream;
     ngx_http_upstream_init_peer_pt     original_init_peer;
@@ -22,20 +28,38 @@ typedef struct {
 } ngx_http_upstream_keepalive_srv_conf_t;
 
 
+typedef struct {
+    ngx_queue_t                        queue;
+    ngx_queue_t                        cache;
+
+    ngx_uint_t                         cached;
+    ngx_uint_t                         hits;
+    ngx_uint_t                         misses;
+    ngx_uint_t                         evicted;
+    ngx_uint_t                         expired;
+
+    socklen_t                          socklen;
+    ngx_sockaddr_t                     sockaddr;
+
+} ngx_http_upstream_keepalive_peer_t;
+
+
 typedef struct {
     ngx_http_upstream_keepalive_srv_conf_t  *conf;
+    ngx_http_upstream_keepalive_peer_t      *peer;
 
     ngx_queue_t                        queue;
+    ngx_queue_t                        peer_queue;
     ngx_connection_t                  *connection;
 
-    socklen_t                          socklen;
-    ngx_sockaddr_t                     sockaddr;
+    ngx_msec_t                         expire;
 
 } ngx_http_upstream_keepalive_cache_t;
 
 
 typedef struct {
     ngx_http_upstream_keepalive_srv_conf_t  *conf;
+    ngx_http_upstream_keepalive_peer_t      *peer;
 
     ngx_http_upstream_t               *upstream;
 
@@ -59,6 +83,16 @@ static ngx_int_t ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc,
 static void ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
 
+static ngx_http_upstream_keepalive_peer_t *
+    ngx_http_upstream_keepalive_lookup_peer(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, struct sockaddr *sockaddr,
+    socklen_t socklen);
+static ngx_http_upstream_keepalive_cache_t *
+    ngx_http_upstream_keepalive_victim(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf);
+static void ngx_http_upstream_keepalive_drop(
+    ngx_http_upstream_keepalive_cache_t *item);
+
 static void ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close(ngx_connection_t *c);
@@ -70,6 +104,10 @@ static void ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
     void *data);
 #endif
 
+static ngx_int_t ngx_http_upstream_keepalive_add_variables(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_keepalive_stats_variable(
+    ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+
 static void *ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -84,12 +122,43 @@ static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
       0,
       NULL },
 
+    { ngx_string("keepalive_per_peer"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, max_per_peer),
+      NULL },
+
+    { ngx_string("keepalive_requests"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, requests),
+      NULL },
+
+    { ngx_string("keepalive_timeout"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, timeout),
+      NULL },
+
       ngx_null_command
 };
 
 
+static ngx_http_variable_t  ngx_http_upstream_keepalive_vars[] = {
+
+    { ngx_string("upstream_keepalive_stats"), NULL,
+      ngx_http_upstream_keepalive_stats_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+
 static ngx_http_module_t  ngx_http_upstream_keepalive_module_ctx = {
-    NULL,                                  /* preconfiguration */
+    ngx_http_upstream_keepalive_add_variables, /* preconfiguration */
     NULL,                                  /* postconfiguration */
 
     NULL,                                  /* create main configuration */
@@ -133,6 +202,10 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
     kcf = ngx_http_conf_upstream_srv_conf(us,
                                           ngx_http_upstream_keepalive_module);
 
+    ngx_conf_init_uint_value(kcf->max_per_peer, 0);
+    ngx_conf_init_uint_value(kcf->requests, 100);
+    ngx_conf_init_msec_value(kcf->timeout, 60000);
+
     if (kcf->original_init_upstream(cf, us) != NGX_OK) {
         return NGX_ERROR;
     }
@@ -151,6 +224,9 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
 
     ngx_queue_init(&kcf->cache);
     ngx_queue_init(&kcf->free);
+    ngx_queue_init(&kcf->peers);
+
+    kcf->pool = cf->pool;
 
     for (i = 0; i < kcf->max_cached; i++) {
         ngx_queue_insert_head(&kcf->free, &cached[i].queue);
@@ -184,6 +260,7 @@ ngx_http_upstream_init_keepalive_peer(ngx_http_request_t *r,
     }
 
     kp->conf = kcf;
+    kp->peer = NULL;
     kp->upstream = r->upstream;
     kp->data = r->upstream->peer.data;
     kp->original_get_peer = r->upstream->peer.get;
@@ -210,9 +287,10 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_int_t          rc;
-    ngx_queue_t       *q, *cache;
-    ngx_connection_t  *c;
+    ngx_int_t                            rc;
+    ngx_queue_t                         *q;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_keepalive_peer_t  *peer;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer");
@@ -227,33 +305,35 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
 
     /* search cache for suitable connection */
 
-    cache = &kp->conf->cache;
-
-    for (q = ngx_queue_head(cache);
-         q != ngx_queue_sentinel(cache);
-         q = ngx_queue_next(q))
-    {
-        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
-        c = item->connection;
+    peer = ngx_http_upstream_keepalive_lookup_peer(kp->conf, pc->sockaddr,
+                                                   pc->socklen);
+    if (peer == NULL) {
+        return NGX_OK;
+    }
 
-        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) pc->sockaddr,
-                         item->socklen, pc->socklen)
-            == 0)
-        {
-            ngx_queue_remove(q);
-            ngx_queue_insert_head(&kp->conf->free, q);
+    kp->peer = peer;
 
-            goto found;
-        }
+    if (ngx_queue_empty(&peer->cache)) {
+        peer->misses++;
+        return NGX_OK;
     }
 
-    return NGX_OK;
+    q = ngx_queue_head(&peer->cache);
+
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, peer_queue);
+    c = item->connection;
 
-found:
+    ngx_http_upstream_keepalive_drop(item);
+
+    peer->hits++;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer: using connection %p", c);
 
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
     c->idle = 0;
     c->sent = 0;
     c->log = pc->log;
@@ -273,7 +353,9 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_uint_t state)
 {
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
+    ngx_http_upstream_keepalive_srv_conf_t   *kcf;
     ngx_http_upstream_keepalive_cache_t      *item;
+    ngx_http_upstream_keepalive_peer_t       *peer;
 
     ngx_queue_t          *q;
     ngx_connection_t     *c;
@@ -284,6 +366,7 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
 
     /* cache valid connections */
 
+    kcf = kp->conf;
     u = kp->upstream;
     c = pc->connection;
 
@@ -306,6 +389,10 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         goto invalid;
     }
 
+    if (c->requests >= kcf->requests) {
+        goto invalid;
+    }
+
     if (ngx_terminate || ngx_exiting) {
         goto invalid;
     }
@@ -314,28 +401,51 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         goto invalid;
     }
 
+    peer = ngx_http_upstream_keepalive_lookup_peer(kcf, pc->sockaddr,
+                                                   pc->socklen);
+    if (peer == NULL) {
+        goto invalid;
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer: saving connection %p", c);
 
-    if (ngx_queue_empty(&kp->conf->free)) {
+    if (kcf->max_per_peer && peer->cached >= kcf->max_per_peer) {
 
-        q = ngx_queue_last(&kp->conf->cache);
-        ngx_queue_remove(q);
+        q = ngx_queue_last(&peer->cache);
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t,
+                              peer_queue);
 
-        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
-
-        ngx_http_upstream_keepalive_close(item->connection);
+    } else if (ngx_queue_empty(&kcf->free)) {
+        item = ngx_http_upstream_keepalive_victim(kcf);
 
     } else {
-        q = ngx_queue_head(&kp->conf->free);
-        ngx_queue_remove(q);
+        item = NULL;
+    }
+
+    if (item) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "free keepalive peer: evicting connection %p, "
+                       "%ui cached", item->connection, item->peer->cached);
+
+        item->peer->evicted++;
 
-        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+        ngx_http_upstream_keepalive_close(item->connection);
+        ngx_http_upstream_keepalive_drop(item);
     }
 
-    ngx_queue_insert_head(&kp->conf->cache, q);
+    q = ngx_queue_head(&kcf->free);
+    ngx_queue_remove(q);
+
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+    ngx_queue_insert_head(&kcf->cache, &item->queue);
+    ngx_queue_insert_head(&peer->cache, &item->peer_queue);
+    peer->cached++;
 
+    item->peer = peer;
     item->connection = c;
+    item->expire = ngx_current_msec + kcf->timeout;
 
     pc->connection = NULL;
 
@@ -346,6 +456,9 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         ngx_del_timer(c->write);
     }
 
+    c->read->delayed = 0;
+    ngx_add_timer(c->read, kcf->timeout);
+
     c->write->handler = ngx_http_upstream_keepalive_dummy_handler;
     c->read->handler = ngx_http_upstream_keepalive_close_handler;
 
@@ -356,9 +469,6 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     c->write->log = ngx_cycle->log;
     c->pool->log = ngx_cycle->log;
 
-    item->socklen = pc->socklen;
-    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
-
     if (c->read->ready) {
         ngx_http_upstream_keepalive_close_handler(c->read);
     }
@@ -369,6 +479,112 @@ invalid:
 }
 
 
+static ngx_http_upstream_keepalive_peer_t *
+ngx_http_upstream_keepalive_lookup_peer(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, struct sockaddr *sockaddr,
+    socklen_t socklen)
+{
+    ngx_queue_t                         *q;
+    ngx_http_upstream_keepalive_peer_t  *peer;
+
+    for (q = ngx_queue_head(&kcf->peers);
+         q != ngx_queue_sentinel(&kcf->peers);
+         q = ngx_queue_next(q))
+    {
+        peer = ngx_queue_data(q, ngx_http_upstream_keepalive_peer_t, queue);
+
+        if (ngx_memn2cmp((u_char *) &peer->sockaddr, (u_char *) sockaddr,
+                         peer->socklen, socklen)
+            == 0)
+        {
+            return peer;
+        }
+    }
+
+    if (socklen > sizeof(ngx_sockaddr_t)) {
+        return NULL;
+    }
+
+    /*
+     * peer entries are never freed: the set of addresses
+     * an upstream block may connect to is fixed by configuration
+     */
+
+    peer = ngx_pcalloc(kcf->pool, sizeof(ngx_http_upstream_keepalive_peer_t));
+    if (peer == NULL) {
+        return NULL;
+    }
+
+    ngx_queue_init(&peer->cache);
+
+    peer->socklen = socklen;
+    ngx_memcpy(&peer->sockaddr, sockaddr, socklen);
+
+    ngx_queue_insert_tail(&kcf->peers, &peer->queue);
+
+    return peer;
+}
+
+
+static ngx_http_upstream_keepalive_cache_t *
+ngx_http_upstream_keepalive_victim(ngx_http_upstream_keepalive_srv_conf_t *kcf)
+{
+    ngx_queue_t                          *q;
+    ngx_http_upstream_keepalive_peer_t   *peer, *busiest;
+    ngx_http_upstream_keepalive_cache_t  *item;
+
+    /*
+     * the least recently used connection is the one closest to its
+     * idle timeout; evict it if it is going to expire soon anyway
+     */
+
+    q = ngx_queue_last(&kcf->cache);
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+    if ((ngx_msec_int_t) (item->expire - ngx_current_msec)
+        <= (ngx_msec_int_t) (kcf->timeout / 4))
+    {
+        return item;
+    }
+
+    /*
+     * otherwise take the oldest connection of the peer with the largest
+     * number of cached connections, so a busy peer does not push out
+     * connections to other peers
+     */
+
+    busiest = item->peer;
+
+    for (q = ngx_queue_head(&kcf->peers);
+         q != ngx_queue_sentinel(&kcf->peers);
+         q = ngx_queue_next(q))
+    {
+        peer = ngx_queue_data(q, ngx_http_upstream_keepalive_peer_t, queue);
+
+        if (peer->cached > busiest->cached) {
+            busiest = peer;
+        }
+    }
+
+    q = ngx_queue_last(&busiest->cache);
+
+    return ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, peer_queue);
+}
+
+
+static void
+ngx_http_upstream_keepalive_drop(ngx_http_upstream_keepalive_cache_t *item)
+{
+    ngx_queue_remove(&item->queue);
+    ngx_queue_remove(&item->peer_queue);
+
+    item->peer->cached--;
+    item->connection = NULL;
+
+    ngx_queue_insert_head(&item->conf->free, &item->queue);
+}
+
+
 static void
 ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev)
 {
@@ -380,7 +596,6 @@ ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev)
 static void
 ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev)
 {
-    ngx_http_upstream_keepalive_srv_conf_t  *conf;
     ngx_http_upstream_keepalive_cache_t     *item;
 
     int                n;
@@ -391,11 +606,17 @@ ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev)
                    "keepalive close handler");
 
     c = ev->data;
+    item = c->data;
 
     if (c->close) {
         goto close;
     }
 
+    if (ev->timedout) {
+        item->peer->expired++;
+        goto close;
+    }
+
     n = recv(c->fd, buf, 1, MSG_PEEK);
 
     if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
@@ -410,13 +631,8 @@ ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev)
 
 close:
 
-    item = c->data;
-    conf = item->conf;
-
     ngx_http_upstream_keepalive_close(c);
-
-    ngx_queue_remove(&item->queue);
-    ngx_queue_insert_head(&conf->free, &item->queue);
+    ngx_http_upstream_keepalive_drop(item);
 }
 
 
@@ -466,6 +682,68 @@ ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc, void *data)
 #endif
 
 
+static ngx_int_t
+ngx_http_upstream_keepalive_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_upstream_keepalive_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_stats_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                                   *p;
+    ngx_http_upstream_t                      *u;
+    ngx_http_upstream_keepalive_peer_t       *peer;
+    ngx_http_upstream_keepalive_peer_data_t  *kp;
+
+    u = r->upstream;
+
+    if (u == NULL || u->peer.free != ngx_http_upstream_free_keepalive_peer) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    kp = u->peer.data;
+    peer = kp->peer;
+
+    if (peer == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, sizeof("cached= hits= misses= evicted= expired=")
+                             - 1 + 5 * NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "cached=%ui hits=%ui misses=%ui evicted=%ui "
+                         "expired=%ui", peer->cached, peer->hits,
+                         peer->misses, peer->evicted, peer->expired)
+             - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
 {
@@ -483,8 +761,13 @@ ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
      *     conf->original_init_upstream = NULL;
      *     conf->original_init_peer = NULL;
      *     conf->max_cached = 0;
+     *     conf->pool = NULL;
      */
 
+    conf->max_per_peer = NGX_CONF_UNSET_UINT;
+    conf->requests = NGX_CONF_UNSET_UINT;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+
     return conf;
 }
 
@@ -27,7 +27,17 @@
 #define NGX_HTTP_CACHE_ETAG_LEN      128
 #define NGX_HTTP_CACHE_VARY_LEN      128
 
-#define NGX_HTTP_CACHE_VERSION       5
+#define NGX_HTTP_CACHE_VERSION       6
+
+#define NGX_HTTP_CACHE_MAX_DISKS     32
+
+#define NGX_HTTP_CACHE_LRU           0
+#define NGX_HTTP_CACHE_SLRU          1
+#define NGX_HTTP_CACHE_TINYLFU       2
+
+#define NGX_HTTP_CACHE_REFRESH_SCHEDULED  1
+#define NGX_HTTP_CACHE_REFRESH_CLAIMED    2
+#define NGX_HTTP_CACHE_REFRESH_RUNNING    3
 
 
 typedef struct {
@@ -36,6 +46,35 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+typedef struct ngx_http_file_cache_ram_s  ngx_http_file_cache_ram_t;
+typedef struct ngx_http_file_cache_deleter_s  ngx_http_file_cache_deleter_t;
+
+
+/*
+ * a partial entry keeps the body at its offsets in a sparse file,
+ * followed by a bitmap of the slices present
+ */
+
+typedef struct {
+    size_t                           size;
+
+    off_t                            start;   /* negative for a suffix */
+    off_t                            end;     /* -1 up to the end */
+
+    off_t                            length;
+    off_t                            fetch_start;
+    off_t                            fetch_end;
+    off_t                            send_start;
+    off_t                            send_end;
+
+    u_char                          *bitmap;
+    ngx_str_t                        range;
+    ngx_str_t                        if_range;
+
+    unsigned                         in_place:1;
+} ngx_http_cache_slice_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -51,7 +90,11 @@ typedef struct {
     unsigned                         updating:1;
     unsigned                         deleting:1;
     unsigned                         purged:1;
-                                     /* 10 unused bits */
+    unsigned                         hot:1;
+    unsigned                         slow:1;
+    unsigned                         disk:5;
+    unsigned                         refresh:2;
+                                     /* 1 unused bit */
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
@@ -59,9 +102,19 @@ typedef struct {
     size_t                           body_start;
     off_t                            fs_size;
     ngx_msec_t                       lock_time;
+    ngx_http_file_cache_ram_t       *ram;
 } ngx_http_file_cache_node_t;
 
 
+struct ngx_http_file_cache_ram_s {
+    ngx_queue_t                      queue;
+    ngx_http_file_cache_node_t      *node;
+    size_t                           size;
+    size_t                           len;
+    u_char                           data[1];
+};
+
+
 struct ngx_http_cache_s {
     ngx_file_t                       file;
     ngx_array_t                      keys;
@@ -95,8 +148,14 @@ struct ngx_http_cache_s {
     ngx_http_file_cache_t           *file_cache;
     ngx_http_file_cache_node_t      *node;
 
+    ngx_http_cache_slice_t          *slice;
+
+    ngx_path_t                      *path;
+    ngx_uint_t                       disk;
+
 #if (NGX_THREADS || NGX_COMPAT)
     ngx_thread_task_t               *thread_task;
+    ngx_thread_pool_t               *thread_pool;
 #endif
 
     ngx_msec_t                       lock_timeout;
@@ -120,6 +179,12 @@ struct ngx_http_cache_s {
 
     unsigned                         stale_updating:1;
     unsigned                         stale_error:1;
+
+    unsigned                         ram:1;
+    unsigned                         slow:1;
+
+    unsigned                         refresh:1;
+    unsigned                         refreshing:1;
 };
 
 
@@ -139,6 +204,8 @@ typedef struct {
     u_char                           vary_len;
     u_char                           vary[NGX_HTTP_CACHE_VARY_LEN];
     u_char                           variant[NGX_HTTP_CACHE_KEY_LEN];
+    off_t                            slice_length;
+    size_t                           slice_size;
 } ngx_http_file_cache_header_t;
 
 
@@ -151,16 +218,73 @@ typedef struct {
     off_t                            size;
     ngx_uint_t                       count;
     ngx_uint_t                       watermark;
+
+    ngx_queue_t                      hot;
+    ngx_uint_t                       hot_count;
+
+    ngx_queue_t                      slow;
+    off_t                            slow_size;
+
+    off_t                            disk_size[NGX_HTTP_CACHE_MAX_DISKS];
+    time_t                           disk_failed[NGX_HTTP_CACHE_MAX_DISKS];
+
+    u_char                          *sketch;
+    ngx_uint_t                       sketch_mask;
+    ngx_uint_t                       sketch_adds;
+
+    ngx_queue_t                      ram_queue;
+    size_t                           ram_size;
+    ngx_uint_t                       ram_count;
+
+    ngx_atomic_t                     lookups;
+    ngx_atomic_t                     ram_hits;
+    ngx_atomic_t                     disk_hits;
+    ngx_atomic_t                     slow_hits;
+    ngx_atomic_t                     promoted;
+    ngx_atomic_t                     demoted;
+    ngx_atomic_t                     rejected;
+
+    ngx_uint_t                       refreshing;
+    ngx_uint_t                       refresh_tokens;
+    time_t                           refresh_time;
+    ngx_atomic_t                     refreshes;
+
+    ngx_atomic_t                     delete_backlog;
+    ngx_atomic_t                     deleted;
+    ngx_msec_t                       delete_time;
 } ngx_http_file_cache_sh_t;
 
 
+typedef struct {
+    ngx_path_t                      *path;
+    off_t                            max_size;
+#if (NGX_THREADS || NGX_COMPAT)
+    ngx_thread_pool_t               *thread_pool;
+#endif
+} ngx_http_file_cache_disk_t;
+
+
+typedef struct {
+    uint32_t                         hash;
+    ngx_uint_t                       disk;
+} ngx_http_file_cache_point_t;
+
+
 struct ngx_http_file_cache_s {
     ngx_http_file_cache_sh_t        *sh;
     ngx_slab_pool_t                 *shpool;
 
     ngx_path_t                      *path;
+    ngx_path_t                      *slow;
+
+    ngx_array_t                      disks;
+    ngx_http_file_cache_point_t     *points;
+    ngx_uint_t                       npoints;
+    time_t                           disk_fail_timeout;
 
     off_t                            max_size;
+    off_t                            slow_max_size;
+    ngx_uint_t                       promote_min_uses;
     size_t                           bsize;
 
     time_t                           inactive;
@@ -181,6 +305,26 @@ struct ngx_http_file_cache_s {
 
     ngx_uint_t                       use_temp_path;
                                      /* unsigned use_temp_path:1 */
+
+    ngx_uint_t                       policy;
+
+    size_t                           ram_size;
+    size_t                           ram_max_object;
+    ngx_uint_t                       ram_min_uses;
+
+    ngx_str_t                        index;
+    time_t                           index_interval;
+    time_t                           index_time;
+
+    time_t                           refresh_ahead;
+    ngx_uint_t                       refresh_concurrency;
+    ngx_uint_t                       refresh_rate;
+
+    ngx_uint_t                       delete_thread;
+                                     /* unsigned delete_thread:1 */
+#if (NGX_THREADS)
+    ngx_http_file_cache_deleter_t   *deleter;
+#endif
 };
 
 
@@ -191,6 +335,8 @@ ngx_int_t ngx_http_file_cache_open(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update_header(ngx_http_request_t *r);
+ngx_int_t ngx_http_file_cache_slice_open(ngx_http_request_t *r,
+    ngx_temp_file_t *tf);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
 time_t ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status);
@@ -273,6 +273,14 @@ ngx_http_copy_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
     tp = clcf->thread_pool;
 
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache && file == &r->cache->file && r->cache->thread_pool) {
+        tp = r->cache->thread_pool;
+    }
+
+#endif
+
     if (tp == NULL) {
         if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
             != NGX_OK)
@@ -70,6 +70,11 @@ static char *ngx_http_core_internal(ngx_conf_t *cf, ngx_command_t *cmd,
                                     void *conf);
 static char *ngx_http_core_resolver(ngx_conf_t *cf, ngx_command_t *cmd,
                                     void *conf);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_open_file_thread_handler(ngx_thread_task_t *task,
+                                                   ngx_open_file_info_t *of);
+static void ngx_http_open_file_thread_event_handler(ngx_event_t *ev);
+#endif
 #if (NGX_HTTP_GZIP)
 static ngx_int_t ngx_http_gzip_accept_encoding(ngx_str_t *ae);
 static ngx_uint_t ngx_http_gzip_quantity(u_char *p, u_char *last);
@@ -389,6 +394,13 @@ static ngx_command_t ngx_http_core_commands[] = {
      offsetof(ngx_http_core_loc_conf_t, aio_write),
      NULL},
 
+    {ngx_string("aio_open"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_core_loc_conf_t, aio_open),
+     NULL},
+
     {ngx_string("read_ahead"),
      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
      ngx_conf_set_size_slot,
@@ -2931,6 +2943,101 @@ ngx_http_set_disable_symlinks(ngx_http_request_t *r,
     return NGX_OK;
 }
 
+/*
+ * "aio_open" posts open() and stat() of static files to the "aio threads"
+ * pool; the task is kept as the core module context of the request
+ */
+
+void
+ngx_http_set_open_file_thread(ngx_http_request_t *r,
+                              ngx_http_core_loc_conf_t *clcf, ngx_open_file_info_t *of)
+{
+#if (NGX_THREADS)
+    if (clcf->aio != NGX_HTTP_AIO_THREADS || !clcf->aio_open)
+    {
+        return;
+    }
+
+    of->thread_task = ngx_http_get_module_ctx(r, ngx_http_core_module);
+    of->thread_handler = ngx_http_open_file_thread_handler;
+    of->thread_ctx = r;
+#endif
+}
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_open_file_thread_handler(ngx_thread_task_t *task,
+                                  ngx_open_file_info_t *of)
+{
+    ngx_str_t name;
+    ngx_thread_pool_t *tp;
+    ngx_http_request_t *r;
+    ngx_http_core_loc_conf_t *clcf;
+
+    r = of->thread_ctx;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    tp = clcf->thread_pool;
+
+    if (tp == NULL)
+    {
+        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        tp = ngx_thread_pool_get((ngx_cycle_t *)ngx_cycle, &name);
+
+        if (tp == NULL)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "thread pool \"%V\" not found", &name);
+            return NGX_ERROR;
+        }
+    }
+
+    task->event.data = r;
+    task->event.handler = ngx_http_open_file_thread_event_handler;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_http_set_ctx(r, task, ngx_http_core_module);
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_open_file_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t *c;
+    ngx_http_request_t *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http thread open: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    /* the handler is called again to pick up the result */
+
+    r->write_event_handler(r);
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
 ngx_int_t
 ngx_http_get_forwarded_addr(ngx_http_request_t *r, ngx_addr_t *addr,
                             ngx_array_t *headers, ngx_str_t *value, ngx_array_t *proxies,
@@ -3753,6 +3860,7 @@ ngx_http_core_create_loc_conf(ngx_conf_t *cf)
     clcf->sendfile_max_chunk = NGX_CONF_UNSET_SIZE;
     clcf->aio = NGX_CONF_UNSET;
     clcf->aio_write = NGX_CONF_UNSET;
+    clcf->aio_open = NGX_CONF_UNSET;
 #if (NGX_THREADS)
     clcf->thread_pool = NGX_CONF_UNSET_PTR;
     clcf->thread_pool_value = NGX_CONF_UNSET_PTR;
@@ -3985,6 +4093,7 @@ ngx_http_core_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
                               prev->sendfile_max_chunk, 0);
     ngx_conf_merge_value(conf->aio, prev->aio, NGX_HTTP_AIO_OFF);
     ngx_conf_merge_value(conf->aio_write, prev->aio_write, 0);
+    ngx_conf_merge_value(conf->aio_open, prev->aio_open, 0);
 #if (NGX_THREADS)
     ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
     ngx_conf_merge_ptr_value(conf->thread_pool_value, prev->thread_pool_value,
@@ -15,8 +15,6 @@
 
 #if (NGX_THREADS)
 #include <ngx_thread_pool.h>
-#elif (NGX_COMPAT)
-typedef struct ngx_thread_pool_s  ngx_thread_pool_t;
 #endif
 
 
@@ -437,6 +435,7 @@ struct ngx_http_core_loc_conf_s {
     ngx_flag_t    sendfile;                /* sendfile */
     ngx_flag_t    aio;                     /* aio */
     ngx_flag_t    aio_write;               /* aio_write */
+    ngx_flag_t    aio_open;                /* aio_open */
     ngx_flag_t    tcp_nopush;              /* tcp_nopush */
     ngx_flag_t    tcp_nodelay;             /* tcp_nodelay */
     ngx_flag_t    reset_timedout_connection; /* reset_timedout_connection */
@@ -582,6 +581,8 @@ ngx_int_t ngx_http_request_body_save_filter(ngx_http_request_t *r,
 
 ngx_int_t ngx_http_set_disable_symlinks(ngx_http_request_t *r,
     ngx_http_core_loc_conf_t *clcf, ngx_str_t *path, ngx_open_file_info_t *of);
+void ngx_http_set_open_file_thread(ngx_http_request_t *r,
+    ngx_http_core_loc_conf_t *clcf, ngx_open_file_info_t *of);
 
 ngx_int_t ngx_http_get_forwarded_addr(ngx_http_request_t *r, ngx_addr_t *addr,
     ngx_array_t *headers, ngx_str_t *value, ngx_array_t *proxies,
@@ -18,6 +18,15 @@ static void ngx_http_file_cache_lock_wait(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_slice_read(ngx_http_request_t *r,
+    ngx_http_cache_t *c, off_t length, size_t size);
+static ngx_int_t ngx_http_file_cache_slice_update(ngx_http_request_t *r,
+    ngx_temp_file_t *tf);
+static ngx_int_t ngx_http_file_cache_refresh_claim(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_refresh_done(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_refresh(ngx_http_file_cache_t *cache);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 #if (NGX_HAVE_FILE_AIO)
@@ -28,8 +37,33 @@ static ngx_int_t ngx_http_cache_thread_handler(ngx_thread_task_t *task,
     ngx_file_t *file);
 static void ngx_http_cache_thread_event_handler(ngx_event_t *ev);
 #endif
+static ngx_int_t ngx_http_file_cache_ram_read(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_ram_store(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_ram_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static ngx_int_t ngx_http_file_cache_sketch_init(ngx_http_file_cache_t *cache,
+    size_t size);
+static void ngx_http_file_cache_sketch_add(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static ngx_uint_t ngx_http_file_cache_sketch_estimate(
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_node_t *fcn);
+static ngx_uint_t ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_promote(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static ngx_queue_t *ngx_http_file_cache_last(ngx_http_file_cache_t *cache);
+static ngx_queue_t *ngx_http_file_cache_queue(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
 static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
+static ngx_path_t *ngx_http_file_cache_path(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
+static ngx_uint_t ngx_http_file_cache_disk(ngx_http_file_cache_t *cache,
+    u_char *key);
+static void ngx_http_file_cache_disk_error(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
     ngx_path_t *path);
 static ngx_http_file_cache_node_t *
@@ -45,10 +79,19 @@ static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
 static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_cleanup(void *data);
-static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
+static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache,
+    ngx_uint_t disk);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
     ngx_queue_t *q, u_char *name);
+static u_char *ngx_http_file_cache_alloc_name(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_node_name(ngx_path_t *path,
+    ngx_http_file_cache_node_t *fcn, u_char *name);
+static time_t ngx_http_file_cache_tier_demote(ngx_http_file_cache_t *cache,
+    ngx_uint_t disk);
+static void ngx_http_file_cache_tier_promote(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_tier_move(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
 static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
@@ -62,7 +105,31 @@ static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_file_cache_delete_init(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_delete_defer(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, u_char *name);
+static void *ngx_http_file_cache_delete_thread(void *data);
+static ngx_uint_t ngx_http_file_cache_delete_batch(
+    ngx_http_file_cache_deleter_t *d, ngx_str_t *trash);
+#endif
 static void ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache);
+static ngx_uint_t ngx_http_file_cache_in_path(ngx_str_t *name,
+    ngx_str_t *path);
+static char *ngx_http_file_cache_init_disks(ngx_conf_t *cf,
+    ngx_http_file_cache_t *cache, off_t disk_max_size);
+static int ngx_libc_cdecl ngx_http_file_cache_cmp_points(const void *one,
+    const void *two);
+static void ngx_http_file_cache_flush(void *data);
+static ngx_int_t ngx_http_file_cache_index_write(ngx_http_file_cache_t *cache,
+    ngx_uint_t complete);
+static ngx_rbtree_node_t *ngx_http_file_cache_index_next(
+    ngx_http_file_cache_t *cache, u_char *key);
+static int ngx_libc_cdecl ngx_http_file_cache_index_cmp(const void *one,
+    const void *two);
+static uint32_t ngx_http_file_cache_index_disks(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache,
+    ngx_log_t *log);
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -79,14 +146,86 @@ ngx_str_t  ngx_http_cache_status[] = {
 static u_char  ngx_http_file_cache_key[] = { LF, 'K', 'E', 'Y', ':', ' ' };
 
 
+#define NGX_HTTP_CACHE_ALL_DISKS      (ngx_uint_t) -1
+
+
+/*
+ * the index is a snapshot of the keys zone: a header followed by
+ * entries sorted by expiration time, so that the inactive queue
+ * can be rebuilt in order; entries refer to disks by number, so
+ * the header keeps a checksum of the disk paths
+ */
+
+#define NGX_HTTP_CACHE_INDEX_VERSION  2
+#define NGX_HTTP_CACHE_INDEX_CHUNK    4096
+
+#define NGX_HTTP_CACHE_INDEX_HOT      0x0001
+#define NGX_HTTP_CACHE_INDEX_SLOW     0x0002
+#define NGX_HTTP_CACHE_INDEX_DISK     8
+
+
+typedef struct {
+    u_char                           magic[8];
+    uint32_t                         version;
+    uint32_t                         entry_size;
+    uint32_t                         complete;
+    uint32_t                         bsize;
+    uint32_t                         ndisks;
+    uint32_t                         disks;
+    time_t                           time;
+    uint64_t                         count;
+} ngx_http_file_cache_index_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_file_uniq_t                  uniq;
+    time_t                           expire;
+    off_t                            fs_size;
+    uint32_t                         body_start;
+    uint16_t                         uses;
+    uint16_t                         flags;
+} ngx_http_file_cache_index_entry_t;
+
+
+static u_char  ngx_http_file_cache_index_magic[] = "NGXCIDX";
+
+
+#if (NGX_THREADS)
+
+/*
+ * the cache manager renames expired files into a "trash" directory
+ * of their path, and a thread unlinks the directory contents in batches
+ */
+
+struct ngx_http_file_cache_deleter_s {
+    ngx_http_file_cache_t           *cache;
+
+    ngx_thread_mutex_t               mutex;
+    ngx_thread_cond_t                cond;
+    ngx_uint_t                       signaled;  /* unsigned signaled:1 */
+
+    ngx_uint_t                       pending;   /* unsigned pending:1 */
+
+    ngx_str_t                       *trash;
+    ngx_uint_t                       ntrash;
+
+    u_char                          *name;
+    u_char                          *path;
+};
+
+#endif
+
+
 static ngx_int_t
 ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_file_cache_t  *ocache = data;
 
-    size_t                  len;
-    ngx_uint_t              n;
-    ngx_http_file_cache_t  *cache;
+    size_t                       len;
+    ngx_uint_t                   n;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_disk_t  *disk, *odisk;
 
     cache = shm_zone->data;
 
@@ -110,17 +249,60 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             }
         }
 
+        /* entries may be left in the slow path */
+
+        if (ocache->slow
+            && (cache->slow == NULL
+                || ngx_strcmp(cache->slow->name.data, ocache->slow->name.data)
+                   != 0))
+        {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "cache \"%V\" had previously different slow path",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
+        /* disks may only be added, since entries refer to them by number */
+
+        disk = cache->disks.elts;
+        odisk = ocache->disks.elts;
+
+        for (n = 1; n < ocache->disks.nelts; n++) {
+            if (n == cache->disks.nelts
+                || ngx_strcmp(disk[n].path->name.data,
+                              odisk[n].path->name.data)
+                   != 0)
+            {
+                ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                              "cache \"%V\" had previously different disks",
+                              &shm_zone->shm.name);
+                return NGX_ERROR;
+            }
+        }
+
         cache->sh = ocache->sh;
 
         cache->shpool = ocache->shpool;
         cache->bsize = ocache->bsize;
 
         cache->max_size /= cache->bsize;
+        cache->slow_max_size /= cache->bsize;
+
+        for (n = 0; n < cache->disks.nelts; n++) {
+            disk[n].max_size /= cache->bsize;
+        }
 
         if (!cache->sh->cold || cache->sh->loading) {
             cache->path->loader = NULL;
         }
 
+        if (cache->policy == NGX_HTTP_CACHE_TINYLFU
+            && cache->sh->sketch == NULL)
+        {
+            return ngx_http_file_cache_sketch_init(cache,
+                                                   shm_zone->shm.size);
+        }
+
         return NGX_OK;
     }
 
@@ -144,6 +326,9 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
                     ngx_http_file_cache_rbtree_insert_value);
 
     ngx_queue_init(&cache->sh->queue);
+    ngx_queue_init(&cache->sh->hot);
+    ngx_queue_init(&cache->sh->slow);
+    ngx_queue_init(&cache->sh->ram_queue);
 
     cache->sh->cold = 1;
     cache->sh->loading = 0;
@@ -151,9 +336,42 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
     cache->sh->count = 0;
     cache->sh->watermark = (ngx_uint_t) -1;
 
+    cache->sh->hot_count = 0;
+    cache->sh->slow_size = 0;
+    cache->sh->sketch = NULL;
+
+    ngx_memzero(cache->sh->disk_size, sizeof(cache->sh->disk_size));
+    ngx_memzero(cache->sh->disk_failed, sizeof(cache->sh->disk_failed));
+    cache->sh->rejected = 0;
+
+    cache->sh->ram_size = 0;
+    cache->sh->ram_count = 0;
+    cache->sh->lookups = 0;
+    cache->sh->ram_hits = 0;
+    cache->sh->disk_hits = 0;
+    cache->sh->slow_hits = 0;
+    cache->sh->promoted = 0;
+    cache->sh->demoted = 0;
+
+    cache->sh->refreshing = 0;
+    cache->sh->refresh_tokens = 0;
+    cache->sh->refresh_time = 0;
+    cache->sh->refreshes = 0;
+
+    cache->sh->delete_backlog = 0;
+    cache->sh->deleted = 0;
+    cache->sh->delete_time = 0;
+
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
     cache->max_size /= cache->bsize;
+    cache->slow_max_size /= cache->bsize;
+
+    disk = cache->disks.elts;
+
+    for (n = 0; n < cache->disks.nelts; n++) {
+        disk[n].max_size /= cache->bsize;
+    }
 
     len = sizeof(" in cache keys zone \"\"") + shm_zone->shm.name.len;
 
@@ -167,6 +385,17 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     cache->shpool->log_nomem = 0;
 
+    if (cache->policy == NGX_HTTP_CACHE_TINYLFU
+        && ngx_http_file_cache_sketch_init(cache, shm_zone->shm.size)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (cache->index.len) {
+        ngx_http_file_cache_index_load(cache, shm_zone->shm.log);
+    }
+
     return NGX_OK;
 }
 
@@ -215,7 +444,9 @@ ngx_http_file_cache_create(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+    if (ngx_http_file_cache_name(r, ngx_http_file_cache_path(cache, c))
+        != NGX_OK)
+    {
         return NGX_ERROR;
     }
 
@@ -263,6 +494,7 @@ ngx_http_file_cache_create_key(ngx_http_request_t *r)
 ngx_int_t
 ngx_http_file_cache_open(ngx_http_request_t *r)
 {
+    size_t                     size;
     ngx_int_t                  rc, rv;
     ngx_uint_t                 test;
     ngx_http_cache_t          *c;
@@ -291,6 +523,10 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
 
         cln->handler = ngx_http_file_cache_cleanup;
         cln->data = c;
+
+        if (!c->secondary) {
+            (void) ngx_atomic_fetch_add(&cache->sh->lookups, 1);
+        }
     }
 
     rc = ngx_http_file_cache_exists(cache, c);
@@ -334,7 +570,9 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         }
     }
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+    if (ngx_http_file_cache_name(r, ngx_http_file_cache_path(cache, c))
+        != NGX_OK)
+    {
         return NGX_ERROR;
     }
 
@@ -342,6 +580,14 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    if (c->exists && cache->ram_size) {
+        rc = ngx_http_file_cache_ram_read(r, c);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -368,6 +614,7 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         default:
             ngx_log_error(NGX_LOG_CRIT, r->connection->log, of.err,
                           ngx_open_file_n " \"%s\" failed", c->file.name.data);
+            ngx_http_file_cache_disk_error(cache, c);
             return NGX_ERROR;
         }
     }
@@ -381,7 +628,15 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
     c->length = of.size;
     c->fs_size = (of.fs_size + cache->bsize - 1) / cache->bsize;
 
-    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    /* objects small enough for the ram tier are read as a whole */
+
+    size = c->body_start;
+
+    if (cache->ram_size && of.size <= (off_t) cache->ram_max_object) {
+        size = ngx_max(size, (size_t) of.size);
+    }
+
+    c->buf = ngx_create_temp_buf(r->pool, size);
     if (c->buf == NULL) {
         return NGX_ERROR;
     }
@@ -533,10 +788,20 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_http_file_cache_t         *cache;
     ngx_http_file_cache_header_t  *h;
 
-    n = ngx_http_file_cache_aio_read(r, c);
+    if (c->ram) {
+        n = c->length;
 
-    if (n < 0) {
-        return n;
+    } else {
+        n = ngx_http_file_cache_aio_read(r, c);
+
+        if (n < 0) {
+
+            if (n == NGX_ERROR) {
+                ngx_http_file_cache_disk_error(c->file_cache, c);
+            }
+
+            return n;
+        }
     }
 
     if ((size_t) n < c->header_start) {
@@ -625,12 +890,27 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             c->node->uniq = c->uniq;
             c->node->fs_size = c->fs_size;
 
-            cache->sh->size += c->fs_size;
+            if (c->node->slow) {
+                cache->sh->slow_size += c->fs_size;
+
+            } else {
+                c->node->disk = c->disk;
+                cache->sh->size += c->fs_size;
+                cache->sh->disk_size[c->disk] += c->fs_size;
+            }
         }
 
         ngx_shmtx_unlock(&cache->shpool->mutex);
     }
 
+    if (h->slice_length) {
+        rc = ngx_http_file_cache_slice_read(r, c, h->slice_length,
+                                            h->slice_size);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
     now = ngx_time();
 
     if (c->valid_sec < now) {
@@ -658,10 +938,256 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         return rc;
     }
 
+    if (cache->refresh_ahead
+        && (c->node->valid_sec != c->valid_sec || c->node->refresh))
+    {
+        rc = ngx_http_file_cache_refresh_claim(r, c);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    if (c->ram) {
+        (void) ngx_atomic_fetch_add(&cache->sh->ram_hits, 1);
+        return NGX_OK;
+    }
+
+    if (c->node->slow) {
+        c->slow = 1;
+        (void) ngx_atomic_fetch_add(&cache->sh->slow_hits, 1);
+
+    } else {
+        (void) ngx_atomic_fetch_add(&cache->sh->disk_hits, 1);
+    }
+
+    if (cache->ram_size && c->buf->last - c->buf->pos == c->length
+        && h->slice_length == 0)
+    {
+        ngx_http_file_cache_ram_store(cache, c);
+    }
+
     return NGX_OK;
 }
 
 
+static ngx_int_t
+ngx_http_file_cache_slice_read(ngx_http_request_t *r, ngx_http_cache_t *c,
+    off_t length, size_t size)
+{
+    u_char                  *p;
+    off_t                    start, end;
+    size_t                   len;
+    ssize_t                  n;
+    ngx_uint_t               i, first, last, missing;
+    ngx_http_cache_slice_t  *slice;
+
+    slice = c->slice;
+
+    /*
+     * a partial entry is replaced when it expires, and by a response
+     * to a request without slices or with slices of another size
+     */
+
+    if (slice == NULL || slice->size != size || c->valid_sec < ngx_time()) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache partial entry replaced");
+
+        c->valid_sec = 0;
+        c->updating_sec = 0;
+        c->error_sec = 0;
+
+        return NGX_DECLINED;
+    }
+
+    slice->length = length;
+    slice->in_place = 0;
+    slice->range.len = 0;
+
+    start = slice->start;
+    end = slice->end;
+
+    if (start < 0) {
+        start = ngx_max(length + start, 0);
+        end = length;
+    }
+
+    if (end == -1 || end > length) {
+        end = length;
+    }
+
+    c->length = c->body_start + length;
+
+    if (start >= end) {
+        return NGX_OK;
+    }
+
+    len = ((length + size - 1) / size + 7) / 8;
+
+    slice->bitmap = ngx_pnalloc(r->pool, len);
+    if (slice->bitmap == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the bitmap is small and read synchronously */
+
+    n = ngx_read_file(&c->file, slice->bitmap, len, c->body_start + length);
+
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if ((size_t) n != len) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incomplete slice bitmap",
+                      c->file.name.data);
+
+        c->valid_sec = 0;
+        c->updating_sec = 0;
+        c->error_sec = 0;
+
+        return NGX_DECLINED;
+    }
+
+    first = (ngx_uint_t) (start / size);
+    last = (ngx_uint_t) ((end - 1) / size);
+
+    missing = last + 1;
+
+    for (i = first; i <= last; i++) {
+        if (!(slice->bitmap[i / 8] & (1 << (i % 8)))) {
+
+            if (missing > last) {
+                slice->fetch_start = (off_t) (i * size);
+            }
+
+            missing = i;
+        }
+    }
+
+    if (missing > last) {
+        return NGX_OK;
+    }
+
+    /* only the missing slices are requested, the rest is sent from the file */
+
+    slice->in_place = 1;
+
+    slice->fetch_end = ngx_min((off_t) ((missing + 1) * size), length);
+    slice->send_start = (off_t) (first * size);
+    slice->send_end = ngx_min((off_t) ((last + 1) * size), length);
+
+    p = ngx_pnalloc(r->pool, sizeof("bytes=-") - 1 + 2 * NGX_OFF_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    slice->range.data = p;
+    slice->range.len = ngx_sprintf(p, "bytes=%O-%O", slice->fetch_start,
+                                   slice->fetch_end - 1)
+                       - p;
+
+    /* a weak entity tag cannot be used in If-Range */
+
+    if (c->etag.len && !(c->etag.len > 2 && c->etag.data[0] == 'W'
+                         && c->etag.data[1] == '/'))
+    {
+        slice->if_range = c->etag;
+
+    } else if (c->last_modified != -1) {
+        p = ngx_pnalloc(r->pool, sizeof("Mon, 28 Sep 1970 06:00:00 GMT") - 1);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        slice->if_range.data = p;
+        slice->if_range.len = ngx_http_time(p, c->last_modified) - p;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache slices: %O-%O, fetch %O-%O",
+                   slice->send_start, slice->send_end,
+                   slice->fetch_start, slice->fetch_end);
+
+    r->cached = 0;
+
+    /* concurrent fills of an entry wait for each other as misses do */
+
+    return ngx_http_file_cache_lock(r, c);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_refresh_claim(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    time_t                       now;
+    ngx_int_t                    rc;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_sh_t    *sh;
+    ngx_http_file_cache_node_t  *fcn;
+
+    cache = c->file_cache;
+    sh = cache->sh;
+
+    rc = NGX_OK;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+
+    /* the manager schedules refreshes by the validity known to the node */
+
+    if (!fcn->error) {
+        fcn->valid_sec = c->valid_sec;
+    }
+
+    if (r->cache_updater) {
+
+        /* a background subrequest of the request which claimed a refresh */
+
+        if (fcn->refresh == NGX_HTTP_CACHE_REFRESH_CLAIMED) {
+            fcn->refresh = NGX_HTTP_CACHE_REFRESH_RUNNING;
+            fcn->updating = 1;
+
+            c->refreshing = 1;
+            c->updating = 1;
+            c->lock_time = fcn->lock_time;
+
+            rc = NGX_HTTP_CACHE_STALE;
+        }
+
+    } else if (fcn->refresh == NGX_HTTP_CACHE_REFRESH_SCHEDULED
+               && !fcn->updating
+               && sh->refreshing < cache->refresh_concurrency)
+    {
+        now = ngx_time();
+
+        if (sh->refresh_time != now) {
+            sh->refresh_time = now;
+            sh->refresh_tokens = cache->refresh_rate;
+        }
+
+        if (sh->refresh_tokens) {
+            sh->refresh_tokens--;
+            sh->refreshing++;
+
+            fcn->refresh = NGX_HTTP_CACHE_REFRESH_CLAIMED;
+
+            c->refresh = 1;
+            c->background = 1;
+
+            (void) ngx_atomic_fetch_add(&sh->refreshes, 1);
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache refresh: %ui %i", fcn->refresh, rc);
+
+    return rc;
+}
+
+
 static ssize_t
 ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
@@ -675,7 +1201,8 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 #if (NGX_HAVE_FILE_AIO)
 
     if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
-        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+        n = ngx_file_aio_read(&c->file, c->buf->pos,
+                              c->buf->end - c->buf->pos, 0, r->pool);
 
         if (n != NGX_AGAIN) {
             c->reading = 0;
@@ -702,7 +1229,8 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->file.thread_handler = ngx_http_cache_thread_handler;
         c->file.thread_ctx = r;
 
-        n = ngx_thread_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+        n = ngx_thread_read(&c->file, c->buf->pos, c->buf->end - c->buf->pos,
+                            0, r->pool);
 
         c->thread_task = c->file.thread_task;
         c->reading = (n == NGX_AGAIN);
@@ -712,7 +1240,7 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
 #endif
 
-    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
+    return ngx_read_file(&c->file, c->buf->pos, c->buf->end - c->buf->pos, 0);
 }
 
 
@@ -758,7 +1286,10 @@ ngx_http_cache_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
     r = file->thread_ctx;
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-    tp = clcf->thread_pool;
+
+    /* a cache disk may have its own pool */
+
+    tp = r->cache->thread_pool ? r->cache->thread_pool : clcf->thread_pool;
 
     if (tp == NULL) {
         if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
@@ -816,1428 +1347,3562 @@ ngx_http_cache_thread_event_handler(ngx_event_t *ev)
 
 
 static ngx_int_t
-ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+ngx_http_file_cache_ram_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_int_t                    rc;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_http_file_cache_t      *cache;
+    ngx_http_file_cache_ram_t  *ram;
+
+    cache = c->file_cache;
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
-    fcn = c->node;
+    ram = c->node->ram;
 
-    if (fcn == NULL) {
-        fcn = ngx_http_file_cache_lookup(cache, c->key);
+    if (ram == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
     }
 
-    if (fcn) {
-        ngx_queue_remove(&fcn->queue);
+    c->buf = ngx_create_temp_buf(r->pool, ngx_max(ram->len, c->body_start));
+    if (c->buf == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_ERROR;
+    }
 
-        if (c->node == NULL) {
-            fcn->uses++;
-            fcn->count++;
-        }
+    ngx_memcpy(c->buf->pos, ram->data, ram->len);
 
-        if (fcn->error) {
+    ngx_queue_remove(&ram->queue);
+    ngx_queue_insert_head(&cache->sh->ram_queue, &ram->queue);
 
-            if (fcn->valid_sec < ngx_time()) {
-                goto renew;
-            }
+    c->uniq = c->node->uniq;
+    c->length = ram->len;
+    c->fs_size = c->node->fs_size;
 
-            rc = NGX_OK;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-            goto done;
-        }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache ram: %O", c->length);
 
-        if (fcn->exists || fcn->uses >= c->min_uses) {
+    c->ram = 1;
 
-            c->exists = fcn->exists;
-            if (fcn->body_start) {
-                c->body_start = fcn->body_start;
-            }
+    return ngx_http_file_cache_read(r, c);
+}
 
-            rc = NGX_OK;
 
-            goto done;
-        }
+static void
+ngx_http_file_cache_ram_store(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c)
+{
+    size_t                       len, size;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_ram_t   *ram;
+    ngx_http_file_cache_node_t  *fcn;
 
-        rc = NGX_AGAIN;
+    /* account memory as the slab allocator rounds it */
 
-        goto done;
+    len = offsetof(ngx_http_file_cache_ram_t, data) + (size_t) c->length;
+
+    if (len > ngx_pagesize / 2) {
+        size = ngx_align(len, ngx_pagesize);
+
+    } else {
+        for (size = 8; size < len; size <<= 1) { /* void */ }
     }
 
-    fcn = ngx_slab_calloc_locked(cache->shpool,
-                                 sizeof(ngx_http_file_cache_node_t));
-    if (fcn == NULL) {
-        ngx_http_file_cache_set_watermark(cache);
+    if (size > cache->ram_size) {
+        return;
+    }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-        (void) ngx_http_file_cache_forced_expire(cache);
+    fcn = c->node;
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    /* the file might have been replaced after it was opened */
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                          "could not allocate node%s", cache->shpool->log_ctx);
-            rc = NGX_ERROR;
-            goto failed;
-        }
+    if (fcn->ram
+        || fcn->uniq != c->uniq
+        || fcn->uses < cache->ram_min_uses)
+    {
+        goto done;
     }
 
-    cache->sh->count++;
+    while (cache->sh->ram_size + size > cache->ram_size) {
+        q = ngx_queue_last(&cache->sh->ram_queue);
+        ram = ngx_queue_data(q, ngx_http_file_cache_ram_t, queue);
 
-    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+        ngx_http_file_cache_ram_free(cache, ram->node);
+    }
 
-    ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    ram = ngx_slab_alloc_locked(cache->shpool, len);
+    if (ram == NULL) {
+        goto done;
+    }
 
-    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    ram->node = fcn;
+    ram->size = size;
+    ram->len = (size_t) c->length;
 
-    fcn->uses = 1;
-    fcn->count = 1;
+    ngx_memcpy(ram->data, c->buf->pos, ram->len);
 
-renew:
+    ngx_queue_insert_head(&cache->sh->ram_queue, &ram->queue);
 
-    rc = NGX_DECLINED;
+    cache->sh->ram_size += size;
+    cache->sh->ram_count++;
 
-    fcn->valid_msec = 0;
-    fcn->error = 0;
-    fcn->exists = 0;
-    fcn->valid_sec = 0;
-    fcn->uniq = 0;
-    fcn->body_start = 0;
-    fcn->fs_size = 0;
+    fcn->ram = ram;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache ram store: %uz r:%uz",
+                   ram->len, cache->sh->ram_size);
 
 done:
 
-    fcn->expire = ngx_time() + cache->inactive;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
 
-    c->uniq = fcn->uniq;
-    c->error = fcn->error;
-    c->node = fcn;
+static void
+ngx_http_file_cache_ram_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_http_file_cache_ram_t  *ram;
 
-failed:
+    ram = fcn->ram;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (ram == NULL) {
+        return;
+    }
 
-    return rc;
+    fcn->ram = NULL;
+
+    ngx_queue_remove(&ram->queue);
+
+    cache->sh->ram_size -= ram->size;
+    cache->sh->ram_count--;
+
+    ngx_slab_free_locked(cache->shpool, ram);
 }
 
 
+/*
+ * the frequency sketch is a count-min sketch of four rows of 4-bit
+ * counters indexed by the md5 key, halved after every 10 * width additions
+ */
+
 static ngx_int_t
-ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
+ngx_http_file_cache_sketch_init(ngx_http_file_cache_t *cache, size_t size)
 {
-    u_char            *p;
-    ngx_http_cache_t  *c;
+    ngx_uint_t  n;
 
-    c = r->cache;
-
-    if (c->file.name.len) {
-        return NGX_OK;
-    }
+    /* about as many counters per row as nodes the zone may hold */
 
-    c->file.name.len = path->name.len + 1 + path->len
-                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    for (n = 1024; n < size / 128; n <<= 1) { /* void */ }
 
-    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
-    if (c->file.name.data == NULL) {
+    cache->sh->sketch = ngx_slab_calloc(cache->shpool, 4 * n / 2);
+    if (cache->sh->sketch == NULL) {
         return NGX_ERROR;
     }
 
-    ngx_memcpy(c->file.name.data, path->name.data, path->name.len);
-
-    p = c->file.name.data + path->name.len + 1 + path->len;
-    p = ngx_hex_dump(p, c->key, NGX_HTTP_CACHE_KEY_LEN);
-    *p = '\0';
-
-    ngx_create_hashed_filename(path, c->file.name.data, c->file.name.len);
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "cache file: \"%s\"", c->file.name.data);
+    cache->sh->sketch_mask = n - 1;
+    cache->sh->sketch_adds = 0;
 
     return NGX_OK;
 }
 
 
-static ngx_http_file_cache_node_t *
-ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+static void
+ngx_http_file_cache_sketch_add(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
 {
-    ngx_int_t                    rc;
-    ngx_rbtree_key_t             node_key;
-    ngx_rbtree_node_t           *node, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
+    u_char      *p;
+    uint32_t     h, g;
+    ngx_uint_t   i, n, v, min, mask, idx[4];
 
-    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+    p = cache->sh->sketch;
 
-    node = cache->sh->rbtree.root;
-    sentinel = cache->sh->rbtree.sentinel;
+    if (p == NULL || cache->policy != NGX_HTTP_CACHE_TINYLFU) {
+        return;
+    }
 
-    while (node != sentinel) {
+    mask = cache->sh->sketch_mask;
 
-        if (node_key < node->key) {
-            node = node->left;
-            continue;
-        }
+    h = (uint32_t) fcn->node.key;
+    ngx_memcpy(&g, fcn->key, sizeof(uint32_t));
+    g |= 1;
 
-        if (node_key > node->key) {
-            node = node->right;
-            continue;
+    min = 15;
+
+    for (i = 0; i < 4; i++) {
+        idx[i] = i * (mask + 1) + ((h + i * g) & mask);
+
+        v = (p[idx[i] >> 1] >> ((idx[i] & 1) << 2)) & 0xf;
+
+        if (v < min) {
+            min = v;
         }
+    }
 
-        /* node_key == node->key */
+    if (min == 15) {
+        goto done;
+    }
 
-        fcn = (ngx_http_file_cache_node_t *) node;
+    /* conservative update: only the smallest counters are incremented */
 
-        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
-                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    for (i = 0; i < 4; i++) {
+        v = (p[idx[i] >> 1] >> ((idx[i] & 1) << 2)) & 0xf;
 
-        if (rc == 0) {
-            return fcn;
+        if (v == min) {
+            p[idx[i] >> 1] += (u_char) (1 << ((idx[i] & 1) << 2));
         }
+    }
 
-        node = (rc < 0) ? node->left : node->right;
+done:
+
+    if (++cache->sh->sketch_adds < 10 * (mask + 1)) {
+        return;
     }
 
-    /* not found */
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache sketch reset");
 
-    return NULL;
+    for (n = 0; n < 4 * (mask + 1) / 2; n++) {
+        p[n] = (p[n] >> 1) & 0x77;
+    }
+
+    cache->sh->sketch_adds = 0;
 }
 
 
-static void
-ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+static ngx_uint_t
+ngx_http_file_cache_sketch_estimate(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
 {
-    ngx_rbtree_node_t           **p;
-    ngx_http_file_cache_node_t   *cn, *cnt;
+    u_char      *p;
+    uint32_t     h, g;
+    ngx_uint_t   i, v, min, idx, mask;
 
-    for ( ;; ) {
+    p = cache->sh->sketch;
+    mask = cache->sh->sketch_mask;
 
-        if (node->key < temp->key) {
+    h = (uint32_t) fcn->node.key;
+    ngx_memcpy(&g, fcn->key, sizeof(uint32_t));
+    g |= 1;
 
-            p = &temp->left;
+    min = 15;
 
-        } else if (node->key > temp->key) {
+    for (i = 0; i < 4; i++) {
+        idx = i * (mask + 1) + ((h + i * g) & mask);
 
-            p = &temp->right;
+        v = (p[idx >> 1] >> ((idx & 1) << 2)) & 0xf;
 
-        } else { /* node->key == temp->key */
+        if (v < min) {
+            min = v;
+        }
+    }
 
-            cn = (ngx_http_file_cache_node_t *) node;
-            cnt = (ngx_http_file_cache_node_t *) temp;
+    return min;
+}
 
-            p = (ngx_memcmp(cn->key, cnt->key,
-                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
-                 < 0)
-                    ? &temp->left : &temp->right;
-        }
 
-        if (*p == sentinel) {
-            break;
-        }
+/*
+ * once the cache is full, a new entry is only stored
+ * if it is estimated to be used more often than the entry
+ * which would be evicted for it
+ */
 
-        temp = *p;
+static ngx_uint_t
+ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *victim;
+
+    if (cache->policy != NGX_HTTP_CACHE_TINYLFU
+        || cache->sh->sketch == NULL
+        || cache->sh->cold)
+    {
+        return 1;
     }
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
+    if (cache->sh->size < cache->max_size
+        && cache->sh->count < cache->sh->watermark)
+    {
+        return 1;
+    }
+
+    q = ngx_queue_empty(&cache->sh->queue) ? &cache->sh->hot
+                                           : &cache->sh->queue;
+
+    if (ngx_queue_empty(q)) {
+        return 1;
+    }
+
+    victim = ngx_queue_data(ngx_queue_last(q), ngx_http_file_cache_node_t,
+                            queue);
+
+    if (ngx_http_file_cache_sketch_estimate(cache, fcn)
+        > ngx_http_file_cache_sketch_estimate(cache, victim))
+    {
+        return 1;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache admission rejected: %02xd%02xd%02xd%02xd",
+                   fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+    cache->sh->rejected++;
+
+    return 0;
 }
 
 
+/*
+ * segmented LRU: entries hit again move from the probationary segment
+ * (sh->queue) to the protected one (sh->hot), which is limited to 80%
+ * of entries; its least recently used entries move back to probation
+ */
+
 static void
-ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
-    u_char *hash)
+ngx_http_file_cache_promote(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
 {
-    u_char     *p, *last;
-    ngx_str_t   name;
-    ngx_md5_t   md5;
-    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *lru;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache vary: \"%*s\"", len, vary);
+    if (cache->policy == NGX_HTTP_CACHE_LRU || fcn->hot || fcn->slow) {
+        return;
+    }
 
-    ngx_md5_init(&md5);
-    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+    fcn->hot = 1;
+    cache->sh->hot_count++;
 
-    ngx_strlow(buf, vary, len);
+    while (cache->sh->hot_count > cache->sh->count * 8 / 10
+           && !ngx_queue_empty(&cache->sh->hot))
+    {
+        q = ngx_queue_last(&cache->sh->hot);
+        lru = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
-    p = buf;
-    last = buf + len;
+        ngx_queue_remove(q);
+        ngx_queue_insert_head(&cache->sh->queue, q);
 
-    while (p < last) {
+        lru->hot = 0;
+        cache->sh->hot_count--;
+    }
+}
 
-        while (p < last && (*p == ' ' || *p == ',')) { p++; }
 
-        name.data = p;
+static ngx_queue_t *
+ngx_http_file_cache_last(ngx_http_file_cache_t *cache)
+{
+    ngx_uint_t                   i;
+    ngx_queue_t                 *q, *last, *queue[3];
+    ngx_http_file_cache_node_t  *fcn, *lru;
 
-        while (p < last && *p != ',' && *p != ' ') { p++; }
+    queue[0] = &cache->sh->queue;
+    queue[1] = &cache->sh->hot;
+    queue[2] = &cache->sh->slow;
 
-        name.len = p - name.data;
+    last = NULL;
+    lru = NULL;
 
-        if (name.len == 0) {
-            break;
+    for (i = 0; i < 3; i++) {
+
+        if (ngx_queue_empty(queue[i])) {
+            continue;
         }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache vary: %V", &name);
+        q = ngx_queue_last(queue[i]);
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
-        ngx_md5_update(&md5, name.data, name.len);
-        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+        if (lru == NULL || fcn->expire < lru->expire) {
+            last = q;
+            lru = fcn;
+        }
+    }
 
-        ngx_http_file_cache_vary_header(r, &md5, &name);
+    return last;
+}
 
-        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
+
+static ngx_queue_t *
+ngx_http_file_cache_queue(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    if (fcn->slow) {
+        return &cache->sh->slow;
     }
 
-    ngx_md5_final(hash, &md5);
+    return fcn->hot ? &cache->sh->hot : &cache->sh->queue;
 }
 
 
-static void
-ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
-    ngx_str_t *name)
+static ngx_int_t
+ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    size_t            len;
-    u_char           *p, *start, *last;
-    ngx_uint_t        i, multiple, normalize;
-    ngx_list_part_t  *part;
-    ngx_table_elt_t  *header;
+    ngx_int_t                    rc;
+    ngx_http_file_cache_node_t  *fcn;
 
-    multiple = 0;
-    normalize = 0;
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    if (name->len == sizeof("Accept-Charset") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
-                           sizeof("Accept-Charset") - 1) == 0)
-    {
-        normalize = 1;
-
-    } else if (name->len == sizeof("Accept-Encoding") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
-                           sizeof("Accept-Encoding") - 1) == 0)
-    {
-        normalize = 1;
+    fcn = c->node;
 
-    } else if (name->len == sizeof("Accept-Language") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
-                           sizeof("Accept-Language") - 1) == 0)
-    {
-        normalize = 1;
+    if (fcn == NULL) {
+        fcn = ngx_http_file_cache_lookup(cache, c->key);
     }
 
-    part = &r->headers_in.headers.part;
-    header = part->elts;
+    if (fcn) {
+        ngx_queue_remove(&fcn->queue);
 
-    for (i = 0; /* void */ ; i++) {
+        if (c->node == NULL) {
+            fcn->uses++;
+            fcn->count++;
 
-        if (i >= part->nelts) {
-            if (part->next == NULL) {
-                break;
+            ngx_http_file_cache_sketch_add(cache, fcn);
+        }
+
+        if (fcn->error) {
+
+            if (fcn->valid_sec < ngx_time()) {
+                goto renew;
             }
 
-            part = part->next;
-            header = part->elts;
-            i = 0;
-        }
+            rc = NGX_OK;
 
-        if (header[i].hash == 0) {
-            continue;
+            goto done;
         }
 
-        if (header[i].key.len != name->len) {
-            continue;
-        }
+        if (fcn->exists
+            || (fcn->uses >= c->min_uses
+                && ngx_http_file_cache_admit(cache, fcn)))
+        {
+            c->exists = fcn->exists;
+            if (fcn->body_start) {
+                c->body_start = fcn->body_start;
+            }
 
-        if (ngx_strncasecmp(header[i].key.data, name->data, name->len) != 0) {
-            continue;
+            rc = NGX_OK;
+
+            goto done;
         }
 
-        if (!normalize) {
+        rc = NGX_AGAIN;
 
-            if (multiple) {
-                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
-            }
+        goto done;
+    }
 
-            ngx_md5_update(md5, header[i].value.data, header[i].value.len);
+    fcn = ngx_slab_calloc_locked(cache->shpool,
+                                 sizeof(ngx_http_file_cache_node_t));
+    if (fcn == NULL) {
+        ngx_http_file_cache_set_watermark(cache);
 
-            multiple = 1;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-            continue;
+        (void) ngx_http_file_cache_forced_expire(cache,
+                                                 NGX_HTTP_CACHE_ALL_DISKS);
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "could not allocate node%s", cache->shpool->log_ctx);
+            rc = NGX_ERROR;
+            goto failed;
         }
+    }
 
-        /* normalize spaces */
+    cache->sh->count++;
 
-        p = header[i].value.data;
-        last = p + header[i].value.len;
+    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
-        while (p < last) {
+    ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-            while (p < last && (*p == ' ' || *p == ',')) { p++; }
+    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
 
-            start = p;
+    fcn->uses = 1;
+    fcn->count = 1;
 
-            while (p < last && *p != ',' && *p != ' ') { p++; }
+    ngx_http_file_cache_sketch_add(cache, fcn);
 
-            len = p - start;
+    if (c->min_uses == 1 && !ngx_http_file_cache_admit(cache, fcn)) {
+        rc = NGX_AGAIN;
+        goto done;
+    }
 
-            if (len == 0) {
-                break;
-            }
+renew:
 
-            if (multiple) {
-                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
-            }
+    rc = NGX_DECLINED;
 
-            ngx_md5_update(md5, start, len);
+    ngx_http_file_cache_ram_free(cache, fcn);
 
-            multiple = 1;
-        }
+    fcn->valid_msec = 0;
+    fcn->error = 0;
+    fcn->exists = 0;
+    fcn->valid_sec = 0;
+    fcn->uniq = 0;
+    fcn->body_start = 0;
+    fcn->fs_size = 0;
+
+done:
+
+    fcn->expire = ngx_time() + cache->inactive;
+
+    if (rc == NGX_OK && fcn->exists && c->node == NULL) {
+        ngx_http_file_cache_promote(cache, fcn);
     }
+
+    ngx_queue_insert_head(ngx_http_file_cache_queue(cache, fcn), &fcn->queue);
+
+    c->uniq = fcn->uniq;
+    c->error = fcn->error;
+    c->node = fcn;
+
+failed:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
+static ngx_path_t *
+ngx_http_file_cache_path(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_t  *cache;
+    ngx_uint_t                   disk;
+    ngx_http_file_cache_disk_t  *disks;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache reopen");
+    if (c->file.name.len) {
+        return c->path;
+    }
 
-    if (c->secondary) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has incorrect vary hash",
-                      c->file.name.data);
-        return NGX_DECLINED;
+    if (c->node->slow) {
+        return cache->slow;
     }
 
-    cache = c->file_cache;
+    disks = cache->disks.elts;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    /* an existing file stays on its disk unless the disk has failed */
 
-    c->node->count--;
-    c->node = NULL;
+    if (cache->disks.nelts == 1
+        || (c->node->exists
+            && cache->sh->disk_failed[c->node->disk] <= ngx_time()))
+    {
+        disk = c->node->disk;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    } else {
+        disk = ngx_http_file_cache_disk(cache, c->key);
+    }
 
-    c->secondary = 1;
-    c->file.name.len = 0;
-    c->body_start = c->buf->end - c->buf->start;
+    c->disk = disk;
 
-    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+#if (NGX_THREADS)
+    c->thread_pool = disks[disk].thread_pool;
+#endif
 
-    return ngx_http_file_cache_open(r);
+    return disks[disk].path;
 }
 
 
-ngx_int_t
-ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
+/*
+ * files are spread over disks by consistent hashing of the key,
+ * so that adding a disk or excluding a failed one moves only
+ * the keys of that disk
+ */
+
+static ngx_uint_t
+ngx_http_file_cache_disk(ngx_http_file_cache_t *cache, u_char *key)
 {
-    ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
+    time_t                        now;
+    uint32_t                      hash;
+    ngx_uint_t                    i, j, k, n, disk;
+    ngx_http_file_cache_point_t  *point;
 
-    u_char            *p;
-    ngx_str_t         *key;
-    ngx_uint_t         i;
-    ngx_http_cache_t  *c;
+    if (cache->npoints == 0) {
+        return 0;
+    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache set header");
+    hash = ngx_crc32_short(key, NGX_HTTP_CACHE_KEY_LEN);
 
-    c = r->cache;
+    point = cache->points;
+    n = cache->npoints;
 
-    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+    /* find first point >= hash */
 
-    h->version = NGX_HTTP_CACHE_VERSION;
-    h->valid_sec = c->valid_sec;
-    h->updating_sec = c->updating_sec;
-    h->error_sec = c->error_sec;
-    h->last_modified = c->last_modified;
-    h->date = c->date;
-    h->crc32 = c->crc32;
-    h->valid_msec = (u_short) c->valid_msec;
-    h->header_start = (u_short) c->header_start;
-    h->body_start = (u_short) c->body_start;
+    i = 0;
+    j = n;
 
-    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
-        h->etag_len = (u_char) c->etag.len;
-        ngx_memcpy(h->etag, c->etag.data, c->etag.len);
-    }
+    while (i < j) {
+        k = (i + j) / 2;
 
-    if (c->vary.len) {
-        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
-            /* should not happen */
-            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        if (hash > point[k].hash) {
+            i = k + 1;
+
+        } else {
+            j = k;
         }
+    }
 
-        h->vary_len = (u_char) c->vary.len;
-        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
+    disk = point[i % n].disk;
+    now = ngx_time();
 
-        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
-        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    for (k = 0; k < n; k++) {
+        j = point[(i + k) % n].disk;
+
+        if (cache->sh->disk_failed[j] <= now) {
+            disk = j;
+            break;
+        }
     }
 
-    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
-        return NGX_ERROR;
+    return disk;
+}
+
+
+static void
+ngx_http_file_cache_disk_error(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c)
+{
+    time_t                       now;
+    ngx_http_file_cache_disk_t  *disks;
+
+    if (cache->disks.nelts == 1 || c->path == NULL || c->path == cache->slow) {
+        return;
     }
 
-    p = buf + sizeof(ngx_http_file_cache_header_t);
+    disks = cache->disks.elts;
+    now = ngx_time();
 
-    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    key = c->keys.elts;
-    for (i = 0; i < c->keys.nelts; i++) {
-        p = ngx_copy(p, key[i].data, key[i].len);
+    if (cache->sh->disk_failed[c->disk] > now) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
     }
 
-    *p = LF;
+    cache->sh->disk_failed[c->disk] = now + cache->disk_fail_timeout;
 
-    return NGX_OK;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_error(NGX_LOG_ERR, c->file.log, 0,
+                  "cache disk \"%V\" is excluded for %Ts",
+                  &disks[c->disk].path->name, cache->disk_fail_timeout);
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
+ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
 {
-    ngx_http_file_cache_t  *cache;
+    u_char            *p;
+    ngx_http_cache_t  *c;
 
-    if (!c->secondary) {
-        return NGX_OK;
-    }
+    c = r->cache;
 
-    if (c->vary.len
-        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
-    {
+    if (c->file.name.len) {
         return NGX_OK;
     }
 
-    /*
-     * if the variant hash doesn't match one we used as a secondary
-     * cache key, switch back to the original key
-     */
+    c->path = path;
 
-    cache = c->file_cache;
+    c->file.name.len = path->name.len + 1 + path->len
+                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache main key");
+    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
+    if (c->file.name.data == NULL) {
+        return NGX_ERROR;
+    }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_memcpy(c->file.name.data, path->name.data, path->name.len);
+
+    p = c->file.name.data + path->name.len + 1 + path->len;
+    p = ngx_hex_dump(p, c->key, NGX_HTTP_CACHE_KEY_LEN);
+    *p = '\0';
+
+    ngx_create_hashed_filename(path, c->file.name.data, c->file.name.len);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "cache file: \"%s\"", c->file.name.data);
+
+    return NGX_OK;
+}
+
+
+static ngx_http_file_cache_node_t *
+ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        fcn = (ngx_http_file_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return fcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static void
+ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_http_file_cache_node_t   *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_http_file_cache_node_t *) node;
+            cnt = (ngx_http_file_cache_node_t *) temp;
+
+            p = (ngx_memcmp(cn->key, cnt->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static void
+ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
+    u_char *hash)
+{
+    u_char     *p, *last;
+    ngx_str_t   name;
+    ngx_md5_t   md5;
+    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache vary: \"%*s\"", len, vary);
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    ngx_strlow(buf, vary, len);
+
+    p = buf;
+    last = buf + len;
+
+    while (p < last) {
+
+        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+        name.data = p;
+
+        while (p < last && *p != ',' && *p != ' ') { p++; }
+
+        name.len = p - name.data;
+
+        if (name.len == 0) {
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache vary: %V", &name);
+
+        ngx_md5_update(&md5, name.data, name.len);
+        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+
+        ngx_http_file_cache_vary_header(r, &md5, &name);
+
+        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
+    }
+
+    ngx_md5_final(hash, &md5);
+}
+
+
+static void
+ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
+    ngx_str_t *name)
+{
+    size_t            len;
+    u_char           *p, *start, *last;
+    ngx_uint_t        i, multiple, normalize;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *header;
+
+    multiple = 0;
+    normalize = 0;
+
+    if (name->len == sizeof("Accept-Charset") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
+                           sizeof("Accept-Charset") - 1) == 0)
+    {
+        normalize = 1;
+
+    } else if (name->len == sizeof("Accept-Encoding") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
+                           sizeof("Accept-Encoding") - 1) == 0)
+    {
+        normalize = 1;
+
+    } else if (name->len == sizeof("Accept-Language") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
+                           sizeof("Accept-Language") - 1) == 0)
+    {
+        normalize = 1;
+    }
+
+    part = &r->headers_in.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].hash == 0) {
+            continue;
+        }
+
+        if (header[i].key.len != name->len) {
+            continue;
+        }
+
+        if (ngx_strncasecmp(header[i].key.data, name->data, name->len) != 0) {
+            continue;
+        }
+
+        if (!normalize) {
+
+            if (multiple) {
+                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+            }
+
+            ngx_md5_update(md5, header[i].value.data, header[i].value.len);
+
+            multiple = 1;
+
+            continue;
+        }
+
+        /* normalize spaces */
+
+        p = header[i].value.data;
+        last = p + header[i].value.len;
+
+        while (p < last) {
+
+            while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+            start = p;
+
+            while (p < last && *p != ',' && *p != ' ') { p++; }
+
+            len = p - start;
+
+            if (len == 0) {
+                break;
+            }
+
+            if (multiple) {
+                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+            }
+
+            ngx_md5_update(md5, start, len);
+
+            multiple = 1;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t  *cache;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache reopen");
+
+    if (c->secondary) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect vary hash",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    c->node->count--;
+    c->node = NULL;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    c->secondary = 1;
+    c->ram = 0;
+    c->file.name.len = 0;
+    c->body_start = c->buf->end - c->buf->start;
+
+    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+
+    return ngx_http_file_cache_open(r);
+}
+
+
+ngx_int_t
+ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
+{
+    ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
+
+    u_char            *p;
+    ngx_str_t         *key;
+    ngx_uint_t         i;
+    ngx_http_cache_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache set header");
+
+    c = r->cache;
+
+    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+
+    h->version = NGX_HTTP_CACHE_VERSION;
+    h->valid_sec = c->valid_sec;
+    h->updating_sec = c->updating_sec;
+    h->error_sec = c->error_sec;
+    h->last_modified = c->last_modified;
+    h->date = c->date;
+    h->crc32 = c->crc32;
+    h->valid_msec = (u_short) c->valid_msec;
+    h->header_start = (u_short) c->header_start;
+    h->body_start = (u_short) c->body_start;
+
+    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
+        h->etag_len = (u_char) c->etag.len;
+        ngx_memcpy(h->etag, c->etag.data, c->etag.len);
+    }
+
+    if (c->vary.len) {
+        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
+            /* should not happen */
+            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        }
+
+        h->vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    if (c->slice) {
+        h->slice_length = c->slice->length;
+        h->slice_size = c->slice->size;
+    }
+
+    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    p = buf + sizeof(ngx_http_file_cache_header_t);
+
+    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+
+    key = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        p = ngx_copy(p, key[i].data, key[i].len);
+    }
+
+    *p = LF;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t  *cache;
+
+    if (!c->secondary) {
+        return NGX_OK;
+    }
+
+    if (c->vary.len
+        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * if the variant hash doesn't match one we used as a secondary
+     * cache key, switch back to the original key
+     */
+
+    cache = c->file_cache;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache main key");
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
     c->node->count--;
     c->node->updating = 0;
     c->node = NULL;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    c->file.name.len = 0;
+
+    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_file_cache_name(r, ngx_http_file_cache_path(cache, c))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    off_t                   fs_size;
+    ngx_int_t               rc;
+    ngx_file_uniq_t         uniq;
+    ngx_file_info_t         fi;
+    ngx_http_cache_t        *c;
+    ngx_ext_rename_file_t   ext;
+    ngx_http_file_cache_t  *cache;
+
+    c = r->cache;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update");
+
+    if (c->slice && ngx_http_file_cache_slice_update(r, tf) != NGX_OK) {
+        ngx_http_file_cache_free(c, tf);
+        return;
+    }
+
+    cache = c->file_cache;
+
+    c->updated = 1;
+    c->updating = 0;
+
+    uniq = 0;
+    fs_size = 0;
+
+    if (c->slice && c->slice->in_place) {
+
+        /* the slices were written to the cache file itself */
+
+        rc = NGX_OK;
+
+    } else {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache rename: \"%s\" to \"%s\"",
+                       tf->file.name.data, c->file.name.data);
+
+        ext.access = NGX_FILE_OWNER_ACCESS;
+        ext.path_access = NGX_FILE_OWNER_ACCESS;
+        ext.time = -1;
+        ext.create_path = 1;
+        ext.delete_file = 1;
+        ext.log = r->connection->log;
+
+        rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+    }
+
+    if (rc != NGX_OK) {
+        ngx_http_file_cache_disk_error(cache, c);
+
+    } else {
+
+        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+
+            rc = NGX_ERROR;
+
+        } else {
+            uniq = ngx_file_uniq(&fi);
+            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+        }
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    c->node->count--;
+    c->node->error = 0;
+    c->node->uniq = uniq;
+    c->node->body_start = c->body_start;
+    c->node->valid_sec = c->valid_sec;
+
+    if (c->node->refresh == NGX_HTTP_CACHE_REFRESH_SCHEDULED) {
+        c->node->refresh = 0;
+    }
+
+    ngx_http_file_cache_refresh_done(cache, c);
+
+    ngx_http_file_cache_ram_free(cache, c->node);
+
+    if (c->node->slow) {
+        cache->sh->slow_size += fs_size - c->node->fs_size;
+
+    } else {
+        cache->sh->size += fs_size - c->node->fs_size;
+        cache->sh->disk_size[c->node->disk] -= c->node->fs_size;
+        cache->sh->disk_size[c->disk] += fs_size;
+        c->node->disk = c->disk;
+    }
+
+    c->node->fs_size = fs_size;
+
+    if (rc == NGX_OK) {
+        c->node->exists = 1;
+    }
+
+    c->node->updating = 0;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+ngx_int_t
+ngx_http_file_cache_slice_open(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    ngx_fd_t                  fd;
+    ngx_file_info_t           fi;
+    ngx_http_cache_t         *c;
+    ngx_pool_cleanup_t       *cln;
+    ngx_pool_cleanup_file_t  *clnf;
+
+    c = r->cache;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    fd = ngx_open_file(c->file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", c->file.name.data);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = fd;
+    clnf->name = c->file.name.data;
+    clnf->log = r->pool->log;
+
+    /* make sure the cache file wasn't replaced */
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", c->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (ngx_file_uniq(&fi) != c->uniq) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" changed", c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    tf->file.fd = fd;
+    tf->file.name = c->file.name;
+    tf->offset = c->body_start + c->slice->fetch_start;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_slice_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    off_t                    end;
+    size_t                   len;
+    u_char                  *bitmap;
+    ngx_uint_t               i, first, last, n;
+    ngx_file_info_t          fi;
+    ngx_http_cache_t        *c;
+    ngx_http_cache_slice_t  *slice;
+
+    c = r->cache;
+    slice = c->slice;
+
+    if (tf->file.fd == NGX_INVALID_FILE) {
+        return NGX_DECLINED;
+    }
+
+    /* only the slices received as a whole are marked */
+
+    end = tf->offset - c->body_start;
+
+    n = (ngx_uint_t) ((slice->length + slice->size - 1) / slice->size);
+
+    first = (ngx_uint_t) ((slice->fetch_start + slice->size - 1)
+                          / slice->size);
+    last = (end >= slice->length) ? n : (ngx_uint_t) (end / slice->size);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache slices received: %ui-%ui of %ui",
+                   first, last, n);
+
+    if (first >= last) {
+        return NGX_DECLINED;
+    }
+
+    len = (n + 7) / 8;
+
+    if (slice->in_place) {
+
+        /* the file might have been replaced while being written */
+
+        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+            return NGX_ERROR;
+        }
+
+        if (ngx_file_uniq(&fi) != c->uniq) {
+            return NGX_DECLINED;
+        }
+
+        bitmap = slice->bitmap;
+
+    } else {
+        bitmap = ngx_pcalloc(r->pool, len);
+        if (bitmap == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    for (i = first; i < last; i++) {
+        bitmap[i / 8] |= (u_char) (1 << (i % 8));
+    }
+
+    if (ngx_write_file(&tf->file, bitmap, len, c->body_start + slice->length)
+        == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_file_cache_update_header(ngx_http_request_t *r)
+{
+    ssize_t                        n;
+    ngx_err_t                      err;
+    ngx_file_t                     file;
+    ngx_file_info_t                fi;
+    ngx_http_cache_t              *c;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_header_t   h;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update header");
+
+    c = r->cache;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = c->file.name;
+    file.log = r->connection->log;
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        /* cache file may have been deleted */
+
+        if (err == NGX_ENOENT) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache \"%s\" not found",
+                           file.name.data);
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        return;
+    }
+
+    /*
+     * make sure cache file wasn't replaced;
+     * if it was, do nothing
+     */
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", file.name.data);
+        goto done;
+    }
+
+    if (c->uniq != ngx_file_uniq(&fi)
+        || c->length != ngx_file_size(&fi))
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" changed",
+                       file.name.data);
+        goto done;
+    }
+
+    n = ngx_read_file(&file, (u_char *) &h,
+                      sizeof(ngx_http_file_cache_header_t), 0);
+
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      ngx_read_file_n " read only %z of %z from \"%s\"",
+                      n, sizeof(ngx_http_file_cache_header_t), file.name.data);
+        goto done;
+    }
+
+    if (h.version != NGX_HTTP_CACHE_VERSION
+        || h.last_modified != c->last_modified
+        || h.crc32 != c->crc32
+        || (size_t) h.header_start != c->header_start
+        || (size_t) h.body_start != c->body_start)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" content changed",
+                       file.name.data);
+        goto done;
+    }
+
+    /*
+     * update cache file header with new data,
+     * notably h.valid_sec and h.date
+     */
+
+    ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
+
+    h.version = NGX_HTTP_CACHE_VERSION;
+    h.valid_sec = c->valid_sec;
+    h.updating_sec = c->updating_sec;
+    h.error_sec = c->error_sec;
+    h.last_modified = c->last_modified;
+    h.date = c->date;
+    h.crc32 = c->crc32;
+    h.valid_msec = (u_short) c->valid_msec;
+    h.header_start = (u_short) c->header_start;
+    h.body_start = (u_short) c->body_start;
+
+    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
+        h.etag_len = (u_char) c->etag.len;
+        ngx_memcpy(h.etag, c->etag.data, c->etag.len);
+    }
+
+    if (c->vary.len) {
+        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
+            /* should not happen */
+            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        }
+
+        h.vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h.vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    if (ngx_write_file(&file, (u_char *) &h,
+                       sizeof(ngx_http_file_cache_header_t), 0)
+        == NGX_ERROR)
+    {
+        goto done;
+    }
+
+    /* keep the ram copy in sync with the file */
+
+    cache = c->file_cache;
+
+    if (cache->ram_size && c->node) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        if (c->node->ram && c->node->uniq == c->uniq) {
+            ngx_memcpy(c->node->ram->data, &h,
+                       sizeof(ngx_http_file_cache_header_t));
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+    }
+
+done:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+}
+
+
+ngx_int_t
+ngx_http_cache_send(ngx_http_request_t *r)
+{
+    ngx_int_t          rc;
+    ngx_buf_t         *b;
+    ngx_chain_t        out;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache send: %s", c->file.name.data);
+
+    if (r != r->main && c->length - c->body_start == 0) {
+        return ngx_http_send_header(r);
+    }
+
+    /* we need to allocate all before the header would be sent */
+
+    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* small objects are already in memory as a whole */
+
+    if (c->buf->last - c->buf->pos == c->length) {
+        b->pos = c->buf->pos + c->body_start;
+        b->last = c->buf->last;
+
+        b->memory = (c->length - c->body_start) ? 1: 0;
+        b->last_buf = (r == r->main) ? 1: 0;
+        b->last_in_chain = 1;
+
+        goto send;
+    }
+
+    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (b->file == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->file_pos = c->body_start;
+    b->file_last = c->length;
+
+    b->in_file = (c->length - c->body_start) ? 1: 0;
+    b->last_buf = (r == r->main) ? 1: 0;
+    b->last_in_chain = 1;
+
+    b->file->fd = c->file.fd;
+    b->file->name = c->file.name;
+    b->file->log = r->connection->log;
+
+send:
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+void
+ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+{
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
+
+    if (c->updated || c->node == NULL) {
+        return;
+    }
+
+    cache = c->file_cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache free, fd: %d", c->file.fd);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+    fcn->count--;
+
+    ngx_http_file_cache_refresh_done(cache, c);
+
+    if (c->updating && fcn->lock_time == c->lock_time) {
+        fcn->updating = 0;
+    }
+
+    if (c->error) {
+        fcn->error = c->error;
+
+        if (c->valid_sec) {
+            fcn->valid_sec = c->valid_sec;
+            fcn->valid_msec = c->valid_msec;
+        }
+
+    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
+        ngx_queue_remove(&fcn->queue);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+
+        if (fcn->hot) {
+            cache->sh->hot_count--;
+        }
+
+        ngx_slab_free_locked(cache->shpool, fcn);
+        cache->sh->count--;
+        c->node = NULL;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    c->updated = 1;
+    c->updating = 0;
+
+    if (c->temp_file && (c->slice == NULL || !c->slice->in_place)) {
+        if (tf && tf->file.fd != NGX_INVALID_FILE) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                           "http file cache incomplete: \"%s\"",
+                           tf->file.name.data);
+
+            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed",
+                              tf->file.name.data);
+            }
+        }
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+}
+
+
+static void
+ngx_http_file_cache_refresh_done(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_node_t  *fcn;
+
+    /* called with the zone locked */
+
+    fcn = c->node;
+
+    if ((c->refresh && fcn->refresh == NGX_HTTP_CACHE_REFRESH_CLAIMED)
+        || (c->refreshing && fcn->refresh == NGX_HTTP_CACHE_REFRESH_RUNNING))
+    {
+        fcn->refresh = 0;
+        cache->sh->refreshing--;
+    }
+
+    c->refresh = 0;
+    c->refreshing = 0;
+}
+
+
+static void
+ngx_http_file_cache_cleanup(void *data)
+{
+    ngx_http_cache_t  *c = data;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache cleanup");
+
+    if (c->updating && !c->background) {
+        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
+                      "stalled cache updating, error:%ui", c->error);
+    }
+
+    ngx_http_file_cache_free(c, NULL);
+}
+
+
+static time_t
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache,
+    ngx_uint_t disk)
+{
+    u_char                      *name;
+    time_t                       wait;
+    ngx_uint_t                   i, tries;
+    ngx_queue_t                 *q, *queue[3];
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache forced expire");
+
+    name = ngx_http_file_cache_alloc_name(cache);
+    if (name == NULL) {
+        return 10;
+    }
+
+    wait = 10;
+    tries = 20;
+
+    /* the slow tier is evicted first, then the probationary segment */
+
+    queue[0] = &cache->sh->slow;
+    queue[1] = &cache->sh->queue;
+    queue[2] = &cache->sh->hot;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for (i = (disk == NGX_HTTP_CACHE_ALL_DISKS) ? 0 : 1; i < 3; i++) {
+
+        for (q = ngx_queue_last(queue[i]);
+             q != ngx_queue_sentinel(queue[i]);
+             q = ngx_queue_prev(q))
+        {
+            fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+            if (disk != NGX_HTTP_CACHE_ALL_DISKS && fcn->disk != disk) {
+                continue;
+            }
+
+            ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
+                  fcn->count, fcn->exists,
+                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+            if (fcn->count == 0) {
+                ngx_http_file_cache_delete(cache, q, name);
+                wait = 0;
+
+            } else {
+                if (--tries) {
+                    continue;
+                }
+
+                wait = 1;
+            }
+
+            goto done;
+        }
+    }
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static time_t
+ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+{
+    u_char                      *name, *p;
+    size_t                       len;
+    time_t                       now, wait;
+    ngx_msec_t                   elapsed;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire");
+
+    name = ngx_http_file_cache_alloc_name(cache);
+    if (name == NULL) {
+        return 10;
+    }
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for ( ;; ) {
+
+        if (ngx_quit || ngx_terminate) {
+            wait = 1;
+            break;
+        }
+
+        q = ngx_http_file_cache_last(cache);
+
+        if (q == NULL) {
+            wait = 10;
+            break;
+        }
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        wait = fcn->expire - now;
+
+        if (wait > 0) {
+            wait = wait > 10 ? 10 : wait;
+            break;
+        }
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
+                       fcn->count, fcn->exists,
+                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            ngx_http_file_cache_delete(cache, q, name);
+            goto next;
+        }
+
+        if (fcn->deleting) {
+            wait = 1;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_queue_remove(q);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_queue_insert_head(ngx_http_file_cache_queue(cache, fcn),
+                              &fcn->queue);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+next:
+
+        if (++cache->files >= cache->manager_files) {
+            wait = 0;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            wait = 0;
+            break;
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static void
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
+    u_char *name)
+{
+    ngx_err_t                    err;
+    ngx_int_t                    rc;
+    ngx_http_file_cache_disk_t  *disks;
+    ngx_http_file_cache_node_t  *fcn;
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    if (fcn->exists) {
+
+        if (fcn->slow) {
+            cache->sh->slow_size -= fcn->fs_size;
+            ngx_http_file_cache_node_name(cache->slow, fcn, name);
+
+        } else {
+            disks = cache->disks.elts;
+
+            cache->sh->size -= fcn->fs_size;
+            cache->sh->disk_size[fcn->disk] -= fcn->fs_size;
+            ngx_http_file_cache_node_name(disks[fcn->disk].path, fcn, name);
+        }
+
+        ngx_http_file_cache_ram_free(cache, fcn);
+
+        fcn->count++;
+        fcn->deleting = 1;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: \"%s\"", name);
+
+        rc = NGX_DECLINED;
+
+#if (NGX_THREADS)
+        if (cache->deleter) {
+            rc = ngx_http_file_cache_delete_defer(cache, fcn, name);
+        }
+#endif
+
+        if (rc != NGX_OK && ngx_delete_file(name) == NGX_FILE_ERROR) {
+            err = ngx_errno;
+
+            /* entries restored from an index may be gone already */
+
+            if (err != NGX_ENOENT || !cache->index.len) {
+                ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                              ngx_delete_file_n " \"%s\" failed", name);
+            }
+        }
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        fcn->count--;
+        fcn->deleting = 0;
+    }
+
+    if (fcn->count == 0) {
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+
+        if (fcn->hot) {
+            cache->sh->hot_count--;
+        }
+
+        ngx_slab_free_locked(cache->shpool, fcn);
+        cache->sh->count--;
+    }
+}
+
+
+static u_char *
+ngx_http_file_cache_alloc_name(ngx_http_file_cache_t *cache)
+{
+    size_t                       len;
+    ngx_uint_t                   i;
+    ngx_http_file_cache_disk_t  *disks;
+
+    /* all the paths have the same levels */
+
+    len = cache->slow ? cache->slow->name.len : 0;
+
+    disks = cache->disks.elts;
+
+    for (i = 0; i < cache->disks.nelts; i++) {
+        len = ngx_max(len, disks[i].path->name.len);
+    }
+
+    len += 1 + cache->path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    return ngx_alloc(len + 1, ngx_cycle->log);
+}
+
+
+static void
+ngx_http_file_cache_node_name(ngx_path_t *path,
+    ngx_http_file_cache_node_t *fcn, u_char *name)
+{
+    u_char  *p;
+
+    p = ngx_cpymem(name, path->name.data, path->name.len);
+    p += 1 + path->len;
+    p = ngx_hex_dump(p, (u_char *) &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    p = ngx_hex_dump(p, fcn->key,
+                     NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    *p = '\0';
+
+    ngx_create_hashed_filename(path, name, p - name);
+}
+
+
+/*
+ * with a slow path, entries evicted from the cache path are moved there
+ * instead of being deleted, and are moved back once hit promote_min_uses
+ * times; the slow path has its own size limit and is evicted first
+ */
+
+static time_t
+ngx_http_file_cache_tier_demote(ngx_http_file_cache_t *cache, ngx_uint_t disk)
+{
+    u_char                      *name;
+    time_t                       wait;
+    ngx_int_t                    rc;
+    ngx_uint_t                   i, tries;
+    ngx_queue_t                 *q, *queue[2];
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache demote");
+
+    name = ngx_http_file_cache_alloc_name(cache);
+    if (name == NULL) {
+        return 10;
+    }
+
+    wait = 10;
+    tries = 20;
+
+    queue[0] = &cache->sh->queue;
+    queue[1] = &cache->sh->hot;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for (i = 0; i < 2; i++) {
+
+        for (q = ngx_queue_last(queue[i]);
+             q != ngx_queue_sentinel(queue[i]);
+             q = ngx_queue_prev(q))
+        {
+            fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+            if (disk != NGX_HTTP_CACHE_ALL_DISKS && fcn->disk != disk) {
+                continue;
+            }
+
+            if (fcn->count == 0 && !fcn->updating) {
+
+                rc = fcn->exists ? ngx_http_file_cache_tier_move(cache, fcn)
+                                 : NGX_ERROR;
+
+                /* the entry is deleted if it cannot be moved */
+
+                if (rc == NGX_ERROR && fcn->count == 0) {
+                    ngx_http_file_cache_delete(cache, q, name);
+                }
+
+                wait = 0;
+
+            } else {
+                if (--tries) {
+                    continue;
+                }
+
+                wait = 1;
+            }
+
+            goto done;
+        }
+    }
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static void
+ngx_http_file_cache_tier_promote(ngx_http_file_cache_t *cache)
+{
+    ngx_uint_t                   n;
+    ngx_msec_t                   elapsed;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for ( ;; ) {
+
+        /* entries hit recently are at the head of the queue */
+
+        fcn = NULL;
+        n = 0;
+
+        for (q = ngx_queue_head(&cache->sh->slow);
+             q != ngx_queue_sentinel(&cache->sh->slow)
+             && n++ < cache->manager_files;
+             q = ngx_queue_next(q))
+        {
+            fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+            if (fcn->uses >= cache->promote_min_uses
+                && fcn->count == 0 && fcn->exists && !fcn->updating)
+            {
+                break;
+            }
+
+            fcn = NULL;
+        }
+
+        if (fcn == NULL) {
+            break;
+        }
+
+        if (ngx_http_file_cache_tier_move(cache, fcn) != NGX_OK) {
+            fcn->uses = 0;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            break;
+        }
+
+        if (++cache->files >= cache->manager_files) {
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            break;
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+/*
+ * the file is copied under a temporary name with the zone unlocked;
+ * the entry is switched to the other tier only if it has not been used
+ * meanwhile, since requests started before may still open the old file
+ */
+
+static ngx_int_t
+ngx_http_file_cache_tier_move(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    u_char                      *src, *dst, *temp, *name;
+    off_t                        fs_size;
+    size_t                       len;
+    ngx_err_t                    err;
+    ngx_int_t                    rc;
+    ngx_uint_t                   disk;
+    ngx_path_t                  *from, *to;
+    ngx_file_uniq_t              uniq;
+    ngx_file_info_t              fi;
+    ngx_copy_file_t              cf;
+    ngx_http_file_cache_disk_t  *disks;
+    u_char                       key[NGX_HTTP_CACHE_KEY_LEN];
+
+    disks = cache->disks.elts;
+
+    if (fcn->slow) {
+        ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+        ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        disk = ngx_http_file_cache_disk(cache, key);
+
+        from = cache->slow;
+        to = disks[disk].path;
+
+    } else {
+        disk = fcn->disk;
+
+        from = disks[disk].path;
+        to = cache->slow;
+    }
+
+    len = ngx_max(from->name.len, to->name.len) + 1 + from->len
+          + 2 * NGX_HTTP_CACHE_KEY_LEN + sizeof(".0000000000");
+
+    src = ngx_alloc(3 * len, ngx_cycle->log);
+    if (src == NULL) {
+        return NGX_ERROR;
+    }
+
+    dst = src + len;
+    temp = dst + len;
+
+    ngx_http_file_cache_node_name(from, fcn, src);
+    ngx_http_file_cache_node_name(to, fcn, dst);
+
+    (void) ngx_sprintf(temp, "%s.%010uD%Z", dst,
+                       (uint32_t) ngx_next_temp_number(0));
+
+    uniq = fcn->uniq;
+    fcn->count++;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache move: \"%s\" to \"%s\"", src, dst);
+
+    rc = NGX_ERROR;
+    fs_size = 0;
+
+    err = ngx_create_full_path(temp, ngx_dir_access(NGX_FILE_OWNER_ACCESS));
+
+    if (err) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                      ngx_create_dir_n " \"%s\" failed", temp);
+        goto failed;
+    }
+
+    cf.size = -1;
+    cf.buf_size = 0;
+    cf.access = NGX_FILE_OWNER_ACCESS;
+    cf.time = -1;
+    cf.log = ngx_cycle->log;
+
+    if (ngx_copy_file(src, temp, &cf) != NGX_OK) {
+        goto failed;
+    }
+
+    if (ngx_file_info(temp, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_file_info_n " \"%s\" failed", temp);
+        goto failed;
+    }
+
+    if (ngx_rename_file(temp, dst) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      temp, dst);
+        goto failed;
+    }
+
+    fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+    rc = NGX_OK;
+
+failed:
+
+    if (rc == NGX_ERROR) {
+        (void) ngx_delete_file(temp);
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn->count--;
+
+    if (rc == NGX_OK
+        && (fcn->count || fcn->updating || !fcn->exists || fcn->uniq != uniq))
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache move declined, count:%d", fcn->count);
+
+        rc = NGX_DECLINED;
+    }
+
+    if (rc == NGX_OK) {
+
+        if (fcn->slow) {
+            cache->sh->slow_size -= fcn->fs_size;
+            cache->sh->size += fs_size;
+            cache->sh->disk_size[disk] += fs_size;
+            cache->sh->promoted++;
+
+            fcn->disk = disk;
+
+        } else {
+            cache->sh->size -= fcn->fs_size;
+            cache->sh->disk_size[disk] -= fcn->fs_size;
+            cache->sh->slow_size += fs_size;
+            cache->sh->demoted++;
+        }
+
+        ngx_queue_remove(&fcn->queue);
+
+        if (fcn->hot) {
+            fcn->hot = 0;
+            cache->sh->hot_count--;
+        }
+
+        fcn->slow = !fcn->slow;
+        fcn->uses = 0;
+        fcn->uniq = ngx_file_uniq(&fi);
+        fcn->fs_size = fs_size;
+
+        ngx_queue_insert_head(ngx_http_file_cache_queue(cache, fcn),
+                              &fcn->queue);
+    }
+
+    /* the file which is not used by the entry anymore */
+
+    name = (rc == NGX_OK) ? src : (rc == NGX_DECLINED) ? dst : NULL;
+
+    if (name) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+            err = ngx_errno;
+
+            if (err != NGX_ENOENT) {
+                ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                              ngx_delete_file_n " \"%s\" failed", name);
+            }
+        }
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+    }
+
+    ngx_free(src);
+
+    return rc;
+}
+
+
+static ngx_msec_t
+ngx_http_file_cache_manager(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    off_t                        size, slow_size;
+    time_t                       wait;
+    ngx_msec_t                   elapsed, next;
+    ngx_uint_t                   i, count, watermark, disk;
+    ngx_http_file_cache_disk_t  *disks;
+
+#if (NGX_THREADS)
+    if (cache->delete_thread && cache->deleter == NULL
+        && ngx_http_file_cache_delete_init(cache) != NGX_OK)
+    {
+        cache->delete_thread = 0;
+    }
+#endif
+
+    if (cache->index.len
+        && ngx_time() - cache->index_time >= cache->index_interval)
+    {
+        cache->index_time = ngx_time();
+        (void) ngx_http_file_cache_index_write(cache, 0);
+    }
+
+    if (cache->refresh_ahead) {
+        ngx_http_file_cache_refresh(cache);
+    }
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+
+    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+
+    if (next == 0) {
+        next = cache->manager_sleep;
+        goto done;
+    }
+
+    if (cache->slow) {
+        ngx_http_file_cache_tier_promote(cache);
+    }
+
+    disks = cache->disks.elts;
+
+    for ( ;; ) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        size = cache->sh->size;
+        slow_size = cache->sh->slow_size;
+        count = cache->sh->count;
+        watermark = cache->sh->watermark;
+
+        disk = NGX_HTTP_CACHE_ALL_DISKS;
+
+        for (i = 0; i < cache->disks.nelts; i++) {
+            if (cache->sh->disk_size[i] >= disks[i].max_size) {
+                disk = i;
+                break;
+            }
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug5(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache size: %O s:%O c:%ui w:%i d:%i",
+                       size, slow_size, count, (ngx_int_t) watermark,
+                       (ngx_int_t) disk);
+
+        if (size < cache->max_size
+            && slow_size < cache->slow_max_size
+            && count < watermark
+            && disk == NGX_HTTP_CACHE_ALL_DISKS)
+        {
+            break;
+        }
+
+        /* a disk over its own limit is cleaned only */
+
+        if (size >= cache->max_size
+            || slow_size >= cache->slow_max_size
+            || count >= watermark)
+        {
+            disk = NGX_HTTP_CACHE_ALL_DISKS;
+        }
+
+        if (cache->slow
+            && (size >= cache->max_size || disk != NGX_HTTP_CACHE_ALL_DISKS))
+        {
+            wait = ngx_http_file_cache_tier_demote(cache, disk);
+
+        } else {
+            wait = ngx_http_file_cache_forced_expire(cache, disk);
+        }
+
+        if (wait > 0) {
+            next = (ngx_msec_t) wait * 1000;
+            break;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            break;
+        }
 
-    c->file.name.len = 0;
+        if (++cache->files >= cache->manager_files) {
+            next = cache->manager_sleep;
+            break;
+        }
 
-    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
+        ngx_time_update();
 
-    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
-        return NGX_ERROR;
-    }
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
-        return NGX_ERROR;
+        if (elapsed >= cache->manager_threshold) {
+            next = cache->manager_sleep;
+            break;
+        }
     }
 
-    return NGX_OK;
-}
+done:
 
+#if (NGX_THREADS)
+    if (cache->deleter && cache->deleter->pending) {
+        cache->deleter->pending = 0;
 
-void
-ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
-{
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
-    ngx_http_file_cache_t  *cache;
+        if (ngx_thread_mutex_lock(&cache->deleter->mutex, ngx_cycle->log)
+            == NGX_OK)
+        {
+            cache->deleter->signaled = 1;
 
-    c = r->cache;
+            (void) ngx_thread_cond_signal(&cache->deleter->cond,
+                                          ngx_cycle->log);
+            (void) ngx_thread_mutex_unlock(&cache->deleter->mutex,
+                                           ngx_cycle->log);
+        }
+    }
+#endif
 
-    if (c->updated) {
-        return;
+    if (cache->refresh_ahead && next > 1000) {
+        next = 1000;
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update");
+    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
 
-    cache = c->file_cache;
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache manager: %ui e:%M n:%M",
+                   cache->files, elapsed, next);
 
-    c->updated = 1;
-    c->updating = 0;
+    return next;
+}
 
-    uniq = 0;
-    fs_size = 0;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache rename: \"%s\" to \"%s\"",
-                   tf->file.name.data, c->file.name.data);
+/*
+ * entries hit within refresh_ahead and expiring within it are scheduled
+ * for a refresh; the next hit starts a background conditional request
+ * if the zone's concurrency and rate limits allow
+ */
 
-    ext.access = NGX_FILE_OWNER_ACCESS;
-    ext.path_access = NGX_FILE_OWNER_ACCESS;
-    ext.time = -1;
-    ext.create_path = 1;
-    ext.delete_file = 1;
-    ext.log = r->connection->log;
+static void
+ngx_http_file_cache_refresh(ngx_http_file_cache_t *cache)
+{
+    time_t                       now, recent;
+    ngx_uint_t                   i, n;
+    ngx_queue_t                 *queues[3], *q;
+    ngx_http_file_cache_node_t  *fcn;
 
-    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+    now = ngx_time();
+    recent = now - cache->refresh_ahead + cache->inactive;
 
-    if (rc == NGX_OK) {
+    queues[0] = &cache->sh->hot;
+    queues[1] = &cache->sh->queue;
+    queues[2] = &cache->sh->slow;
 
-        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+    n = 0;
 
-            rc = NGX_ERROR;
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-        } else {
-            uniq = ngx_file_uniq(&fi);
-            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
-        }
-    }
+    for (i = 0; i < 3; i++) {
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        /* the queues are ordered by the last access */
 
-    c->node->count--;
-    c->node->error = 0;
-    c->node->uniq = uniq;
-    c->node->body_start = c->body_start;
+        for (q = ngx_queue_head(queues[i]);
+             q != ngx_queue_sentinel(queues[i]) && n < cache->manager_files;
+             q = ngx_queue_next(q))
+        {
+            fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
-    cache->sh->size += fs_size - c->node->fs_size;
-    c->node->fs_size = fs_size;
+            if (fcn->expire < recent) {
+                break;
+            }
 
-    if (rc == NGX_OK) {
-        c->node->exists = 1;
-    }
+            if (!fcn->exists
+                || fcn->error
+                || fcn->updating
+                || fcn->deleting
+                || fcn->refresh
+                || fcn->valid_sec <= now
+                || fcn->valid_sec > now + cache->refresh_ahead)
+            {
+                continue;
+            }
 
-    c->node->updating = 0;
+            fcn->refresh = NGX_HTTP_CACHE_REFRESH_SCHEDULED;
+            n++;
+        }
+    }
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache refresh scheduled: %ui", n);
 }
 
 
-void
-ngx_http_file_cache_update_header(ngx_http_request_t *r)
+static void
+ngx_http_file_cache_loader(void *data)
 {
-    ssize_t                        n;
-    ngx_err_t                      err;
-    ngx_file_t                     file;
-    ngx_file_info_t                fi;
-    ngx_http_cache_t              *c;
-    ngx_http_file_cache_header_t   h;
+    ngx_http_file_cache_t  *cache = data;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update header");
+    ngx_uint_t                   i;
+    ngx_tree_ctx_t               tree;
+    ngx_http_file_cache_disk_t  *disks;
 
-    c = r->cache;
+    if (!cache->sh->cold || cache->sh->loading) {
+        return;
+    }
 
-    ngx_memzero(&file, sizeof(ngx_file_t));
+    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
+        return;
+    }
 
-    file.name = c->file.name;
-    file.log = r->connection->log;
-    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache loader");
 
-    if (file.fd == NGX_INVALID_FILE) {
-        err = ngx_errno;
+    tree.init_handler = NULL;
+    tree.file_handler = ngx_http_file_cache_manage_file;
+    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
+    tree.post_tree_handler = ngx_http_file_cache_noop;
+    tree.spec_handler = ngx_http_file_cache_delete_file;
+    tree.data = cache;
+    tree.alloc = 0;
+    tree.log = ngx_cycle->log;
 
-        /* cache file may have been deleted */
+    cache->last = ngx_current_msec;
+    cache->files = 0;
 
-        if (err == NGX_ENOENT) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "http file cache \"%s\" not found",
-                           file.name.data);
+    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
+        cache->sh->loading = 0;
+        return;
+    }
+
+    disks = cache->disks.elts;
+
+    for (i = 1; i < cache->disks.nelts; i++) {
+        if (ngx_walk_tree(&tree, &disks[i].path->name) == NGX_ABORT) {
+            cache->sh->loading = 0;
             return;
         }
+    }
 
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
-                      ngx_open_file_n " \"%s\" failed", file.name.data);
+    if (cache->slow
+        && ngx_walk_tree(&tree, &cache->slow->name) == NGX_ABORT)
+    {
+        cache->sh->loading = 0;
         return;
     }
 
-    /*
-     * make sure cache file wasn't replaced;
-     * if it was, do nothing
-     */
+    cache->sh->cold = 0;
+    cache->sh->loading = 0;
 
-    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                      ngx_fd_info_n " \"%s\" failed", file.name.data);
-        goto done;
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %.3fM, bsize: %uz",
+                  &cache->path->name,
+                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
+                  cache->bsize);
+
+    if (cache->slow) {
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "http file cache: %V %.3fM, slow",
+                      &cache->slow->name,
+                      ((double) cache->sh->slow_size * cache->bsize)
+                      / (1024 * 1024));
     }
+}
 
-    if (c->uniq != ngx_file_uniq(&fi)
-        || c->length != ngx_file_size(&fi))
+
+static ngx_int_t
+ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_msec_t              elapsed;
+    ngx_http_file_cache_t  *cache;
+
+    cache = ctx->data;
+
+    if (cache->index.len
+        && ngx_strncmp(path->data, cache->index.data, cache->index.len) == 0)
     {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache \"%s\" changed",
-                       file.name.data);
-        goto done;
+        return NGX_OK;
     }
 
-    n = ngx_read_file(&file, (u_char *) &h,
-                      sizeof(ngx_http_file_cache_header_t), 0);
+    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
+        (void) ngx_http_file_cache_delete_file(ctx, path);
+    }
 
-    if (n == NGX_ERROR) {
-        goto done;
+    if (++cache->files >= cache->loader_files) {
+        ngx_http_file_cache_loader_sleep(cache);
+
+    } else {
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache loader time elapsed: %M", elapsed);
+
+        if (elapsed >= cache->loader_threshold) {
+            ngx_http_file_cache_loader_sleep(cache);
+        }
     }
 
-    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      ngx_read_file_n " read only %z of %z from \"%s\"",
-                      n, sizeof(ngx_http_file_cache_header_t), file.name.data);
-        goto done;
+    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    if (path->len >= 5
+        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
+    {
+        return NGX_DECLINED;
     }
 
-    if (h.version != NGX_HTTP_CACHE_VERSION
-        || h.last_modified != c->last_modified
-        || h.crc32 != c->crc32
-        || (size_t) h.header_start != c->header_start
-        || (size_t) h.body_start != c->body_start)
+    if (path->len >= 6
+        && ngx_strncmp(path->data + path->len - 6, "/trash", 6) == 0)
     {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache \"%s\" content changed",
-                       file.name.data);
-        goto done;
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+{
+    ngx_msleep(cache->loader_sleep);
+
+    ngx_time_update();
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+{
+    u_char                      *p;
+    ngx_int_t                    n;
+    ngx_uint_t                   i;
+    ngx_http_cache_t             c;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_disk_t  *disks;
+
+    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
+        return NGX_ERROR;
     }
 
     /*
-     * update cache file header with new data,
-     * notably h.valid_sec and h.date
+     * Temporary files in cache have a suffix consisting of a dot
+     * followed by 10 digits.
      */
 
-    ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
-
-    h.version = NGX_HTTP_CACHE_VERSION;
-    h.valid_sec = c->valid_sec;
-    h.updating_sec = c->updating_sec;
-    h.error_sec = c->error_sec;
-    h.last_modified = c->last_modified;
-    h.date = c->date;
-    h.crc32 = c->crc32;
-    h.valid_msec = (u_short) c->valid_msec;
-    h.header_start = (u_short) c->header_start;
-    h.body_start = (u_short) c->body_start;
+    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
+        && name->data[name->len - 10 - 1] == '.')
+    {
+        return NGX_OK;
+    }
 
-    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
-        h.etag_len = (u_char) c->etag.len;
-        ngx_memcpy(h.etag, c->etag.data, c->etag.len);
+    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
+                      "cache file \"%s\" is too small", name->data);
+        return NGX_ERROR;
     }
 
-    if (c->vary.len) {
-        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
-            /* should not happen */
-            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
-        }
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+    cache = ctx->data;
 
-        h.vary_len = (u_char) c->vary.len;
-        ngx_memcpy(h.vary, c->vary.data, c->vary.len);
+    c.length = ctx->size;
+    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
 
-        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
-        ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    if (cache->slow && ngx_http_file_cache_in_path(name, &cache->slow->name)) {
+        c.slow = 1;
+
+    } else {
+        disks = cache->disks.elts;
+
+        for (i = 1; i < cache->disks.nelts; i++) {
+            if (ngx_http_file_cache_in_path(name, &disks[i].path->name)) {
+                c.disk = i;
+                break;
+            }
+        }
     }
 
-    (void) ngx_write_file(&file, (u_char *) &h,
-                          sizeof(ngx_http_file_cache_header_t), 0);
+    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
 
-done:
+    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
+        n = ngx_hextoi(p, 2);
 
-    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-                      ngx_close_file_n " \"%s\" failed", file.name.data);
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        p += 2;
+
+        c.key[i] = (u_char) n;
     }
+
+    return ngx_http_file_cache_add(cache, &c);
 }
 
 
-ngx_int_t
-ngx_http_cache_send(ngx_http_request_t *r)
+static ngx_int_t
+ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    ngx_int_t          rc;
-    ngx_buf_t         *b;
-    ngx_chain_t        out;
-    ngx_http_cache_t  *c;
+    u_char                      *name;
+    ngx_http_file_cache_disk_t  *disks;
+    ngx_http_file_cache_node_t  *fcn;
 
-    c = r->cache;
+    name = NULL;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache send: %s", c->file.name.data);
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    if (r != r->main && c->length - c->body_start == 0) {
-        return ngx_http_send_header(r);
-    }
+    fcn = ngx_http_file_cache_lookup(cache, c->key);
 
-    /* we need to allocate all before the header would be sent */
+    if (fcn == NULL) {
 
-    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-    if (b == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_http_file_cache_set_watermark(cache);
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+            if (cache->fail_time != ngx_time()) {
+                cache->fail_time = ngx_time();
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                           "could not allocate node%s", cache->shpool->log_ctx);
+            }
 
-    rc = ngx_http_send_header(r);
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_ERROR;
+        }
 
-    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-        return rc;
-    }
+        cache->sh->count++;
 
-    b->file_pos = c->body_start;
-    b->file_last = c->length;
+        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
-    b->in_file = (c->length - c->body_start) ? 1: 0;
-    b->last_buf = (r == r->main) ? 1: 0;
-    b->last_in_chain = 1;
+        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    b->file->fd = c->file.fd;
-    b->file->name = c->file.name;
-    b->file->log = r->connection->log;
+        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
 
-    out.buf = b;
-    out.next = NULL;
+        fcn->uses = 1;
+        fcn->exists = 1;
+        fcn->fs_size = c->fs_size;
+        fcn->slow = c->slow;
+        fcn->disk = c->disk;
 
-    return ngx_http_output_filter(r, &out);
-}
+        if (fcn->slow) {
+            cache->sh->slow_size += c->fs_size;
 
+        } else {
+            cache->sh->size += c->fs_size;
+            cache->sh->disk_size[fcn->disk] += c->fs_size;
+        }
 
-void
-ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
-{
-    ngx_http_file_cache_t       *cache;
-    ngx_http_file_cache_node_t  *fcn;
+    } else if (fcn->slow != c->slow || fcn->disk != c->disk) {
 
-    if (c->updated || c->node == NULL) {
-        return;
-    }
+        /*
+         * a copy left by an interrupted move between the tiers or
+         * by a failed disk is deleted, unless the entry is being moved;
+         * of two copies on the disks the one on the hashed disk is kept
+         */
 
-    cache = c->file_cache;
+        if (fcn->count || fcn->slow || c->slow
+            || ngx_http_file_cache_disk(cache, c->key) != c->disk)
+        {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return fcn->count ? NGX_OK : NGX_ERROR;
+        }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache free, fd: %d", c->file.fd);
+        name = ngx_http_file_cache_alloc_name(cache);
+        if (name == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_ERROR;
+        }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        disks = cache->disks.elts;
 
-    fcn = c->node;
-    fcn->count--;
+        ngx_http_file_cache_node_name(disks[fcn->disk].path, fcn, name);
 
-    if (c->updating && fcn->lock_time == c->lock_time) {
-        fcn->updating = 0;
-    }
+        cache->sh->size += c->fs_size - fcn->fs_size;
+        cache->sh->disk_size[fcn->disk] -= fcn->fs_size;
+        cache->sh->disk_size[c->disk] += c->fs_size;
 
-    if (c->error) {
-        fcn->error = c->error;
+        ngx_http_file_cache_ram_free(cache, fcn);
 
-        if (c->valid_sec) {
-            fcn->valid_sec = c->valid_sec;
-            fcn->valid_msec = c->valid_msec;
-        }
+        fcn->disk = c->disk;
+        fcn->fs_size = c->fs_size;
+        fcn->uniq = 0;
+        fcn->body_start = 0;
 
-    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
         ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
-        c->node = NULL;
+
+    } else {
+        ngx_queue_remove(&fcn->queue);
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    fcn->expire = ngx_time() + cache->inactive;
 
-    c->updated = 1;
-    c->updating = 0;
+    ngx_queue_insert_head(ngx_http_file_cache_queue(cache, fcn), &fcn->queue);
 
-    if (c->temp_file) {
-        if (tf && tf->file.fd != NGX_INVALID_FILE) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                           "http file cache incomplete: \"%s\"",
-                           tf->file.name.data);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
-                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
-                              ngx_delete_file_n " \"%s\" failed",
-                              tf->file.name.data);
-            }
+    if (name) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache duplicate: \"%s\"", name);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
         }
-    }
 
-    if (c->wait_event.timer_set) {
-        ngx_del_timer(&c->wait_event);
+        ngx_free(name);
     }
+
+    return NGX_OK;
 }
 
 
-static void
-ngx_http_file_cache_cleanup(void *data)
+static ngx_int_t
+ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 {
-    ngx_http_cache_t  *c = data;
-
-    if (c->updated) {
-        return;
-    }
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache cleanup");
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "http file cache delete: \"%s\"", path->data);
 
-    if (c->updating && !c->background) {
-        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
-                      "stalled cache updating, error:%ui", c->error);
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
     }
 
-    ngx_http_file_cache_free(c, NULL);
+    return NGX_OK;
 }
 
 
-static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
-{
-    u_char                      *name;
-    size_t                       len;
-    time_t                       wait;
-    ngx_uint_t                   tries;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache forced expire");
-
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+#if (NGX_THREADS)
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
+static ngx_int_t
+ngx_http_file_cache_delete_init(ngx_http_file_cache_t *cache)
+{
+    int                             err;
+    size_t                          len;
+    pthread_t                       tid;
+    ngx_str_t                      *name;
+    ngx_uint_t                      i;
+    pthread_attr_t                  attr;
+    ngx_http_file_cache_disk_t     *disks;
+    ngx_http_file_cache_deleter_t  *d;
+
+    d = ngx_calloc(sizeof(ngx_http_file_cache_deleter_t), ngx_cycle->log);
+    if (d == NULL) {
+        return NGX_ERROR;
     }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+    d->cache = cache;
+    d->signaled = 1;
 
-    wait = 10;
-    tries = 20;
+    d->ntrash = cache->disks.nelts + (cache->slow ? 1 : 0);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    d->trash = ngx_calloc(d->ntrash * sizeof(ngx_str_t), ngx_cycle->log);
+    if (d->trash == NULL) {
+        goto failed;
+    }
 
-    for (q = ngx_queue_last(&cache->sh->queue);
-         q != ngx_queue_sentinel(&cache->sh->queue);
-         q = ngx_queue_prev(q))
-    {
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    disks = cache->disks.elts;
+    len = 0;
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
-                  fcn->count, fcn->exists,
-                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+    for (i = 0; i < d->ntrash; i++) {
+        name = (i < cache->disks.nelts) ? &disks[i].path->name
+                                        : &cache->slow->name;
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
+        d->trash[i].len = name->len + sizeof("/trash") - 1;
+        d->trash[i].data = ngx_alloc(d->trash[i].len + 1, ngx_cycle->log);
+        if (d->trash[i].data == NULL) {
+            goto failed;
+        }
 
-        } else {
-            if (--tries) {
-                continue;
-            }
+        (void) ngx_sprintf(d->trash[i].data, "%V/trash%Z", name);
 
-            wait = 1;
+        if (ngx_create_dir(d->trash[i].data, 0700) == NGX_FILE_ERROR
+            && ngx_errno != NGX_EEXIST)
+        {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_create_dir_n " \"%s\" failed",
+                          d->trash[i].data);
+            goto failed;
         }
 
-        break;
+        len = ngx_max(len, d->trash[i].len);
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    len += 1 + NGX_MAX_PATH + 1;
 
-    ngx_free(name);
+    d->name = ngx_alloc(len, ngx_cycle->log);
+    if (d->name == NULL) {
+        goto failed;
+    }
 
-    return wait;
-}
+    d->path = ngx_alloc(len, ngx_cycle->log);
+    if (d->path == NULL) {
+        goto failed;
+    }
 
+    if (ngx_thread_mutex_create(&d->mutex, ngx_cycle->log) != NGX_OK) {
+        goto failed;
+    }
 
-static time_t
-ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
-{
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
-    ngx_path_t                  *path;
-    ngx_msec_t                   elapsed;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    if (ngx_thread_cond_create(&d->cond, ngx_cycle->log) != NGX_OK) {
+        goto failed_mutex;
+    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache expire");
+    err = pthread_attr_init(&attr);
+    if (err) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, err,
+                      "pthread_attr_init() failed");
+        goto failed_cond;
+    }
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (err) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, err,
+                      "pthread_attr_setdetachstate() failed");
+        goto failed_attr;
+    }
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
+    err = pthread_create(&tid, &attr, ngx_http_file_cache_delete_thread, d);
+    if (err) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, err,
+                      "pthread_create() failed");
+        goto failed_attr;
     }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+    (void) pthread_attr_destroy(&attr);
 
-    now = ngx_time();
+    cache->deleter = d;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    return NGX_OK;
 
-    for ( ;; ) {
+failed_attr:
 
-        if (ngx_quit || ngx_terminate) {
-            wait = 1;
-            break;
-        }
+    (void) pthread_attr_destroy(&attr);
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            wait = 10;
-            break;
-        }
+failed_cond:
 
-        q = ngx_queue_last(&cache->sh->queue);
+    (void) ngx_thread_cond_destroy(&d->cond, ngx_cycle->log);
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+failed_mutex:
 
-        wait = fcn->expire - now;
+    (void) ngx_thread_mutex_destroy(&d->mutex, ngx_cycle->log);
 
-        if (wait > 0) {
-            wait = wait > 10 ? 10 : wait;
-            break;
+failed:
+
+    if (d->trash) {
+        for (i = 0; i < d->ntrash; i++) {
+            ngx_free(d->trash[i].data);
         }
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
-                       fcn->count, fcn->exists,
-                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+        ngx_free(d->trash);
+    }
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            goto next;
-        }
+    ngx_free(d->name);
+    ngx_free(d->path);
+    ngx_free(d);
 
-        if (fcn->deleting) {
-            wait = 1;
-            break;
-        }
+    return NGX_ERROR;
+}
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+static ngx_int_t
+ngx_http_file_cache_delete_defer(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, u_char *name)
+{
+    size_t                          len;
+    ngx_str_t                      *trash;
+    ngx_http_file_cache_deleter_t  *d;
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    d = cache->deleter;
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    trash = &d->trash[fcn->slow ? cache->disks.nelts : fcn->disk];
 
-next:
+    /* the file keeps its name, so leftovers are removed after a restart */
 
-        if (++cache->files >= cache->manager_files) {
-            wait = 0;
-            break;
-        }
+    len = ngx_strlen(name);
 
-        ngx_time_update();
+    (void) ngx_sprintf(d->name, "%V/%s%Z", trash,
+                       name + len - 2 * NGX_HTTP_CACHE_KEY_LEN);
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    (void) ngx_atomic_fetch_add(&cache->sh->delete_backlog, 1);
 
-        if (elapsed >= cache->manager_threshold) {
-            wait = 0;
-            break;
-        }
+    if (ngx_rename_file(name, d->name) == NGX_FILE_ERROR) {
+        (void) ngx_atomic_fetch_add(&cache->sh->delete_backlog, -1);
+        return NGX_DECLINED;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
-
-    ngx_free(name);
+    d->pending = 1;
 
-    return wait;
+    return NGX_OK;
 }
 
 
-static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+static void *
+ngx_http_file_cache_delete_thread(void *data)
 {
-    u_char                      *p;
-    size_t                       len;
-    ngx_path_t                  *path;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_http_file_cache_deleter_t  *d = data;
+
+    int                        err;
+    sigset_t                   set;
+    ngx_uint_t                 i, n;
+    ngx_msec_t                 start;
+    struct timeval             tv;
+    ngx_atomic_uint_t          backlog;
+    ngx_http_file_cache_sh_t  *sh;
+
+    sigfillset(&set);
+
+    sigdelset(&set, SIGILL);
+    sigdelset(&set, SIGFPE);
+    sigdelset(&set, SIGSEGV);
+    sigdelset(&set, SIGBUS);
+
+    err = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (err) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, err,
+                      "pthread_sigmask() failed");
+        return NULL;
+    }
 
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    sh = d->cache->sh;
 
-    if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
+    for ( ;; ) {
+        if (ngx_thread_mutex_lock(&d->mutex, ngx_cycle->log) != NGX_OK) {
+            return NULL;
+        }
 
-        path = cache->path;
-        p = name + path->name.len + 1 + path->len;
-        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        p = ngx_hex_dump(p, fcn->key, len);
-        *p = '\0';
+        while (!d->signaled) {
+            if (ngx_thread_cond_wait(&d->cond, &d->mutex, ngx_cycle->log)
+                != NGX_OK)
+            {
+                (void) ngx_thread_mutex_unlock(&d->mutex, ngx_cycle->log);
+                return NULL;
+            }
+        }
 
-        fcn->count++;
-        fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        d->signaled = 0;
 
-        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-        ngx_create_hashed_filename(path, name, len);
+        if (ngx_thread_mutex_unlock(&d->mutex, ngx_cycle->log) != NGX_OK) {
+            return NULL;
+        }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: \"%s\"", name);
+        ngx_gettimeofday(&tv);
+        start = (ngx_msec_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
 
-        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          ngx_delete_file_n " \"%s\" failed", name);
-        }
+        n = 0;
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
-        fcn->count--;
-        fcn->deleting = 0;
-    }
+        for (i = 0; i < d->ntrash; i++) {
+            n += ngx_http_file_cache_delete_batch(d, &d->trash[i]);
+        }
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
-    }
-}
+        ngx_gettimeofday(&tv);
+        sh->delete_time = (ngx_msec_t) tv.tv_sec * 1000 + tv.tv_usec / 1000
+                          - start;
 
+        (void) ngx_atomic_fetch_add(&sh->deleted, n);
 
-static ngx_msec_t
-ngx_http_file_cache_manager(void *data)
-{
-    ngx_http_file_cache_t  *cache = data;
+        /* leftovers of a previous manager are not in the backlog */
 
-    off_t       size;
-    time_t      wait;
-    ngx_msec_t  elapsed, next;
-    ngx_uint_t  count, watermark;
+        do {
+            backlog = sh->delete_backlog;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+        } while (!ngx_atomic_cmp_set(&sh->delete_backlog, backlog,
+                                     backlog > n ? backlog - n : 0));
+    }
+}
 
-    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
 
-    if (next == 0) {
-        next = cache->manager_sleep;
-        goto done;
+static ngx_uint_t
+ngx_http_file_cache_delete_batch(ngx_http_file_cache_deleter_t *d,
+    ngx_str_t *trash)
+{
+    size_t      len;
+    ngx_dir_t   dir;
+    ngx_err_t   err;
+    ngx_uint_t  n;
+
+    if (ngx_open_dir(trash, &dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_dir_n " \"%s\" failed", trash->data);
+        return 0;
     }
 
-    for ( ;; ) {
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    n = 0;
 
-        size = cache->sh->size;
-        count = cache->sh->count;
-        watermark = cache->sh->watermark;
+    for ( ;; ) {
+        ngx_set_errno(0);
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        if (ngx_read_dir(&dir) == NGX_ERROR) {
+            err = ngx_errno;
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache size: %O c:%ui w:%i",
-                       size, count, (ngx_int_t) watermark);
+            if (err != NGX_ENOMOREFILES) {
+                ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                              ngx_read_dir_n " \"%s\" failed", trash->data);
+            }
 
-        if (size < cache->max_size && count < watermark) {
             break;
         }
 
-        wait = ngx_http_file_cache_forced_expire(cache);
+        len = ngx_de_namelen(&dir);
 
-        if (wait > 0) {
-            next = (ngx_msec_t) wait * 1000;
-            break;
+        if (ngx_de_name(&dir)[0] == '.' || len > NGX_MAX_PATH) {
+            continue;
         }
 
-        if (ngx_quit || ngx_terminate) {
-            break;
-        }
+        (void) ngx_sprintf(d->path, "%V/%*s%Z", trash, len, ngx_de_name(&dir));
 
-        if (++cache->files >= cache->manager_files) {
-            next = cache->manager_sleep;
-            break;
+        if (ngx_delete_file(d->path) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", d->path);
+            continue;
         }
 
-        ngx_time_update();
-
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+        n++;
+    }
 
-        if (elapsed >= cache->manager_threshold) {
-            next = cache->manager_sleep;
-            break;
-        }
+    if (ngx_close_dir(&dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_dir_n " \"%s\" failed", trash->data);
     }
 
-done:
+    return n;
+}
 
-    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+#endif
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache manager: %ui e:%M n:%M",
-                   cache->files, elapsed, next);
 
-    return next;
+static void
+ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
+{
+    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache watermark: %ui", cache->sh->watermark);
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_in_path(ngx_str_t *name, ngx_str_t *path)
+{
+    return name->len > path->len
+           && ngx_strncmp(name->data, path->data, path->len) == 0
+           && name->data[path->len] == '/';
 }
 
 
 static void
-ngx_http_file_cache_loader(void *data)
+ngx_http_file_cache_flush(void *data)
 {
     ngx_http_file_cache_t  *cache = data;
 
-    ngx_tree_ctx_t  tree;
+    /*
+     * called by the master process after all other processes have exited,
+     * so the snapshot is complete unless the cache was not fully loaded
+     */
+
+    if (cache->index.len && cache->sh) {
+        (void) ngx_http_file_cache_index_write(cache, !cache->sh->cold);
+    }
+}
 
-    if (!cache->sh->cold || cache->sh->loading) {
-        return;
+
+static ngx_int_t
+ngx_http_file_cache_index_write(ngx_http_file_cache_t *cache,
+    ngx_uint_t complete)
+{
+    u_char                             *name;
+    ngx_int_t                           rc;
+    ngx_uint_t                          i, n, count;
+    ngx_rbtree_node_t                  *node;
+    ngx_file_mapping_t                  fm;
+    ngx_http_file_cache_node_t         *fcn;
+    ngx_http_file_cache_index_t        *index;
+    ngx_http_file_cache_index_entry_t  *entry, *e, *last;
+    u_char                              key[NGX_HTTP_CACHE_KEY_LEN];
+
+    name = ngx_alloc(cache->index.len + sizeof(".tmp"), ngx_cycle->log);
+    if (name == NULL) {
+        return NGX_ERROR;
     }
 
-    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
-        return;
+    (void) ngx_sprintf(name, "%V.tmp%Z", &cache->index);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    count = cache->sh->count + 1024;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    fm.name = name;
+    fm.size = sizeof(ngx_http_file_cache_index_t)
+              + count * sizeof(ngx_http_file_cache_index_entry_t);
+    fm.log = ngx_cycle->log;
+
+    if (ngx_create_file_mapping(&fm) != NGX_OK) {
+        ngx_free(name);
+        return NGX_ERROR;
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache loader");
+    index = fm.addr;
+    entry = (ngx_http_file_cache_index_entry_t *) &index[1];
 
-    tree.init_handler = NULL;
-    tree.file_handler = ngx_http_file_cache_manage_file;
-    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
-    tree.post_tree_handler = ngx_http_file_cache_noop;
-    tree.spec_handler = ngx_http_file_cache_delete_file;
-    tree.data = cache;
-    tree.alloc = 0;
-    tree.log = ngx_cycle->log;
+    e = entry;
+    last = entry + count;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    /*
+     * the tree is copied in chunks so that the zone is not locked for long;
+     * each chunk starts after the key the previous one has stopped at
+     */
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
-        cache->sh->loading = 0;
-        return;
+    for (n = 0; /* void */ ; n++) {
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        node = ngx_http_file_cache_index_next(cache, n ? key : NULL);
+
+        for (i = 0; node && i < NGX_HTTP_CACHE_INDEX_CHUNK && e < last; i++) {
+            fcn = (ngx_http_file_cache_node_t *) node;
+
+            ngx_memcpy(key, &node->key, sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+            if (fcn->exists && !fcn->deleting) {
+                ngx_memcpy(e->key, key, NGX_HTTP_CACHE_KEY_LEN);
+                e->uniq = fcn->uniq;
+                e->expire = fcn->expire;
+                e->fs_size = fcn->fs_size;
+                e->body_start = (uint32_t) fcn->body_start;
+                e->uses = (uint16_t) fcn->uses;
+                e->flags = (fcn->hot ? NGX_HTTP_CACHE_INDEX_HOT : 0)
+                           | (fcn->slow ? NGX_HTTP_CACHE_INDEX_SLOW : 0)
+                           | (fcn->disk << NGX_HTTP_CACHE_INDEX_DISK);
+                e++;
+            }
+
+            node = ngx_rbtree_next(&cache->sh->rbtree, node);
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        if (node == NULL || e == last) {
+            break;
+        }
     }
 
-    cache->sh->cold = 0;
-    cache->sh->loading = 0;
+    if (node) {
+        complete = 0;
+    }
 
-    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
-                  "http file cache: %V %.3fM, bsize: %uz",
-                  &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
-                  cache->bsize);
-}
+    ngx_qsort(entry, e - entry, sizeof(ngx_http_file_cache_index_entry_t),
+              ngx_http_file_cache_index_cmp);
+
+    ngx_memcpy(index->magic, ngx_http_file_cache_index_magic,
+               sizeof(ngx_http_file_cache_index_magic));
+    index->version = NGX_HTTP_CACHE_INDEX_VERSION;
+    index->entry_size = sizeof(ngx_http_file_cache_index_entry_t);
+    index->complete = complete;
+    index->bsize = (uint32_t) cache->bsize;
+    index->ndisks = (uint32_t) cache->disks.nelts;
+    index->disks = ngx_http_file_cache_index_disks(cache);
+    index->time = ngx_time();
+    index->count = e - entry;
 
+    ngx_close_file_mapping(&fm);
+
+    rc = NGX_OK;
+
+    if (ngx_rename_file(name, cache->index.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%V\" failed",
+                      name, &cache->index);
+
+        (void) ngx_delete_file(name);
+        rc = NGX_ERROR;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache index \"%V\": %uz entries, complete:%ui",
+                   &cache->index, (size_t) (e - entry), complete);
+
+    ngx_free(name);
 
-static ngx_int_t
-ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    return NGX_OK;
+    return rc;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static ngx_rbtree_node_t *
+ngx_http_file_cache_index_next(ngx_http_file_cache_t *cache, u_char *key)
 {
-    ngx_msec_t              elapsed;
-    ngx_http_file_cache_t  *cache;
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel, *next;
+    ngx_http_file_cache_node_t  *fcn;
 
-    cache = ctx->data;
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
 
-    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
-        (void) ngx_http_file_cache_delete_file(ctx, path);
+    if (node == sentinel) {
+        return NULL;
     }
 
-    if (++cache->files >= cache->loader_files) {
-        ngx_http_file_cache_loader_sleep(cache);
+    if (key == NULL) {
+        return ngx_rbtree_min(node, sentinel);
+    }
 
-    } else {
-        ngx_time_update();
+    /* the first node with a key greater than the given one */
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache loader time elapsed: %M", elapsed);
+    next = NULL;
 
-        if (elapsed >= cache->loader_threshold) {
-            ngx_http_file_cache_loader_sleep(cache);
+    while (node != sentinel) {
+
+        if (node->key != node_key) {
+            rc = (node->key > node_key) ? 1 : -1;
+
+        } else {
+            fcn = (ngx_http_file_cache_node_t *) node;
+
+            rc = ngx_memcmp(fcn->key, &key[sizeof(ngx_rbtree_key_t)],
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        }
+
+        if (rc > 0) {
+            next = node;
+            node = node->left;
+
+        } else {
+            node = node->right;
         }
     }
 
-    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+    return next;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static int ngx_libc_cdecl
+ngx_http_file_cache_index_cmp(const void *one, const void *two)
 {
-    if (path->len >= 5
-        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
-    {
-        return NGX_DECLINED;
+    const ngx_http_file_cache_index_entry_t  *first = one;
+    const ngx_http_file_cache_index_entry_t  *second = two;
+
+    if (first->expire == second->expire) {
+        return 0;
     }
 
-    return NGX_OK;
+    return (first->expire < second->expire) ? -1 : 1;
 }
 
 
-static void
-ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+static uint32_t
+ngx_http_file_cache_index_disks(ngx_http_file_cache_t *cache)
 {
-    ngx_msleep(cache->loader_sleep);
+    uint32_t                     crc;
+    ngx_uint_t                   n;
+    ngx_http_file_cache_disk_t  *disk;
 
-    ngx_time_update();
+    disk = cache->disks.elts;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    ngx_crc32_init(crc);
+
+    for (n = 0; n < cache->disks.nelts; n++) {
+        ngx_crc32_update(&crc, disk[n].path->name.data,
+                         disk[n].path->name.len + 1);
+    }
+
+    ngx_crc32_final(crc);
+
+    return crc;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+static void
+ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache, ngx_log_t *log)
 {
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
+    time_t                              shift;
+    ssize_t                             n;
+    uint32_t                            complete;
+    ngx_uint_t                          i, disk;
+    ngx_file_t                          file;
+    ngx_file_info_t                     fi;
+    ngx_file_mapping_t                  fm;
+    ngx_http_file_cache_node_t         *fcn;
+    ngx_http_file_cache_index_t        *index;
+    ngx_http_file_cache_index_entry_t  *e;
+
+    if (ngx_file_info(cache->index.data, &fi) == NGX_FILE_ERROR) {
+        return;
+    }
 
-    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
-        return NGX_ERROR;
+    fm.name = cache->index.data;
+    fm.log = log;
+
+    if (ngx_open_file_mapping(&fm) != NGX_OK) {
+        return;
     }
 
-    /*
-     * Temporary files in cache have a suffix consisting of a dot
-     * followed by 10 digits.
-     */
+    index = fm.addr;
 
-    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
-        && name->data[name->len - 10 - 1] == '.')
+    if (fm.size < sizeof(ngx_http_file_cache_index_t)
+        || ngx_memcmp(index->magic, ngx_http_file_cache_index_magic,
+                      sizeof(ngx_http_file_cache_index_magic)) != 0
+        || index->version != NGX_HTTP_CACHE_INDEX_VERSION
+        || index->entry_size != sizeof(ngx_http_file_cache_index_entry_t)
+        || index->bsize != cache->bsize
+        || (fm.size - sizeof(ngx_http_file_cache_index_t))
+           / sizeof(ngx_http_file_cache_index_entry_t) < index->count)
     {
-        return NGX_OK;
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "cache index \"%V\" is invalid, ignored", &cache->index);
+        goto done;
     }
 
-    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
-                      "cache file \"%s\" is too small", name->data);
-        return NGX_ERROR;
+    if (index->ndisks != cache->disks.nelts
+        || index->disks != ngx_http_file_cache_index_disks(cache))
+    {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "cache index \"%V\" was made with different disks, "
+                      "ignored", &cache->index);
+        goto done;
     }
 
-    ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+    /* inactivity is counted as if the cache had not been stopped */
 
-    c.length = ctx->size;
-    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+    shift = ngx_time() - index->time;
 
-    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+    if (shift < 0) {
+        shift = 0;
+    }
 
-    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
-        n = ngx_hextoi(p, 2);
+    e = (ngx_http_file_cache_index_entry_t *) &index[1];
+    n = 0;
 
-        if (n == NGX_ERROR) {
-            return NGX_ERROR;
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for (i = 0; i < index->count; i++, e++) {
+
+        if (ngx_http_file_cache_lookup(cache, e->key)) {
+            continue;
         }
 
-        p += 2;
+        if ((e->flags & NGX_HTTP_CACHE_INDEX_SLOW) && cache->slow == NULL) {
+            continue;
+        }
 
-        c.key[i] = (u_char) n;
-    }
+        disk = e->flags >> NGX_HTTP_CACHE_INDEX_DISK;
 
-    return ngx_http_file_cache_add(cache, &c);
-}
+        if (disk >= cache->disks.nelts) {
+            continue;
+        }
 
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            break;
+        }
 
-static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
-{
-    ngx_http_file_cache_node_t  *fcn;
+        ngx_memcpy((u_char *) &fcn->node.key, e->key,
+                   sizeof(ngx_rbtree_key_t));
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_memcpy(fcn->key, &e->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
 
-    if (fcn == NULL) {
+        fcn->uses = e->uses;
+        fcn->exists = 1;
+        fcn->uniq = e->uniq;
+        fcn->body_start = e->body_start;
+        fcn->fs_size = e->fs_size;
+        fcn->expire = e->expire + shift;
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_http_file_cache_set_watermark(cache);
+        fcn->disk = disk;
 
-            if (cache->fail_time != ngx_time()) {
-                cache->fail_time = ngx_time();
-                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                           "could not allocate node%s", cache->shpool->log_ctx);
-            }
+        if (e->flags & NGX_HTTP_CACHE_INDEX_SLOW) {
+            fcn->slow = 1;
 
-            ngx_shmtx_unlock(&cache->shpool->mutex);
-            return NGX_ERROR;
+        } else if ((e->flags & NGX_HTTP_CACHE_INDEX_HOT)
+                   && cache->policy != NGX_HTTP_CACHE_LRU)
+        {
+            fcn->hot = 1;
+            cache->sh->hot_count++;
         }
 
+        ngx_queue_insert_head(ngx_http_file_cache_queue(cache, fcn),
+                              &fcn->queue);
+
         cache->sh->count++;
 
-        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+        if (fcn->slow) {
+            cache->sh->slow_size += fcn->fs_size;
 
-        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        } else {
+            cache->sh->size += fcn->fs_size;
+            cache->sh->disk_size[disk] += fcn->fs_size;
+        }
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+        n++;
+    }
 
-        fcn->uses = 1;
-        fcn->exists = 1;
-        fcn->fs_size = c->fs_size;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        cache->sh->size += c->fs_size;
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "http file cache: %V %z of %uL entries loaded from index%s",
+                  &cache->path->name, n, index->count,
+                  index->complete ? "" : ", incomplete");
 
-    } else {
-        ngx_queue_remove(&fcn->queue);
+    if (!index->complete || i != index->count) {
+        goto done;
     }
 
-    fcn->expire = ngx_time() + cache->inactive;
+    /*
+     * the snapshot was made after all processes had exited, so there
+     * is nothing on disk it misses and the tree walk is not needed;
+     * the file is marked as incomplete until the next snapshot
+     * in case of a crash
+     */
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    cache->sh->cold = 0;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_memzero(&file, sizeof(ngx_file_t));
 
-    return NGX_OK;
-}
+    file.name = cache->index;
+    file.log = log;
 
+    file.fd = ngx_open_file(cache->index.data, NGX_FILE_WRONLY,
+                            NGX_FILE_OPEN, 0);
 
-static ngx_int_t
-ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "http file cache delete: \"%s\"", path->data);
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_open_file_n " \"%V\" failed", &cache->index);
+        goto failed;
+    }
 
-    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
-                      ngx_delete_file_n " \"%s\" failed", path->data);
+    complete = 0;
+
+    n = ngx_write_file(&file, (u_char *) &complete, sizeof(uint32_t),
+                       offsetof(ngx_http_file_cache_index_t, complete));
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &cache->index);
     }
 
-    return NGX_OK;
-}
+    if (n == sizeof(uint32_t)) {
+        goto done;
+    }
 
+failed:
 
-static void
-ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
-{
-    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+    /* a complete index must not be used twice */
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache watermark: %ui", cache->sh->watermark);
+    if (ngx_delete_file(cache->index.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_delete_file_n " \"%V\" failed", &cache->index);
+    }
+
+done:
+
+    ngx_close_file_mapping(&fm);
 }
 
 
@@ -2272,17 +4937,20 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     char  *confp = conf;
 
-    off_t                   max_size;
-    u_char                 *last, *p;
-    time_t                  inactive;
-    ssize_t                 size;
-    ngx_str_t               s, name, *value;
-    ngx_int_t               loader_files, manager_files;
-    ngx_msec_t              loader_sleep, manager_sleep, loader_threshold,
-                            manager_threshold;
-    ngx_uint_t              i, n, use_temp_path;
-    ngx_array_t            *caches;
-    ngx_http_file_cache_t  *cache, **ce;
+    off_t                        max_size, slow_max_size, disk_max_size;
+    u_char                      *last, *p;
+    time_t                       inactive;
+    ssize_t                      size, ram_size, ram_max_object;
+    ngx_str_t                    s, name, *value;
+    ngx_int_t                    loader_files, manager_files, ram_min_uses,
+                                 promote_min_uses, refresh_concurrency,
+                                 refresh_rate;
+    ngx_msec_t                   loader_sleep, manager_sleep, loader_threshold,
+                                 manager_threshold;
+    ngx_uint_t                   i, n, use_temp_path, policy, index;
+    ngx_array_t                 *caches;
+    ngx_http_file_cache_t       *cache, **ce;
+    ngx_http_file_cache_disk_t  *disk;
 
     cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_file_cache_t));
     if (cache == NULL) {
@@ -2294,7 +4962,26 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (ngx_array_init(&cache->disks, cf->pool, 1,
+                       sizeof(ngx_http_file_cache_disk_t))
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    disk = ngx_array_push(&cache->disks);
+    if (disk == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(disk, sizeof(ngx_http_file_cache_disk_t));
+
+    disk->path = cache->path;
+    disk->max_size = -1;
+
     use_temp_path = 1;
+    policy = NGX_HTTP_CACHE_LRU;
+    index = 0;
 
     inactive = 600;
 
@@ -2306,6 +4993,19 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     manager_sleep = 50;
     manager_threshold = 200;
 
+    ram_size = 0;
+    ram_max_object = 16384;
+    ram_min_uses = 2;
+
+    slow_max_size = NGX_MAX_OFF_T_VALUE;
+    promote_min_uses = 2;
+
+    disk_max_size = NGX_MAX_OFF_T_VALUE;
+    cache->disk_fail_timeout = 60;
+
+    refresh_concurrency = 16;
+    refresh_rate = 10;
+
     name.len = 0;
     size = 0;
     max_size = NGX_MAX_OFF_T_VALUE;
@@ -2366,13 +5066,98 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             if (ngx_strcmp(&value[i].data[14], "on") == 0) {
                 use_temp_path = 1;
 
-            } else if (ngx_strcmp(&value[i].data[14], "off") == 0) {
-                use_temp_path = 0;
+            } else if (ngx_strcmp(&value[i].data[14], "off") == 0) {
+                use_temp_path = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid use_temp_path value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "delete_thread=", 14) == 0) {
+
+            if (ngx_strcmp(&value[i].data[14], "on") == 0) {
+#if (NGX_THREADS)
+                cache->delete_thread = 1;
+#else
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"delete_thread\" is unsupported "
+                                   "on this platform");
+                return NGX_CONF_ERROR;
+#endif
+
+            } else if (ngx_strcmp(&value[i].data[14], "off") == 0) {
+                cache->delete_thread = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid delete_thread value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index=", 6) == 0) {
+
+            if (ngx_strcmp(&value[i].data[6], "on") == 0) {
+                index = 1;
+
+            } else if (ngx_strcmp(&value[i].data[6], "off") == 0) {
+                index = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid index value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index_interval=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            cache->index_interval = ngx_parse_time(&s, 1);
+            if (cache->index_interval == (time_t) NGX_ERROR
+                || cache->index_interval == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid index_interval value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "policy=", 7) == 0) {
+
+            if (ngx_strcmp(&value[i].data[7], "lru") == 0) {
+                policy = NGX_HTTP_CACHE_LRU;
+
+            } else if (ngx_strcmp(&value[i].data[7], "slru") == 0) {
+                policy = NGX_HTTP_CACHE_SLRU;
+
+            } else if (ngx_strcmp(&value[i].data[7], "tinylfu") == 0) {
+                policy = NGX_HTTP_CACHE_TINYLFU;
 
             } else {
                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                   "invalid use_temp_path value \"%V\", "
-                                   "it must be \"on\" or \"off\"",
+                                   "invalid policy value \"%V\", "
+                                   "it must be \"lru\", \"slru\" "
+                                   "or \"tinylfu\"",
                                    &value[i]);
                 return NGX_CONF_ERROR;
             }
@@ -2435,6 +5220,198 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "slow_path=", 10) == 0) {
+
+            cache->slow = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+            if (cache->slow == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            cache->slow->name.len = value[i].len - 10;
+            cache->slow->name.data = value[i].data + 10;
+
+            if (cache->slow->name.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid slow_path value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (cache->slow->name.data[cache->slow->name.len - 1] == '/') {
+                cache->slow->name.len--;
+            }
+
+            if (ngx_conf_full_name(cf->cycle, &cache->slow->name, 0)
+                != NGX_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "disk=", 5) == 0) {
+
+            if (cache->disks.nelts == NGX_HTTP_CACHE_MAX_DISKS) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "too many disks, maximum is %d",
+                                   NGX_HTTP_CACHE_MAX_DISKS);
+                return NGX_CONF_ERROR;
+            }
+
+            disk = ngx_array_push(&cache->disks);
+            if (disk == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_memzero(disk, sizeof(ngx_http_file_cache_disk_t));
+
+            disk->max_size = -1;
+
+            disk->path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+            if (disk->path == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            /* disk=path[:max_size[:thread_pool]] */
+
+            p = value[i].data + 5;
+            last = value[i].data + value[i].len;
+
+            s.data = p;
+            p = ngx_strlchr(p, last, ':');
+            s.len = (p ? p : last) - s.data;
+
+            if (s.len == 0) {
+                goto invalid_disk;
+            }
+
+            if (s.data[s.len - 1] == '/') {
+                s.len--;
+            }
+
+            disk->path->name.len = s.len;
+            disk->path->name.data = ngx_pstrdup(cf->pool, &s);
+            if (disk->path->name.data == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_conf_full_name(cf->cycle, &disk->path->name, 0)
+                != NGX_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+
+            if (p == NULL) {
+                continue;
+            }
+
+            s.data = ++p;
+            p = ngx_strlchr(p, last, ':');
+            s.len = (p ? p : last) - s.data;
+
+            if (s.len) {
+                disk->max_size = ngx_parse_offset(&s);
+                if (disk->max_size <= 0) {
+                    goto invalid_disk;
+                }
+            }
+
+            if (p == NULL) {
+                continue;
+            }
+
+            s.data = p + 1;
+            s.len = last - s.data;
+
+            if (s.len == 0) {
+                goto invalid_disk;
+            }
+
+#if (NGX_THREADS)
+
+            disk->thread_pool = ngx_thread_pool_add(cf, &s);
+            if (disk->thread_pool == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+
+#else
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "thread pools are not supported "
+                               "on this platform");
+            return NGX_CONF_ERROR;
+
+#endif
+
+        invalid_disk:
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid disk \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_strncmp(value[i].data, "disk_max_size=", 14) == 0) {
+
+            s.len = value[i].len - 14;
+            s.data = value[i].data + 14;
+
+            disk_max_size = ngx_parse_offset(&s);
+            if (disk_max_size <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid disk_max_size value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "disk_fail_timeout=", 18) == 0) {
+
+            s.len = value[i].len - 18;
+            s.data = value[i].data + 18;
+
+            cache->disk_fail_timeout = ngx_parse_time(&s, 1);
+            if (cache->disk_fail_timeout == (time_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid disk_fail_timeout value \"%V\"",
+                           &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "slow_max_size=", 14) == 0) {
+
+            s.len = value[i].len - 14;
+            s.data = value[i].data + 14;
+
+            slow_max_size = ngx_parse_offset(&s);
+            if (slow_max_size <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid slow_max_size value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "promote_min_uses=", 17) == 0) {
+
+            promote_min_uses = ngx_atoi(value[i].data + 17,
+                                        value[i].len - 17);
+            if (promote_min_uses == NGX_ERROR || promote_min_uses == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid promote_min_uses value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "loader_files=", 13) == 0) {
 
             loader_files = ngx_atoi(value[i].data + 13, value[i].len - 13);
@@ -2519,6 +5496,91 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "ram=", 4) == 0) {
+
+            s.len = value[i].len - 4;
+            s.data = value[i].data + 4;
+
+            ram_size = ngx_parse_size(&s);
+            if (ram_size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ram value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ram_max_object=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            ram_max_object = ngx_parse_size(&s);
+            if (ram_max_object == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid ram_max_object value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ram_min_uses=", 13) == 0) {
+
+            ram_min_uses = ngx_atoi(value[i].data + 13, value[i].len - 13);
+            if (ram_min_uses == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid ram_min_uses value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "refresh_ahead=", 14) == 0) {
+
+            s.len = value[i].len - 14;
+            s.data = value[i].data + 14;
+
+            cache->refresh_ahead = ngx_parse_time(&s, 1);
+            if (cache->refresh_ahead == (time_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid refresh_ahead value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "refresh_concurrency=", 20) == 0) {
+
+            refresh_concurrency = ngx_atoi(value[i].data + 20,
+                                           value[i].len - 20);
+            if (refresh_concurrency == NGX_ERROR
+                || refresh_concurrency == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid refresh_concurrency value \"%V\"",
+                           &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "refresh_rate=", 13) == 0) {
+
+            refresh_rate = ngx_atoi(value[i].data + 13, value[i].len - 13);
+            if (refresh_rate == NGX_ERROR || refresh_rate == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid refresh_rate value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -2533,6 +5595,7 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     cache->path->manager = ngx_http_file_cache_manager;
     cache->path->loader = ngx_http_file_cache_loader;
+    cache->path->flush = ngx_http_file_cache_flush;
     cache->path->data = cache;
     cache->path->conf_file = cf->conf_file->file.name.data;
     cache->path->line = cf->conf_file->line;
@@ -2547,7 +5610,30 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
-    cache->shm_zone = ngx_shared_memory_add(cf, &name, size, cmd->post);
+    if (ngx_http_file_cache_init_disks(cf, cache, disk_max_size)
+        != NGX_CONF_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cache->slow) {
+        ngx_memcpy(cache->slow->level, cache->path->level,
+                   sizeof(cache->path->level));
+
+        cache->slow->len = cache->path->len;
+        cache->slow->data = cache;
+        cache->slow->conf_file = cf->conf_file->file.name.data;
+        cache->slow->line = cf->conf_file->line;
+
+        if (ngx_add_path(cf, &cache->slow) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    /* the ram tier is allocated in the keys zone */
+
+    cache->shm_zone = ngx_shared_memory_add(cf, &name, size + ram_size,
+                                            cmd->post);
     if (cache->shm_zone == NULL) {
         return NGX_CONF_ERROR;
     }
@@ -2563,9 +5649,34 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->shm_zone->data = cache;
 
     cache->use_temp_path = use_temp_path;
+    cache->policy = policy;
+
+    if (index) {
+        cache->index.len = cache->path->name.len + sizeof("/index") - 1;
+        cache->index.data = ngx_pnalloc(cf->pool, cache->index.len + 1);
+        if (cache->index.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        (void) ngx_sprintf(cache->index.data, "%V/index%Z",
+                           &cache->path->name);
+
+        if (cache->index_interval == 0) {
+            cache->index_interval = 600;
+        }
+    }
 
     cache->inactive = inactive;
     cache->max_size = max_size;
+    cache->slow_max_size = slow_max_size;
+    cache->promote_min_uses = promote_min_uses;
+
+    cache->ram_size = ram_size;
+    cache->ram_max_object = ram_max_object;
+    cache->ram_min_uses = ram_min_uses;
+
+    cache->refresh_concurrency = refresh_concurrency;
+    cache->refresh_rate = refresh_rate;
 
     caches = (ngx_array_t *) (confp + cmd->offset);
 
@@ -2580,6 +5691,141 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+static char *
+ngx_http_file_cache_init_disks(ngx_conf_t *cf, ngx_http_file_cache_t *cache,
+    off_t disk_max_size)
+{
+    size_t                        len;
+    uint32_t                      hash, base_hash;
+    ngx_str_t                    *name, *prev;
+    ngx_uint_t                    i, j, n;
+    ngx_http_file_cache_disk_t   *disk;
+    ngx_http_file_cache_point_t  *point;
+    union {
+        uint32_t                  value;
+        u_char                    byte[4];
+    } prev_hash;
+
+    disk = cache->disks.elts;
+    n = cache->disks.nelts;
+
+    /* the loader walks all the trees, so they must not overlap */
+
+    for (i = 0; i <= n; i++) {
+
+        if (i == n && cache->slow == NULL) {
+            break;
+        }
+
+        name = (i == n) ? &cache->slow->name : &disk[i].path->name;
+
+        for (j = 0; j < i; j++) {
+            prev = &disk[j].path->name;
+            len = ngx_min(name->len, prev->len);
+
+            if (ngx_strncmp(name->data, prev->data, len) == 0
+                && (name->len == prev->len
+                    || (name->len > len ? name->data[len]
+                                        : prev->data[len]) == '/'))
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "cache path \"%V\" overlaps \"%V\"",
+                                   name, prev);
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+
+        if (disk[i].max_size == -1) {
+            disk[i].max_size = disk_max_size;
+        }
+
+        if (i == 0) {
+            continue;
+        }
+
+        ngx_memcpy(disk[i].path->level, cache->path->level,
+                   sizeof(cache->path->level));
+
+        disk[i].path->len = cache->path->len;
+        disk[i].path->data = cache;
+        disk[i].path->conf_file = cf->conf_file->file.name.data;
+        disk[i].path->line = cf->conf_file->line;
+
+        if (ngx_add_path(cf, &disk[i].path) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (n == 1) {
+        return NGX_CONF_OK;
+    }
+
+    /* a continuum as in the upstream hash module, 160 points per disk */
+
+    cache->points = ngx_palloc(cf->pool,
+                               n * 160 * sizeof(ngx_http_file_cache_point_t));
+    if (cache->points == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    point = cache->points;
+
+    for (i = 0; i < n; i++) {
+        name = &disk[i].path->name;
+
+        ngx_crc32_init(base_hash);
+        ngx_crc32_update(&base_hash, name->data, name->len);
+
+        prev_hash.value = 0;
+
+        for (j = 0; j < 160; j++) {
+            hash = base_hash;
+
+            ngx_crc32_update(&hash, prev_hash.byte, 4);
+            ngx_crc32_final(hash);
+
+            point->hash = hash;
+            point->disk = i;
+            point++;
+
+#if (NGX_HAVE_LITTLE_ENDIAN)
+            prev_hash.value = hash;
+#else
+            prev_hash.byte[0] = (u_char) (hash & 0xff);
+            prev_hash.byte[1] = (u_char) ((hash >> 8) & 0xff);
+            prev_hash.byte[2] = (u_char) ((hash >> 16) & 0xff);
+            prev_hash.byte[3] = (u_char) ((hash >> 24) & 0xff);
+#endif
+        }
+    }
+
+    cache->npoints = n * 160;
+
+    ngx_qsort(cache->points, cache->npoints,
+              sizeof(ngx_http_file_cache_point_t),
+              ngx_http_file_cache_cmp_points);
+
+    return NGX_CONF_OK;
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_file_cache_cmp_points(const void *one, const void *two)
+{
+    const ngx_http_file_cache_point_t  *first = one;
+    const ngx_http_file_cache_point_t  *second = two;
+
+    if (first->hash == second->hash) {
+        return 0;
+    }
+
+    return (first->hash < second->hash) ? -1 : 1;
+}
+
+
 char *
 ngx_http_file_cache_valid_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf)
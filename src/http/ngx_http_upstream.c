@@ -21,15 +21,33 @@ static ngx_int_t ngx_http_upstream_cache_background_update(
     ngx_http_request_t *r, ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_cache_slice(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_cache_slice_range(ngx_http_request_t *r,
+    ngx_http_cache_slice_t *slice);
+static ngx_int_t ngx_http_upstream_cache_slice_response(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_cache_slice_headers(ngx_http_request_t *r,
+    off_t offset);
+static ngx_int_t ngx_http_upstream_cache_slice_file(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_cache_slice_output(ngx_http_request_t *r,
+    off_t start, off_t end);
 static ngx_int_t ngx_http_upstream_cache_status(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_cache_last_modified(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_cache_etag(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_cache_tier(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_cache_tier_stats(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 #endif
 
 static void ngx_http_upstream_init_request(ngx_http_request_t *r);
+static void ngx_http_upstream_start(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
 static void ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx);
 static void ngx_http_upstream_rd_check_broken_connection(ngx_http_request_t *r);
 static void ngx_http_upstream_wr_check_broken_connection(ngx_http_request_t *r);
@@ -77,6 +95,12 @@ static void
 static void
     ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
     ngx_uint_t do_write);
+static void ngx_http_upstream_buffers_account(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+#if (NGX_HAVE_SPLICE)
+static void ngx_http_upstream_splice_init(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+#endif
 static ngx_int_t ngx_http_upstream_non_buffered_filter_init(void *data);
 static ngx_int_t ngx_http_upstream_non_buffered_filter(void *data,
     ssize_t bytes);
@@ -98,6 +122,38 @@ static void ngx_http_upstream_dummy_handler(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_next(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_uint_t ft_type);
+static void ngx_http_upstream_hedge_arm(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hedge_original_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hedge_restore(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_uint_t state);
+static void ngx_http_upstream_hedge_stop(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_close_peer(ngx_peer_connection_t *pc,
+    ngx_uint_t state);
+static void ngx_http_upstream_hedge_sample(ngx_http_upstream_hedge_conf_t *hcf,
+    ngx_msec_t ms);
+static ngx_msec_t ngx_http_upstream_hedge_delay(
+    ngx_http_upstream_hedge_conf_t *hcf);
+static ngx_int_t ngx_http_upstream_coalesce_init(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_coalesce_header(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_uint_t ngx_http_upstream_coalesce_shareable(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_coalesce_copy_headers(ngx_http_request_t *r,
+    ngx_http_upstream_t *lu);
+static void ngx_http_upstream_coalesce_body(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_coalesce_open(
+    ngx_http_upstream_coalesce_t *cf, ngx_temp_file_t *tf);
+static void ngx_http_upstream_coalesce_finalize(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_int_t rc);
+static void ngx_http_upstream_coalesce_handler(ngx_event_t *ev);
+static void ngx_http_upstream_coalesce_downstream(ngx_http_request_t *r);
+static void ngx_http_upstream_coalesce_send(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
 static void ngx_http_upstream_cleanup(void *data);
 static void ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_int_t rc);
@@ -164,6 +220,8 @@ static ngx_int_t ngx_http_upstream_response_time_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_response_length_variable(
     ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_buffers_stats_variable(
+    ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_header_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_cookie_variable(ngx_http_request_t *r,
@@ -172,6 +230,8 @@ static ngx_int_t ngx_http_upstream_cookie_variable(ngx_http_request_t *r,
 static char *ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy);
 static char *ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_upstream_hedge(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 static ngx_int_t ngx_http_upstream_set_local(ngx_http_request_t *r,
   ngx_http_upstream_t *u, ngx_http_upstream_local_t *local);
@@ -338,6 +398,20 @@ static ngx_command_t  ngx_http_upstream_commands[] = {
       0,
       NULL },
 
+    { ngx_string("hedge"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_hedge,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("upstream_buffers_budget"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_upstream_main_conf_t, buffers_budget),
+      NULL },
+
       ngx_null_command
 };
 
@@ -403,6 +477,10 @@ static ngx_http_variable_t  ngx_http_upstream_vars[] = {
       ngx_http_upstream_response_length_variable, 1,
       NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("upstream_buffers_stats"), NULL,
+      ngx_http_upstream_buffers_stats_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
 #if (NGX_HTTP_CACHE)
 
     { ngx_string("upstream_cache_status"), NULL,
@@ -417,6 +495,14 @@ static ngx_http_variable_t  ngx_http_upstream_vars[] = {
       ngx_http_upstream_cache_etag, 0,
       NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH, 0 },
 
+    { ngx_string("upstream_cache_tier"), NULL,
+      ngx_http_upstream_cache_tier, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_cache_tier_stats"), NULL,
+      ngx_http_upstream_cache_tier_stats, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
 #endif
 
     { ngx_string("upstream_http_"), NULL, ngx_http_upstream_header_variable,
@@ -536,14 +622,9 @@ ngx_http_upstream_init(ngx_http_request_t *r)
 static void
 ngx_http_upstream_init_request(ngx_http_request_t *r)
 {
-    ngx_str_t                      *host;
-    ngx_uint_t                      i;
-    ngx_resolver_ctx_t             *ctx, temp;
     ngx_http_cleanup_t             *cln;
     ngx_http_upstream_t            *u;
     ngx_http_core_loc_conf_t       *clcf;
-    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
-    ngx_http_upstream_main_conf_t  *umcf;
 
     if (r->aio) {
         return;
@@ -661,6 +742,37 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
     cln->data = r;
     u->cleanup = &cln->handler;
 
+    if (u->conf->coalesce) {
+
+        switch (ngx_http_upstream_coalesce_init(r, u)) {
+
+        case NGX_ERROR:
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+
+        case NGX_DONE:
+            return;
+
+        default: /* NGX_OK */
+            break;
+        }
+    }
+
+    ngx_http_upstream_start(r, u);
+}
+
+
+static void
+ngx_http_upstream_start(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_str_t                      *host;
+    ngx_uint_t                      i;
+    ngx_resolver_ctx_t             *ctx, temp;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
     if (u->resolved == NULL) {
 
         uscf = u->conf->upstream;
@@ -725,6 +837,8 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
 
         temp.name = *host;
 
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
         ctx = ngx_resolve_start(clcf->resolver, &temp);
         if (ctx == NULL) {
             ngx_http_upstream_finalize_request(r, u,
@@ -866,6 +980,13 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         c->lock_timeout = u->conf->cache_lock_timeout;
         c->lock_age = u->conf->cache_lock_age;
 
+        if (u->conf->cache_slice
+            && (r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))
+            && ngx_http_upstream_cache_slice(r, u) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
         u->cache_status = NGX_HTTP_CACHE_MISS;
     }
 
@@ -934,11 +1055,18 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
             u->buffer.last = u->buffer.pos;
         }
 
+        if (c->slice && !c->slice->in_place
+            && ngx_http_upstream_cache_slice_range(r, c->slice) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
         break;
 
     case NGX_HTTP_CACHE_SCARCE:
 
         u->cacheable = 0;
+        c->slice = NULL;
 
         break;
 
@@ -959,7 +1087,15 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return rc;
     }
 
-    if (ngx_http_upstream_cache_check_range(r, u) == NGX_DECLINED) {
+    /* a response to a request for the whole object is cached as usual */
+
+    if (c->slice && c->slice->range.len == 0) {
+        c->slice = NULL;
+    }
+
+    if (c->slice == NULL
+        && ngx_http_upstream_cache_check_range(r, u) == NGX_DECLINED)
+    {
         u->cacheable = 0;
     }
 
@@ -1050,6 +1186,10 @@ ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
             return NGX_DONE;
         }
 
+        if (c->slice && c->slice->length) {
+            ngx_http_upstream_cache_slice_headers(r, 0);
+        }
+
         return ngx_http_cache_send(r);
     }
 
@@ -1137,918 +1277,1005 @@ ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
     return NGX_OK;
 }
 
-#endif
-
 
-static void
-ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx)
+static ngx_int_t
+ngx_http_upstream_cache_slice(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
-    ngx_connection_t              *c;
-    ngx_http_request_t            *r;
-    ngx_http_upstream_t           *u;
-    ngx_http_upstream_resolved_t  *ur;
+    off_t                      start, end, cutoff, cutlim;
+    u_char                    *p;
+    ngx_uint_t                 suffix;
+    ngx_table_elt_t           *h;
+    ngx_http_cache_slice_t    *slice;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    r = ctx->data;
-    c = r->connection;
+    slice = ngx_pcalloc(r->pool, sizeof(ngx_http_cache_slice_t));
+    if (slice == NULL) {
+        return NGX_ERROR;
+    }
 
-    u = r->upstream;
-    ur = u->resolved;
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     slice->start = 0;
+     *     slice->length = 0;
+     *     slice->bitmap = NULL;
+     *     slice->range = { 0, NULL };
+     *     slice->if_range = { 0, NULL };
+     *     slice->in_place = 0;
+     */
 
-    ngx_http_set_log_request(c->log, r);
+    slice->size = u->conf->cache_slice;
+    slice->end = -1;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream resolve: \"%V?%V\"", &r->uri, &r->args);
+    r->cache->slice = slice;
 
-    if (ctx->state) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "%V could not be resolved (%i: %s)",
-                      &ctx->name, ctx->state,
-                      ngx_resolver_strerror(ctx->state));
+    /* a HEAD request needs the first slice only */
 
-        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
-        goto failed;
+    if (r->method == NGX_HTTP_HEAD) {
+        slice->end = 1;
+        return NGX_OK;
     }
 
-    ur->naddrs = ctx->naddrs;
-    ur->addrs = ctx->addrs;
+    /* anything but a single range is served from the whole object */
 
-#if (NGX_DEBUG)
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    h = r->headers_in.range;
+
+    if (h == NULL
+        || r->headers_in.if_range
+        || r != r->main
+        || r->http_version < NGX_HTTP_VERSION_10
+        || clcf->max_ranges == 0
+        || h->value.len < 7
+        || ngx_strncasecmp(h->value.data, (u_char *) "bytes=", 6) != 0)
     {
-    u_char      text[NGX_SOCKADDR_STRLEN];
-    ngx_str_t   addr;
-    ngx_uint_t  i;
+        return NGX_OK;
+    }
 
-    addr.data = text;
+    p = h->value.data + 6;
 
-    for (i = 0; i < ctx->naddrs; i++) {
-        addr.len = ngx_sock_ntop(ur->addrs[i].sockaddr, ur->addrs[i].socklen,
-                                 text, NGX_SOCKADDR_STRLEN, 0);
+    cutoff = NGX_MAX_OFF_T_VALUE / 10;
+    cutlim = NGX_MAX_OFF_T_VALUE % 10;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "name was resolved to %V", &addr);
+    start = 0;
+    end = 0;
+    suffix = 0;
+
+    while (*p == ' ') { p++; }
+
+    if (*p == '-') {
+        suffix = 1;
+        p++;
+
+    } else {
+        if (*p < '0' || *p > '9') {
+            return NGX_OK;
+        }
+
+        while (*p >= '0' && *p <= '9') {
+            if (start >= cutoff && (start > cutoff || *p - '0' > cutlim)) {
+                return NGX_OK;
+            }
+
+            start = start * 10 + *p++ - '0';
+        }
+
+        while (*p == ' ') { p++; }
+
+        if (*p++ != '-') {
+            return NGX_OK;
+        }
+
+        while (*p == ' ') { p++; }
+
+        if (*p == '\0') {
+            slice->start = start;
+            return NGX_OK;
+        }
     }
+
+    if (*p < '0' || *p > '9') {
+        return NGX_OK;
     }
-#endif
 
-    if (ngx_http_upstream_create_round_robin_peer(r, ur) != NGX_OK) {
-        ngx_http_upstream_finalize_request(r, u,
-                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
-        goto failed;
+    while (*p >= '0' && *p <= '9') {
+        if (end >= cutoff && (end > cutoff || *p - '0' > cutlim)) {
+            return NGX_OK;
+        }
+
+        end = end * 10 + *p++ - '0';
     }
 
-    ngx_resolve_name_done(ctx);
-    ur->ctx = NULL;
+    while (*p == ' ') { p++; }
 
-    u->peer.start_time = ngx_current_msec;
+    if (*p != '\0') {
+        return NGX_OK;
+    }
 
-    if (u->conf->next_upstream_tries
-        && u->peer.tries > u->conf->next_upstream_tries)
-    {
-        u->peer.tries = u->conf->next_upstream_tries;
+    if (suffix) {
+        if (end) {
+            slice->start = -end;
+        }
+
+        return NGX_OK;
     }
 
-    ngx_http_upstream_connect(r, u);
+    if (end < start || end == NGX_MAX_OFF_T_VALUE) {
+        return NGX_OK;
+    }
 
-failed:
+    slice->start = start;
+    slice->end = end + 1;
 
-    ngx_http_run_posted_requests(c);
+    return NGX_OK;
 }
 
 
-static void
-ngx_http_upstream_handler(ngx_event_t *ev)
+static ngx_int_t
+ngx_http_upstream_cache_slice_range(ngx_http_request_t *r,
+    ngx_http_cache_slice_t *slice)
 {
-    ngx_connection_t     *c;
-    ngx_http_request_t   *r;
-    ngx_http_upstream_t  *u;
+    off_t   size;
+    u_char  *p;
 
-    c = ev->data;
-    r = c->data;
+    /* a request for the whole object caches it as usual */
 
-    u = r->upstream;
-    c = r->connection;
+    if (slice->start == 0 && slice->end == -1) {
+        return NGX_OK;
+    }
 
-    ngx_http_set_log_request(c->log, r);
+    p = ngx_pnalloc(r->pool, sizeof("bytes=-") - 1 + 2 * NGX_OFF_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream request: \"%V?%V\"", &r->uri, &r->args);
+    slice->range.data = p;
 
-    if (ev->delayed && ev->timedout) {
-        ev->delayed = 0;
-        ev->timedout = 0;
-    }
+    size = slice->size;
 
-    if (ev->write) {
-        u->write_event_handler(r, u);
+    if (slice->start < 0) {
+        slice->fetch_start = slice->start;
+        slice->fetch_end = -1;
+
+        p = ngx_sprintf(p, "bytes=%O", slice->start);
 
     } else {
-        u->read_event_handler(r, u);
-    }
+        slice->fetch_start = slice->start / size * size;
 
-    ngx_http_run_posted_requests(c);
-}
+        if (slice->end == -1) {
+            slice->fetch_end = -1;
 
+            p = ngx_sprintf(p, "bytes=%O-", slice->fetch_start);
 
-static void
-ngx_http_upstream_rd_check_broken_connection(ngx_http_request_t *r)
-{
-    ngx_http_upstream_check_broken_connection(r, r->connection->read);
-}
+        } else {
+            slice->fetch_end = (slice->end + size - 1) / size * size;
+
+            p = ngx_sprintf(p, "bytes=%O-%O", slice->fetch_start,
+                            slice->fetch_end - 1);
+        }
+    }
 
+    slice->range.len = p - slice->range.data;
 
-static void
-ngx_http_upstream_wr_check_broken_connection(ngx_http_request_t *r)
-{
-    ngx_http_upstream_check_broken_connection(r, r->connection->write);
+    return NGX_OK;
 }
 
 
-static void
-ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
-    ngx_event_t *ev)
+static ngx_int_t
+ngx_http_upstream_cache_slice_response(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
 {
-    int                  n;
-    char                 buf[1];
-    ngx_err_t            err;
-    ngx_int_t            event;
-    ngx_connection_t     *c;
-    ngx_http_upstream_t  *u;
-
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ev->log, 0,
-                   "http upstream check client, write event:%d, \"%V\"",
-                   ev->write, &r->uri);
+    off_t                    start, end, length, cutoff, cutlim;
+    u_char                  *p;
+    ngx_table_elt_t         *h;
+    ngx_http_cache_slice_t  *slice;
 
-    c = r->connection;
-    u = r->upstream;
+    slice = r->cache->slice;
 
-    if (c->error) {
-        if ((ngx_event_flags & NGX_USE_LEVEL_EVENT) && ev->active) {
+    if (u->headers_in.status_n != NGX_HTTP_PARTIAL_CONTENT) {
 
-            event = ev->write ? NGX_WRITE_EVENT : NGX_READ_EVENT;
+        /* the whole object replaces a partial one */
 
-            if (ngx_del_event(ev, event, 0) != NGX_OK) {
-                ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-                return;
-            }
+        if (slice->in_place) {
+            r->cache->valid_sec = 0;
+            r->cache->updating_sec = 0;
+            r->cache->error_sec = 0;
         }
 
-        if (!u->cacheable) {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_CLIENT_CLOSED_REQUEST);
-        }
+        r->cache->slice = NULL;
 
-        return;
+        return NGX_OK;
     }
 
-#if (NGX_HTTP_V2)
-    if (r->stream) {
-        return;
+    h = r->headers_out.content_range;
+
+    if (h == NULL
+        || h->value.len < 7
+        || ngx_strncmp(h->value.data, "bytes ", 6) != 0)
+    {
+        goto invalid;
     }
-#endif
 
-#if (NGX_HAVE_KQUEUE)
+    p = h->value.data + 6;
 
-    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
+    cutoff = NGX_MAX_OFF_T_VALUE / 10;
+    cutlim = NGX_MAX_OFF_T_VALUE % 10;
 
-        if (!ev->pending_eof) {
-            return;
-        }
+    start = 0;
+    end = 0;
+    length = 0;
 
-        ev->eof = 1;
-        c->error = 1;
+    while (*p == ' ') { p++; }
 
-        if (ev->kq_errno) {
-            ev->error = 1;
-        }
+    if (*p < '0' || *p > '9') {
+        goto invalid;
+    }
 
-        if (!u->cacheable && u->peer.connection) {
-            ngx_log_error(NGX_LOG_INFO, ev->log, ev->kq_errno,
-                          "kevent() reported that client prematurely closed "
-                          "connection, so upstream connection is closed too");
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_CLIENT_CLOSED_REQUEST);
-            return;
+    while (*p >= '0' && *p <= '9') {
+        if (start >= cutoff && (start > cutoff || *p - '0' > cutlim)) {
+            goto invalid;
         }
 
-        ngx_log_error(NGX_LOG_INFO, ev->log, ev->kq_errno,
-                      "kevent() reported that client prematurely closed "
-                      "connection");
+        start = start * 10 + *p++ - '0';
+    }
 
-        if (u->peer.connection == NULL) {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_CLIENT_CLOSED_REQUEST);
-        }
+    while (*p == ' ') { p++; }
 
-        return;
+    if (*p++ != '-') {
+        goto invalid;
     }
 
-#endif
-
-#if (NGX_HAVE_EPOLLRDHUP)
+    while (*p == ' ') { p++; }
 
-    if ((ngx_event_flags & NGX_USE_EPOLL_EVENT) && ngx_use_epoll_rdhup) {
-        socklen_t  len;
+    if (*p < '0' || *p > '9') {
+        goto invalid;
+    }
 
-        if (!ev->pending_eof) {
-            return;
+    while (*p >= '0' && *p <= '9') {
+        if (end >= cutoff && (end > cutoff || *p - '0' > cutlim)) {
+            goto invalid;
         }
 
-        ev->eof = 1;
-        c->error = 1;
+        end = end * 10 + *p++ - '0';
+    }
 
-        err = 0;
-        len = sizeof(ngx_err_t);
+    end++;
 
-        /*
-         * BSDs and Linux return 0 and set a pending error in err
-         * Solaris returns -1 and sets errno
-         */
+    while (*p == ' ') { p++; }
 
-        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
-            == -1)
-        {
-            err = ngx_socket_errno;
-        }
+    if (*p++ != '/') {
+        goto invalid;
+    }
 
-        if (err) {
-            ev->error = 1;
-        }
+    while (*p == ' ') { p++; }
 
-        if (!u->cacheable && u->peer.connection) {
-            ngx_log_error(NGX_LOG_INFO, ev->log, err,
-                        "epoll_wait() reported that client prematurely closed "
-                        "connection, so upstream connection is closed too");
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_CLIENT_CLOSED_REQUEST);
-            return;
-        }
+    /* the complete length is required to place slices */
 
-        ngx_log_error(NGX_LOG_INFO, ev->log, err,
-                      "epoll_wait() reported that client prematurely closed "
-                      "connection");
+    if (*p < '0' || *p > '9') {
+        goto invalid;
+    }
 
-        if (u->peer.connection == NULL) {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_CLIENT_CLOSED_REQUEST);
+    while (*p >= '0' && *p <= '9') {
+        if (length >= cutoff && (length > cutoff || *p - '0' > cutlim)) {
+            goto invalid;
         }
 
-        return;
+        length = length * 10 + *p++ - '0';
     }
 
-#endif
+    if (start >= end || end > length) {
+        goto invalid;
+    }
 
-    n = recv(c->fd, buf, 1, MSG_PEEK);
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream slice response: %O-%O/%O",
+                   start, end, length);
 
-    err = ngx_socket_errno;
+    if (slice->in_place) {
+        if (length != slice->length
+            || start != slice->fetch_start
+            || end != slice->fetch_end)
+        {
+            goto unexpected;
+        }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, err,
-                   "http upstream recv(): %d", n);
+    } else {
+        if (start != (slice->fetch_start < 0
+                      ? ngx_max(length + slice->fetch_start, 0)
+                      : slice->fetch_start)
+            || end != ((slice->fetch_end == -1 || slice->fetch_end > length)
+                       ? length : slice->fetch_end))
+        {
+            goto unexpected;
+        }
 
-    if (ev->write && (n >= 0 || err == NGX_EAGAIN)) {
-        return;
+        slice->length = length;
+        slice->fetch_start = start;
+        slice->fetch_end = end;
+        slice->send_start = start;
+        slice->send_end = end;
     }
 
-    if ((ngx_event_flags & NGX_USE_LEVEL_EVENT) && ev->active) {
+    ngx_http_upstream_cache_slice_headers(r, slice->send_start);
 
-        event = ev->write ? NGX_WRITE_EVENT : NGX_READ_EVENT;
+    return NGX_OK;
 
-        if (ngx_del_event(ev, event, 0) != NGX_OK) {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return;
-        }
-    }
+invalid:
 
-    if (n > 0) {
-        return;
-    }
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "upstream sent invalid range in slice response");
 
-    if (n == -1) {
-        if (err == NGX_EAGAIN) {
-            return;
-        }
+    return NGX_HTTP_BAD_GATEWAY;
 
-        ev->error = 1;
+unexpected:
 
-    } else { /* n == 0 */
-        err = 0;
-    }
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "upstream sent unexpected range in slice response: %O-%O/%O",
+                  start, end, length);
 
-    ev->eof = 1;
-    c->error = 1;
+    return NGX_HTTP_BAD_GATEWAY;
+}
 
-    if (!u->cacheable && u->peer.connection) {
-        ngx_log_error(NGX_LOG_INFO, ev->log, err,
-                      "client prematurely closed connection, "
-                      "so upstream connection is closed too");
-        ngx_http_upstream_finalize_request(r, u,
-                                           NGX_HTTP_CLIENT_CLOSED_REQUEST);
-        return;
-    }
 
-    ngx_log_error(NGX_LOG_INFO, ev->log, err,
-                  "client prematurely closed connection");
+static void
+ngx_http_upstream_cache_slice_headers(ngx_http_request_t *r, off_t offset)
+{
+    /* the range filter serves the client's range out of the slices */
 
-    if (u->peer.connection == NULL) {
-        ngx_http_upstream_finalize_request(r, u,
-                                           NGX_HTTP_CLIENT_CLOSED_REQUEST);
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.status_line.len = 0;
+    r->headers_out.content_length_n = r->cache->slice->length;
+    r->headers_out.content_offset = offset;
+
+    if (r->headers_out.content_range) {
+        r->headers_out.content_range->hash = 0;
+        r->headers_out.content_range = NULL;
     }
+
+    r->allow_ranges = 1;
+    r->single_range = 1;
 }
 
 
-static void
-ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
+static ngx_int_t
+ngx_http_upstream_cache_slice_file(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
 {
     ngx_int_t          rc;
-    ngx_connection_t  *c;
+    ngx_chain_t        out;
+    ngx_event_pipe_t  *p;
+    ngx_http_cache_t  *c;
 
-    r->connection->log->action = "connecting to upstream";
+    c = r->cache;
+    p = u->pipe;
 
-    if (u->state && u->state->response_time) {
-        u->state->response_time = ngx_current_msec - u->state->response_time;
-    }
+    /* the body is written at its offset in the object */
 
-    u->state = ngx_array_push(r->upstream_states);
-    if (u->state == NULL) {
-        ngx_http_upstream_finalize_request(r, u,
-                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
-        return;
-    }
+    p->buf_to_file = NULL;
 
-    ngx_memzero(u->state, sizeof(ngx_http_upstream_state_t));
+    if (c->slice->in_place) {
+        rc = ngx_http_file_cache_slice_open(r, p->temp_file);
 
-    u->state->response_time = ngx_current_msec;
-    u->state->connect_time = (ngx_msec_t) -1;
-    u->state->header_time = (ngx_msec_t) -1;
+        if (rc == NGX_DECLINED) {
+            u->cacheable = 0;
+            p->cacheable = u->store;
 
-    rc = ngx_event_connect_peer(&u->peer);
+            ngx_http_file_cache_free(c, p->temp_file);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http upstream connect: %i", rc);
+            return NGX_OK;
+        }
 
-    if (rc == NGX_ERROR) {
-        ngx_http_upstream_finalize_request(r, u,
-                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
-        return;
+        return rc;
     }
 
-    u->state->peer = u->peer.name;
-
-    if (rc == NGX_BUSY) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "no live upstreams");
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_NOLIVE);
-        return;
+    out.buf = ngx_calloc_buf(r->pool);
+    if (out.buf == NULL) {
+        return NGX_ERROR;
     }
 
-    if (rc == NGX_DECLINED) {
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
-        return;
+    out.buf->start = u->buffer.start;
+    out.buf->pos = u->buffer.start;
+    out.buf->last = u->buffer.pos;
+    out.buf->temporary = 1;
+    out.next = NULL;
+
+    if (ngx_write_chain_to_temp_file(p->temp_file, &out) == NGX_ERROR) {
+        return NGX_ERROR;
     }
 
-    /* rc == NGX_OK || rc == NGX_AGAIN || rc == NGX_DONE */
+    p->temp_file->offset = c->body_start + c->slice->fetch_start;
 
-    c = u->peer.connection;
+    return NGX_OK;
+}
 
-    c->data = r;
 
-    c->write->handler = ngx_http_upstream_handler;
-    c->read->handler = ngx_http_upstream_handler;
+static ngx_int_t
+ngx_http_upstream_cache_slice_output(ngx_http_request_t *r, off_t start,
+    off_t end)
+{
+    ngx_buf_t         *b;
+    ngx_chain_t        out;
+    ngx_http_cache_t  *c;
 
-    u->write_event_handler = ngx_http_upstream_send_request_handler;
-    u->read_event_handler = ngx_http_upstream_process_header;
+    c = r->cache;
 
-    c->sendfile &= r->connection->sendfile;
-    u->output.sendfile = c->sendfile;
+    if (start >= end) {
+        return NGX_OK;
+    }
 
-    if (c->pool == NULL) {
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream slice cached: %O-%O", start, end);
 
-        /* we need separate pool here to be able to cache SSL connections */
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
 
-        c->pool = ngx_create_pool(128, r->connection->log);
-        if (c->pool == NULL) {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return;
-        }
+    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (b->file == NULL) {
+        return NGX_ERROR;
     }
 
-    c->log = r->connection->log;
-    c->pool->log = c->log;
-    c->read->log = c->log;
-    c->write->log = c->log;
+    b->file_pos = c->body_start + start;
+    b->file_last = c->body_start + end;
 
-    /* init or reinit the ngx_output_chain() and ngx_chain_writer() contexts */
+    b->in_file = 1;
 
-    u->writer.out = NULL;
-    u->writer.last = &u->writer.out;
-    u->writer.connection = c;
-    u->writer.limit = 0;
+    b->file->fd = c->file.fd;
+    b->file->name = c->file.name;
+    b->file->log = r->connection->log;
+    b->file->directio = c->file.directio;
 
-    if (u->request_sent) {
-        if (ngx_http_upstream_reinit(r, u) != NGX_OK) {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return;
-        }
-    }
+    out.buf = b;
+    out.next = NULL;
 
-    if (r->request_body
-        && r->request_body->buf
-        && r->request_body->temp_file
-        && r == r->main)
-    {
-        /*
-         * the r->request_body->buf can be reused for one request only,
-         * the subrequests should allocate their own temporary bufs
-         */
+    return ngx_http_output_filter(r, &out);
+}
 
-        u->output.free = ngx_alloc_chain_link(r->pool);
-        if (u->output.free == NULL) {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return;
-        }
+#endif
 
-        u->output.free->buf = r->request_body->buf;
-        u->output.free->next = NULL;
-        u->output.allocated = 1;
 
-        r->request_body->buf->pos = r->request_body->buf->start;
-        r->request_body->buf->last = r->request_body->buf->start;
-        r->request_body->buf->tag = u->output.tag;
-    }
+static void
+ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx)
+{
+    ngx_connection_t              *c;
+    ngx_http_request_t            *r;
+    ngx_http_upstream_t           *u;
+    ngx_http_upstream_resolved_t  *ur;
 
-    u->request_sent = 0;
-    u->request_body_sent = 0;
+    r = ctx->data;
+    c = r->connection;
 
-    if (rc == NGX_AGAIN) {
-        ngx_add_timer(c->write, u->conf->connect_timeout);
-        return;
-    }
+    u = r->upstream;
+    ur = u->resolved;
 
-#if (NGX_HTTP_SSL)
+    ngx_http_set_log_request(c->log, r);
 
-    if (u->ssl && c->ssl == NULL) {
-        ngx_http_upstream_ssl_init_connection(r, u, c);
-        return;
-    }
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream resolve: \"%V?%V\"", &r->uri, &r->args);
 
-#endif
+    if (ctx->state) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "%V could not be resolved (%i: %s)",
+                      &ctx->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state));
 
-    ngx_http_upstream_send_request(r, u, 1);
-}
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
+        goto failed;
+    }
 
+    ur->naddrs = ctx->naddrs;
+    ur->addrs = ctx->addrs;
 
-#if (NGX_HTTP_SSL)
+#if (NGX_DEBUG)
+    {
+    u_char      text[NGX_SOCKADDR_STRLEN];
+    ngx_str_t   addr;
+    ngx_uint_t  i;
 
-static void
-ngx_http_upstream_ssl_init_connection(ngx_http_request_t *r,
-    ngx_http_upstream_t *u, ngx_connection_t *c)
-{
-    int                        tcp_nodelay;
-    ngx_int_t                  rc;
-    ngx_http_core_loc_conf_t  *clcf;
+    addr.data = text;
 
-    if (ngx_http_upstream_test_connect(c) != NGX_OK) {
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
-        return;
+    for (i = 0; i < ctx->naddrs; i++) {
+        addr.len = ngx_sock_ntop(ur->addrs[i].sockaddr, ur->addrs[i].socklen,
+                                 text, NGX_SOCKADDR_STRLEN, 0);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "name was resolved to %V", &addr);
+    }
     }
+#endif
 
-    if (ngx_ssl_create_connection(u->conf->ssl, c,
-                                  NGX_SSL_BUFFER|NGX_SSL_CLIENT)
-        != NGX_OK)
-    {
+    if (ngx_http_upstream_create_round_robin_peer(r, ur) != NGX_OK) {
         ngx_http_upstream_finalize_request(r, u,
                                            NGX_HTTP_INTERNAL_SERVER_ERROR);
-        return;
+        goto failed;
     }
 
-    c->sendfile = 0;
-    u->output.sendfile = 0;
+    ngx_resolve_name_done(ctx);
+    ur->ctx = NULL;
 
-    if (u->conf->ssl_server_name || u->conf->ssl_verify) {
-        if (ngx_http_upstream_ssl_name(r, u, c) != NGX_OK) {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return;
-        }
+    u->peer.start_time = ngx_current_msec;
+
+    if (u->conf->next_upstream_tries
+        && u->peer.tries > u->conf->next_upstream_tries)
+    {
+        u->peer.tries = u->conf->next_upstream_tries;
     }
 
-    if (u->conf->ssl_session_reuse) {
-        if (u->peer.set_session(&u->peer, u->peer.data) != NGX_OK) {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return;
-        }
+    ngx_http_upstream_connect(r, u);
 
-        /* abbreviated SSL handshake may interact badly with Nagle */
+failed:
 
-        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    ngx_http_run_posted_requests(c);
+}
 
-        if (clcf->tcp_nodelay && c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
 
-            tcp_nodelay = 1;
+static void
+ngx_http_upstream_handler(ngx_event_t *ev)
+{
+    ngx_connection_t     *c;
+    ngx_http_request_t   *r;
+    ngx_http_upstream_t  *u;
 
-            if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
-                           (const void *) &tcp_nodelay, sizeof(int)) == -1)
-            {
-                ngx_connection_error(c, ngx_socket_errno,
-                                     "setsockopt(TCP_NODELAY) failed");
-                ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-                return;
-            }
+    c = ev->data;
+    r = c->data;
 
-            c->tcp_nodelay = NGX_TCP_NODELAY_SET;
-        }
-    }
+    u = r->upstream;
+    c = r->connection;
 
-    r->connection->log->action = "SSL handshaking to upstream";
+    ngx_http_set_log_request(c->log, r);
 
-    rc = ngx_ssl_handshake(c);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream request: \"%V?%V\"", &r->uri, &r->args);
 
-    if (rc == NGX_AGAIN) {
+    if (ev->delayed && ev->timedout) {
+        ev->delayed = 0;
+        ev->timedout = 0;
+    }
 
-        if (!c->write->timer_set) {
-            ngx_add_timer(c->write, u->conf->connect_timeout);
-        }
+    if (ev->write) {
+        u->write_event_handler(r, u);
 
-        c->ssl->handler = ngx_http_upstream_ssl_handshake;
-        return;
+    } else {
+        u->read_event_handler(r, u);
     }
 
-    ngx_http_upstream_ssl_handshake(c);
+    ngx_http_run_posted_requests(c);
 }
 
 
 static void
-ngx_http_upstream_ssl_handshake(ngx_connection_t *c)
+ngx_http_upstream_rd_check_broken_connection(ngx_http_request_t *r)
 {
-    long                  rc;
-    ngx_http_request_t   *r;
-    ngx_http_upstream_t  *u;
+    ngx_http_upstream_check_broken_connection(r, r->connection->read);
+}
 
-    r = c->data;
-    u = r->upstream;
 
-    ngx_http_set_log_request(c->log, r);
+static void
+ngx_http_upstream_wr_check_broken_connection(ngx_http_request_t *r)
+{
+    ngx_http_upstream_check_broken_connection(r, r->connection->write);
+}
 
-    if (c->ssl->handshaked) {
 
-        if (u->conf->ssl_verify) {
-            rc = SSL_get_verify_result(c->ssl->connection);
+static void
+ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
+    ngx_event_t *ev)
+{
+    int                  n;
+    char                 buf[1];
+    ngx_err_t            err;
+    ngx_int_t            event;
+    ngx_connection_t     *c;
+    ngx_http_upstream_t  *u;
 
-            if (rc != X509_V_OK) {
-                ngx_log_error(NGX_LOG_ERR, c->log, 0,
-                              "upstream SSL certificate verify error: (%l:%s)",
-                              rc, X509_verify_cert_error_string(rc));
-                goto failed;
-            }
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http upstream check client, write event:%d, \"%V\"",
+                   ev->write, &r->uri);
 
-            if (ngx_ssl_check_host(c, &u->ssl_name) != NGX_OK) {
-                ngx_log_error(NGX_LOG_ERR, c->log, 0,
-                              "upstream SSL certificate does not match \"%V\"",
-                              &u->ssl_name);
-                goto failed;
-            }
-        }
+    c = r->connection;
+    u = r->upstream;
 
-        if (u->conf->ssl_session_reuse) {
-            u->peer.save_session(&u->peer, u->peer.data);
-        }
+    if (c->error) {
+        if ((ngx_event_flags & NGX_USE_LEVEL_EVENT) && ev->active) {
 
-        c->write->handler = ngx_http_upstream_handler;
-        c->read->handler = ngx_http_upstream_handler;
+            event = ev->write ? NGX_WRITE_EVENT : NGX_READ_EVENT;
 
-        c = r->connection;
+            if (ngx_del_event(ev, event, 0) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+                return;
+            }
+        }
 
-        ngx_http_upstream_send_request(r, u, 1);
+        if (!u->cacheable && !ngx_http_upstream_coalesce_shared(u)) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_CLIENT_CLOSED_REQUEST);
+        }
 
-        ngx_http_run_posted_requests(c);
         return;
     }
 
-    if (c->write->timedout) {
-        c = r->connection;
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_TIMEOUT);
-        ngx_http_run_posted_requests(c);
+#if (NGX_HTTP_V2)
+    if (r->stream) {
         return;
     }
+#endif
 
-failed:
-
-    c = r->connection;
+#if (NGX_HAVE_KQUEUE)
 
-    ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
 
-    ngx_http_run_posted_requests(c);
-}
+        if (!ev->pending_eof) {
+            return;
+        }
 
+        ev->eof = 1;
+        c->error = 1;
 
-static ngx_int_t
-ngx_http_upstream_ssl_name(ngx_http_request_t *r, ngx_http_upstream_t *u,
-    ngx_connection_t *c)
-{
-    u_char     *p, *last;
-    ngx_str_t   name;
+        if (ev->kq_errno) {
+            ev->error = 1;
+        }
 
-    if (u->conf->ssl_name) {
-        if (ngx_http_complex_value(r, u->conf->ssl_name, &name) != NGX_OK) {
-            return NGX_ERROR;
+        if (!u->cacheable && !ngx_http_upstream_coalesce_shared(u)
+            && u->peer.connection)
+        {
+            ngx_log_error(NGX_LOG_INFO, ev->log, ev->kq_errno,
+                          "kevent() reported that client prematurely closed "
+                          "connection, so upstream connection is closed too");
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_CLIENT_CLOSED_REQUEST);
+            return;
         }
 
-    } else {
-        name = u->ssl_name;
-    }
+        ngx_log_error(NGX_LOG_INFO, ev->log, ev->kq_errno,
+                      "kevent() reported that client prematurely closed "
+                      "connection");
 
-    if (name.len == 0) {
-        goto done;
-    }
-
-    /*
-     * ssl name here may contain port, notably if derived from $proxy_host
-     * or $http_host; we have to strip it
-     */
-
-    p = name.data;
-    last = name.data + name.len;
-
-    if (*p == '[') {
-        p = ngx_strlchr(p, last, ']');
-
-        if (p == NULL) {
-            p = name.data;
+        if (u->peer.connection == NULL) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_CLIENT_CLOSED_REQUEST);
         }
-    }
-
-    p = ngx_strlchr(p, last, ':');
-
-    if (p != NULL) {
-        name.len = p - name.data;
-    }
 
-    if (!u->conf->ssl_server_name) {
-        goto done;
+        return;
     }
 
-#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
-
-    /* as per RFC 6066, literal IPv4 and IPv6 addresses are not permitted */
+#endif
 
-    if (name.len == 0 || *name.data == '[') {
-        goto done;
-    }
+#if (NGX_HAVE_EPOLLRDHUP)
 
-    if (ngx_inet_addr(name.data, name.len) != INADDR_NONE) {
-        goto done;
-    }
+    if ((ngx_event_flags & NGX_USE_EPOLL_EVENT) && ngx_use_epoll_rdhup) {
+        socklen_t  len;
 
-    /*
-     * SSL_set_tlsext_host_name() needs a null-terminated string,
-     * hence we explicitly null-terminate name here
-     */
+        if (!ev->pending_eof) {
+            return;
+        }
 
-    p = ngx_pnalloc(r->pool, name.len + 1);
-    if (p == NULL) {
-        return NGX_ERROR;
-    }
+        ev->eof = 1;
+        c->error = 1;
 
-    (void) ngx_cpystrn(p, name.data, name.len + 1);
+        err = 0;
+        len = sizeof(ngx_err_t);
 
-    name.data = p;
+        /*
+         * BSDs and Linux return 0 and set a pending error in err
+         * Solaris returns -1 and sets errno
+         */
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "upstream SSL server name: \"%s\"", name.data);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
 
-    if (SSL_set_tlsext_host_name(c->ssl->connection,
-                                 (char *) name.data)
-        == 0)
-    {
-        ngx_ssl_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "SSL_set_tlsext_host_name(\"%s\") failed", name.data);
-        return NGX_ERROR;
-    }
+        if (err) {
+            ev->error = 1;
+        }
 
-#endif
+        if (!u->cacheable && !ngx_http_upstream_coalesce_shared(u)
+            && u->peer.connection)
+        {
+            ngx_log_error(NGX_LOG_INFO, ev->log, err,
+                        "epoll_wait() reported that client prematurely closed "
+                        "connection, so upstream connection is closed too");
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_CLIENT_CLOSED_REQUEST);
+            return;
+        }
 
-done:
+        ngx_log_error(NGX_LOG_INFO, ev->log, err,
+                      "epoll_wait() reported that client prematurely closed "
+                      "connection");
 
-    u->ssl_name = name;
+        if (u->peer.connection == NULL) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_CLIENT_CLOSED_REQUEST);
+        }
 
-    return NGX_OK;
-}
+        return;
+    }
 
 #endif
 
+    n = recv(c->fd, buf, 1, MSG_PEEK);
 
-static ngx_int_t
-ngx_http_upstream_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
-{
-    off_t         file_pos;
-    ngx_chain_t  *cl;
-
-    if (u->reinit_request(r) != NGX_OK) {
-        return NGX_ERROR;
-    }
-
-    u->keepalive = 0;
-    u->upgrade = 0;
+    err = ngx_socket_errno;
 
-    ngx_memzero(&u->headers_in, sizeof(ngx_http_upstream_headers_in_t));
-    u->headers_in.content_length_n = -1;
-    u->headers_in.last_modified_time = -1;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, err,
+                   "http upstream recv(): %d", n);
 
-    if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
-                      sizeof(ngx_table_elt_t))
-        != NGX_OK)
-    {
-        return NGX_ERROR;
+    if (ev->write && (n >= 0 || err == NGX_EAGAIN)) {
+        return;
     }
 
-    /* reinit the request chain */
-
-    file_pos = 0;
-
-    for (cl = u->request_bufs; cl; cl = cl->next) {
-        cl->buf->pos = cl->buf->start;
+    if ((ngx_event_flags & NGX_USE_LEVEL_EVENT) && ev->active) {
 
-        /* there is at most one file */
+        event = ev->write ? NGX_WRITE_EVENT : NGX_READ_EVENT;
 
-        if (cl->buf->in_file) {
-            cl->buf->file_pos = file_pos;
-            file_pos = cl->buf->file_last;
+        if (ngx_del_event(ev, event, 0) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
         }
     }
 
-    /* reinit the subrequest's ngx_output_chain() context */
+    if (n > 0) {
+        return;
+    }
 
-    if (r->request_body && r->request_body->temp_file
-        && r != r->main && u->output.buf)
-    {
-        u->output.free = ngx_alloc_chain_link(r->pool);
-        if (u->output.free == NULL) {
-            return NGX_ERROR;
+    if (n == -1) {
+        if (err == NGX_EAGAIN) {
+            return;
         }
 
-        u->output.free->buf = u->output.buf;
-        u->output.free->next = NULL;
+        ev->error = 1;
 
-        u->output.buf->pos = u->output.buf->start;
-        u->output.buf->last = u->output.buf->start;
+    } else { /* n == 0 */
+        err = 0;
     }
 
-    u->output.buf = NULL;
-    u->output.in = NULL;
-    u->output.busy = NULL;
-
-    /* reinit u->buffer */
-
-    u->buffer.pos = u->buffer.start;
-
-#if (NGX_HTTP_CACHE)
+    ev->eof = 1;
+    c->error = 1;
 
-    if (r->cache) {
-        u->buffer.pos += r->cache->header_start;
+    if (!u->cacheable && !ngx_http_upstream_coalesce_shared(u)
+        && u->peer.connection)
+    {
+        ngx_log_error(NGX_LOG_INFO, ev->log, err,
+                      "client prematurely closed connection, "
+                      "so upstream connection is closed too");
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_CLIENT_CLOSED_REQUEST);
+        return;
     }
 
-#endif
-
-    u->buffer.last = u->buffer.pos;
+    ngx_log_error(NGX_LOG_INFO, ev->log, err,
+                  "client prematurely closed connection");
 
-    return NGX_OK;
+    if (u->peer.connection == NULL) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_CLIENT_CLOSED_REQUEST);
+    }
 }
 
 
 static void
-ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u,
-    ngx_uint_t do_write)
+ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
     ngx_int_t          rc;
     ngx_connection_t  *c;
 
-    c = u->peer.connection;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream send request");
+    r->connection->log->action = "connecting to upstream";
 
-    if (u->state->connect_time == (ngx_msec_t) -1) {
-        u->state->connect_time = ngx_current_msec - u->state->response_time;
+    if (u->state && u->state->response_time) {
+        u->state->response_time = ngx_current_msec - u->state->response_time;
     }
 
-    if (!u->request_sent && ngx_http_upstream_test_connect(c) != NGX_OK) {
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+    u->state = ngx_array_push(r->upstream_states);
+    if (u->state == NULL) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
         return;
     }
 
-    c->log->action = "sending request to upstream";
+    ngx_memzero(u->state, sizeof(ngx_http_upstream_state_t));
 
-    rc = ngx_http_upstream_send_request_body(r, u, do_write);
+    u->state->response_time = ngx_current_msec;
+    u->state->connect_time = (ngx_msec_t) -1;
+    u->state->header_time = (ngx_msec_t) -1;
+
+    rc = ngx_event_connect_peer(&u->peer);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream connect: %i", rc);
 
     if (rc == NGX_ERROR) {
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
         return;
     }
 
-    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
-        ngx_http_upstream_finalize_request(r, u, rc);
-        return;
-    }
+    u->state->peer = u->peer.name;
 
-    if (rc == NGX_AGAIN) {
-        if (!c->write->ready) {
-            ngx_add_timer(c->write, u->conf->send_timeout);
+    if (rc == NGX_BUSY) {
 
-        } else if (c->write->timer_set) {
-            ngx_del_timer(c->write);
-        }
+        if (u->hedge && u->hedge->peer.connection) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http upstream hedge: no live upstreams");
 
-        if (ngx_handle_write_event(c->write, u->conf->send_lowat) != NGX_OK) {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            r->upstream_states->nelts--;
+            u->state = NULL;
+
+            ngx_http_upstream_hedge_restore(r, u, 0);
             return;
         }
 
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "no live upstreams");
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_NOLIVE);
         return;
     }
 
-    /* rc == NGX_OK */
+    if (rc == NGX_DECLINED) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+        return;
+    }
 
-    u->request_body_sent = 1;
+    if (u->hedge && u->hedge->peer.connection
+        && ngx_memn2cmp((u_char *) u->peer.sockaddr,
+                        (u_char *) u->hedge->peer.sockaddr,
+                        u->peer.socklen, u->hedge->peer.socklen)
+           == 0)
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream hedge: same server selected");
 
-    if (c->write->timer_set) {
-        ngx_del_timer(c->write);
-    }
+        r->upstream_states->nelts--;
+        u->state = NULL;
 
-    if (c->tcp_nopush == NGX_TCP_NOPUSH_SET) {
-        if (ngx_tcp_push(c->fd) == NGX_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, c->log, ngx_socket_errno,
-                          ngx_tcp_push_n " failed");
+        ngx_http_upstream_hedge_restore(r, u, 0);
+        return;
+    }
+
+    /* rc == NGX_OK || rc == NGX_AGAIN || rc == NGX_DONE */
+
+    c = u->peer.connection;
+
+    c->requests++;
+
+    c->data = r;
+
+    c->write->handler = ngx_http_upstream_handler;
+    c->read->handler = ngx_http_upstream_handler;
+
+    u->write_event_handler = ngx_http_upstream_send_request_handler;
+    u->read_event_handler = ngx_http_upstream_process_header;
+
+    c->sendfile &= r->connection->sendfile;
+    u->output.sendfile = c->sendfile;
+
+    if (c->pool == NULL) {
+
+        /* we need separate pool here to be able to cache SSL connections */
+
+        c->pool = ngx_create_pool(128, r->connection->log);
+        if (c->pool == NULL) {
             ngx_http_upstream_finalize_request(r, u,
                                                NGX_HTTP_INTERNAL_SERVER_ERROR);
             return;
         }
+    }
 
-        c->tcp_nopush = NGX_TCP_NOPUSH_UNSET;
+    c->log = r->connection->log;
+    c->pool->log = c->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    /* init or reinit the ngx_output_chain() and ngx_chain_writer() contexts */
+
+    u->writer.out = NULL;
+    u->writer.last = &u->writer.out;
+    u->writer.connection = c;
+    u->writer.limit = 0;
+
+    if (u->request_sent) {
+        if (ngx_http_upstream_reinit(r, u) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
     }
 
-    u->write_event_handler = ngx_http_upstream_dummy_handler;
+    if (r->request_body
+        && r->request_body->buf
+        && r->request_body->temp_file
+        && r == r->main)
+    {
+        /*
+         * the r->request_body->buf can be reused for one request only,
+         * the subrequests should allocate their own temporary bufs
+         */
 
-    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
-        ngx_http_upstream_finalize_request(r, u,
-                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        u->output.free = ngx_alloc_chain_link(r->pool);
+        if (u->output.free == NULL) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        u->output.free->buf = r->request_body->buf;
+        u->output.free->next = NULL;
+        u->output.allocated = 1;
+
+        r->request_body->buf->pos = r->request_body->buf->start;
+        r->request_body->buf->last = r->request_body->buf->start;
+        r->request_body->buf->tag = u->output.tag;
+    }
+
+    u->request_sent = 0;
+    u->request_body_sent = 0;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, u->conf->connect_timeout);
         return;
     }
 
-    ngx_add_timer(c->read, u->conf->read_timeout);
+#if (NGX_HTTP_SSL)
 
-    if (c->read->ready) {
-        ngx_http_upstream_process_header(r, u);
+    if (u->ssl && c->ssl == NULL) {
+        ngx_http_upstream_ssl_init_connection(r, u, c);
         return;
     }
+
+#endif
+
+    ngx_http_upstream_send_request(r, u, 1);
 }
 
 
-static ngx_int_t
-ngx_http_upstream_send_request_body(ngx_http_request_t *r,
-    ngx_http_upstream_t *u, ngx_uint_t do_write)
+#if (NGX_HTTP_SSL)
+
+static void
+ngx_http_upstream_ssl_init_connection(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_connection_t *c)
 {
     int                        tcp_nodelay;
     ngx_int_t                  rc;
-    ngx_chain_t               *out, *cl, *ln;
-    ngx_connection_t          *c;
     ngx_http_core_loc_conf_t  *clcf;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http upstream send request body");
-
-    if (!r->request_body_no_buffering) {
+    if (ngx_http_upstream_test_connect(c) != NGX_OK) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+        return;
+    }
 
-        /* buffered request body */
+    if (ngx_ssl_create_connection(u->conf->ssl, c,
+                                  NGX_SSL_BUFFER|NGX_SSL_CLIENT)
+        != NGX_OK)
+    {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
 
-        if (!u->request_sent) {
-            u->request_sent = 1;
-            out = u->request_bufs;
+    c->sendfile = 0;
+    u->output.sendfile = 0;
 
-        } else {
-            out = NULL;
+    if (u->conf->ssl_server_name || u->conf->ssl_verify) {
+        if (ngx_http_upstream_ssl_name(r, u, c) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
         }
-
-        return ngx_output_chain(&u->output, out);
     }
 
-    if (!u->request_sent) {
-        u->request_sent = 1;
-        out = u->request_bufs;
-
-        if (r->request_body->bufs) {
-            for (cl = out; cl->next; cl = out->next) { /* void */ }
-            cl->next = r->request_body->bufs;
-            r->request_body->bufs = NULL;
+    if (u->conf->ssl_session_reuse) {
+        if (u->peer.set_session(&u->peer, u->peer.data) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
         }
 
-        c = u->peer.connection;
+        /* abbreviated SSL handshake may interact badly with Nagle */
+
         clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
         if (clcf->tcp_nodelay && c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
@@ -2061,2152 +2288,3848 @@ ngx_http_upstream_send_request_body(ngx_http_request_t *r,
             {
                 ngx_connection_error(c, ngx_socket_errno,
                                      "setsockopt(TCP_NODELAY) failed");
-                return NGX_ERROR;
+                ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+                return;
             }
 
             c->tcp_nodelay = NGX_TCP_NODELAY_SET;
         }
-
-        r->read_event_handler = ngx_http_upstream_read_request_handler;
-
-    } else {
-        out = NULL;
     }
 
-    for ( ;; ) {
-
-        if (do_write) {
-            rc = ngx_output_chain(&u->output, out);
+    r->connection->log->action = "SSL handshaking to upstream";
 
-            if (rc == NGX_ERROR) {
-                return NGX_ERROR;
-            }
+    rc = ngx_ssl_handshake(c);
 
-            while (out) {
-                ln = out;
-                out = out->next;
-                ngx_free_chain(r->pool, ln);
-            }
+    if (rc == NGX_AGAIN) {
 
-            if (rc == NGX_OK && !r->reading_body) {
-                break;
-            }
+        if (!c->write->timer_set) {
+            ngx_add_timer(c->write, u->conf->connect_timeout);
         }
 
-        if (r->reading_body) {
-            /* read client request body */
+        c->ssl->handler = ngx_http_upstream_ssl_handshake;
+        return;
+    }
 
-            rc = ngx_http_read_unbuffered_request_body(r);
+    ngx_http_upstream_ssl_handshake(c);
+}
 
-            if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
-                return rc;
-            }
 
-            out = r->request_body->bufs;
-            r->request_body->bufs = NULL;
-        }
+static void
+ngx_http_upstream_ssl_handshake(ngx_connection_t *c)
+{
+    long                  rc;
+    ngx_http_request_t   *r;
+    ngx_http_upstream_t  *u;
 
-        /* stop if there is nothing to send */
+    r = c->data;
+    u = r->upstream;
 
-        if (out == NULL) {
-            rc = NGX_AGAIN;
-            break;
-        }
+    ngx_http_set_log_request(c->log, r);
 
-        do_write = 1;
-    }
+    if (c->ssl->handshaked) {
 
-    if (!r->reading_body) {
-        if (!u->store && !r->post_action && !u->conf->ignore_client_abort) {
-            r->read_event_handler =
-                                  ngx_http_upstream_rd_check_broken_connection;
+        if (u->conf->ssl_verify) {
+            rc = SSL_get_verify_result(c->ssl->connection);
+
+            if (rc != X509_V_OK) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream SSL certificate verify error: (%l:%s)",
+                              rc, X509_verify_cert_error_string(rc));
+                goto failed;
+            }
+
+            if (ngx_ssl_check_host(c, &u->ssl_name) != NGX_OK) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream SSL certificate does not match \"%V\"",
+                              &u->ssl_name);
+                goto failed;
+            }
         }
-    }
 
-    return rc;
-}
+        if (u->conf->ssl_session_reuse) {
+            u->peer.save_session(&u->peer, u->peer.data);
+        }
 
+        c->write->handler = ngx_http_upstream_handler;
+        c->read->handler = ngx_http_upstream_handler;
 
-static void
-ngx_http_upstream_send_request_handler(ngx_http_request_t *r,
-    ngx_http_upstream_t *u)
-{
-    ngx_connection_t  *c;
+        c = r->connection;
 
-    c = u->peer.connection;
+        ngx_http_upstream_send_request(r, u, 1);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http upstream send request handler");
+        ngx_http_run_posted_requests(c);
+        return;
+    }
 
     if (c->write->timedout) {
+        c = r->connection;
         ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_TIMEOUT);
+        ngx_http_run_posted_requests(c);
         return;
     }
 
-#if (NGX_HTTP_SSL)
+failed:
 
-    if (u->ssl && c->ssl == NULL) {
-        ngx_http_upstream_ssl_init_connection(r, u, c);
-        return;
-    }
-
-#endif
-
-    if (u->header_sent) {
-        u->write_event_handler = ngx_http_upstream_dummy_handler;
-
-        (void) ngx_handle_write_event(c->write, 0);
+    c = r->connection;
 
-        return;
-    }
+    ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
 
-    ngx_http_upstream_send_request(r, u, 1);
+    ngx_http_run_posted_requests(c);
 }
 
 
-static void
-ngx_http_upstream_read_request_handler(ngx_http_request_t *r)
+static ngx_int_t
+ngx_http_upstream_ssl_name(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_connection_t *c)
 {
-    ngx_connection_t     *c;
-    ngx_http_upstream_t  *u;
-
-    c = r->connection;
-    u = r->upstream;
+    u_char     *p, *last;
+    ngx_str_t   name;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http upstream read request handler");
+    if (u->conf->ssl_name) {
+        if (ngx_http_complex_value(r, u->conf->ssl_name, &name) != NGX_OK) {
+            return NGX_ERROR;
+        }
 
-    if (c->read->timedout) {
-        c->timedout = 1;
-        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
-        return;
+    } else {
+        name = u->ssl_name;
     }
 
-    ngx_http_upstream_send_request(r, u, 0);
-}
+    if (name.len == 0) {
+        goto done;
+    }
 
+    /*
+     * ssl name here may contain port, notably if derived from $proxy_host
+     * or $http_host; we have to strip it
+     */
 
-static void
-ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
-{
-    ssize_t            n;
-    ngx_int_t          rc;
-    ngx_connection_t  *c;
+    p = name.data;
+    last = name.data + name.len;
 
-    c = u->peer.connection;
+    if (*p == '[') {
+        p = ngx_strlchr(p, last, ']');
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream process header");
+        if (p == NULL) {
+            p = name.data;
+        }
+    }
 
-    c->log->action = "reading response header from upstream";
+    p = ngx_strlchr(p, last, ':');
 
-    if (c->read->timedout) {
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_TIMEOUT);
-        return;
+    if (p != NULL) {
+        name.len = p - name.data;
     }
 
-    if (!u->request_sent && ngx_http_upstream_test_connect(c) != NGX_OK) {
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
-        return;
+    if (!u->conf->ssl_server_name) {
+        goto done;
     }
 
-    if (u->buffer.start == NULL) {
-        u->buffer.start = ngx_palloc(r->pool, u->conf->buffer_size);
-        if (u->buffer.start == NULL) {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return;
-        }
-
-        u->buffer.pos = u->buffer.start;
-        u->buffer.last = u->buffer.start;
-        u->buffer.end = u->buffer.start + u->conf->buffer_size;
-        u->buffer.temporary = 1;
-
-        u->buffer.tag = u->output.tag;
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
 
-        if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
-                          sizeof(ngx_table_elt_t))
-            != NGX_OK)
-        {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return;
-        }
+    /* as per RFC 6066, literal IPv4 and IPv6 addresses are not permitted */
 
-#if (NGX_HTTP_CACHE)
+    if (name.len == 0 || *name.data == '[') {
+        goto done;
+    }
 
-        if (r->cache) {
-            u->buffer.pos += r->cache->header_start;
-            u->buffer.last = u->buffer.pos;
-        }
-#endif
+    if (ngx_inet_addr(name.data, name.len) != INADDR_NONE) {
+        goto done;
     }
 
-    for ( ;; ) {
+    /*
+     * SSL_set_tlsext_host_name() needs a null-terminated string,
+     * hence we explicitly null-terminate name here
+     */
 
-        n = c->recv(c, u->buffer.last, u->buffer.end - u->buffer.last);
+    p = ngx_pnalloc(r->pool, name.len + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
 
-        if (n == NGX_AGAIN) {
-#if 0
-            ngx_add_timer(rev, u->read_timeout);
-#endif
+    (void) ngx_cpystrn(p, name.data, name.len + 1);
 
-            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
-                ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-                return;
-            }
+    name.data = p;
 
-            return;
-        }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "upstream SSL server name: \"%s\"", name.data);
 
-        if (n == 0) {
-            ngx_log_error(NGX_LOG_ERR, c->log, 0,
-                          "upstream prematurely closed connection");
-        }
+    if (SSL_set_tlsext_host_name(c->ssl->connection,
+                                 (char *) name.data)
+        == 0)
+    {
+        ngx_ssl_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "SSL_set_tlsext_host_name(\"%s\") failed", name.data);
+        return NGX_ERROR;
+    }
 
-        if (n == NGX_ERROR || n == 0) {
-            ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
-            return;
-        }
+#endif
 
-        u->state->bytes_received += n;
+done:
 
-        u->buffer.last += n;
+    u->ssl_name = name;
 
-#if 0
-        u->valid_header_in = 0;
+    return NGX_OK;
+}
 
-        u->peer.cached = 0;
 #endif
 
-        rc = u->process_header(r);
-
-        if (rc == NGX_AGAIN) {
 
-            if (u->buffer.last == u->buffer.end) {
-                ngx_log_error(NGX_LOG_ERR, c->log, 0,
-                              "upstream sent too big header");
+static ngx_int_t
+ngx_http_upstream_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    off_t         file_pos;
+    ngx_chain_t  *cl;
 
-                ngx_http_upstream_next(r, u,
-                                       NGX_HTTP_UPSTREAM_FT_INVALID_HEADER);
-                return;
-            }
+    if (u->reinit_request(r) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-            continue;
-        }
+    u->keepalive = 0;
+    u->upgrade = 0;
 
-        break;
-    }
+    ngx_memzero(&u->headers_in, sizeof(ngx_http_upstream_headers_in_t));
+    u->headers_in.content_length_n = -1;
+    u->headers_in.last_modified_time = -1;
 
-    if (rc == NGX_HTTP_UPSTREAM_INVALID_HEADER) {
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_INVALID_HEADER);
-        return;
+    if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
     }
 
-    if (rc == NGX_ERROR) {
-        ngx_http_upstream_finalize_request(r, u,
-                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
-        return;
-    }
+    /* reinit the request chain */
 
-    /* rc == NGX_OK */
+    file_pos = 0;
 
-    u->state->header_time = ngx_current_msec - u->state->response_time;
+    for (cl = u->request_bufs; cl; cl = cl->next) {
+        cl->buf->pos = cl->buf->start;
 
-    if (u->headers_in.status_n >= NGX_HTTP_SPECIAL_RESPONSE) {
+        /* there is at most one file */
 
-        if (ngx_http_upstream_test_next(r, u) == NGX_OK) {
-            return;
+        if (cl->buf->in_file) {
+            cl->buf->file_pos = file_pos;
+            file_pos = cl->buf->file_last;
         }
+    }
 
-        if (ngx_http_upstream_intercept_errors(r, u) == NGX_OK) {
-            return;
+    /* reinit the subrequest's ngx_output_chain() context */
+
+    if (r->request_body && r->request_body->temp_file
+        && r != r->main && u->output.buf)
+    {
+        u->output.free = ngx_alloc_chain_link(r->pool);
+        if (u->output.free == NULL) {
+            return NGX_ERROR;
         }
-    }
 
-    if (ngx_http_upstream_process_headers(r, u) != NGX_OK) {
-        return;
-    }
+        u->output.free->buf = u->output.buf;
+        u->output.free->next = NULL;
 
-    if (!r->subrequest_in_memory) {
-        ngx_http_upstream_send_response(r, u);
-        return;
+        u->output.buf->pos = u->output.buf->start;
+        u->output.buf->last = u->output.buf->start;
     }
 
-    /* subrequest content in memory */
+    u->output.buf = NULL;
+    u->output.in = NULL;
+    u->output.busy = NULL;
 
-    if (u->input_filter == NULL) {
-        u->input_filter_init = ngx_http_upstream_non_buffered_filter_init;
-        u->input_filter = ngx_http_upstream_non_buffered_filter;
-        u->input_filter_ctx = r;
-    }
+    /* reinit u->buffer */
 
-    if (u->input_filter_init(u->input_filter_ctx) == NGX_ERROR) {
-        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-        return;
-    }
+    u->buffer.pos = u->buffer.start;
 
-    n = u->buffer.last - u->buffer.pos;
+#if (NGX_HTTP_CACHE)
 
-    if (n) {
-        u->buffer.last = u->buffer.pos;
-
-        u->state->response_length += n;
-
-        if (u->input_filter(u->input_filter_ctx, n) == NGX_ERROR) {
-            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-            return;
-        }
+    if (r->cache) {
+        u->buffer.pos += r->cache->header_start;
     }
 
-    if (u->length == 0) {
-        ngx_http_upstream_finalize_request(r, u, 0);
-        return;
-    }
+#endif
 
-    u->read_event_handler = ngx_http_upstream_process_body_in_memory;
+    u->buffer.last = u->buffer.pos;
 
-    ngx_http_upstream_process_body_in_memory(r, u);
+    return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_http_upstream_test_next(ngx_http_request_t *r, ngx_http_upstream_t *u)
+static void
+ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_uint_t do_write)
 {
-    ngx_uint_t                 status;
-    ngx_http_upstream_next_t  *un;
-
-    status = u->headers_in.status_n;
-
-    for (un = ngx_http_upstream_next_errors; un->status; un++) {
-
-        if (status != un->status) {
-            continue;
-        }
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
 
-        if (u->peer.tries > 1 && (u->conf->next_upstream & un->mask)) {
-            ngx_http_upstream_next(r, u, un->mask);
-            return NGX_OK;
-        }
+    c = u->peer.connection;
 
-#if (NGX_HTTP_CACHE)
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream send request");
 
-        if (u->cache_status == NGX_HTTP_CACHE_EXPIRED
-            && ((u->conf->cache_use_stale & un->mask) || r->cache->stale_error))
-        {
-            ngx_int_t  rc;
+    if (u->state->connect_time == (ngx_msec_t) -1) {
+        u->state->connect_time = ngx_current_msec - u->state->response_time;
+    }
 
-            rc = u->reinit_request(r);
+    if (!u->request_sent && ngx_http_upstream_test_connect(c) != NGX_OK) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+        return;
+    }
 
-            if (rc == NGX_OK) {
-                u->cache_status = NGX_HTTP_CACHE_STALE;
-                rc = ngx_http_upstream_cache_send(r, u);
-            }
+    c->log->action = "sending request to upstream";
 
-            ngx_http_upstream_finalize_request(r, u, rc);
-            return NGX_OK;
-        }
+    rc = ngx_http_upstream_send_request_body(r, u, do_write);
 
-#endif
+    if (rc == NGX_ERROR) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+        return;
     }
 
-#if (NGX_HTTP_CACHE)
-
-    if (status == NGX_HTTP_NOT_MODIFIED
-        && u->cache_status == NGX_HTTP_CACHE_EXPIRED
-        && u->conf->cache_revalidate)
-    {
-        time_t     now, valid, updating, error;
-        ngx_int_t  rc;
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        ngx_http_upstream_finalize_request(r, u, rc);
+        return;
+    }
 
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http upstream not modified");
+    if (rc == NGX_AGAIN) {
+        if (!c->write->ready) {
+            ngx_add_timer(c->write, u->conf->send_timeout);
 
-        now = ngx_time();
+        } else if (c->write->timer_set) {
+            ngx_del_timer(c->write);
+        }
 
-        valid = r->cache->valid_sec;
-        updating = r->cache->updating_sec;
-        error = r->cache->error_sec;
+        if (ngx_handle_write_event(c->write, u->conf->send_lowat) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
 
-        rc = u->reinit_request(r);
+        return;
+    }
 
-        if (rc != NGX_OK) {
-            ngx_http_upstream_finalize_request(r, u, rc);
-            return NGX_OK;
-        }
+    /* rc == NGX_OK */
 
-        u->cache_status = NGX_HTTP_CACHE_REVALIDATED;
-        rc = ngx_http_upstream_cache_send(r, u);
+    u->request_body_sent = 1;
 
-        if (valid == 0) {
-            valid = r->cache->valid_sec;
-            updating = r->cache->updating_sec;
-            error = r->cache->error_sec;
-        }
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
 
-        if (valid == 0) {
-            valid = ngx_http_file_cache_valid(u->conf->cache_valid,
-                                              u->headers_in.status_n);
-            if (valid) {
-                valid = now + valid;
-            }
+    if (c->tcp_nopush == NGX_TCP_NOPUSH_SET) {
+        if (ngx_tcp_push(c->fd) == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, c->log, ngx_socket_errno,
+                          ngx_tcp_push_n " failed");
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
         }
 
-        if (valid) {
-            r->cache->valid_sec = valid;
-            r->cache->updating_sec = updating;
-            r->cache->error_sec = error;
-
-            r->cache->date = now;
+        c->tcp_nopush = NGX_TCP_NOPUSH_UNSET;
+    }
 
-            ngx_http_file_cache_update_header(r);
-        }
+    u->write_event_handler = ngx_http_upstream_dummy_handler;
 
-        ngx_http_upstream_finalize_request(r, u, rc);
-        return NGX_OK;
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
     }
 
-#endif
+    ngx_add_timer(c->read, u->conf->read_timeout);
 
-    return NGX_DECLINED;
+    ngx_http_upstream_hedge_arm(r, u);
+
+    if (c->read->ready) {
+        ngx_http_upstream_process_header(r, u);
+        return;
+    }
 }
 
 
 static ngx_int_t
-ngx_http_upstream_intercept_errors(ngx_http_request_t *r,
-    ngx_http_upstream_t *u)
+ngx_http_upstream_send_request_body(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_uint_t do_write)
 {
-    ngx_int_t                  status;
-    ngx_uint_t                 i;
-    ngx_table_elt_t           *h;
-    ngx_http_err_page_t       *err_page;
+    int                        tcp_nodelay;
+    ngx_int_t                  rc;
+    ngx_chain_t               *out, *cl, *ln;
+    ngx_connection_t          *c;
     ngx_http_core_loc_conf_t  *clcf;
 
-    status = u->headers_in.status_n;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream send request body");
 
-    if (status == NGX_HTTP_NOT_FOUND && u->conf->intercept_404) {
-        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_NOT_FOUND);
-        return NGX_OK;
-    }
+    if (!r->request_body_no_buffering) {
 
-    if (!u->conf->intercept_errors) {
-        return NGX_DECLINED;
-    }
+        /* buffered request body */
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+        if (!u->request_sent) {
+            u->request_sent = 1;
+            out = u->request_bufs;
 
-    if (clcf->error_pages == NULL) {
-        return NGX_DECLINED;
+        } else {
+            out = NULL;
+        }
+
+        return ngx_output_chain(&u->output, out);
     }
 
-    err_page = clcf->error_pages->elts;
-    for (i = 0; i < clcf->error_pages->nelts; i++) {
+    if (!u->request_sent) {
+        u->request_sent = 1;
+        out = u->request_bufs;
 
-        if (err_page[i].status == status) {
+        if (r->request_body->bufs) {
+            for (cl = out; cl->next; cl = out->next) { /* void */ }
+            cl->next = r->request_body->bufs;
+            r->request_body->bufs = NULL;
+        }
 
-            if (status == NGX_HTTP_UNAUTHORIZED
-                && u->headers_in.www_authenticate)
-            {
-                h = ngx_list_push(&r->headers_out.headers);
+        c = u->peer.connection;
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-                if (h == NULL) {
-                    ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-                    return NGX_OK;
-                }
+        if (clcf->tcp_nodelay && c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
 
-                *h = *u->headers_in.www_authenticate;
+            tcp_nodelay = 1;
 
-                r->headers_out.www_authenticate = h;
+            if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
+                           (const void *) &tcp_nodelay, sizeof(int)) == -1)
+            {
+                ngx_connection_error(c, ngx_socket_errno,
+                                     "setsockopt(TCP_NODELAY) failed");
+                return NGX_ERROR;
             }
 
-#if (NGX_HTTP_CACHE)
+            c->tcp_nodelay = NGX_TCP_NODELAY_SET;
+        }
 
-            if (r->cache) {
-                time_t  valid;
+        r->read_event_handler = ngx_http_upstream_read_request_handler;
 
-                valid = ngx_http_file_cache_valid(u->conf->cache_valid, status);
+    } else {
+        out = NULL;
+    }
 
-                if (valid) {
-                    r->cache->valid_sec = ngx_time() + valid;
-                    r->cache->error = status;
-                }
+    for ( ;; ) {
 
-                ngx_http_file_cache_free(r->cache, u->pipe->temp_file);
+        if (do_write) {
+            rc = ngx_output_chain(&u->output, out);
+
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
             }
-#endif
-            ngx_http_upstream_finalize_request(r, u, status);
 
-            return NGX_OK;
-        }
-    }
+            while (out) {
+                ln = out;
+                out = out->next;
+                ngx_free_chain(r->pool, ln);
+            }
 
-    return NGX_DECLINED;
-}
-
-
-static ngx_int_t
-ngx_http_upstream_test_connect(ngx_connection_t *c)
-{
-    int        err;
-    socklen_t  len;
+            if (rc == NGX_OK && !r->reading_body) {
+                break;
+            }
+        }
 
-#if (NGX_HAVE_KQUEUE)
+        if (r->reading_body) {
+            /* read client request body */
 
-    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
-        if (c->write->pending_eof || c->read->pending_eof) {
-            if (c->write->pending_eof) {
-                err = c->write->kq_errno;
+            rc = ngx_http_read_unbuffered_request_body(r);
 
-            } else {
-                err = c->read->kq_errno;
+            if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+                return rc;
             }
 
-            c->log->action = "connecting to upstream";
-            (void) ngx_connection_error(c, err,
-                                    "kevent() reported that connect() failed");
-            return NGX_ERROR;
+            out = r->request_body->bufs;
+            r->request_body->bufs = NULL;
         }
 
-    } else
-#endif
-    {
-        err = 0;
-        len = sizeof(int);
-
-        /*
-         * BSDs and Linux return 0 and set a pending error in err
-         * Solaris returns -1 and sets errno
-         */
+        /* stop if there is nothing to send */
 
-        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
-            == -1)
-        {
-            err = ngx_socket_errno;
+        if (out == NULL) {
+            rc = NGX_AGAIN;
+            break;
         }
 
-        if (err) {
-            c->log->action = "connecting to upstream";
-            (void) ngx_connection_error(c, err, "connect() failed");
-            return NGX_ERROR;
+        do_write = 1;
+    }
+
+    if (!r->reading_body) {
+        if (!u->store && !r->post_action && !u->conf->ignore_client_abort) {
+            r->read_event_handler =
+                                  ngx_http_upstream_rd_check_broken_connection;
         }
     }
 
-    return NGX_OK;
+    return rc;
 }
 
 
-static ngx_int_t
-ngx_http_upstream_process_headers(ngx_http_request_t *r, ngx_http_upstream_t *u)
+static void
+ngx_http_upstream_send_request_handler(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
 {
-    ngx_str_t                       uri, args;
-    ngx_uint_t                      i, flags;
-    ngx_list_part_t                *part;
-    ngx_table_elt_t                *h;
-    ngx_http_upstream_header_t     *hh;
-    ngx_http_upstream_main_conf_t  *umcf;
+    ngx_connection_t  *c;
 
-    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+    c = u->peer.connection;
 
-    if (u->headers_in.x_accel_redirect
-        && !(u->conf->ignore_headers & NGX_HTTP_UPSTREAM_IGN_XA_REDIRECT))
-    {
-        ngx_http_upstream_finalize_request(r, u, NGX_DECLINED);
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream send request handler");
 
-        part = &u->headers_in.headers.part;
-        h = part->elts;
+    if (c->write->timedout) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_TIMEOUT);
+        return;
+    }
 
-        for (i = 0; /* void */; i++) {
+#if (NGX_HTTP_SSL)
 
-            if (i >= part->nelts) {
-                if (part->next == NULL) {
-                    break;
-                }
+    if (u->ssl && c->ssl == NULL) {
+        ngx_http_upstream_ssl_init_connection(r, u, c);
+        return;
+    }
 
-                part = part->next;
-                h = part->elts;
-                i = 0;
-            }
+#endif
 
-            hh = ngx_hash_find(&umcf->headers_in_hash, h[i].hash,
-                               h[i].lowcase_key, h[i].key.len);
+    if (u->header_sent) {
+        u->write_event_handler = ngx_http_upstream_dummy_handler;
 
-            if (hh && hh->redirect) {
-                if (hh->copy_handler(r, &h[i], hh->conf) != NGX_OK) {
-                    ngx_http_finalize_request(r,
-                                              NGX_HTTP_INTERNAL_SERVER_ERROR);
-                    return NGX_DONE;
-                }
-            }
-        }
+        (void) ngx_handle_write_event(c->write, 0);
 
-        uri = u->headers_in.x_accel_redirect->value;
+        return;
+    }
 
-        if (uri.data[0] == '@') {
-            ngx_http_named_location(r, &uri);
+    ngx_http_upstream_send_request(r, u, 1);
+}
 
-        } else {
-            ngx_str_null(&args);
-            flags = NGX_HTTP_LOG_UNSAFE;
 
-            if (ngx_http_parse_unsafe_uri(r, &uri, &args, &flags) != NGX_OK) {
-                ngx_http_finalize_request(r, NGX_HTTP_NOT_FOUND);
-                return NGX_DONE;
-            }
+static void
+ngx_http_upstream_read_request_handler(ngx_http_request_t *r)
+{
+    ngx_connection_t     *c;
+    ngx_http_upstream_t  *u;
 
-            if (r->method != NGX_HTTP_HEAD) {
-                r->method = NGX_HTTP_GET;
-                r->method_name = ngx_http_core_get_method;
-            }
+    c = r->connection;
+    u = r->upstream;
 
-            ngx_http_internal_redirect(r, &uri, &args);
-        }
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream read request handler");
 
-        ngx_http_finalize_request(r, NGX_DONE);
-        return NGX_DONE;
+    if (c->read->timedout) {
+        c->timedout = 1;
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
     }
 
-    part = &u->headers_in.headers.part;
-    h = part->elts;
+    ngx_http_upstream_send_request(r, u, 0);
+}
 
-    for (i = 0; /* void */; i++) {
 
-        if (i >= part->nelts) {
-            if (part->next == NULL) {
-                break;
-            }
+static void
+ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ssize_t            n;
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
 
-            part = part->next;
-            h = part->elts;
-            i = 0;
-        }
+    c = u->peer.connection;
 
-        if (ngx_hash_find(&u->conf->hide_headers_hash, h[i].hash,
-                          h[i].lowcase_key, h[i].key.len))
-        {
-            continue;
-        }
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream process header");
 
-        hh = ngx_hash_find(&umcf->headers_in_hash, h[i].hash,
-                           h[i].lowcase_key, h[i].key.len);
+    c->log->action = "reading response header from upstream";
 
-        if (hh) {
-            if (hh->copy_handler(r, &h[i], hh->conf) != NGX_OK) {
-                ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-                return NGX_DONE;
-            }
+    if (c->read->timedout) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_TIMEOUT);
+        return;
+    }
 
-            continue;
-        }
+    if (!u->request_sent && ngx_http_upstream_test_connect(c) != NGX_OK) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+        return;
+    }
 
-        if (ngx_http_upstream_copy_header_line(r, &h[i], 0) != NGX_OK) {
+    if (u->buffer.start == NULL) {
+        u->buffer.start = ngx_palloc(r->pool, u->conf->buffer_size);
+        if (u->buffer.start == NULL) {
             ngx_http_upstream_finalize_request(r, u,
                                                NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return NGX_DONE;
+            return;
         }
-    }
-
-    if (r->headers_out.server && r->headers_out.server->value.data == NULL) {
-        r->headers_out.server->hash = 0;
-    }
-
-    if (r->headers_out.date && r->headers_out.date->value.data == NULL) {
-        r->headers_out.date->hash = 0;
-    }
-
-    r->headers_out.status = u->headers_in.status_n;
-    r->headers_out.status_line = u->headers_in.status_line;
 
-    r->headers_out.content_length_n = u->headers_in.content_length_n;
+        u->buffer.pos = u->buffer.start;
+        u->buffer.last = u->buffer.start;
+        u->buffer.end = u->buffer.start + u->conf->buffer_size;
+        u->buffer.temporary = 1;
 
-    r->disable_not_modified = !u->cacheable;
+        u->buffer.tag = u->output.tag;
 
-    if (u->conf->force_ranges) {
-        r->allow_ranges = 1;
-        r->single_range = 1;
+        if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
+                          sizeof(ngx_table_elt_t))
+            != NGX_OK)
+        {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
 
 #if (NGX_HTTP_CACHE)
-        if (r->cached) {
-            r->single_range = 0;
+
+        if (r->cache) {
+            u->buffer.pos += r->cache->header_start;
+            u->buffer.last = u->buffer.pos;
         }
 #endif
     }
 
-    u->length = -1;
-
-    return NGX_OK;
-}
+    for ( ;; ) {
 
+        n = c->recv(c, u->buffer.last, u->buffer.end - u->buffer.last);
 
-static void
-ngx_http_upstream_process_body_in_memory(ngx_http_request_t *r,
-    ngx_http_upstream_t *u)
-{
-    size_t             size;
-    ssize_t            n;
-    ngx_buf_t         *b;
-    ngx_event_t       *rev;
-    ngx_connection_t  *c;
+        if (n == NGX_AGAIN) {
+#if 0
+            ngx_add_timer(rev, u->read_timeout);
+#endif
 
-    c = u->peer.connection;
-    rev = c->read;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream process body on memory");
-
-    if (rev->timedout) {
-        ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
-        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_GATEWAY_TIME_OUT);
-        return;
-    }
-
-    b = &u->buffer;
-
-    for ( ;; ) {
-
-        size = b->end - b->last;
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+                return;
+            }
 
-        if (size == 0) {
-            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
-                          "upstream buffer is too small to read response");
-            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
             return;
         }
 
-        n = c->recv(c, b->last, size);
-
-        if (n == NGX_AGAIN) {
-            break;
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream prematurely closed connection");
         }
 
-        if (n == 0 || n == NGX_ERROR) {
-            ngx_http_upstream_finalize_request(r, u, n);
+        if (n == NGX_ERROR || n == 0) {
+            ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
             return;
         }
 
+        if (u->hedge) {
+            ngx_http_upstream_hedge_stop(r, u);
+        }
+
         u->state->bytes_received += n;
-        u->state->response_length += n;
 
-        if (u->input_filter(u->input_filter_ctx, n) == NGX_ERROR) {
-            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-            return;
-        }
+        u->buffer.last += n;
 
-        if (!rev->ready) {
-            break;
-        }
-    }
+#if 0
+        u->valid_header_in = 0;
 
-    if (u->length == 0) {
-        ngx_http_upstream_finalize_request(r, u, 0);
-        return;
-    }
+        u->peer.cached = 0;
+#endif
 
-    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
-        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-        return;
-    }
+        rc = u->process_header(r);
 
-    if (rev->active) {
-        ngx_add_timer(rev, u->conf->read_timeout);
+        if (rc == NGX_AGAIN) {
 
-    } else if (rev->timer_set) {
-        ngx_del_timer(rev);
-    }
-}
+            if (u->buffer.last == u->buffer.end) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream sent too big header");
 
+                ngx_http_upstream_next(r, u,
+                                       NGX_HTTP_UPSTREAM_FT_INVALID_HEADER);
+                return;
+            }
 
-static void
-ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
-{
-    int                        tcp_nodelay;
-    ssize_t                    n;
-    ngx_int_t                  rc;
-    ngx_event_pipe_t          *p;
-    ngx_connection_t          *c;
-    ngx_http_core_loc_conf_t  *clcf;
+            continue;
+        }
 
-    rc = ngx_http_send_header(r);
+        break;
+    }
 
-    if (rc == NGX_ERROR || rc > NGX_OK || r->post_action) {
-        ngx_http_upstream_finalize_request(r, u, rc);
+    if (rc == NGX_HTTP_UPSTREAM_INVALID_HEADER) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_INVALID_HEADER);
         return;
     }
 
-    u->header_sent = 1;
-
-    if (u->upgrade) {
-
-#if (NGX_HTTP_CACHE)
+    if (rc == NGX_ERROR) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
 
-        if (r->cache) {
-            ngx_http_file_cache_free(r->cache, u->pipe->temp_file);
-        }
+    /* rc == NGX_OK */
 
-#endif
+    u->state->header_time = ngx_current_msec - u->state->response_time;
 
-        ngx_http_upstream_upgrade(r, u);
-        return;
+    if (u->upstream && u->upstream->hedge) {
+        ngx_http_upstream_hedge_sample(u->upstream->hedge,
+                                       u->state->header_time);
     }
 
-    c = r->connection;
-
-    if (r->header_only) {
+    if (u->headers_in.status_n >= NGX_HTTP_SPECIAL_RESPONSE) {
 
-        if (!u->buffering) {
-            ngx_http_upstream_finalize_request(r, u, rc);
+        if (ngx_http_upstream_test_next(r, u) == NGX_OK) {
             return;
         }
 
-        if (!u->cacheable && !u->store) {
-            ngx_http_upstream_finalize_request(r, u, rc);
+        if (ngx_http_upstream_intercept_errors(r, u) == NGX_OK) {
             return;
         }
-
-        u->pipe->downstream_error = 1;
     }
 
-    if (r->request_body && r->request_body->temp_file) {
-        ngx_pool_run_cleanup_file(r->pool, r->request_body->temp_file->file.fd);
-        r->request_body->temp_file->file.fd = NGX_INVALID_FILE;
+    if (ngx_http_upstream_process_headers(r, u) != NGX_OK) {
+        return;
     }
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-
-    if (!u->buffering) {
+    if (!r->subrequest_in_memory) {
+        ngx_http_upstream_send_response(r, u);
+        return;
+    }
 
-#if (NGX_HTTP_CACHE)
+    /* subrequest content in memory */
 
-        if (r->cache) {
-            ngx_http_file_cache_free(r->cache, u->pipe->temp_file);
-        }
+    if (u->input_filter == NULL) {
+        u->input_filter_init = ngx_http_upstream_non_buffered_filter_init;
+        u->input_filter = ngx_http_upstream_non_buffered_filter;
+        u->input_filter_ctx = r;
+    }
 
-#endif
+    if (u->input_filter_init(u->input_filter_ctx) == NGX_ERROR) {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
 
-        if (u->input_filter == NULL) {
-            u->input_filter_init = ngx_http_upstream_non_buffered_filter_init;
-            u->input_filter = ngx_http_upstream_non_buffered_filter;
-            u->input_filter_ctx = r;
-        }
+    n = u->buffer.last - u->buffer.pos;
 
-        u->read_event_handler = ngx_http_upstream_process_non_buffered_upstream;
-        r->write_event_handler =
-                             ngx_http_upstream_process_non_buffered_downstream;
+    if (n) {
+        u->buffer.last = u->buffer.pos;
 
-        r->limit_rate = 0;
+        u->state->response_length += n;
 
-        if (u->input_filter_init(u->input_filter_ctx) == NGX_ERROR) {
+        if (u->input_filter(u->input_filter_ctx, n) == NGX_ERROR) {
             ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
             return;
         }
+    }
 
-        if (clcf->tcp_nodelay && c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
+    if (u->length == 0) {
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
 
-            tcp_nodelay = 1;
+    u->read_event_handler = ngx_http_upstream_process_body_in_memory;
 
-            if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
-                               (const void *) &tcp_nodelay, sizeof(int)) == -1)
-            {
-                ngx_connection_error(c, ngx_socket_errno,
-                                     "setsockopt(TCP_NODELAY) failed");
-                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-                return;
-            }
+    ngx_http_upstream_process_body_in_memory(r, u);
+}
 
-            c->tcp_nodelay = NGX_TCP_NODELAY_SET;
-        }
 
-        n = u->buffer.last - u->buffer.pos;
+static ngx_int_t
+ngx_http_upstream_test_next(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_uint_t                 status;
+    ngx_http_upstream_next_t  *un;
 
-        if (n) {
-            u->buffer.last = u->buffer.pos;
+    status = u->headers_in.status_n;
 
-            u->state->response_length += n;
+    for (un = ngx_http_upstream_next_errors; un->status; un++) {
 
-            if (u->input_filter(u->input_filter_ctx, n) == NGX_ERROR) {
-                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-                return;
-            }
+        if (status != un->status) {
+            continue;
+        }
 
-            ngx_http_upstream_process_non_buffered_downstream(r);
+        if (u->peer.tries > 1 && (u->conf->next_upstream & un->mask)) {
+            ngx_http_upstream_next(r, u, un->mask);
+            return NGX_OK;
+        }
 
-        } else {
-            u->buffer.pos = u->buffer.start;
-            u->buffer.last = u->buffer.start;
+#if (NGX_HTTP_CACHE)
 
-            if (ngx_http_send_special(r, NGX_HTTP_FLUSH) == NGX_ERROR) {
-                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-                return;
-            }
+        if (u->cache_status == NGX_HTTP_CACHE_EXPIRED
+            && ((u->conf->cache_use_stale & un->mask) || r->cache->stale_error))
+        {
+            ngx_int_t  rc;
 
-            if (u->peer.connection->read->ready || u->length == 0) {
-                ngx_http_upstream_process_non_buffered_upstream(r, u);
+            rc = u->reinit_request(r);
+
+            if (rc == NGX_OK) {
+                u->cache_status = NGX_HTTP_CACHE_STALE;
+                rc = ngx_http_upstream_cache_send(r, u);
             }
+
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return NGX_OK;
         }
 
-        return;
+#endif
     }
 
-    /* TODO: preallocate event_pipe bufs, look "Content-Length" */
-
 #if (NGX_HTTP_CACHE)
 
-    if (r->cache && r->cache->file.fd != NGX_INVALID_FILE) {
-        ngx_pool_run_cleanup_file(r->pool, r->cache->file.fd);
-        r->cache->file.fd = NGX_INVALID_FILE;
-    }
-
-    switch (ngx_http_test_predicates(r, u->conf->no_cache)) {
+    if (status == NGX_HTTP_NOT_MODIFIED
+        && u->cache_status == NGX_HTTP_CACHE_EXPIRED
+        && (u->conf->cache_revalidate || r->cache->refreshing))
+    {
+        time_t     now, valid, updating, error;
+        ngx_int_t  rc;
 
-    case NGX_ERROR:
-        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-        return;
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream not modified");
 
-    case NGX_DECLINED:
-        u->cacheable = 0;
-        break;
+        now = ngx_time();
 
-    default: /* NGX_OK */
-
-        if (u->cache_status == NGX_HTTP_CACHE_BYPASS) {
+        valid = r->cache->valid_sec;
+        updating = r->cache->updating_sec;
+        error = r->cache->error_sec;
 
-            /* create cache if previously bypassed */
+        rc = u->reinit_request(r);
 
-            if (ngx_http_file_cache_create(r) != NGX_OK) {
-                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-                return;
-            }
+        if (rc != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return NGX_OK;
         }
 
-        break;
-    }
-
-    if (u->cacheable) {
-        time_t  now, valid;
-
-        now = ngx_time();
+        u->cache_status = NGX_HTTP_CACHE_REVALIDATED;
+        rc = ngx_http_upstream_cache_send(r, u);
 
-        valid = r->cache->valid_sec;
+        if (valid == 0) {
+            valid = r->cache->valid_sec;
+            updating = r->cache->updating_sec;
+            error = r->cache->error_sec;
+        }
 
         if (valid == 0) {
             valid = ngx_http_file_cache_valid(u->conf->cache_valid,
                                               u->headers_in.status_n);
             if (valid) {
-                r->cache->valid_sec = now + valid;
+                valid = now + valid;
             }
         }
 
         if (valid) {
+            r->cache->valid_sec = valid;
+            r->cache->updating_sec = updating;
+            r->cache->error_sec = error;
+
             r->cache->date = now;
-            r->cache->body_start = (u_short) (u->buffer.pos - u->buffer.start);
 
-            if (u->headers_in.status_n == NGX_HTTP_OK
-                || u->headers_in.status_n == NGX_HTTP_PARTIAL_CONTENT)
-            {
-                r->cache->last_modified = u->headers_in.last_modified_time;
+            ngx_http_file_cache_update_header(r);
+        }
 
-                if (u->headers_in.etag) {
-                    r->cache->etag = u->headers_in.etag->value;
+        ngx_http_upstream_finalize_request(r, u, rc);
+        return NGX_OK;
+    }
 
-                } else {
-                    ngx_str_null(&r->cache->etag);
-                }
+#endif
 
-            } else {
-                r->cache->last_modified = -1;
-                ngx_str_null(&r->cache->etag);
-            }
+    return NGX_DECLINED;
+}
 
-            if (ngx_http_file_cache_set_header(r, u->buffer.start) != NGX_OK) {
-                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-                return;
-            }
 
-        } else {
-            u->cacheable = 0;
-        }
-    }
+static ngx_int_t
+ngx_http_upstream_intercept_errors(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_int_t                  status;
+    ngx_uint_t                 i;
+    ngx_table_elt_t           *h;
+    ngx_http_err_page_t       *err_page;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http cacheable: %d", u->cacheable);
+    status = u->headers_in.status_n;
 
-    if (u->cacheable == 0 && r->cache) {
-        ngx_http_file_cache_free(r->cache, u->pipe->temp_file);
+    if (status == NGX_HTTP_NOT_FOUND && u->conf->intercept_404) {
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_NOT_FOUND);
+        return NGX_OK;
     }
 
-    if (r->header_only && !u->cacheable && !u->store) {
-        ngx_http_upstream_finalize_request(r, u, 0);
-        return;
+    if (!u->conf->intercept_errors) {
+        return NGX_DECLINED;
     }
 
-#endif
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-    p = u->pipe;
+    if (clcf->error_pages == NULL) {
+        return NGX_DECLINED;
+    }
 
-    p->output_filter = ngx_http_upstream_output_filter;
-    p->output_ctx = r;
-    p->tag = u->output.tag;
-    p->bufs = u->conf->bufs;
-    p->busy_size = u->conf->busy_buffers_size;
-    p->upstream = u->peer.connection;
-    p->downstream = c;
-    p->pool = r->pool;
-    p->log = c->log;
-    p->limit_rate = u->conf->limit_rate;
-    p->start_sec = ngx_time();
+    err_page = clcf->error_pages->elts;
+    for (i = 0; i < clcf->error_pages->nelts; i++) {
 
-    p->cacheable = u->cacheable || u->store;
+        if (err_page[i].status == status) {
 
-    p->temp_file = ngx_pcalloc(r->pool, sizeof(ngx_temp_file_t));
-    if (p->temp_file == NULL) {
-        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-        return;
-    }
+            if (status == NGX_HTTP_UNAUTHORIZED
+                && u->headers_in.www_authenticate)
+            {
+                h = ngx_list_push(&r->headers_out.headers);
 
-    p->temp_file->file.fd = NGX_INVALID_FILE;
-    p->temp_file->file.log = c->log;
-    p->temp_file->path = u->conf->temp_path;
-    p->temp_file->pool = r->pool;
+                if (h == NULL) {
+                    ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+                    return NGX_OK;
+                }
 
-    if (p->cacheable) {
-        p->temp_file->persistent = 1;
+                *h = *u->headers_in.www_authenticate;
+
+                r->headers_out.www_authenticate = h;
+            }
 
 #if (NGX_HTTP_CACHE)
-        if (r->cache && !r->cache->file_cache->use_temp_path) {
-            p->temp_file->path = r->cache->file_cache->path;
-            p->temp_file->file.name = r->cache->file.name;
-        }
-#endif
 
-    } else {
-        p->temp_file->log_level = NGX_LOG_WARN;
-        p->temp_file->warn = "an upstream response is buffered "
-                             "to a temporary file";
-    }
+            if (r->cache) {
+                time_t  valid;
 
-    p->max_temp_file_size = u->conf->max_temp_file_size;
-    p->temp_file_write_size = u->conf->temp_file_write_size;
+                valid = ngx_http_file_cache_valid(u->conf->cache_valid, status);
 
-#if (NGX_THREADS)
-    if (clcf->aio == NGX_HTTP_AIO_THREADS && clcf->aio_write) {
-        p->thread_handler = ngx_http_upstream_thread_handler;
-        p->thread_ctx = r;
-    }
+                if (valid) {
+                    r->cache->valid_sec = ngx_time() + valid;
+                    r->cache->error = status;
+                }
+
+                ngx_http_file_cache_free(r->cache, u->pipe->temp_file);
+            }
 #endif
+            ngx_http_upstream_finalize_request(r, u, status);
 
-    p->preread_bufs = ngx_alloc_chain_link(r->pool);
-    if (p->preread_bufs == NULL) {
-        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-        return;
+            return NGX_OK;
+        }
     }
 
-    p->preread_bufs->buf = &u->buffer;
-    p->preread_bufs->next = NULL;
-    u->buffer.recycled = 1;
-
-    p->preread_size = u->buffer.last - u->buffer.pos;
+    return NGX_DECLINED;
+}
 
-    if (u->cacheable) {
 
-        p->buf_to_file = ngx_calloc_buf(r->pool);
-        if (p->buf_to_file == NULL) {
-            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-            return;
-        }
+static ngx_int_t
+ngx_http_upstream_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
 
-        p->buf_to_file->start = u->buffer.start;
-        p->buf_to_file->pos = u->buffer.start;
-        p->buf_to_file->last = u->buffer.pos;
-        p->buf_to_file->temporary = 1;
-    }
+#if (NGX_HAVE_KQUEUE)
 
-    if (ngx_event_flags & NGX_USE_IOCP_EVENT) {
-        /* the posted aio operation may corrupt a shadow buffer */
-        p->single_buf = 1;
-    }
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
 
-    /* TODO: p->free_bufs = 0 if use ngx_create_chain_of_bufs() */
-    p->free_bufs = 1;
+            } else {
+                err = c->read->kq_errno;
+            }
 
-    /*
-     * event_pipe would do u->buffer.last += p->preread_size
-     * as though these bytes were read
-     */
-    u->buffer.last = u->buffer.pos;
+            c->log->action = "connecting to upstream";
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
 
-    if (u->conf->cyclic_temp_file) {
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
 
         /*
-         * we need to disable the use of sendfile() if we use cyclic temp file
-         * because the writing a new data may interfere with sendfile()
-         * that uses the same kernel file pages (at least on FreeBSD)
+         * BSDs and Linux return 0 and set a pending error in err
+         * Solaris returns -1 and sets errno
          */
 
-        p->cyclic_temp_file = 1;
-        c->sendfile = 0;
-
-    } else {
-        p->cyclic_temp_file = 0;
-    }
-
-    p->read_timeout = u->conf->read_timeout;
-    p->send_timeout = clcf->send_timeout;
-    p->send_lowat = clcf->send_lowat;
-
-    p->length = -1;
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
 
-    if (u->input_filter_init
-        && u->input_filter_init(p->input_ctx) != NGX_OK)
-    {
-        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-        return;
+        if (err) {
+            c->log->action = "connecting to upstream";
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
     }
 
-    u->read_event_handler = ngx_http_upstream_process_upstream;
-    r->write_event_handler = ngx_http_upstream_process_downstream;
-
-    ngx_http_upstream_process_upstream(r, u);
+    return NGX_OK;
 }
 
 
-static void
-ngx_http_upstream_upgrade(ngx_http_request_t *r, ngx_http_upstream_t *u)
+static ngx_int_t
+ngx_http_upstream_process_headers(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
-    int                        tcp_nodelay;
-    ngx_connection_t          *c;
-    ngx_http_core_loc_conf_t  *clcf;
+    ngx_str_t                       uri, args;
+    ngx_uint_t                      i, flags;
+    ngx_list_part_t                *part;
+    ngx_table_elt_t                *h;
+    ngx_http_upstream_header_t     *hh;
+    ngx_http_upstream_main_conf_t  *umcf;
 
-    c = r->connection;
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
 
-    /* TODO: prevent upgrade if not requested or not possible */
+    if (u->headers_in.x_accel_redirect
+        && !(u->conf->ignore_headers & NGX_HTTP_UPSTREAM_IGN_XA_REDIRECT))
+    {
+        ngx_http_upstream_finalize_request(r, u, NGX_DECLINED);
 
-    r->keepalive = 0;
-    c->log->action = "proxying upgraded connection";
+        part = &u->headers_in.headers.part;
+        h = part->elts;
 
-    u->read_event_handler = ngx_http_upstream_upgraded_read_upstream;
-    u->write_event_handler = ngx_http_upstream_upgraded_write_upstream;
-    r->read_event_handler = ngx_http_upstream_upgraded_read_downstream;
-    r->write_event_handler = ngx_http_upstream_upgraded_write_downstream;
+        for (i = 0; /* void */; i++) {
 
-    if (clcf->tcp_nodelay) {
-        tcp_nodelay = 1;
+            if (i >= part->nelts) {
+                if (part->next == NULL) {
+                    break;
+                }
 
-        if (c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
+                part = part->next;
+                h = part->elts;
+                i = 0;
+            }
 
-            if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
-                           (const void *) &tcp_nodelay, sizeof(int)) == -1)
-            {
-                ngx_connection_error(c, ngx_socket_errno,
-                                     "setsockopt(TCP_NODELAY) failed");
-                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-                return;
+            hh = ngx_hash_find(&umcf->headers_in_hash, h[i].hash,
+                               h[i].lowcase_key, h[i].key.len);
+
+            if (hh && hh->redirect) {
+                if (hh->copy_handler(r, &h[i], hh->conf) != NGX_OK) {
+                    ngx_http_finalize_request(r,
+                                              NGX_HTTP_INTERNAL_SERVER_ERROR);
+                    return NGX_DONE;
+                }
             }
+        }
 
-            c->tcp_nodelay = NGX_TCP_NODELAY_SET;
+        uri = u->headers_in.x_accel_redirect->value;
+
+        if (uri.data[0] == '@') {
+            ngx_http_named_location(r, &uri);
+
+        } else {
+            ngx_str_null(&args);
+            flags = NGX_HTTP_LOG_UNSAFE;
+
+            if (ngx_http_parse_unsafe_uri(r, &uri, &args, &flags) != NGX_OK) {
+                ngx_http_finalize_request(r, NGX_HTTP_NOT_FOUND);
+                return NGX_DONE;
+            }
+
+            if (r->method != NGX_HTTP_HEAD) {
+                r->method = NGX_HTTP_GET;
+                r->method_name = ngx_http_core_get_method;
+            }
+
+            ngx_http_internal_redirect(r, &uri, &args);
         }
 
-        if (u->peer.connection->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, u->peer.connection->log, 0,
-                           "tcp_nodelay");
+        ngx_http_finalize_request(r, NGX_DONE);
+        return NGX_DONE;
+    }
 
-            if (setsockopt(u->peer.connection->fd, IPPROTO_TCP, TCP_NODELAY,
-                           (const void *) &tcp_nodelay, sizeof(int)) == -1)
-            {
-                ngx_connection_error(u->peer.connection, ngx_socket_errno,
-                                     "setsockopt(TCP_NODELAY) failed");
-                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-                return;
+    part = &u->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
             }
 
-            u->peer.connection->tcp_nodelay = NGX_TCP_NODELAY_SET;
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (ngx_hash_find(&u->conf->hide_headers_hash, h[i].hash,
+                          h[i].lowcase_key, h[i].key.len))
+        {
+            continue;
+        }
+
+        hh = ngx_hash_find(&umcf->headers_in_hash, h[i].hash,
+                           h[i].lowcase_key, h[i].key.len);
+
+        if (hh) {
+            if (hh->copy_handler(r, &h[i], hh->conf) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+                return NGX_DONE;
+            }
+
+            continue;
+        }
+
+        if (ngx_http_upstream_copy_header_line(r, &h[i], 0) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return NGX_DONE;
         }
     }
 
-    if (ngx_http_send_special(r, NGX_HTTP_FLUSH) == NGX_ERROR) {
-        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-        return;
+    if (r->headers_out.server && r->headers_out.server->value.data == NULL) {
+        r->headers_out.server->hash = 0;
     }
 
-    if (u->peer.connection->read->ready
-        || u->buffer.pos != u->buffer.last)
-    {
-        ngx_post_event(c->read, &ngx_posted_events);
-        ngx_http_upstream_process_upgraded(r, 1, 1);
-        return;
+    if (r->headers_out.date && r->headers_out.date->value.data == NULL) {
+        r->headers_out.date->hash = 0;
     }
 
-    ngx_http_upstream_process_upgraded(r, 0, 1);
-}
+    r->headers_out.status = u->headers_in.status_n;
+    r->headers_out.status_line = u->headers_in.status_line;
 
+    r->headers_out.content_length_n = u->headers_in.content_length_n;
 
-static void
-ngx_http_upstream_upgraded_read_downstream(ngx_http_request_t *r)
-{
-    ngx_http_upstream_process_upgraded(r, 0, 0);
-}
+    r->disable_not_modified = !u->cacheable;
 
+    if (u->conf->force_ranges) {
+        r->allow_ranges = 1;
+        r->single_range = 1;
 
-static void
-ngx_http_upstream_upgraded_write_downstream(ngx_http_request_t *r)
-{
-    ngx_http_upstream_process_upgraded(r, 1, 1);
-}
+#if (NGX_HTTP_CACHE)
+        if (r->cached) {
+            r->single_range = 0;
+        }
+#endif
+    }
 
+    u->length = -1;
 
-static void
-ngx_http_upstream_upgraded_read_upstream(ngx_http_request_t *r,
-    ngx_http_upstream_t *u)
-{
-    ngx_http_upstream_process_upgraded(r, 1, 0);
+    return NGX_OK;
 }
 
 
 static void
-ngx_http_upstream_upgraded_write_upstream(ngx_http_request_t *r,
+ngx_http_upstream_process_body_in_memory(ngx_http_request_t *r,
     ngx_http_upstream_t *u)
 {
-    ngx_http_upstream_process_upgraded(r, 0, 1);
-}
+    size_t             size;
+    ssize_t            n;
+    ngx_buf_t         *b;
+    ngx_event_t       *rev;
+    ngx_connection_t  *c;
 
+    c = u->peer.connection;
+    rev = c->read;
 
-static void
-ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
-    ngx_uint_t from_upstream, ngx_uint_t do_write)
-{
-    size_t                     size;
-    ssize_t                    n;
-    ngx_buf_t                 *b;
-    ngx_connection_t          *c, *downstream, *upstream, *dst, *src;
-    ngx_http_upstream_t       *u;
-    ngx_http_core_loc_conf_t  *clcf;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream process body on memory");
 
-    c = r->connection;
-    u = r->upstream;
+    if (rev->timedout) {
+        ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_GATEWAY_TIME_OUT);
+        return;
+    }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream process upgraded, fu:%ui", from_upstream);
+    b = &u->buffer;
 
-    downstream = c;
-    upstream = u->peer.connection;
+    for ( ;; ) {
 
-    if (downstream->write->timedout) {
-        c->timedout = 1;
-        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
-        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
+        size = b->end - b->last;
+
+        if (size == 0) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "upstream buffer is too small to read response");
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        n = c->recv(c, b->last, size);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == 0 || n == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, n);
+            return;
+        }
+
+        u->state->bytes_received += n;
+        u->state->response_length += n;
+
+        if (u->input_filter(u->input_filter_ctx, n) == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        if (!rev->ready) {
+            break;
+        }
+    }
+
+    if (u->length == 0) {
+        ngx_http_upstream_finalize_request(r, u, 0);
         return;
     }
 
-    if (upstream->read->timedout || upstream->write->timedout) {
-        ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
-        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_GATEWAY_TIME_OUT);
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
         return;
     }
 
-    if (from_upstream) {
-        src = upstream;
+    if (rev->active) {
+        ngx_add_timer(rev, u->conf->read_timeout);
+
+    } else if (rev->timer_set) {
+        ngx_del_timer(rev);
+    }
+}
+
+
+static void
+ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    int                             tcp_nodelay;
+    off_t                           size;
+    ssize_t                         n;
+    ngx_int_t                       rc;
+    ngx_event_pipe_t               *p;
+    ngx_connection_t               *c;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache && r->cache->slice && r->cache->slice->range.len) {
+        rc = ngx_http_upstream_cache_slice_response(r, u);
+
+        if (rc != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return;
+        }
+    }
+
+#endif
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->post_action) {
+        ngx_http_upstream_finalize_request(r, u, rc);
+        return;
+    }
+
+    u->header_sent = 1;
+
+    if (u->coalesce) {
+        ngx_http_upstream_coalesce_header(r, u);
+    }
+
+    if (u->upgrade) {
+
+#if (NGX_HTTP_CACHE)
+
+        if (r->cache) {
+            ngx_http_file_cache_free(r->cache, u->pipe->temp_file);
+        }
+
+#endif
+
+        ngx_http_upstream_upgrade(r, u);
+        return;
+    }
+
+    c = r->connection;
+
+    if (r->header_only) {
+
+        if (!u->buffering) {
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return;
+        }
+
+        if (!u->cacheable && !u->store) {
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return;
+        }
+
+        u->pipe->downstream_error = 1;
+    }
+
+#if (NGX_HTTP_CACHE)
+
+    /* cached slices preceding the ones requested */
+
+    if (r->cache && r->cache->slice && r->cache->slice->in_place
+        && !r->header_only)
+    {
+        rc = ngx_http_upstream_cache_slice_output(r,
+                                                  r->cache->slice->send_start,
+                                                  r->cache->slice->fetch_start);
+
+        if (rc == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+    }
+
+#endif
+
+    if (r->request_body && r->request_body->temp_file) {
+        ngx_pool_run_cleanup_file(r->pool, r->request_body->temp_file->file.fd);
+        r->request_body->temp_file->file.fd = NGX_INVALID_FILE;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (!u->buffering) {
+
+#if (NGX_HTTP_CACHE)
+
+        if (r->cache) {
+            ngx_http_file_cache_free(r->cache, u->pipe->temp_file);
+        }
+
+#endif
+
+        if (u->input_filter == NULL) {
+            u->input_filter_init = ngx_http_upstream_non_buffered_filter_init;
+            u->input_filter = ngx_http_upstream_non_buffered_filter;
+            u->input_filter_ctx = r;
+        }
+
+        u->read_event_handler = ngx_http_upstream_process_non_buffered_upstream;
+        r->write_event_handler =
+                             ngx_http_upstream_process_non_buffered_downstream;
+
+        if (u->input_filter_init(u->input_filter_ctx) == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+#if (NGX_HAVE_SPLICE)
+        if (u->conf->splice) {
+            ngx_http_upstream_splice_init(r, u);
+        }
+#endif
+
+        r->limit_rate = 0;
+
+        if (clcf->tcp_nodelay && c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
+
+            tcp_nodelay = 1;
+
+            if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
+                               (const void *) &tcp_nodelay, sizeof(int)) == -1)
+            {
+                ngx_connection_error(c, ngx_socket_errno,
+                                     "setsockopt(TCP_NODELAY) failed");
+                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                return;
+            }
+
+            c->tcp_nodelay = NGX_TCP_NODELAY_SET;
+        }
+
+        n = u->buffer.last - u->buffer.pos;
+
+        if (n) {
+            u->buffer.last = u->buffer.pos;
+
+            u->state->response_length += n;
+
+            if (u->input_filter(u->input_filter_ctx, n) == NGX_ERROR) {
+                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                return;
+            }
+
+            ngx_http_upstream_process_non_buffered_downstream(r);
+
+        } else {
+            u->buffer.pos = u->buffer.start;
+            u->buffer.last = u->buffer.start;
+
+            if (ngx_http_send_special(r, NGX_HTTP_FLUSH) == NGX_ERROR) {
+                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                return;
+            }
+
+            if (u->peer.connection->read->ready || u->length == 0) {
+                ngx_http_upstream_process_non_buffered_upstream(r, u);
+            }
+        }
+
+        return;
+    }
+
+    /* TODO: preallocate event_pipe bufs, look "Content-Length" */
+
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache && r->cache->file.fd != NGX_INVALID_FILE
+        && (r->cache->slice == NULL || !r->cache->slice->in_place))
+    {
+        ngx_pool_run_cleanup_file(r->pool, r->cache->file.fd);
+        r->cache->file.fd = NGX_INVALID_FILE;
+    }
+
+    switch (ngx_http_test_predicates(r, u->conf->no_cache)) {
+
+    case NGX_ERROR:
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+
+    case NGX_DECLINED:
+        u->cacheable = 0;
+        break;
+
+    default: /* NGX_OK */
+
+        if (u->cache_status == NGX_HTTP_CACHE_BYPASS) {
+
+            /* create cache if previously bypassed */
+
+            if (ngx_http_file_cache_create(r) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                return;
+            }
+        }
+
+        break;
+    }
+
+    /* slices written in place keep the cached header */
+
+    if (u->cacheable
+        && (r->cache->slice == NULL || !r->cache->slice->in_place))
+    {
+        time_t  now, valid;
+
+        now = ngx_time();
+
+        valid = r->cache->valid_sec;
+
+        if (valid == 0) {
+            valid = ngx_http_file_cache_valid(u->conf->cache_valid,
+                                              r->cache->slice
+                                              ? NGX_HTTP_OK
+                                              : u->headers_in.status_n);
+            if (valid) {
+                r->cache->valid_sec = now + valid;
+            }
+        }
+
+        if (valid) {
+            r->cache->date = now;
+            r->cache->body_start = (u_short) (u->buffer.pos - u->buffer.start);
+
+            if (u->headers_in.status_n == NGX_HTTP_OK
+                || u->headers_in.status_n == NGX_HTTP_PARTIAL_CONTENT)
+            {
+                r->cache->last_modified = u->headers_in.last_modified_time;
+
+                if (u->headers_in.etag) {
+                    r->cache->etag = u->headers_in.etag->value;
+
+                } else {
+                    ngx_str_null(&r->cache->etag);
+                }
+
+            } else {
+                r->cache->last_modified = -1;
+                ngx_str_null(&r->cache->etag);
+            }
+
+            if (ngx_http_file_cache_set_header(r, u->buffer.start) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                return;
+            }
+
+        } else {
+            u->cacheable = 0;
+        }
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http cacheable: %d", u->cacheable);
+
+    if (u->cacheable == 0 && r->cache) {
+        ngx_http_file_cache_free(r->cache, u->pipe->temp_file);
+    }
+
+    if (r->header_only && !u->cacheable && !u->store) {
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
+
+#endif
+
+    p = u->pipe;
+
+    p->output_filter = ngx_http_upstream_output_filter;
+    p->output_ctx = r;
+    p->tag = u->output.tag;
+    p->bufs = u->conf->bufs;
+    p->busy_size = u->conf->busy_buffers_size;
+    p->upstream = u->peer.connection;
+    p->downstream = c;
+    p->pool = r->pool;
+    p->log = c->log;
+    p->limit_rate = u->conf->limit_rate;
+    p->start_sec = ngx_time();
+
+    if (u->conf->max_buffers_size) {
+        umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+        p->grow_size = u->conf->max_buffers_size;
+        p->grow_budget = umcf->buffers_budget;
+        p->grow_memory = &umcf->buffers_memory;
+        p->start_msec = ngx_current_msec;
+        p->start_sent = c->sent;
+    }
+
+    p->cacheable = u->cacheable || u->store;
+
+    /* coalesced requests are sent the response from the temp file */
+
+    if (ngx_http_upstream_coalesce_shared(u)) {
+        p->cacheable = 1;
+    }
+
+    p->temp_file = ngx_pcalloc(r->pool, sizeof(ngx_temp_file_t));
+    if (p->temp_file == NULL) {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    p->temp_file->file.fd = NGX_INVALID_FILE;
+    p->temp_file->file.log = c->log;
+    p->temp_file->path = u->conf->temp_path;
+    p->temp_file->pool = r->pool;
+
+    if (p->cacheable) {
+        p->temp_file->persistent = 1;
+
+        if (!u->cacheable && !u->store) {
+            p->temp_file->clean = 1;
+        }
+
+#if (NGX_HTTP_CACHE)
+        if (r->cache && !r->cache->file_cache->use_temp_path) {
+            p->temp_file->path = r->cache->path;
+            p->temp_file->file.name = r->cache->file.name;
+        }
+#endif
+
+    } else {
+        p->temp_file->log_level = NGX_LOG_WARN;
+        p->temp_file->warn = "an upstream response is buffered "
+                             "to a temporary file";
+    }
+
+    p->max_temp_file_size = u->conf->max_temp_file_size;
+    p->temp_file_write_size = u->conf->temp_file_write_size;
+
+#if (NGX_THREADS)
+    if (clcf->aio == NGX_HTTP_AIO_THREADS && clcf->aio_write) {
+        p->thread_handler = ngx_http_upstream_thread_handler;
+        p->thread_ctx = r;
+    }
+#endif
+
+    p->preread_bufs = ngx_alloc_chain_link(r->pool);
+    if (p->preread_bufs == NULL) {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    p->preread_bufs->buf = &u->buffer;
+    p->preread_bufs->next = NULL;
+    u->buffer.recycled = 1;
+
+    p->preread_size = u->buffer.last - u->buffer.pos;
+
+    if (u->cacheable) {
+
+        p->buf_to_file = ngx_calloc_buf(r->pool);
+        if (p->buf_to_file == NULL) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        p->buf_to_file->start = u->buffer.start;
+        p->buf_to_file->pos = u->buffer.start;
+        p->buf_to_file->last = u->buffer.pos;
+        p->buf_to_file->temporary = 1;
+    }
+
+#if (NGX_HTTP_CACHE)
+
+    if (u->cacheable && r->cache->slice
+        && ngx_http_upstream_cache_slice_file(r, u) != NGX_OK)
+    {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+#endif
+
+    if (ngx_event_flags & NGX_USE_IOCP_EVENT) {
+        /* the posted aio operation may corrupt a shadow buffer */
+        p->single_buf = 1;
+    }
+
+    /* TODO: p->free_bufs = 0 if use ngx_create_chain_of_bufs() */
+    p->free_bufs = 1;
+
+    /*
+     * event_pipe would do u->buffer.last += p->preread_size
+     * as though these bytes were read
+     */
+    u->buffer.last = u->buffer.pos;
+
+    if (u->conf->cyclic_temp_file) {
+
+        /*
+         * we need to disable the use of sendfile() if we use cyclic temp file
+         * because the writing a new data may interfere with sendfile()
+         * that uses the same kernel file pages (at least on FreeBSD)
+         */
+
+        p->cyclic_temp_file = 1;
+        c->sendfile = 0;
+
+    } else {
+        p->cyclic_temp_file = 0;
+    }
+
+    p->read_timeout = u->conf->read_timeout;
+    p->send_timeout = clcf->send_timeout;
+    p->send_lowat = clcf->send_lowat;
+
+    p->length = -1;
+
+    if (u->input_filter_init
+        && u->input_filter_init(p->input_ctx) != NGX_OK)
+    {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    if (u->conf->max_buffers_size
+        && u->headers_in.content_length_n >= 0
+        && !u->headers_in.chunked)
+    {
+        size = u->headers_in.content_length_n - p->preread_size;
+
+        if (size > 0 && size < (off_t) p->bufs.size) {
+
+            /* the rest of a small response is read into one buf of its size */
+
+            p->bufs.num = 1;
+            p->bufs.size = (size_t) size;
+        }
+    }
+
+    u->read_event_handler = ngx_http_upstream_process_upstream;
+    r->write_event_handler = ngx_http_upstream_process_downstream;
+
+    ngx_http_upstream_process_upstream(r, u);
+}
+
+
+static void
+ngx_http_upstream_upgrade(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    int                        tcp_nodelay;
+    ngx_connection_t          *c;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = r->connection;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    /* TODO: prevent upgrade if not requested or not possible */
+
+    r->keepalive = 0;
+    c->log->action = "proxying upgraded connection";
+
+    u->read_event_handler = ngx_http_upstream_upgraded_read_upstream;
+    u->write_event_handler = ngx_http_upstream_upgraded_write_upstream;
+    r->read_event_handler = ngx_http_upstream_upgraded_read_downstream;
+    r->write_event_handler = ngx_http_upstream_upgraded_write_downstream;
+
+    if (clcf->tcp_nodelay) {
+        tcp_nodelay = 1;
+
+        if (c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
+
+            if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
+                           (const void *) &tcp_nodelay, sizeof(int)) == -1)
+            {
+                ngx_connection_error(c, ngx_socket_errno,
+                                     "setsockopt(TCP_NODELAY) failed");
+                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                return;
+            }
+
+            c->tcp_nodelay = NGX_TCP_NODELAY_SET;
+        }
+
+        if (u->peer.connection->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, u->peer.connection->log, 0,
+                           "tcp_nodelay");
+
+            if (setsockopt(u->peer.connection->fd, IPPROTO_TCP, TCP_NODELAY,
+                           (const void *) &tcp_nodelay, sizeof(int)) == -1)
+            {
+                ngx_connection_error(u->peer.connection, ngx_socket_errno,
+                                     "setsockopt(TCP_NODELAY) failed");
+                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                return;
+            }
+
+            u->peer.connection->tcp_nodelay = NGX_TCP_NODELAY_SET;
+        }
+    }
+
+    if (ngx_http_send_special(r, NGX_HTTP_FLUSH) == NGX_ERROR) {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    if (u->peer.connection->read->ready
+        || u->buffer.pos != u->buffer.last)
+    {
+        ngx_post_event(c->read, &ngx_posted_events);
+        ngx_http_upstream_process_upgraded(r, 1, 1);
+        return;
+    }
+
+    ngx_http_upstream_process_upgraded(r, 0, 1);
+}
+
+
+static void
+ngx_http_upstream_upgraded_read_downstream(ngx_http_request_t *r)
+{
+    ngx_http_upstream_process_upgraded(r, 0, 0);
+}
+
+
+static void
+ngx_http_upstream_upgraded_write_downstream(ngx_http_request_t *r)
+{
+    ngx_http_upstream_process_upgraded(r, 1, 1);
+}
+
+
+static void
+ngx_http_upstream_upgraded_read_upstream(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_http_upstream_process_upgraded(r, 1, 0);
+}
+
+
+static void
+ngx_http_upstream_upgraded_write_upstream(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_http_upstream_process_upgraded(r, 0, 1);
+}
+
+
+static void
+ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
+    ngx_uint_t from_upstream, ngx_uint_t do_write)
+{
+    size_t                     size;
+    ssize_t                    n;
+    ngx_buf_t                 *b;
+    ngx_connection_t          *c, *downstream, *upstream, *dst, *src;
+    ngx_http_upstream_t       *u;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = r->connection;
+    u = r->upstream;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream process upgraded, fu:%ui", from_upstream);
+
+    downstream = c;
+    upstream = u->peer.connection;
+
+    if (downstream->write->timedout) {
+        c->timedout = 1;
+        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (upstream->read->timedout || upstream->write->timedout) {
+        ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_GATEWAY_TIME_OUT);
+        return;
+    }
+
+    if (from_upstream) {
+        src = upstream;
         dst = downstream;
         b = &u->buffer;
 
     } else {
-        src = downstream;
-        dst = upstream;
-        b = &u->from_client;
+        src = downstream;
+        dst = upstream;
+        b = &u->from_client;
+
+        if (r->header_in->last > r->header_in->pos) {
+            b = r->header_in;
+            b->end = b->last;
+            do_write = 1;
+        }
+
+        if (b->start == NULL) {
+            b->start = ngx_palloc(r->pool, u->conf->buffer_size);
+            if (b->start == NULL) {
+                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                return;
+            }
+
+            b->pos = b->start;
+            b->last = b->start;
+            b->end = b->start + u->conf->buffer_size;
+            b->temporary = 1;
+            b->tag = u->output.tag;
+        }
+    }
+
+    for ( ;; ) {
+
+        if (do_write) {
+
+            size = b->last - b->pos;
+
+            if (size && dst->write->ready) {
+
+                n = dst->send(dst, b->pos, size);
+
+                if (n == NGX_ERROR) {
+                    ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                    return;
+                }
+
+                if (n > 0) {
+                    b->pos += n;
+
+                    if (b->pos == b->last) {
+                        b->pos = b->start;
+                        b->last = b->start;
+                    }
+                }
+            }
+        }
+
+        size = b->end - b->last;
+
+        if (size && src->read->ready) {
+
+            n = src->recv(src, b->last, size);
+
+            if (n == NGX_AGAIN || n == 0) {
+                break;
+            }
+
+            if (n > 0) {
+                do_write = 1;
+                b->last += n;
+
+                if (from_upstream) {
+                    u->state->bytes_received += n;
+                }
+
+                continue;
+            }
+
+            if (n == NGX_ERROR) {
+                src->read->eof = 1;
+            }
+        }
+
+        break;
+    }
+
+    if ((upstream->read->eof && u->buffer.pos == u->buffer.last)
+        || (downstream->read->eof && u->from_client.pos == u->from_client.last)
+        || (downstream->read->eof && upstream->read->eof))
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http upstream upgraded done");
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (ngx_handle_write_event(upstream->write, u->conf->send_lowat)
+        != NGX_OK)
+    {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    if (upstream->write->active && !upstream->write->ready) {
+        ngx_add_timer(upstream->write, u->conf->send_timeout);
+
+    } else if (upstream->write->timer_set) {
+        ngx_del_timer(upstream->write);
+    }
+
+    if (ngx_handle_read_event(upstream->read, 0) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    if (upstream->read->active && !upstream->read->ready) {
+        ngx_add_timer(upstream->read, u->conf->read_timeout);
+
+    } else if (upstream->read->timer_set) {
+        ngx_del_timer(upstream->read);
+    }
+
+    if (ngx_handle_write_event(downstream->write, clcf->send_lowat)
+        != NGX_OK)
+    {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    if (ngx_handle_read_event(downstream->read, 0) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    if (downstream->write->active && !downstream->write->ready) {
+        ngx_add_timer(downstream->write, clcf->send_timeout);
+
+    } else if (downstream->write->timer_set) {
+        ngx_del_timer(downstream->write);
+    }
+}
+
+
+static void
+ngx_http_upstream_process_non_buffered_downstream(ngx_http_request_t *r)
+{
+    ngx_event_t          *wev;
+    ngx_connection_t     *c;
+    ngx_http_upstream_t  *u;
+
+    c = r->connection;
+    u = r->upstream;
+    wev = c->write;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream process non buffered downstream");
+
+    c->log->action = "sending to client";
+
+    if (wev->timedout) {
+        c->timedout = 1;
+        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    ngx_http_upstream_process_non_buffered_request(r, 1);
+}
+
+
+static void
+ngx_http_upstream_process_non_buffered_upstream(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_connection_t  *c;
+
+    c = u->peer.connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream process non buffered upstream");
+
+    c->log->action = "reading upstream";
+
+    if (c->read->timedout) {
+        ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_GATEWAY_TIME_OUT);
+        return;
+    }
+
+    ngx_http_upstream_process_non_buffered_request(r, 0);
+}
+
+
+static void
+ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
+    ngx_uint_t do_write)
+{
+    size_t                     size;
+    ssize_t                    n;
+    ngx_buf_t                 *b;
+    ngx_int_t                  rc;
+    ngx_connection_t          *downstream, *upstream;
+    ngx_http_upstream_t       *u;
+    ngx_http_core_loc_conf_t  *clcf;
+#if (NGX_HAVE_SPLICE)
+    size_t                     limit;
+#endif
+
+    u = r->upstream;
+    downstream = r->connection;
+    upstream = u->peer.connection;
+
+    b = &u->buffer;
+
+    do_write = do_write || u->length == 0;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+#if (NGX_HAVE_SPLICE)
+    limit = clcf->sendfile_max_chunk;
+#endif
+
+    for ( ;; ) {
+
+        if (do_write) {
+
+#if (NGX_HAVE_SPLICE)
+
+            /* spliced data follow the data already passed to filters */
+
+            if (u->splice && u->splice->size
+                && u->out_bufs == NULL && u->busy_bufs == NULL
+                && r->out == NULL)
+            {
+                n = ngx_linux_splice_send(downstream, u->splice, limit);
+
+                if (n == NGX_ERROR) {
+                    ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                    return;
+                }
+
+                /* sendfile_max_chunk bounds the bytes spliced per call */
+
+                if (limit && n > 0) {
+                    if ((size_t) n >= limit) {
+                        ngx_post_event(downstream->write, &ngx_posted_events);
+                        break;
+                    }
+
+                    limit -= n;
+                }
+            }
+
+#endif
+
+            if (u->out_bufs || u->busy_bufs) {
+                rc = ngx_http_output_filter(r, u->out_bufs);
+
+                if (rc == NGX_ERROR) {
+                    ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                    return;
+                }
+
+                ngx_chain_update_chains(r->pool, &u->free_bufs, &u->busy_bufs,
+                                        &u->out_bufs, u->output.tag);
+            }
+
+            if (u->busy_bufs == NULL
+                && !(downstream->buffered & NGX_SPLICE_BUFFERED))
+            {
+                if (u->length == 0
+                    || (upstream->read->eof && u->length == -1))
+                {
+                    ngx_http_upstream_finalize_request(r, u, 0);
+                    return;
+                }
+
+                if (upstream->read->eof) {
+                    ngx_log_error(NGX_LOG_ERR, upstream->log, 0,
+                                  "upstream prematurely closed connection");
+
+                    ngx_http_upstream_finalize_request(r, u,
+                                                       NGX_HTTP_BAD_GATEWAY);
+                    return;
+                }
+
+                if (upstream->read->error) {
+                    ngx_http_upstream_finalize_request(r, u,
+                                                       NGX_HTTP_BAD_GATEWAY);
+                    return;
+                }
+
+                b->pos = b->start;
+                b->last = b->start;
+            }
+        }
+
+#if (NGX_HAVE_SPLICE)
+
+        if (u->splice) {
+            size = u->splice->capacity - u->splice->size;
+
+            if ((off_t) size > u->length) {
+                size = (size_t) u->length;
+            }
+
+            if (size && upstream->read->ready) {
+
+                n = ngx_linux_splice_recv(upstream, u->splice, size);
+
+                if (n == NGX_AGAIN) {
+                    break;
+                }
+
+                if (n > 0) {
+                    u->state->bytes_received += n;
+                    u->state->response_length += n;
+
+                    u->length -= n;
+
+                    if (u->length == 0) {
+                        u->keepalive = !u->headers_in.connection_close;
+                    }
+                }
+
+                do_write = 1;
+
+                continue;
+            }
+
+            break;
+        }
+
+#endif
+
+        size = b->end - b->last;
+
+        if (size && upstream->read->ready) {
+
+            n = upstream->recv(upstream, b->last, size);
+
+            if (n == NGX_AGAIN) {
+                break;
+            }
+
+            if (n > 0) {
+                u->state->bytes_received += n;
+                u->state->response_length += n;
+
+                if (u->input_filter(u->input_filter_ctx, n) == NGX_ERROR) {
+                    ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                    return;
+                }
+            }
+
+            do_write = 1;
+
+            continue;
+        }
+
+        break;
+    }
+
+    if (downstream->data == r) {
+        if (ngx_handle_write_event(downstream->write, clcf->send_lowat)
+            != NGX_OK)
+        {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+    }
+
+    if (downstream->write->active && !downstream->write->ready) {
+        ngx_add_timer(downstream->write, clcf->send_timeout);
+
+    } else if (downstream->write->timer_set) {
+        ngx_del_timer(downstream->write);
+    }
+
+    if (ngx_handle_read_event(upstream->read, 0) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    if (upstream->read->active && !upstream->read->ready) {
+        ngx_add_timer(upstream->read, u->conf->read_timeout);
+
+    } else if (upstream->read->timer_set) {
+        ngx_del_timer(upstream->read);
+    }
+}
+
+
+#if (NGX_HAVE_SPLICE)
+
+static void
+ngx_http_upstream_splice_init(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_connection_t  *c;
+
+    c = r->connection;
+
+    /*
+     * the body is moved from the upstream socket to the client one
+     * in kernel, so it must not be seen by filters: only a response
+     * with a known length passed unchanged over plain connections
+     * without a rate limit is spliced
+     */
+
+    if (r != r->main
+        || r->limit_rate
+        || r->chunked
+        || u->headers_in.chunked
+        || u->headers_in.content_length_n <= 0
+        || u->length <= 0
+        || r->headers_out.content_length_n != u->headers_in.content_length_n
+        || r->headers_out.status != u->headers_in.status_n)
+    {
+        return;
+    }
+
+#if (NGX_HTTP_V2)
+    if (r->stream) {
+        return;
+    }
+#endif
+
+#if (NGX_SSL)
+    if (c->ssl || u->peer.connection->ssl) {
+        return;
+    }
+#endif
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream splice: %O", u->length);
+
+    /* on failure the body is copied through the buffer as usual */
+
+    u->splice = ngx_linux_splice_pipe(r->pool, u->conf->buffer_size, c->log);
+}
+
+#endif
+
+
+static void
+ngx_http_upstream_buffers_account(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_event_pipe_t               *p;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    p = u->pipe;
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    umcf->buffered++;
+
+    if (!p->cacheable && p->temp_file && p->temp_file->offset) {
+        umcf->spilled++;
+        umcf->spilled_size += p->temp_file->offset;
+    }
+
+    if (p->grown) {
+        umcf->grown++;
+        umcf->buffers_memory -= p->grown;
+        p->grown = 0;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_non_buffered_filter_init(void *data)
+{
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_non_buffered_filter(void *data, ssize_t bytes)
+{
+    ngx_http_request_t  *r = data;
+
+    ngx_buf_t            *b;
+    ngx_chain_t          *cl, **ll;
+    ngx_http_upstream_t  *u;
+
+    u = r->upstream;
+
+    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
+        ll = &cl->next;
+    }
+
+    cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    *ll = cl;
+
+    cl->buf->flush = 1;
+    cl->buf->memory = 1;
+
+    b = &u->buffer;
+
+    cl->buf->pos = b->last;
+    b->last += bytes;
+    cl->buf->last = b->last;
+    cl->buf->tag = u->output.tag;
+
+    if (u->length == -1) {
+        return NGX_OK;
+    }
+
+    u->length -= bytes;
+
+    return NGX_OK;
+}
+
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_upstream_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
+{
+    ngx_str_t                  name;
+    ngx_event_pipe_t          *p;
+    ngx_thread_pool_t         *tp;
+    ngx_http_request_t        *r;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    r = file->thread_ctx;
+    p = r->upstream->pipe;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    tp = clcf->thread_pool;
+
+    if (tp == NULL) {
+        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
+
+        if (tp == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "thread pool \"%V\" not found", &name);
+            return NGX_ERROR;
+        }
+    }
+
+    task->event.data = r;
+    task->event.handler = ngx_http_upstream_thread_event_handler;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->main->blocked++;
+    r->aio = 1;
+    p->aio = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream thread: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    if (r->done) {
+        /*
+         * trigger connection event handler if the subrequest was
+         * already finalized; this can happen if the handler is used
+         * for sendfile() in threads
+         */
+
+        c->write->handler(c->write);
+
+    } else {
+        r->write_event_handler(r);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_upstream_output_filter(void *data, ngx_chain_t *chain)
+{
+    ngx_int_t            rc;
+    ngx_event_pipe_t    *p;
+    ngx_http_request_t  *r;
+
+    r = data;
+    p = r->upstream->pipe;
+
+    rc = ngx_http_output_filter(r, chain);
+
+    p->aio = r->aio;
+
+    return rc;
+}
+
+
+static void
+ngx_http_upstream_process_downstream(ngx_http_request_t *r)
+{
+    ngx_event_t          *wev;
+    ngx_connection_t     *c;
+    ngx_event_pipe_t     *p;
+    ngx_http_upstream_t  *u;
+
+    c = r->connection;
+    u = r->upstream;
+    p = u->pipe;
+    wev = c->write;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream process downstream");
+
+    c->log->action = "sending to client";
+
+#if (NGX_THREADS)
+    p->aio = r->aio;
+#endif
+
+    if (wev->timedout) {
+
+        p->downstream_error = 1;
+        c->timedout = 1;
+        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
+
+    } else {
+
+        if (wev->delayed) {
+
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "http downstream delayed");
+
+            if (ngx_handle_write_event(wev, p->send_lowat) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            }
+
+            return;
+        }
+
+        if (ngx_event_pipe(p, 1) == NGX_ABORT) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+    }
+
+    ngx_http_upstream_process_request(r, u);
+}
+
+
+static void
+ngx_http_upstream_process_upstream(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_event_t       *rev;
+    ngx_event_pipe_t  *p;
+    ngx_connection_t  *c;
+
+    c = u->peer.connection;
+    p = u->pipe;
+    rev = c->read;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream process upstream");
+
+    c->log->action = "reading upstream";
+
+    if (rev->timedout) {
+
+        p->upstream_error = 1;
+        ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
+
+    } else {
+
+        if (rev->delayed) {
+
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "http upstream delayed");
+
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            }
+
+            return;
+        }
+
+        if (ngx_event_pipe(p, 0) == NGX_ABORT) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+    }
+
+    ngx_http_upstream_process_request(r, u);
+}
+
+
+static void
+ngx_http_upstream_process_request(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_temp_file_t   *tf;
+    ngx_event_pipe_t  *p;
+
+    p = u->pipe;
+
+#if (NGX_THREADS)
+
+    if (p->writing && !p->aio) {
+
+        /*
+         * make sure to call ngx_event_pipe()
+         * if there is an incomplete aio write
+         */
+
+        if (ngx_event_pipe(p, 1) == NGX_ABORT) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+    }
+
+    if (p->writing) {
+        return;
+    }
+
+#endif
+
+    if (ngx_http_upstream_coalesce_shared(u)) {
+        ngx_http_upstream_coalesce_body(r, u);
+    }
+
+    if (u->peer.connection) {
+
+        if (u->store) {
+
+            if (p->upstream_eof || p->upstream_done) {
+
+                tf = p->temp_file;
+
+                if (u->headers_in.status_n == NGX_HTTP_OK
+                    && (p->upstream_done || p->length == -1)
+                    && (u->headers_in.content_length_n == -1
+                        || u->headers_in.content_length_n == tf->offset))
+                {
+                    ngx_http_upstream_store(r, u);
+                }
+            }
+        }
+
+#if (NGX_HTTP_CACHE)
+
+        if (u->cacheable) {
+
+            if (p->upstream_done) {
+                ngx_http_file_cache_update(r, p->temp_file);
+
+            } else if (p->upstream_eof) {
+
+                tf = p->temp_file;
+
+                /* slices received as a whole are kept */
+
+                if (r->cache->slice
+                    || (p->length == -1
+                        && (u->headers_in.content_length_n == -1
+                            || u->headers_in.content_length_n
+                               == tf->offset - (off_t) r->cache->body_start)))
+                {
+                    ngx_http_file_cache_update(r, tf);
+
+                } else {
+                    ngx_http_file_cache_free(r->cache, tf);
+                }
+
+            } else if (p->upstream_error) {
+
+                if (r->cache->slice) {
+                    ngx_http_file_cache_update(r, p->temp_file);
+
+                } else {
+                    ngx_http_file_cache_free(r->cache, p->temp_file);
+                }
+            }
+        }
+
+#endif
+
+        if (p->upstream_done || p->upstream_eof || p->upstream_error) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http upstream exit: %p", p->out);
+
+            if (p->upstream_done
+                || (p->upstream_eof && p->length == -1))
+            {
+                ngx_http_upstream_finalize_request(r, u, 0);
+                return;
+            }
+
+            if (p->upstream_eof) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "upstream prematurely closed connection");
+            }
+
+            ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
+            return;
+        }
+    }
+
+    if (p->downstream_error) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream downstream error");
+
+        if (!u->cacheable && !u->store
+            && !ngx_http_upstream_coalesce_shared(u)
+            && u->peer.connection)
+        {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+#if (NGX_HTTP_CACHE)
+
+        /* slices nobody waits for are not fetched */
+
+        if (u->cacheable && r->cache->slice && !r->header_only
+            && u->peer.connection)
+        {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        }
+
+#endif
+    }
+}
+
+
+static void
+ngx_http_upstream_store(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    size_t                  root;
+    time_t                  lm;
+    ngx_str_t               path;
+    ngx_temp_file_t        *tf;
+    ngx_ext_rename_file_t   ext;
+
+    tf = u->pipe->temp_file;
+
+    if (tf->file.fd == NGX_INVALID_FILE) {
+
+        /* create file for empty 200 response */
+
+        tf = ngx_pcalloc(r->pool, sizeof(ngx_temp_file_t));
+        if (tf == NULL) {
+            return;
+        }
+
+        tf->file.fd = NGX_INVALID_FILE;
+        tf->file.log = r->connection->log;
+        tf->path = u->conf->temp_path;
+        tf->pool = r->pool;
+        tf->persistent = 1;
+
+        if (ngx_create_temp_file(&tf->file, tf->path, tf->pool,
+                                 tf->persistent, tf->clean, tf->access)
+            != NGX_OK)
+        {
+            return;
+        }
+
+        u->pipe->temp_file = tf;
+    }
+
+    ext.access = u->conf->store_access;
+    ext.path_access = u->conf->store_access;
+    ext.time = -1;
+    ext.create_path = 1;
+    ext.delete_file = 1;
+    ext.log = r->connection->log;
+
+    if (u->headers_in.last_modified) {
+
+        lm = ngx_parse_http_time(u->headers_in.last_modified->value.data,
+                                 u->headers_in.last_modified->value.len);
+
+        if (lm != NGX_ERROR) {
+            ext.time = lm;
+            ext.fd = tf->file.fd;
+        }
+    }
+
+    if (u->conf->store_lengths == NULL) {
+
+        if (ngx_http_map_uri_to_path(r, &path, &root, 0) == NULL) {
+            return;
+        }
+
+    } else {
+        if (ngx_http_script_run(r, &path, u->conf->store_lengths->elts, 0,
+                                u->conf->store_values->elts)
+            == NULL)
+        {
+            return;
+        }
+    }
 
-        if (r->header_in->last > r->header_in->pos) {
-            b = r->header_in;
-            b->end = b->last;
-            do_write = 1;
+    path.len--;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "upstream stores \"%s\" to \"%s\"",
+                   tf->file.name.data, path.data);
+
+    (void) ngx_ext_rename_file(&tf->file.name, &path, &ext);
+
+    u->store = 0;
+}
+
+
+static void
+ngx_http_upstream_dummy_handler(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream dummy handler");
+}
+
+
+static void
+ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_uint_t ft_type)
+{
+    ngx_msec_t  timeout;
+    ngx_uint_t  status, state;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http next upstream, %xi", ft_type);
+
+    if (u->hedge) {
+
+        if (u->hedge->peer.connection) {
+
+            /* the hedged attempt failed, continue with the original one */
+
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "hedged upstream request failed");
+
+            ngx_http_upstream_hedge_restore(r, u, NGX_PEER_FAILED);
+            return;
+        }
+
+        ngx_http_upstream_hedge_stop(r, u);
+    }
+
+    if (u->peer.sockaddr) {
+
+        if (ft_type == NGX_HTTP_UPSTREAM_FT_HTTP_403
+            || ft_type == NGX_HTTP_UPSTREAM_FT_HTTP_404)
+        {
+            state = NGX_PEER_NEXT;
+
+        } else {
+            state = NGX_PEER_FAILED;
+        }
+
+        u->peer.free(&u->peer, u->peer.data, state);
+        u->peer.sockaddr = NULL;
+    }
+
+    if (ft_type == NGX_HTTP_UPSTREAM_FT_TIMEOUT) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, NGX_ETIMEDOUT,
+                      "upstream timed out");
+    }
+
+    if (u->peer.cached && ft_type == NGX_HTTP_UPSTREAM_FT_ERROR) {
+        /* TODO: inform balancer instead */
+        u->peer.tries++;
+    }
+
+    switch (ft_type) {
+
+    case NGX_HTTP_UPSTREAM_FT_TIMEOUT:
+        status = NGX_HTTP_GATEWAY_TIME_OUT;
+        break;
+
+    case NGX_HTTP_UPSTREAM_FT_HTTP_500:
+        status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        break;
+
+    case NGX_HTTP_UPSTREAM_FT_HTTP_403:
+        status = NGX_HTTP_FORBIDDEN;
+        break;
+
+    case NGX_HTTP_UPSTREAM_FT_HTTP_404:
+        status = NGX_HTTP_NOT_FOUND;
+        break;
+
+    case NGX_HTTP_UPSTREAM_FT_HTTP_429:
+        status = NGX_HTTP_TOO_MANY_REQUESTS;
+        break;
+
+    /*
+     * NGX_HTTP_UPSTREAM_FT_BUSY_LOCK and NGX_HTTP_UPSTREAM_FT_MAX_WAITING
+     * never reach here
+     */
+
+    default:
+        status = NGX_HTTP_BAD_GATEWAY;
+    }
+
+    if (r->connection->error) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_CLIENT_CLOSED_REQUEST);
+        return;
+    }
+
+    u->state->status = status;
+
+    timeout = u->conf->next_upstream_timeout;
+
+    if (u->request_sent
+        && (r->method & (NGX_HTTP_POST|NGX_HTTP_LOCK|NGX_HTTP_PATCH)))
+    {
+        ft_type |= NGX_HTTP_UPSTREAM_FT_NON_IDEMPOTENT;
+    }
+
+    if (u->peer.tries == 0
+        || ((u->conf->next_upstream & ft_type) != ft_type)
+        || (u->request_sent && r->request_body_no_buffering)
+        || (timeout && ngx_current_msec - u->peer.start_time >= timeout))
+    {
+#if (NGX_HTTP_CACHE)
+
+        if (u->cache_status == NGX_HTTP_CACHE_EXPIRED
+            && ((u->conf->cache_use_stale & ft_type) || r->cache->stale_error))
+        {
+            ngx_int_t  rc;
+
+            rc = u->reinit_request(r);
+
+            if (rc == NGX_OK) {
+                u->cache_status = NGX_HTTP_CACHE_STALE;
+                rc = ngx_http_upstream_cache_send(r, u);
+            }
+
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return;
+        }
+#endif
+
+        ngx_http_upstream_finalize_request(r, u, status);
+        return;
+    }
+
+    if (u->peer.connection) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "close http upstream connection: %d",
+                       u->peer.connection->fd);
+#if (NGX_HTTP_SSL)
+
+        if (u->peer.connection->ssl) {
+            u->peer.connection->ssl->no_wait_shutdown = 1;
+            u->peer.connection->ssl->no_send_shutdown = 1;
+
+            (void) ngx_ssl_shutdown(u->peer.connection);
+        }
+#endif
+
+        if (u->peer.connection->pool) {
+            ngx_destroy_pool(u->peer.connection->pool);
         }
 
-        if (b->start == NULL) {
-            b->start = ngx_palloc(r->pool, u->conf->buffer_size);
-            if (b->start == NULL) {
-                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-                return;
-            }
+        ngx_close_connection(u->peer.connection);
+        u->peer.connection = NULL;
+    }
 
-            b->pos = b->start;
-            b->last = b->start;
-            b->end = b->start + u->conf->buffer_size;
-            b->temporary = 1;
-            b->tag = u->output.tag;
-        }
+    ngx_http_upstream_connect(r, u);
+}
+
+
+static void
+ngx_http_upstream_hedge_arm(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_msec_t                       delay;
+    ngx_http_upstream_hedge_t       *hg;
+    ngx_http_upstream_hedge_conf_t  *hcf;
+
+    if (u->upstream == NULL || u->upstream->hedge == NULL) {
+        return;
     }
 
-    for ( ;; ) {
+    hg = u->hedge;
 
-        if (do_write) {
+    if (hg && (hg->hedged || hg->event.timer_set)) {
+        return;
+    }
 
-            size = b->last - b->pos;
+    /*
+     * only idempotent requests without a body are hedged,
+     * and only if there is another server to send them to
+     */
 
-            if (size && dst->write->ready) {
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))
+        || r->headers_in.content_length_n > 0
+        || r->headers_in.chunked
+        || u->ssl
+        || u->peer.tries < 2)
+    {
+        return;
+    }
 
-                n = dst->send(dst, b->pos, size);
+    hcf = u->upstream->hedge;
 
-                if (n == NGX_ERROR) {
-                    ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-                    return;
-                }
+    if (hg == NULL) {
+        hg = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_hedge_t));
+        if (hg == NULL) {
+            return;
+        }
 
-                if (n > 0) {
-                    b->pos += n;
+        hg->event.handler = ngx_http_upstream_hedge_handler;
+        hg->event.data = r;
+        hg->event.log = r->connection->log;
 
-                    if (b->pos == b->last) {
-                        b->pos = b->start;
-                        b->last = b->start;
-                    }
-                }
-            }
+        u->hedge = hg;
+
+        if (++hcf->requests >= 10000) {
+            hcf->requests /= 2;
+            hcf->hedged /= 2;
         }
+    }
 
-        size = b->end - b->last;
+    delay = ngx_http_upstream_hedge_delay(hcf);
 
-        if (size && src->read->ready) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge delay: %M", delay);
 
-            n = src->recv(src, b->last, size);
+    ngx_add_timer(&hg->event, delay);
+}
 
-            if (n == NGX_AGAIN || n == 0) {
-                break;
-            }
 
-            if (n > 0) {
-                do_write = 1;
-                b->last += n;
+static void
+ngx_http_upstream_hedge_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                *c, *oc;
+    ngx_http_request_t              *r;
+    ngx_http_upstream_t             *u;
+    ngx_http_upstream_hedge_t       *hg;
+    ngx_http_upstream_hedge_conf_t  *hcf;
 
-                if (from_upstream) {
-                    u->state->bytes_received += n;
-                }
+    r = ev->data;
+    c = r->connection;
+    u = r->upstream;
+    hg = u->hedge;
+    hcf = u->upstream->hedge;
 
-                continue;
-            }
+    ngx_http_set_log_request(c->log, r);
 
-            if (n == NGX_ERROR) {
-                src->read->eof = 1;
-            }
-        }
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream hedge handler");
 
-        break;
-    }
+    oc = u->peer.connection;
 
-    if ((upstream->read->eof && u->buffer.pos == u->buffer.last)
-        || (downstream->read->eof && u->from_client.pos == u->from_client.last)
-        || (downstream->read->eof && upstream->read->eof))
+    if (oc == NULL
+        || u->read_event_handler != ngx_http_upstream_process_header
+        || u->state->bytes_received)
     {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                       "http upstream upgraded done");
-        ngx_http_upstream_finalize_request(r, u, 0);
         return;
     }
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-
-    if (ngx_handle_write_event(upstream->write, u->conf->send_lowat)
-        != NGX_OK)
-    {
-        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+    if (hcf->hedged * 100 >= hcf->requests * hcf->budget) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http upstream hedge: budget exhausted");
         return;
     }
 
-    if (upstream->write->active && !upstream->write->ready) {
-        ngx_add_timer(upstream->write, u->conf->send_timeout);
+    hg->peer = u->peer;
+    hg->state = u->state - (ngx_http_upstream_state_t *)
+                               r->upstream_states->elts;
+    hg->response_time = u->state->response_time;
 
-    } else if (upstream->write->timer_set) {
-        ngx_del_timer(upstream->write);
-    }
+    /*
+     * a separate balancer context is used for the hedged attempt,
+     * so that the losing attempt can be released with its own one
+     */
 
-    if (ngx_handle_read_event(upstream->read, 0) != NGX_OK) {
-        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+    if (u->upstream->peer.init(r, u->upstream) != NGX_OK) {
+        u->peer = hg->peer;
+        hg->peer.connection = NULL;
         return;
     }
 
-    if (upstream->read->active && !upstream->read->ready) {
-        ngx_add_timer(upstream->read, u->conf->read_timeout);
+    u->peer.connection = NULL;
+    u->peer.sockaddr = NULL;
+    u->peer.cached = 0;
 
-    } else if (upstream->read->timer_set) {
-        ngx_del_timer(upstream->read);
-    }
+    hg->hedged = 1;
+    hcf->hedged++;
 
-    if (ngx_handle_write_event(downstream->write, clcf->send_lowat)
-        != NGX_OK)
-    {
-        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-        return;
-    }
+    oc->read->handler = ngx_http_upstream_hedge_original_handler;
+    oc->write->handler = ngx_http_empty_handler;
 
-    if (ngx_handle_read_event(downstream->read, 0) != NGX_OK) {
-        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-        return;
-    }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream hedge: no response from %V",
+                   hg->peer.name);
 
-    if (downstream->write->active && !downstream->write->ready) {
-        ngx_add_timer(downstream->write, clcf->send_timeout);
+    ngx_http_upstream_connect(r, u);
 
-    } else if (downstream->write->timer_set) {
-        ngx_del_timer(downstream->write);
-    }
+    ngx_http_run_posted_requests(c);
 }
 
 
 static void
-ngx_http_upstream_process_non_buffered_downstream(ngx_http_request_t *r)
+ngx_http_upstream_hedge_original_handler(ngx_event_t *ev)
 {
-    ngx_event_t          *wev;
-    ngx_connection_t     *c;
-    ngx_http_upstream_t  *u;
+    int                         n;
+    char                        buf[1];
+    ngx_err_t                   err;
+    ngx_connection_t           *c, *oc;
+    ngx_http_request_t         *r;
+    ngx_http_upstream_t        *u;
+    ngx_http_upstream_hedge_t  *hg;
+    ngx_http_upstream_state_t  *state;
 
+    oc = ev->data;
+    r = oc->data;
     c = r->connection;
     u = r->upstream;
-    wev = c->write;
+    hg = u->hedge;
+
+    ngx_http_set_log_request(c->log, r);
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream process non buffered downstream");
+                   "http upstream hedge original handler");
 
-    c->log->action = "sending to client";
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out");
+        goto failed;
+    }
+
+    n = recv(oc->fd, buf, 1, MSG_PEEK);
+
+    err = ngx_socket_errno;
+
+    if (n == -1 && err == NGX_EAGAIN) {
+        ev->ready = 0;
+
+        if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+            goto failed;
+        }
 
-    if (wev->timedout) {
-        c->timedout = 1;
-        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
-        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
         return;
     }
 
-    ngx_http_upstream_process_non_buffered_request(r, 1);
-}
+    if (n <= 0) {
+        goto failed;
+    }
 
+    /* the original attempt answered first, cancel the hedged one */
 
-static void
-ngx_http_upstream_process_non_buffered_upstream(ngx_http_request_t *r,
-    ngx_http_upstream_t *u)
-{
-    ngx_connection_t  *c;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream hedge: original attempt won");
 
-    c = u->peer.connection;
+    ngx_http_upstream_hedge_restore(r, u, 0);
+    ngx_http_upstream_process_header(r, u);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream process non buffered upstream");
+    ngx_http_run_posted_requests(c);
 
-    c->log->action = "reading upstream";
+    return;
 
-    if (c->read->timedout) {
-        ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
-        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_GATEWAY_TIME_OUT);
-        return;
-    }
+failed:
 
-    ngx_http_upstream_process_non_buffered_request(r, 0);
+    state = r->upstream_states->elts;
+    state[hg->state].status = ev->timedout ? NGX_HTTP_GATEWAY_TIME_OUT
+                                           : NGX_HTTP_BAD_GATEWAY;
+    state[hg->state].response_time = ngx_current_msec - hg->response_time;
+
+    ngx_http_upstream_hedge_close_peer(&hg->peer, NGX_PEER_FAILED);
 }
 
 
 static void
-ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
-    ngx_uint_t do_write)
+ngx_http_upstream_hedge_restore(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_uint_t state)
 {
-    size_t                     size;
-    ssize_t                    n;
-    ngx_buf_t                 *b;
-    ngx_int_t                  rc;
-    ngx_connection_t          *downstream, *upstream;
-    ngx_http_upstream_t       *u;
-    ngx_http_core_loc_conf_t  *clcf;
-
-    u = r->upstream;
-    downstream = r->connection;
-    upstream = u->peer.connection;
-
-    b = &u->buffer;
+    ngx_connection_t           *c;
+    ngx_http_upstream_hedge_t  *hg;
 
-    do_write = do_write || u->length == 0;
+    hg = u->hedge;
 
-    for ( ;; ) {
+    if (u->state && u->state->response_time) {
+        u->state->response_time = ngx_current_msec - u->state->response_time;
+    }
 
-        if (do_write) {
+    ngx_http_upstream_hedge_close_peer(&u->peer, state);
 
-            if (u->out_bufs || u->busy_bufs) {
-                rc = ngx_http_output_filter(r, u->out_bufs);
+    u->peer = hg->peer;
+    hg->peer.connection = NULL;
 
-                if (rc == NGX_ERROR) {
-                    ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-                    return;
-                }
+    u->state = (ngx_http_upstream_state_t *) r->upstream_states->elts
+               + hg->state;
+    u->state->response_time = hg->response_time;
 
-                ngx_chain_update_chains(r->pool, &u->free_bufs, &u->busy_bufs,
-                                        &u->out_bufs, u->output.tag);
-            }
+    c = u->peer.connection;
 
-            if (u->busy_bufs == NULL) {
+    c->read->handler = ngx_http_upstream_handler;
+    c->write->handler = ngx_http_upstream_handler;
 
-                if (u->length == 0
-                    || (upstream->read->eof && u->length == -1))
-                {
-                    ngx_http_upstream_finalize_request(r, u, 0);
-                    return;
-                }
+    u->writer.connection = c;
 
-                if (upstream->read->eof) {
-                    ngx_log_error(NGX_LOG_ERR, upstream->log, 0,
-                                  "upstream prematurely closed connection");
+    u->write_event_handler = ngx_http_upstream_dummy_handler;
+    u->read_event_handler = ngx_http_upstream_process_header;
 
-                    ngx_http_upstream_finalize_request(r, u,
-                                                       NGX_HTTP_BAD_GATEWAY);
-                    return;
-                }
+    u->request_sent = 1;
+    u->request_body_sent = 1;
+}
 
-                if (upstream->read->error) {
-                    ngx_http_upstream_finalize_request(r, u,
-                                                       NGX_HTTP_BAD_GATEWAY);
-                    return;
-                }
 
-                b->pos = b->start;
-                b->last = b->start;
-            }
-        }
+static void
+ngx_http_upstream_hedge_stop(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_http_upstream_hedge_t  *hg;
+    ngx_http_upstream_state_t  *state;
 
-        size = b->end - b->last;
+    hg = u->hedge;
 
-        if (size && upstream->read->ready) {
+    if (hg->event.timer_set) {
+        ngx_del_timer(&hg->event);
+    }
 
-            n = upstream->recv(upstream, b->last, size);
+    if (hg->peer.connection == NULL) {
+        return;
+    }
 
-            if (n == NGX_AGAIN) {
-                break;
-            }
+    /* the hedged attempt answered first, cancel the original one */
 
-            if (n > 0) {
-                u->state->bytes_received += n;
-                u->state->response_length += n;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge: cancel %V", hg->peer.name);
 
-                if (u->input_filter(u->input_filter_ctx, n) == NGX_ERROR) {
-                    ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-                    return;
-                }
-            }
+    state = r->upstream_states->elts;
+    state[hg->state].response_time = ngx_current_msec - hg->response_time;
 
-            do_write = 1;
+    ngx_http_upstream_hedge_close_peer(&hg->peer, 0);
+}
 
-            continue;
+
+static void
+ngx_http_upstream_hedge_close_peer(ngx_peer_connection_t *pc,
+    ngx_uint_t state)
+{
+    if (pc->connection) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->connection->log, 0,
+                       "close http upstream connection: %d",
+                       pc->connection->fd);
+
+        if (pc->connection->pool) {
+            ngx_destroy_pool(pc->connection->pool);
         }
 
-        break;
+        ngx_close_connection(pc->connection);
+        pc->connection = NULL;
     }
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-
-    if (downstream->data == r) {
-        if (ngx_handle_write_event(downstream->write, clcf->send_lowat)
-            != NGX_OK)
-        {
-            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-            return;
-        }
+    if (pc->sockaddr) {
+        pc->free(pc, pc->data, state);
+        pc->sockaddr = NULL;
     }
+}
 
-    if (downstream->write->active && !downstream->write->ready) {
-        ngx_add_timer(downstream->write, clcf->send_timeout);
 
-    } else if (downstream->write->timer_set) {
-        ngx_del_timer(downstream->write);
-    }
+/*
+ * header times are kept in a histogram with 16 linear one millisecond
+ * buckets followed by 4 buckets per power of two, up to about 65 seconds
+ */
 
-    if (ngx_handle_read_event(upstream->read, 0) != NGX_OK) {
-        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-        return;
-    }
+static void
+ngx_http_upstream_hedge_sample(ngx_http_upstream_hedge_conf_t *hcf,
+    ngx_msec_t ms)
+{
+    ngx_uint_t  i, b;
 
-    if (upstream->read->active && !upstream->read->ready) {
-        ngx_add_timer(upstream->read, u->conf->read_timeout);
+    if (ms < 16) {
+        b = ms;
 
-    } else if (upstream->read->timer_set) {
-        ngx_del_timer(upstream->read);
+    } else {
+        for (i = 4; (ms >> (i + 1)) && i < 19; i++) { /* void */ }
+
+        b = 16 + (i - 4) * 4 + ((ms >> (i - 2)) & 3);
+
+        if (b >= NGX_HTTP_UPSTREAM_HEDGE_BUCKETS) {
+            b = NGX_HTTP_UPSTREAM_HEDGE_BUCKETS - 1;
+        }
     }
-}
 
+    hcf->hist[b]++;
 
-static ngx_int_t
-ngx_http_upstream_non_buffered_filter_init(void *data)
-{
-    return NGX_OK;
+    if (++hcf->samples >= 10000) {
+        hcf->samples = 0;
+
+        for (i = 0; i < NGX_HTTP_UPSTREAM_HEDGE_BUCKETS; i++) {
+            hcf->hist[i] /= 2;
+            hcf->samples += hcf->hist[i];
+        }
+    }
 }
 
 
-static ngx_int_t
-ngx_http_upstream_non_buffered_filter(void *data, ssize_t bytes)
+static ngx_msec_t
+ngx_http_upstream_hedge_delay(ngx_http_upstream_hedge_conf_t *hcf)
 {
-    ngx_http_request_t  *r = data;
+    ngx_uint_t  i, n, sum;
+    ngx_msec_t  delay;
 
-    ngx_buf_t            *b;
-    ngx_chain_t          *cl, **ll;
-    ngx_http_upstream_t  *u;
+    if (hcf->samples < 100) {
+        return hcf->max_delay;
+    }
 
-    u = r->upstream;
+    n = hcf->samples * hcf->percentile / 100;
+    sum = 0;
 
-    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
-        ll = &cl->next;
-    }
+    for (i = 0; i < NGX_HTTP_UPSTREAM_HEDGE_BUCKETS - 1; i++) {
+        sum += hcf->hist[i];
 
-    cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs);
-    if (cl == NULL) {
-        return NGX_ERROR;
+        if (sum > n) {
+            break;
+        }
     }
 
-    *ll = cl;
-
-    cl->buf->flush = 1;
-    cl->buf->memory = 1;
+    /* the upper bound of the bucket */
 
-    b = &u->buffer;
+    if (i < 16) {
+        delay = i + 1;
 
-    cl->buf->pos = b->last;
-    b->last += bytes;
-    cl->buf->last = b->last;
-    cl->buf->tag = u->output.tag;
+    } else {
+        delay = (ngx_msec_t) (4 + (i - 16) % 4 + 1) << ((i - 16) / 4 + 2);
+    }
 
-    if (u->length == -1) {
-        return NGX_OK;
+    if (delay < hcf->min_delay) {
+        return hcf->min_delay;
     }
 
-    u->length -= bytes;
+    if (delay > hcf->max_delay) {
+        return hcf->max_delay;
+    }
 
-    return NGX_OK;
+    return delay;
 }
 
 
-#if (NGX_THREADS)
-
 static ngx_int_t
-ngx_http_upstream_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
+ngx_http_upstream_coalesce_init(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
-    ngx_str_t                  name;
-    ngx_event_pipe_t          *p;
-    ngx_thread_pool_t         *tp;
-    ngx_http_request_t        *r;
-    ngx_http_core_loc_conf_t  *clcf;
+    uint32_t                        hash;
+    ngx_str_t                       key;
+    ngx_str_node_t                 *sn;
+    ngx_http_upstream_coalesce_t   *cf, *leader;
+    ngx_http_upstream_main_conf_t  *umcf;
 
-    r = file->thread_ctx;
-    p = r->upstream->pipe;
+    /* partial and per-user responses are not shared */
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-    tp = clcf->thread_pool;
+    if (r != r->main
+        || r->method != NGX_HTTP_GET
+        || r->headers_in.content_length_n > 0
+        || r->headers_in.chunked
+        || r->headers_in.range
+        || r->headers_in.authorization
+        || u->conf->coalesce_key == NULL)
+    {
+        return NGX_OK;
+    }
 
-    if (tp == NULL) {
-        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
-            != NGX_OK)
-        {
-            return NGX_ERROR;
-        }
+#if (NGX_HTTP_CACHE)
 
-        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
+    /* cached requests are collapsed by proxy_cache_lock */
 
-        if (tp == NULL) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "thread pool \"%V\" not found", &name);
-            return NGX_ERROR;
-        }
+    if (r->cache) {
+        return NGX_OK;
     }
 
-    task->event.data = r;
-    task->event.handler = ngx_http_upstream_thread_event_handler;
+#endif
 
-    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+    if (ngx_http_complex_value(r, u->conf->coalesce_key, &key) != NGX_OK) {
         return NGX_ERROR;
     }
 
-    r->main->blocked++;
-    r->aio = 1;
-    p->aio = 1;
-
-    return NGX_OK;
-}
+    cf = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_coalesce_t));
+    if (cf == NULL) {
+        return NGX_ERROR;
+    }
 
+    cf->request = r;
+    u->coalesce = cf;
 
-static void
-ngx_http_upstream_thread_event_handler(ngx_event_t *ev)
-{
-    ngx_connection_t    *c;
-    ngx_http_request_t  *r;
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
 
-    r = ev->data;
-    c = r->connection;
+    hash = ngx_crc32_long(key.data, key.len);
 
-    ngx_http_set_log_request(c->log, r);
+    sn = ngx_str_rbtree_lookup(&umcf->coalesce, &key, hash);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream thread: \"%V?%V\"", &r->uri, &r->args);
+    if (sn == NULL) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream coalesce leader: \"%V\"", &key);
 
-    r->main->blocked--;
-    r->aio = 0;
+        cf->node.node.key = hash;
+        cf->node.str = key;
 
-    if (r->done) {
-        /*
-         * trigger connection event handler if the subrequest was
-         * already finalized; this can happen if the handler is used
-         * for sendfile() in threads
-         */
+        ngx_rbtree_insert(&umcf->coalesce, &cf->node.node);
 
-        c->write->handler(c->write);
+        ngx_queue_init(&cf->followers);
+        cf->linked = 1;
 
-    } else {
-        r->write_event_handler(r);
-        ngx_http_run_posted_requests(c);
+        return NGX_OK;
     }
-}
 
-#endif
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream coalesce follower: \"%V\"", &key);
 
+    leader = (ngx_http_upstream_coalesce_t *) sn;
 
-static ngx_int_t
-ngx_http_upstream_output_filter(void *data, ngx_chain_t *chain)
-{
-    ngx_int_t            rc;
-    ngx_event_pipe_t    *p;
-    ngx_http_request_t  *r;
+    ngx_queue_insert_tail(&leader->followers, &cf->queue);
 
-    r = data;
-    p = r->upstream->pipe;
+    cf->leader = leader;
+    cf->follower = 1;
+    cf->linked = 1;
 
-    rc = ngx_http_output_filter(r, chain);
+    cf->event.handler = ngx_http_upstream_coalesce_handler;
+    cf->event.data = r;
+    cf->event.log = r->connection->log;
 
-    p->aio = r->aio;
+    cf->file.fd = NGX_INVALID_FILE;
 
-    return rc;
+    return NGX_DONE;
 }
 
 
 static void
-ngx_http_upstream_process_downstream(ngx_http_request_t *r)
+ngx_http_upstream_coalesce_header(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
 {
-    ngx_event_t          *wev;
-    ngx_connection_t     *c;
-    ngx_event_pipe_t     *p;
-    ngx_http_upstream_t  *u;
+    ngx_uint_t                      share;
+    ngx_queue_t                    *q, *next;
+    ngx_http_upstream_coalesce_t   *cf, *fcf;
+    ngx_http_upstream_main_conf_t  *umcf;
 
-    c = r->connection;
-    u = r->upstream;
-    p = u->pipe;
-    wev = c->write;
+    cf = u->coalesce;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream process downstream");
+    if (cf->follower) {
+        return;
+    }
 
-    c->log->action = "sending to client";
+    /* requests arriving from now on would miss a part of the response */
 
-#if (NGX_THREADS)
-    p->aio = r->aio;
-#endif
+    if (cf->linked) {
+        umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
 
-    if (wev->timedout) {
+        ngx_rbtree_delete(&umcf->coalesce, &cf->node.node);
+        cf->linked = 0;
+    }
 
-        p->downstream_error = 1;
-        c->timedout = 1;
-        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
+    if (ngx_queue_empty(&cf->followers)) {
+        return;
+    }
 
-    } else {
+    share = u->buffering
+            && !u->upgrade
+            && !r->header_only
+            && ngx_http_upstream_coalesce_shareable(r, u);
 
-        if (wev->delayed) {
+    cf->shared = share;
 
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                           "http downstream delayed");
+    for (q = ngx_queue_head(&cf->followers);
+         q != ngx_queue_sentinel(&cf->followers);
+         q = next)
+    {
+        next = ngx_queue_next(q);
 
-            if (ngx_handle_write_event(wev, p->send_lowat) != NGX_OK) {
-                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-            }
+        fcf = ngx_queue_data(q, ngx_http_upstream_coalesce_t, queue);
 
-            return;
+        if (share
+            && ngx_http_upstream_coalesce_copy_headers(fcf->request, u)
+               == NGX_OK)
+        {
+            fcf->header = 1;
+
+        } else {
+            ngx_queue_remove(q);
+
+            fcf->linked = 0;
+            fcf->leader = NULL;
+            fcf->release = 1;
         }
 
-        if (ngx_event_pipe(p, 1) == NGX_ABORT) {
-            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-            return;
+        if (!fcf->event.posted) {
+            ngx_post_event(&fcf->event, &ngx_posted_events);
         }
     }
-
-    ngx_http_upstream_process_request(r, u);
 }
 
 
-static void
-ngx_http_upstream_process_upstream(ngx_http_request_t *r,
+static ngx_uint_t
+ngx_http_upstream_coalesce_shareable(ngx_http_request_t *r,
     ngx_http_upstream_t *u)
 {
-    ngx_event_t       *rev;
-    ngx_event_pipe_t  *p;
-    ngx_connection_t  *c;
+    u_char            *p, *last;
+    ngx_uint_t         i;
+    ngx_table_elt_t  **h;
 
-    c = u->peer.connection;
-    p = u->pipe;
-    rev = c->read;
+    if (u->headers_in.status_n == NGX_HTTP_PARTIAL_CONTENT) {
+        return 0;
+    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream process upstream");
+    if (u->headers_in.cookies.nelts
+        && !(u->conf->ignore_headers & NGX_HTTP_UPSTREAM_IGN_SET_COOKIE))
+    {
+        return 0;
+    }
 
-    c->log->action = "reading upstream";
+    /* the variant may depend on the request headers */
 
-    if (rev->timedout) {
+    if (u->headers_in.vary
+        && !(u->conf->ignore_headers & NGX_HTTP_UPSTREAM_IGN_VARY))
+    {
+        return 0;
+    }
 
-        p->upstream_error = 1;
-        ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
+    if (u->conf->ignore_headers & NGX_HTTP_UPSTREAM_IGN_CACHE_CONTROL) {
+        return 1;
+    }
+
+    h = u->headers_in.cache_control.elts;
+
+    for (i = 0; i < u->headers_in.cache_control.nelts; i++) {
+        p = h[i]->value.data;
+        last = p + h[i]->value.len;
+
+        if (ngx_strlcasestrn(p, last, (u_char *) "private", 7 - 1) != NULL
+            || ngx_strlcasestrn(p, last, (u_char *) "no-store", 8 - 1) != NULL)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_coalesce_copy_headers(ngx_http_request_t *r,
+    ngx_http_upstream_t *lu)
+{
+    u_char                         *p;
+    ngx_uint_t                      i;
+    ngx_list_part_t                *part;
+    ngx_table_elt_t                *h, *header;
+    ngx_http_upstream_t            *u;
+    ngx_http_upstream_header_t     *hh;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    u = r->upstream;
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
-    } else {
+    u->headers_in.content_length_n = -1;
+    u->headers_in.last_modified_time = -1;
 
-        if (rev->delayed) {
+    part = &lu->headers_in.headers.part;
+    header = part->elts;
 
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                           "http upstream delayed");
+    for (i = 0; /* void */; i++) {
 
-            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
-                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
             }
 
-            return;
+            part = part->next;
+            header = part->elts;
+            i = 0;
         }
 
-        if (ngx_event_pipe(p, 0) == NGX_ABORT) {
-            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-            return;
+        h = ngx_list_push(&u->headers_in.headers);
+        if (h == NULL) {
+            return NGX_ERROR;
         }
-    }
 
-    ngx_http_upstream_process_request(r, u);
-}
+        h->hash = header[i].hash;
 
+        h->key.len = header[i].key.len;
+        h->value.len = header[i].value.len;
 
-static void
-ngx_http_upstream_process_request(ngx_http_request_t *r,
-    ngx_http_upstream_t *u)
-{
-    ngx_temp_file_t   *tf;
-    ngx_event_pipe_t  *p;
+        p = ngx_pnalloc(r->pool, h->key.len + 1 + h->value.len + 1
+                                 + h->key.len);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
 
-    p = u->pipe;
+        h->key.data = p;
+        p = ngx_cpymem(p, header[i].key.data, h->key.len);
+        *p++ = '\0';
 
-#if (NGX_THREADS)
+        h->value.data = p;
+        p = ngx_cpymem(p, header[i].value.data, h->value.len);
+        *p++ = '\0';
 
-    if (p->writing && !p->aio) {
+        h->lowcase_key = p;
+        ngx_memcpy(p, header[i].lowcase_key, h->key.len);
 
-        /*
-         * make sure to call ngx_event_pipe()
-         * if there is an incomplete aio write
-         */
+        hh = ngx_hash_find(&umcf->headers_in_hash, h->hash,
+                           h->lowcase_key, h->key.len);
 
-        if (ngx_event_pipe(p, 1) == NGX_ABORT) {
-            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-            return;
+        if (hh && hh->handler(r, h, hh->offset) != NGX_OK) {
+            return NGX_ERROR;
         }
     }
 
-    if (p->writing) {
-        return;
-    }
+    u->headers_in.status_n = lu->headers_in.status_n;
 
-#endif
+    if (lu->headers_in.status_line.len) {
+        u->headers_in.status_line.len = lu->headers_in.status_line.len;
+        u->headers_in.status_line.data = ngx_pstrdup(r->pool,
+                                                &lu->headers_in.status_line);
+        if (u->headers_in.status_line.data == NULL) {
+            return NGX_ERROR;
+        }
+    }
 
-    if (u->peer.connection) {
+    u->headers_in.content_length_n = lu->headers_in.content_length_n;
+    u->headers_in.chunked = lu->headers_in.chunked;
 
-        if (u->store) {
+    return NGX_OK;
+}
 
-            if (p->upstream_eof || p->upstream_done) {
 
-                tf = p->temp_file;
+static void
+ngx_http_upstream_coalesce_body(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    off_t                          offset;
+    ngx_queue_t                   *q;
+    ngx_temp_file_t               *tf;
+    ngx_http_upstream_coalesce_t  *cf, *fcf;
 
-                if (u->headers_in.status_n == NGX_HTTP_OK
-                    && (p->upstream_done || p->length == -1)
-                    && (u->headers_in.content_length_n == -1
-                        || u->headers_in.content_length_n == tf->offset))
-                {
-                    ngx_http_upstream_store(r, u);
-                }
-            }
-        }
+    cf = u->coalesce;
+    tf = u->pipe->temp_file;
 
-#if (NGX_HTTP_CACHE)
+    if (tf == NULL || tf->file.fd == NGX_INVALID_FILE) {
+        return;
+    }
 
-        if (u->cacheable) {
+    /*
+     * the whole response is written to the temp file, and followers
+     * send it from there with their own descriptors, as the leader's
+     * file is closed and removed with its request
+     */
 
-            if (p->upstream_done) {
-                ngx_http_file_cache_update(r, p->temp_file);
+    offset = tf->offset;
 
-            } else if (p->upstream_eof) {
+    for (q = ngx_queue_head(&cf->followers);
+         q != ngx_queue_sentinel(&cf->followers);
+         q = ngx_queue_next(q))
+    {
+        fcf = ngx_queue_data(q, ngx_http_upstream_coalesce_t, queue);
 
-                tf = p->temp_file;
+        if (fcf->done || fcf->available == offset) {
+            continue;
+        }
 
-                if (p->length == -1
-                    && (u->headers_in.content_length_n == -1
-                        || u->headers_in.content_length_n
-                           == tf->offset - (off_t) r->cache->body_start))
-                {
-                    ngx_http_file_cache_update(r, tf);
+        if (fcf->file.fd == NGX_INVALID_FILE
+            && ngx_http_upstream_coalesce_open(fcf, tf) != NGX_OK)
+        {
+            fcf->done = 1;
+            fcf->rc = NGX_ERROR;
 
-                } else {
-                    ngx_http_file_cache_free(r->cache, tf);
-                }
+        } else {
+            fcf->available = offset;
+        }
 
-            } else if (p->upstream_error) {
-                ngx_http_file_cache_free(r->cache, p->temp_file);
-            }
+        if (!fcf->event.posted) {
+            ngx_post_event(&fcf->event, &ngx_posted_events);
         }
+    }
+}
 
-#endif
 
-        if (p->upstream_done || p->upstream_eof || p->upstream_error) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "http upstream exit: %p", p->out);
+static ngx_int_t
+ngx_http_upstream_coalesce_open(ngx_http_upstream_coalesce_t *cf,
+    ngx_temp_file_t *tf)
+{
+    u_char                   *name;
+    ngx_fd_t                  fd;
+    ngx_pool_cleanup_t       *cln;
+    ngx_http_request_t       *r;
+    ngx_pool_cleanup_file_t  *clnf;
 
-            if (p->upstream_done
-                || (p->upstream_eof && p->length == -1))
-            {
-                ngx_http_upstream_finalize_request(r, u, 0);
-                return;
-            }
+    r = cf->request;
 
-            if (p->upstream_eof) {
-                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                              "upstream prematurely closed connection");
-            }
+    name = ngx_pnalloc(r->pool, tf->file.name.len + 1);
+    if (name == NULL) {
+        return NGX_ERROR;
+    }
 
-            ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
-            return;
-        }
+    ngx_cpystrn(name, tf->file.name.data, tf->file.name.len + 1);
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
     }
 
-    if (p->downstream_error) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http upstream downstream error");
+    fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
 
-        if (!u->cacheable && !u->store && u->peer.connection) {
-            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-        }
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", name);
+        return NGX_ERROR;
     }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = fd;
+    clnf->name = name;
+    clnf->log = r->pool->log;
+
+    cf->file.fd = fd;
+    cf->file.name.len = tf->file.name.len;
+    cf->file.name.data = name;
+    cf->file.log = r->connection->log;
+
+    return NGX_OK;
 }
 
 
 static void
-ngx_http_upstream_store(ngx_http_request_t *r, ngx_http_upstream_t *u)
+ngx_http_upstream_coalesce_finalize(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_int_t rc)
 {
-    size_t                  root;
-    time_t                  lm;
-    ngx_str_t               path;
-    ngx_temp_file_t        *tf;
-    ngx_ext_rename_file_t   ext;
-
-    tf = u->pipe->temp_file;
+    ngx_queue_t                    *q;
+    ngx_http_upstream_coalesce_t   *cf, *fcf;
+    ngx_http_upstream_main_conf_t  *umcf;
 
-    if (tf->file.fd == NGX_INVALID_FILE) {
+    cf = u->coalesce;
 
-        /* create file for empty 200 response */
+    if (cf->follower) {
 
-        tf = ngx_pcalloc(r->pool, sizeof(ngx_temp_file_t));
-        if (tf == NULL) {
-            return;
+        if (cf->linked) {
+            ngx_queue_remove(&cf->queue);
+            cf->linked = 0;
+            cf->leader = NULL;
         }
 
-        tf->file.fd = NGX_INVALID_FILE;
-        tf->file.log = r->connection->log;
-        tf->path = u->conf->temp_path;
-        tf->pool = r->pool;
-        tf->persistent = 1;
-
-        if (ngx_create_temp_file(&tf->file, tf->path, tf->pool,
-                                 tf->persistent, tf->clean, tf->access)
-            != NGX_OK)
-        {
-            return;
+        if (cf->event.posted) {
+            ngx_delete_posted_event(&cf->event);
         }
 
-        u->pipe->temp_file = tf;
+        return;
     }
 
-    ext.access = u->conf->store_access;
-    ext.path_access = u->conf->store_access;
-    ext.time = -1;
-    ext.create_path = 1;
-    ext.delete_file = 1;
-    ext.log = r->connection->log;
-
-    if (u->headers_in.last_modified) {
+    if (cf->linked) {
+        umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
 
-        lm = ngx_parse_http_time(u->headers_in.last_modified->value.data,
-                                 u->headers_in.last_modified->value.len);
+        ngx_rbtree_delete(&umcf->coalesce, &cf->node.node);
+        cf->linked = 0;
+    }
 
-        if (lm != NGX_ERROR) {
-            ext.time = lm;
-            ext.fd = tf->file.fd;
-        }
+    if (ngx_queue_empty(&cf->followers)) {
+        return;
     }
 
-    if (u->conf->store_lengths == NULL) {
+    /*
+     * the leader of a shared response keeps reading it when its own
+     * client goes away, so the response is complete for followers
+     * if it was completely received from the upstream
+     */
 
-        if (ngx_http_map_uri_to_path(r, &path, &root, 0) == NULL) {
-            return;
-        }
+    if (cf->shared) {
+        ngx_http_upstream_coalesce_body(r, u);
+    }
 
-    } else {
-        if (ngx_http_script_run(r, &path, u->conf->store_lengths->elts, 0,
-                                u->conf->store_values->elts)
-            == NULL)
-        {
-            return;
-        }
+    if (rc != 0) {
+        rc = NGX_HTTP_BAD_GATEWAY;
     }
 
-    path.len--;
+    while (!ngx_queue_empty(&cf->followers)) {
+        q = ngx_queue_head(&cf->followers);
+        ngx_queue_remove(q);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "upstream stores \"%s\" to \"%s\"",
-                   tf->file.name.data, path.data);
+        fcf = ngx_queue_data(q, ngx_http_upstream_coalesce_t, queue);
 
-    (void) ngx_ext_rename_file(&tf->file.name, &path, &ext);
+        fcf->linked = 0;
+        fcf->leader = NULL;
 
-    u->store = 0;
-}
+        if (fcf->header) {
+            if (!fcf->done) {
+                fcf->done = 1;
+                fcf->rc = rc;
+            }
 
+        } else {
+            fcf->release = 1;
+        }
 
-static void
-ngx_http_upstream_dummy_handler(ngx_http_request_t *r, ngx_http_upstream_t *u)
-{
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http upstream dummy handler");
+        if (!fcf->event.posted) {
+            ngx_post_event(&fcf->event, &ngx_posted_events);
+        }
+    }
 }
 
 
 static void
-ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
-    ngx_uint_t ft_type)
+ngx_http_upstream_coalesce_handler(ngx_event_t *ev)
 {
-    ngx_msec_t  timeout;
-    ngx_uint_t  status, state;
+    ngx_connection_t              *c;
+    ngx_http_request_t            *r;
+    ngx_http_upstream_t           *u;
+    ngx_http_upstream_coalesce_t  *cf;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http next upstream, %xi", ft_type);
+    r = ev->data;
+    c = r->connection;
+    u = r->upstream;
+    cf = u->coalesce;
 
-    if (u->peer.sockaddr) {
+    ngx_http_set_log_request(c->log, r);
 
-        if (ft_type == NGX_HTTP_UPSTREAM_FT_HTTP_403
-            || ft_type == NGX_HTTP_UPSTREAM_FT_HTTP_404)
-        {
-            state = NGX_PEER_NEXT;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream coalesce handler");
 
-        } else {
-            state = NGX_PEER_FAILED;
-        }
+    if (cf->release) {
 
-        u->peer.free(&u->peer, u->peer.data, state);
-        u->peer.sockaddr = NULL;
-    }
+        /* the leader's response cannot be shared, go to upstream */
 
-    if (ft_type == NGX_HTTP_UPSTREAM_FT_TIMEOUT) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, NGX_ETIMEDOUT,
-                      "upstream timed out");
+        cf->release = 0;
+        ngx_http_upstream_start(r, u);
+
+    } else {
+        ngx_http_upstream_coalesce_send(r, u);
     }
 
-    if (u->peer.cached && ft_type == NGX_HTTP_UPSTREAM_FT_ERROR) {
-        /* TODO: inform balancer instead */
-        u->peer.tries++;
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_upstream_coalesce_downstream(ngx_http_request_t *r)
+{
+    ngx_connection_t     *c;
+    ngx_http_upstream_t  *u;
+
+    c = r->connection;
+    u = r->upstream;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream coalesce downstream");
+
+    if (c->write->timedout) {
+        c->timedout = 1;
+        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
     }
 
-    switch (ft_type) {
+    ngx_http_upstream_coalesce_send(r, u);
+}
 
-    case NGX_HTTP_UPSTREAM_FT_TIMEOUT:
-        status = NGX_HTTP_GATEWAY_TIME_OUT;
-        break;
 
-    case NGX_HTTP_UPSTREAM_FT_HTTP_500:
-        status = NGX_HTTP_INTERNAL_SERVER_ERROR;
-        break;
+static void
+ngx_http_upstream_coalesce_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_int_t                      rc;
+    ngx_buf_t                     *b;
+    ngx_chain_t                   *cl;
+    ngx_event_t                   *wev;
+    ngx_http_core_loc_conf_t      *clcf;
+    ngx_http_upstream_coalesce_t  *cf;
 
-    case NGX_HTTP_UPSTREAM_FT_HTTP_403:
-        status = NGX_HTTP_FORBIDDEN;
-        break;
+    cf = u->coalesce;
 
-    case NGX_HTTP_UPSTREAM_FT_HTTP_404:
-        status = NGX_HTTP_NOT_FOUND;
-        break;
+    if (cf->header && !u->header_sent) {
 
-    case NGX_HTTP_UPSTREAM_FT_HTTP_429:
-        status = NGX_HTTP_TOO_MANY_REQUESTS;
-        break;
+        if (ngx_http_upstream_process_headers(r, u) != NGX_OK) {
+            return;
+        }
 
-    /*
-     * NGX_HTTP_UPSTREAM_FT_BUSY_LOCK and NGX_HTTP_UPSTREAM_FT_MAX_WAITING
-     * never reach here
-     */
+        rc = ngx_http_send_header(r);
 
-    default:
-        status = NGX_HTTP_BAD_GATEWAY;
-    }
+        if (rc == NGX_ERROR || rc > NGX_OK || r->post_action) {
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return;
+        }
 
-    if (r->connection->error) {
-        ngx_http_upstream_finalize_request(r, u,
-                                           NGX_HTTP_CLIENT_CLOSED_REQUEST);
-        return;
+        u->header_sent = 1;
+
+        if (r->header_only) {
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return;
+        }
+
+        r->write_event_handler = ngx_http_upstream_coalesce_downstream;
     }
 
-    u->state->status = status;
+    /* the data available are sent once the previous part is gone */
 
-    timeout = u->conf->next_upstream_timeout;
+    if (cf->sent < cf->available && (cf->busy == NULL || cf->done)) {
 
-    if (u->request_sent
-        && (r->method & (NGX_HTTP_POST|NGX_HTTP_LOCK|NGX_HTTP_PATCH)))
-    {
-        ft_type |= NGX_HTTP_UPSTREAM_FT_NON_IDEMPOTENT;
-    }
+        cl = ngx_chain_get_free_buf(r->pool, &cf->free);
+        if (cl == NULL) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
 
-    if (u->peer.tries == 0
-        || ((u->conf->next_upstream & ft_type) != ft_type)
-        || (u->request_sent && r->request_body_no_buffering)
-        || (timeout && ngx_current_msec - u->peer.start_time >= timeout))
-    {
-#if (NGX_HTTP_CACHE)
+        b = cl->buf;
 
-        if (u->cache_status == NGX_HTTP_CACHE_EXPIRED
-            && ((u->conf->cache_use_stale & ft_type) || r->cache->stale_error))
-        {
-            ngx_int_t  rc;
+        ngx_memzero(b, sizeof(ngx_buf_t));
 
-            rc = u->reinit_request(r);
+        b->in_file = 1;
+        b->file = &cf->file;
+        b->file_pos = cf->sent;
+        b->file_last = cf->available;
+        b->flush = 1;
+        b->tag = (ngx_buf_tag_t) &ngx_http_upstream_module;
 
-            if (rc == NGX_OK) {
-                u->cache_status = NGX_HTTP_CACHE_STALE;
-                rc = ngx_http_upstream_cache_send(r, u);
-            }
+        cf->sent = cf->available;
+        cf->out = cl;
+    }
 
-            ngx_http_upstream_finalize_request(r, u, rc);
+    if (cf->out || cf->busy) {
+        rc = ngx_http_output_filter(r, cf->out);
+
+        if (rc == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
             return;
         }
-#endif
 
-        ngx_http_upstream_finalize_request(r, u, status);
+        ngx_chain_update_chains(r->pool, &cf->free, &cf->busy, &cf->out,
+                                (ngx_buf_tag_t) &ngx_http_upstream_module);
+    }
+
+    if (cf->done) {
+        ngx_http_upstream_finalize_request(r, u, cf->rc);
         return;
     }
 
-    if (u->peer.connection) {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "close http upstream connection: %d",
-                       u->peer.connection->fd);
-#if (NGX_HTTP_SSL)
+    wev = r->connection->write;
 
-        if (u->peer.connection->ssl) {
-            u->peer.connection->ssl->no_wait_shutdown = 1;
-            u->peer.connection->ssl->no_send_shutdown = 1;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-            (void) ngx_ssl_shutdown(u->peer.connection);
-        }
-#endif
+    if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
 
-        if (u->peer.connection->pool) {
-            ngx_destroy_pool(u->peer.connection->pool);
-        }
+    if (wev->active && !wev->ready) {
+        ngx_add_timer(wev, clcf->send_timeout);
 
-        ngx_close_connection(u->peer.connection);
-        u->peer.connection = NULL;
+    } else if (wev->timer_set) {
+        ngx_del_timer(wev);
     }
-
-    ngx_http_upstream_connect(r, u);
 }
 
 
@@ -4240,6 +6163,14 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     *u->cleanup = NULL;
     u->cleanup = NULL;
 
+    if (u->hedge) {
+        ngx_http_upstream_hedge_stop(r, u);
+    }
+
+    if (u->coalesce) {
+        ngx_http_upstream_coalesce_finalize(r, u, rc);
+    }
+
     if (u->resolved && u->resolved->ctx) {
         ngx_resolve_name_done(u->resolved->ctx);
         u->resolved->ctx = NULL;
@@ -4295,6 +6226,10 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
 
     u->peer.connection = NULL;
 
+    if (u->pipe && u->pipe->pool) {
+        ngx_http_upstream_buffers_account(r, u);
+    }
+
     if (u->pipe && u->pipe->temp_file) {
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "http upstream temp fd: %d",
@@ -4329,6 +6264,10 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
                     r->cache->error = rc;
                 }
             }
+
+            if (r->cache->slice && u->header_sent && u->pipe->temp_file) {
+                ngx_http_file_cache_update(r, u->pipe->temp_file);
+            }
         }
 
         ngx_http_file_cache_free(r->cache, u->pipe->temp_file);
@@ -4372,6 +6311,24 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     }
 
     if (rc == 0) {
+
+#if (NGX_HTTP_CACHE)
+
+        /* cached slices following the ones received */
+
+        if (r->cache && r->cache->slice && r->cache->slice->in_place) {
+            rc = ngx_http_upstream_cache_slice_output(r,
+                                                   r->cache->slice->fetch_end,
+                                                   r->cache->slice->send_end);
+
+            if (rc == NGX_ERROR) {
+                ngx_http_finalize_request(r, rc);
+                return;
+            }
+        }
+
+#endif
+
         rc = ngx_http_send_special(r, NGX_HTTP_LAST);
 
     } else if (flush) {
@@ -5479,6 +7436,37 @@ ngx_http_upstream_response_length_variable(ngx_http_request_t *r,
 }
 
 
+static ngx_int_t
+ngx_http_upstream_buffers_stats_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                         *p;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    p = ngx_pnalloc(r->pool, sizeof("responses= spilled= spilled_bytes= "
+                                    "grown= memory=") - 1
+                             + 3 * NGX_INT_T_LEN + NGX_OFF_T_LEN
+                             + NGX_SIZE_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "responses=%ui spilled=%ui spilled_bytes=%O "
+                         "grown=%ui memory=%uz", umcf->buffered,
+                         umcf->spilled, umcf->spilled_size, umcf->grown,
+                         umcf->buffers_memory)
+             - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_upstream_header_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
@@ -5560,8 +7548,8 @@ ngx_http_upstream_cache_last_modified(ngx_http_request_t *r,
     u_char  *p;
 
     if (r->upstream == NULL
-        || !r->upstream->conf->cache_revalidate
         || r->upstream->cache_status != NGX_HTTP_CACHE_EXPIRED
+        || (!r->upstream->conf->cache_revalidate && !r->cache->refreshing)
         || r->cache->last_modified == -1)
     {
         v->not_found = 1;
@@ -5588,8 +7576,8 @@ ngx_http_upstream_cache_etag(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
 {
     if (r->upstream == NULL
-        || !r->upstream->conf->cache_revalidate
         || r->upstream->cache_status != NGX_HTTP_CACHE_EXPIRED
+        || (!r->upstream->conf->cache_revalidate && !r->cache->refreshing)
         || r->cache->etag.len == 0)
     {
         v->not_found = 1;
@@ -5605,6 +7593,90 @@ ngx_http_upstream_cache_etag(ngx_http_request_t *r,
     return NGX_OK;
 }
 
+
+static ngx_int_t
+ngx_http_upstream_cache_tier(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    if (r->upstream == NULL || r->cache == NULL || !r->cached) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    if (r->cache->ram) {
+        v->len = sizeof("ram") - 1;
+        v->data = (u_char *) "ram";
+
+    } else if (r->cache->slow) {
+        v->len = sizeof("slow") - 1;
+        v->data = (u_char *) "slow";
+
+    } else {
+        v->len = sizeof("disk") - 1;
+        v->data = (u_char *) "disk";
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_tier_stats(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                    *p;
+    ngx_http_file_cache_t     *cache;
+    ngx_http_file_cache_sh_t  *sh;
+
+    if (r->cache == NULL || r->cache->file_cache == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    cache = r->cache->file_cache;
+    sh = cache->sh;
+
+    p = ngx_pnalloc(r->pool, sizeof("lookups= ram_hits= disk_hits= "
+                                    "slow_hits= ram_objects= ram_size= "
+                                    "disk_size= slow_size= promoted= "
+                                    "demoted= rejected= refreshing= "
+                                    "refreshes= delete_backlog= deleted= "
+                                    "delete_time=") - 1
+                             + 10 * NGX_ATOMIC_T_LEN + 2 * NGX_INT_T_LEN
+                             + NGX_SIZE_T_LEN
+                             + NGX_SIZE_T_LEN + 2 * NGX_OFF_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the counters are read without the lock, a slight skew is harmless */
+
+    v->len = ngx_sprintf(p, "lookups=%uA ram_hits=%uA disk_hits=%uA "
+                         "slow_hits=%uA ram_objects=%ui ram_size=%uz "
+                         "disk_size=%O slow_size=%O promoted=%uA "
+                         "demoted=%uA rejected=%uA refreshing=%ui "
+                         "refreshes=%uA delete_backlog=%uA deleted=%uA "
+                         "delete_time=%M",
+                         sh->lookups, sh->ram_hits, sh->disk_hits,
+                         sh->slow_hits, sh->ram_count, sh->ram_size,
+                         sh->size * (off_t) cache->bsize,
+                         sh->slow_size * (off_t) cache->bsize,
+                         sh->promoted, sh->demoted, sh->rejected,
+                         sh->refreshing, sh->refreshes,
+                         sh->delete_backlog, sh->deleted, sh->delete_time)
+             - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
 #endif
 
 
@@ -5881,6 +7953,119 @@ not_supported:
 }
 
 
+static char *
+ngx_http_upstream_hedge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t  *uscf = conf;
+
+    ngx_str_t                       *value, s;
+    ngx_int_t                        n;
+    ngx_uint_t                       i;
+    ngx_http_upstream_hedge_conf_t  *hcf;
+
+    if (uscf->hedge) {
+        return "is duplicate";
+    }
+
+    hcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hedge_conf_t));
+    if (hcf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    hcf->percentile = 95;
+    hcf->min_delay = 10;
+    hcf->max_delay = 1000;
+    hcf->budget = 5;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "percentile=", 11) == 0) {
+
+            n = ngx_atoi(&value[i].data[11], value[i].len - 11);
+
+            if (n == NGX_ERROR || n == 0 || n > 99) {
+                goto invalid;
+            }
+
+            hcf->percentile = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "min_delay=", 10) == 0) {
+
+            s.len = value[i].len - 10;
+            s.data = &value[i].data[10];
+
+            hcf->min_delay = ngx_parse_time(&s, 0);
+
+            if (hcf->min_delay == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_delay=", 10) == 0) {
+
+            s.len = value[i].len - 10;
+            s.data = &value[i].data[10];
+
+            hcf->max_delay = ngx_parse_time(&s, 0);
+
+            if (hcf->max_delay == (ngx_msec_t) NGX_ERROR
+                || hcf->max_delay == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "budget=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = &value[i].data[7];
+
+            if (s.len && s.data[s.len - 1] == '%') {
+                s.len--;
+            }
+
+            n = ngx_atoi(s.data, s.len);
+
+            if (n == NGX_ERROR || n == 0 || n > 100) {
+                goto invalid;
+            }
+
+            hcf->budget = n;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (hcf->min_delay > hcf->max_delay) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"min_delay\" is greater than \"max_delay\"");
+        return NGX_CONF_ERROR;
+    }
+
+    uscf->hedge = hcf;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
 ngx_http_upstream_srv_conf_t *
 ngx_http_upstream_add(ngx_conf_t *cf, ngx_url_t *u, ngx_uint_t flags)
 {
@@ -6323,6 +8508,11 @@ ngx_http_upstream_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    ngx_rbtree_init(&umcf->coalesce, &umcf->coalesce_sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    umcf->buffers_budget = NGX_CONF_UNSET_SIZE;
+
     return umcf;
 }
 
@@ -6340,6 +8530,8 @@ ngx_http_upstream_init_main_conf(ngx_conf_t *cf, void *conf)
     ngx_http_upstream_header_t     *header;
     ngx_http_upstream_srv_conf_t  **uscfp;
 
+    ngx_conf_init_size_value(umcf->buffers_budget, 32 * 1024 * 1024);
+
     uscfp = umcf->upstreams.elts;
 
     for (i = 0; i < umcf->upstreams.nelts; i++) {
@@ -72,6 +72,19 @@ typedef struct {
     ngx_hash_t                       headers_in_hash;
     ngx_array_t                      upstreams;
                                              /* ngx_http_upstream_srv_conf_t */
+
+    ngx_rbtree_t                     coalesce;
+    ngx_rbtree_node_t                coalesce_sentinel;
+
+    size_t                           buffers_budget;
+
+    /* per worker */
+
+    size_t                           buffers_memory;
+    ngx_uint_t                       buffered;
+    ngx_uint_t                       spilled;
+    off_t                            spilled_size;
+    ngx_uint_t                       grown;
 } ngx_http_upstream_main_conf_t;
 
 typedef struct ngx_http_upstream_srv_conf_s  ngx_http_upstream_srv_conf_t;
@@ -116,6 +129,25 @@ typedef struct {
 #define NGX_HTTP_UPSTREAM_MAX_CONNS     0x0100
 
 
+#define NGX_HTTP_UPSTREAM_HEDGE_BUCKETS  64
+
+
+typedef struct {
+    ngx_uint_t                       percentile;
+    ngx_msec_t                       min_delay;
+    ngx_msec_t                       max_delay;
+    ngx_uint_t                       budget;
+
+    /* per worker statistics */
+
+    ngx_uint_t                       samples;
+    ngx_uint_t                       hist[NGX_HTTP_UPSTREAM_HEDGE_BUCKETS];
+
+    ngx_uint_t                       requests;
+    ngx_uint_t                       hedged;
+} ngx_http_upstream_hedge_conf_t;
+
+
 struct ngx_http_upstream_srv_conf_s {
     ngx_http_upstream_peer_t         peer;
     void                           **srv_conf;
@@ -129,6 +161,8 @@ struct ngx_http_upstream_srv_conf_s {
     in_port_t                        port;
     ngx_uint_t                       no_port;  /* unsigned no_port:1 */
 
+    ngx_http_upstream_hedge_conf_t  *hedge;
+
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_shm_zone_t                  *shm_zone;
 #endif
@@ -164,6 +198,8 @@ typedef struct {
     size_t                           max_temp_file_size_conf;
     size_t                           temp_file_write_size_conf;
 
+    size_t                           max_buffers_size;
+
     ngx_bufs_t                       bufs;
 
     ngx_uint_t                       ignore_headers;
@@ -188,6 +224,11 @@ typedef struct {
 
     ngx_http_upstream_local_t       *local;
 
+    ngx_flag_t                       coalesce;
+    ngx_http_complex_value_t        *coalesce_key;
+
+    ngx_flag_t                       splice;
+
 #if (NGX_HTTP_CACHE)
     ngx_shm_zone_t                  *cache_zone;
     ngx_http_complex_value_t        *cache_value;
@@ -197,6 +238,7 @@ typedef struct {
     ngx_uint_t                       cache_methods;
 
     off_t                            cache_max_range_offset;
+    size_t                           cache_slice;
 
     ngx_flag_t                       cache_lock;
     ngx_msec_t                       cache_lock_timeout;
@@ -310,6 +352,52 @@ typedef void (*ngx_http_upstream_handler_pt)(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 
 
+typedef struct {
+    ngx_event_t                      event;
+
+    /* the original attempt, while a hedged one is in progress */
+    ngx_peer_connection_t            peer;
+    ngx_uint_t                       state;
+    ngx_msec_t                       response_time;
+
+    unsigned                         hedged:1;
+} ngx_http_upstream_hedge_t;
+
+
+typedef struct ngx_http_upstream_coalesce_s  ngx_http_upstream_coalesce_t;
+
+struct ngx_http_upstream_coalesce_s {
+    ngx_str_node_t                   node;
+    ngx_http_request_t              *request;
+
+    /* leader */
+    ngx_queue_t                      followers;
+
+    /* follower */
+    ngx_queue_t                      queue;
+    ngx_http_upstream_coalesce_t    *leader;
+    ngx_event_t                      event;
+    ngx_file_t                       file;
+    off_t                            sent;
+    off_t                            available;
+    ngx_chain_t                     *out;
+    ngx_chain_t                     *busy;
+    ngx_chain_t                     *free;
+    ngx_int_t                        rc;
+
+    unsigned                         follower:1;
+    unsigned                         linked:1;
+    unsigned                         shared:1;
+    unsigned                         header:1;
+    unsigned                         release:1;
+    unsigned                         done:1;
+};
+
+
+#define ngx_http_upstream_coalesce_shared(u)                                 \
+    ((u)->coalesce && (u)->coalesce->shared)
+
+
 struct ngx_http_upstream_s {
     ngx_http_upstream_handler_pt     read_event_handler;
     ngx_http_upstream_handler_pt     write_event_handler;
@@ -364,6 +452,13 @@ struct ngx_http_upstream_s {
 
     ngx_http_upstream_state_t       *state;
 
+    ngx_http_upstream_hedge_t       *hedge;
+    ngx_http_upstream_coalesce_t    *coalesce;
+
+#if (NGX_HAVE_SPLICE)
+    ngx_splice_pipe_t               *splice;
+#endif
+
     ngx_str_t                        method;
     ngx_str_t                        schema;
     ngx_str_t                        uri;
@@ -40,6 +40,7 @@
 
 /* settings fields */
 #define NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING    0x1
+#define NGX_HTTP_V2_ENABLE_PUSH_SETTING          0x2
 #define NGX_HTTP_V2_MAX_STREAMS_SETTING          0x3
 #define NGX_HTTP_V2_INIT_WINDOW_SIZE_SETTING     0x4
 #define NGX_HTTP_V2_MAX_FRAME_SIZE_SETTING       0x5
@@ -50,10 +51,32 @@
 
 #define NGX_HTTP_V2_ROOT                         (void *) -1
 
+#define NGX_HTTP_V2_DEFAULT_WEIGHT               16
+
+/* the window grows when a sample reaches 2/3 of the estimate */
+#define NGX_HTTP_V2_BDP_GROWTH(bdp)              ((bdp) * 2 / 3)
+
+/* limits of the per-worker caches of released objects */
+#define NGX_HTTP_V2_CACHED_FRAMES                256
+#define NGX_HTTP_V2_CACHED_NODES                 1024
+
+
+typedef struct {
+    ngx_http_v2_out_frame_t          frame;
+    ngx_chain_t                      chain;
+    ngx_buf_t                        buf;
+    ngx_queue_t                      queue;
+    u_char                           data[NGX_HTTP_V2_FRAME_BUFFER_SIZE];
+} ngx_http_v2_control_frame_t;
+
 
 static void ngx_http_v2_read_handler(ngx_event_t *rev);
 static void ngx_http_v2_write_handler(ngx_event_t *wev);
 static void ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c);
+#if (NGX_HTTP_SSL)
+static ngx_chain_t *ngx_http_v2_send_records(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_out_frame_t *frame, ngx_chain_t *in);
+#endif
 
 static u_char *ngx_http_v2_state_proxy_protocol(ngx_http_v2_connection_t *h2c,
     u_char *pos, u_char *end);
@@ -125,6 +148,8 @@ static ngx_http_v2_node_t *ngx_http_v2_get_node_by_id(
     ngx_http_v2_connection_t *h2c, ngx_uint_t sid, ngx_uint_t alloc);
 static ngx_http_v2_node_t *ngx_http_v2_get_closed_node(
     ngx_http_v2_connection_t *h2c);
+static ngx_http_v2_node_t *ngx_http_v2_alloc_node(ngx_log_t *log);
+static void ngx_http_v2_free_node(ngx_http_v2_node_t *node);
 #define ngx_http_v2_index_size(h2scf)  (h2scf->streams_index_mask + 1)
 #define ngx_http_v2_index(h2scf, sid)  ((sid >> 1) & h2scf->streams_index_mask)
 
@@ -132,6 +157,9 @@ static ngx_int_t ngx_http_v2_send_settings(ngx_http_v2_connection_t *h2c,
     ngx_uint_t ack);
 static ngx_int_t ngx_http_v2_settings_frame_handler(
     ngx_http_v2_connection_t *h2c, ngx_http_v2_out_frame_t *frame);
+static ngx_int_t ngx_http_v2_send_bdp_ping(ngx_http_v2_connection_t *h2c);
+static void ngx_http_v2_update_bdp(ngx_http_v2_connection_t *h2c);
+static size_t ngx_http_v2_adaptive_window(ngx_http_request_t *r, size_t size);
 static ngx_int_t ngx_http_v2_send_window_update(ngx_http_v2_connection_t *h2c,
     ngx_uint_t sid, size_t window);
 static ngx_int_t ngx_http_v2_send_rst_stream(ngx_http_v2_connection_t *h2c,
@@ -144,6 +172,8 @@ static ngx_http_v2_out_frame_t *ngx_http_v2_get_frame(
     u_char flags, ngx_uint_t sid);
 static ngx_int_t ngx_http_v2_frame_handler(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame);
+static void ngx_http_v2_free_frames(ngx_http_v2_connection_t *h2c);
+static void ngx_http_v2_release_memory(ngx_http_v2_connection_t *h2c);
 
 static ngx_int_t ngx_http_v2_validate_header(ngx_http_request_t *r,
     ngx_http_v2_header_t *header);
@@ -158,10 +188,15 @@ static ngx_int_t ngx_http_v2_parse_scheme(ngx_http_request_t *r,
 static ngx_int_t ngx_http_v2_parse_authority(ngx_http_request_t *r,
     ngx_http_v2_header_t *header);
 static ngx_int_t ngx_http_v2_construct_request_line(ngx_http_request_t *r);
+static void ngx_http_v2_priority(ngx_http_v2_stream_t *stream,
+    ngx_str_t *value);
 static ngx_int_t ngx_http_v2_cookie(ngx_http_request_t *r,
     ngx_http_v2_header_t *header);
 static ngx_int_t ngx_http_v2_construct_cookie_header(ngx_http_request_t *r);
+static ngx_int_t ngx_http_v2_set_request_header(ngx_http_request_t *r,
+    ngx_str_t *name, ngx_str_t *value);
 static void ngx_http_v2_run_request(ngx_http_request_t *r);
+static void ngx_http_v2_run_request_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_v2_process_request_body(ngx_http_request_t *r,
     u_char *pos, size_t size, ngx_uint_t last);
 static ngx_int_t ngx_http_v2_filter_request_body(ngx_http_request_t *r);
@@ -201,6 +236,18 @@ static ngx_http_v2_handler_pt ngx_http_v2_frame_states[] = {
     (sizeof(ngx_http_v2_frame_states) / sizeof(ngx_http_v2_handler_pt))
 
 
+static u_char  ngx_http_v2_bdp_ping[NGX_HTTP_V2_PING_SIZE] = "nginxbdp";
+
+/* memory of the grown windows in this worker */
+static size_t  ngx_http_v2_window_memory;
+
+/* control frames and tree nodes released by connections of this worker */
+static ngx_http_v2_control_frame_t  *ngx_http_v2_cached_frames;
+static ngx_uint_t                    ngx_http_v2_ncached_frames;
+static ngx_http_v2_node_t           *ngx_http_v2_cached_nodes;
+static ngx_uint_t                    ngx_http_v2_ncached_nodes;
+
+
 void
 ngx_http_v2_init(ngx_event_t *rev)
 {
@@ -238,6 +285,8 @@ ngx_http_v2_init(ngx_event_t *rev)
     h2c->connection = c;
     h2c->http_connection = hc;
 
+    ngx_queue_init(&h2c->frames);
+
     h2c->send_window = NGX_HTTP_V2_DEFAULT_WINDOW;
     h2c->recv_window = NGX_HTTP_V2_MAX_WINDOW;
 
@@ -247,6 +296,16 @@ ngx_http_v2_init(ngx_event_t *rev)
 
     h2scf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_v2_module);
 
+    h2c->concurrent_pushes = h2scf->concurrent_pushes;
+
+    if (h2scf->hpack_table_size) {
+        h2c->hpack_enc.limit = h2scf->hpack_table_size;
+        h2c->hpack_enc.size = NGX_HTTP_V2_TABLE_SIZE;
+        h2c->hpack_enc.free = NGX_HTTP_V2_TABLE_SIZE;
+
+        ngx_http_v2_table_encoder_size(h2c, NGX_HTTP_V2_TABLE_SIZE);
+    }
+
     h2c->pool = ngx_create_pool(h2scf->pool_size, h2c->connection->log);
     if (h2c->pool == NULL) {
         ngx_http_close_connection(c);
@@ -262,8 +321,8 @@ ngx_http_v2_init(ngx_event_t *rev)
     cln->handler = ngx_http_v2_pool_cleanup;
     cln->data = h2c;
 
-    h2c->streams_index = ngx_pcalloc(c->pool, ngx_http_v2_index_size(h2scf)
-                                              * sizeof(ngx_http_v2_node_t *));
+    h2c->streams_index = ngx_calloc(ngx_http_v2_index_size(h2scf)
+                                    * sizeof(ngx_http_v2_node_t *), c->log);
     if (h2c->streams_index == NULL) {
         ngx_http_close_connection(c);
         return;
@@ -503,7 +562,15 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
                        out->blocked, out->length);
     }
 
-    cl = c->send_chain(c, cl, 0);
+#if (NGX_HTTP_SSL)
+    if (c->ssl && c->ssl->buffer) {
+        cl = ngx_http_v2_send_records(h2c, out, cl);
+
+    } else
+#endif
+    {
+        cl = c->send_chain(c, cl, 0);
+    }
 
     if (cl == NGX_CHAIN_ERROR) {
         goto error;
@@ -601,6 +668,69 @@ error:
 }
 
 
+#if (NGX_HTTP_SSL)
+
+/*
+ * Frames are written to TLS records of up to ssl_buffer_size bytes
+ * which end on frame boundaries, so that a peer is able to process
+ * the frames of a record as soon as it is decrypted.  Only a frame
+ * larger than a record, or appended to data left after a blocked
+ * write, spans several records.
+ */
+
+static ngx_chain_t *
+ngx_http_v2_send_records(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_out_frame_t *frame, ngx_chain_t *in)
+{
+    off_t              limit, buffered, size;
+    ngx_buf_t         *b;
+    ngx_chain_t       *cl;
+    ngx_connection_t  *c;
+
+    c = h2c->connection;
+
+    for ( ;; ) {
+        b = c->ssl->buf;
+        buffered = (b && b->start) ? b->last - b->pos : 0;
+
+        limit = buffered;
+
+        for ( /* void */ ; frame; frame = frame->next) {
+
+            size = 0;
+
+            for (cl = frame->first; /* void */ ; cl = cl->next) {
+                size += ngx_buf_size(cl->buf);
+
+                if (cl == frame->last) {
+                    break;
+                }
+            }
+
+            if (limit > buffered
+                && limit + size > (off_t) c->ssl->buffer_size)
+            {
+                break;
+            }
+
+            limit += size;
+        }
+
+        in = c->send_chain(c, in, limit);
+
+        if (in == NULL || in == NGX_CHAIN_ERROR || !c->write->ready
+            || (c->buffered & NGX_SSL_BUFFERED))
+        {
+            break;
+        }
+    }
+
+    return in;
+}
+
+#endif
+
+
 static void
 ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
 {
@@ -653,9 +783,10 @@ ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
     ngx_destroy_pool(h2c->pool);
 
     h2c->pool = NULL;
-    h2c->free_frames = NULL;
     h2c->free_fake_connections = NULL;
 
+    ngx_http_v2_release_memory(h2c);
+
 #if (NGX_HTTP_SSL)
     if (c->ssl) {
         ngx_ssl_free_buffer(c);
@@ -783,9 +914,10 @@ ngx_http_v2_state_head(ngx_http_v2_connection_t *h2c, u_char *pos, u_char *end)
 static u_char *
 ngx_http_v2_state_data(ngx_http_v2_connection_t *h2c, u_char *pos, u_char *end)
 {
-    size_t                 size;
-    ngx_http_v2_node_t    *node;
-    ngx_http_v2_stream_t  *stream;
+    size_t                   size;
+    ngx_http_v2_node_t      *node;
+    ngx_http_v2_stream_t    *stream;
+    ngx_http_v2_srv_conf_t  *h2scf;
 
     size = h2c->state.length;
 
@@ -846,6 +978,20 @@ ngx_http_v2_state_data(ngx_http_v2_connection_t *h2c, u_char *pos, u_char *end)
         h2c->recv_window = NGX_HTTP_V2_MAX_WINDOW;
     }
 
+    h2scf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
+                                         ngx_http_v2_module);
+
+    if (h2scf->adaptive_window) {
+
+        if (h2c->bdp_ping) {
+            h2c->bdp_received += size;
+
+        } else if (ngx_http_v2_send_bdp_ping(h2c) != NGX_OK) {
+            return ngx_http_v2_connection_error(h2c,
+                                                NGX_HTTP_V2_INTERNAL_ERROR);
+        }
+    }
+
     node = ngx_http_v2_get_node_by_id(h2c, h2c->state.sid, 0);
 
     if (node == NULL || node->stream == NULL) {
@@ -1110,9 +1256,10 @@ ngx_http_v2_state_headers(ngx_http_v2_connection_t *h2c, u_char *pos,
 
     h2c->state.header_limit = h2scf->max_header_size;
 
-    if (h2c->processing >= h2scf->concurrent_streams) {
+    if (h2c->processing - h2c->pushing >= h2scf->concurrent_streams) {
         ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
-                      "concurrent streams exceeded %ui", h2c->processing);
+                      "concurrent streams exceeded %ui",
+                      h2c->processing - h2c->pushing);
 
         status = NGX_HTTP_V2_REFUSED_STREAM;
         goto rst_stream;
@@ -1527,6 +1674,7 @@ ngx_http_v2_state_process_header(ngx_http_v2_connection_t *h2c, u_char *pos,
     ngx_http_core_main_conf_t  *cmcf;
 
     static ngx_str_t cookie = ngx_string("cookie");
+    static ngx_str_t priority = ngx_string("priority");
 
     header = &h2c->state.header;
 
@@ -1633,6 +1781,12 @@ ngx_http_v2_state_process_header(ngx_http_v2_connection_t *h2c, u_char *pos,
         return ngx_http_v2_state_header_complete(h2c, pos, end);
     }
 
+    if (header->name.len == priority.len
+        && ngx_memcmp(header->name.data, priority.data, priority.len) == 0)
+    {
+        ngx_http_v2_priority(r->stream, &header->value);
+    }
+
     h = ngx_list_push(&r->headers_in.headers);
     if (h == NULL) {
         return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_INTERNAL_ERROR);
@@ -1982,7 +2136,8 @@ static u_char *
 ngx_http_v2_state_settings_params(ngx_http_v2_connection_t *h2c, u_char *pos,
     u_char *end)
 {
-    ngx_uint_t  id, value;
+    ngx_uint_t               id, value;
+    ngx_http_v2_srv_conf_t  *h2scf;
 
     while (h2c->state.length) {
         if (end - pos < NGX_HTTP_V2_SETTINGS_PARAM_SIZE) {
@@ -2034,6 +2189,36 @@ ngx_http_v2_state_settings_params(ngx_http_v2_connection_t *h2c, u_char *pos,
             h2c->frame_size = value;
             break;
 
+        case NGX_HTTP_V2_ENABLE_PUSH_SETTING:
+
+            if (value > 1) {
+                ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                              "client sent SETTINGS frame with incorrect "
+                              "ENABLE_PUSH value %ui", value);
+
+                return ngx_http_v2_connection_error(h2c,
+                                                    NGX_HTTP_V2_PROTOCOL_ERROR);
+            }
+
+            h2c->push_disabled = !value;
+            break;
+
+        case NGX_HTTP_V2_MAX_STREAMS_SETTING:
+
+            h2scf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
+                                                 ngx_http_v2_module);
+
+            h2c->concurrent_pushes = ngx_min(value, h2scf->concurrent_pushes);
+            break;
+
+        case NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING:
+
+            if (h2c->hpack_enc.limit) {
+                ngx_http_v2_table_encoder_size(h2c, value);
+            }
+
+            break;
+
         default:
             break;
         }
@@ -2078,6 +2263,14 @@ ngx_http_v2_state_ping(ngx_http_v2_connection_t *h2c, u_char *pos, u_char *end)
                    "http2 PING frame, flags: %ud", h2c->state.flags);
 
     if (h2c->state.flags & NGX_HTTP_V2_ACK_FLAG) {
+
+        if (h2c->bdp_ping
+            && ngx_memcmp(pos, ngx_http_v2_bdp_ping, NGX_HTTP_V2_PING_SIZE)
+               == 0)
+        {
+            ngx_http_v2_update_bdp(h2c);
+        }
+
         return ngx_http_v2_state_skip(h2c, pos, end);
     }
 
@@ -2538,6 +2731,120 @@ ngx_http_v2_settings_frame_handler(ngx_http_v2_connection_t *h2c,
 }
 
 
+/*
+ * One PING is kept in flight while the client sends DATA frames: the data
+ * received until the PING is acknowledged is a sample of the connection's
+ * bandwidth-delay product.
+ */
+
+static ngx_int_t
+ngx_http_v2_send_bdp_ping(ngx_http_v2_connection_t *h2c)
+{
+    ngx_buf_t                *buf;
+    ngx_http_v2_out_frame_t  *frame;
+
+    frame = ngx_http_v2_get_frame(h2c, NGX_HTTP_V2_PING_SIZE,
+                                  NGX_HTTP_V2_PING_FRAME,
+                                  NGX_HTTP_V2_NO_FLAG, 0);
+    if (frame == NULL) {
+        return NGX_ERROR;
+    }
+
+    buf = frame->first->buf;
+
+    buf->last = ngx_cpymem(buf->last, ngx_http_v2_bdp_ping,
+                           NGX_HTTP_V2_PING_SIZE);
+
+    ngx_http_v2_queue_blocked_frame(h2c, frame);
+
+    h2c->bdp_ping = 1;
+    h2c->bdp_received = 0;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v2_update_bdp(ngx_http_v2_connection_t *h2c)
+{
+    h2c->bdp_ping = 0;
+
+    if (h2c->bdp_received >= NGX_HTTP_V2_BDP_GROWTH(h2c->bdp)) {
+        h2c->bdp = ngx_min(2 * h2c->bdp_received, NGX_HTTP_V2_MAX_WINDOW);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 bdp sample:%uz bdp:%uz",
+                   h2c->bdp_received, h2c->bdp);
+}
+
+
+/*
+ * Returns the receive window for an unbuffered request body, which is
+ * grown up to the estimated bandwidth-delay product, but not past the rest
+ * of a known body length, as long as the worker stays within
+ * http2_adaptive_window_budget.
+ */
+
+static size_t
+ngx_http_v2_adaptive_window(ngx_http_request_t *r, size_t size)
+{
+    off_t                      rest;
+    size_t                     max, extra;
+    ngx_http_v2_stream_t      *stream;
+    ngx_http_v2_srv_conf_t    *h2scf;
+    ngx_http_v2_main_conf_t   *h2mcf;
+    ngx_http_v2_connection_t  *h2c;
+
+    stream = r->stream;
+    h2c = stream->connection;
+
+    h2scf = ngx_http_get_module_srv_conf(r, ngx_http_v2_module);
+
+    if (!h2scf->adaptive_window) {
+        return size;
+    }
+
+    max = h2c->bdp;
+
+    if (r->headers_in.content_length_n >= 0) {
+        rest = r->headers_in.content_length_n - r->request_body->received + 1;
+
+        if (rest < (off_t) max) {
+            max = (size_t) rest;
+        }
+    }
+
+    if (max <= size) {
+        return size;
+    }
+
+    h2mcf = ngx_http_get_module_main_conf(r, ngx_http_v2_module);
+
+    if (ngx_http_v2_window_memory >= h2mcf->adaptive_window_budget) {
+        return size;
+    }
+
+    extra = ngx_min(max - size,
+                    h2mcf->adaptive_window_budget - ngx_http_v2_window_memory);
+
+    /* do not bother with small increments */
+
+    if (extra < size / 4) {
+        return size;
+    }
+
+    ngx_http_v2_window_memory += extra;
+    stream->window_memory += extra;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http2 adaptive window:%uz bdp:%uz worker:%uz",
+                   size + extra, h2c->bdp, ngx_http_v2_window_memory);
+
+    return size + extra;
+}
+
+
 static ngx_int_t
 ngx_http_v2_send_window_update(ngx_http_v2_connection_t *h2c, ngx_uint_t sid,
     size_t window)
@@ -2626,46 +2933,55 @@ static ngx_http_v2_out_frame_t *
 ngx_http_v2_get_frame(ngx_http_v2_connection_t *h2c, size_t length,
     ngx_uint_t type, u_char flags, ngx_uint_t sid)
 {
-    ngx_buf_t                *buf;
-    ngx_pool_t               *pool;
-    ngx_http_v2_out_frame_t  *frame;
+    ngx_buf_t                    *buf;
+    ngx_http_v2_out_frame_t      *frame;
+    ngx_http_v2_control_frame_t  *cf;
 
     frame = h2c->free_frames;
 
     if (frame) {
         h2c->free_frames = frame->next;
 
-        buf = frame->first->buf;
-        buf->pos = buf->start;
+    } else {
+        cf = ngx_http_v2_cached_frames;
 
-        frame->blocked = 0;
+        if (cf) {
+            ngx_http_v2_cached_frames = (ngx_http_v2_control_frame_t *)
+                                        cf->frame.next;
+            ngx_http_v2_ncached_frames--;
 
-    } else {
-        pool = h2c->pool ? h2c->pool : h2c->connection->pool;
+        } else {
+            cf = ngx_alloc(sizeof(ngx_http_v2_control_frame_t),
+                           h2c->connection->log);
+            if (cf == NULL) {
+                return NULL;
+            }
 
-        frame = ngx_pcalloc(pool, sizeof(ngx_http_v2_out_frame_t));
-        if (frame == NULL) {
-            return NULL;
-        }
+            ngx_memzero(cf, sizeof(ngx_http_v2_control_frame_t));
 
-        frame->first = ngx_alloc_chain_link(pool);
-        if (frame->first == NULL) {
-            return NULL;
-        }
+            cf->buf.start = cf->data;
+            cf->buf.end = cf->data + NGX_HTTP_V2_FRAME_BUFFER_SIZE;
+            cf->buf.temporary = 1;
+            cf->buf.last_buf = 1;
 
-        buf = ngx_create_temp_buf(pool, NGX_HTTP_V2_FRAME_BUFFER_SIZE);
-        if (buf == NULL) {
-            return NULL;
-        }
+            cf->chain.buf = &cf->buf;
 
-        buf->last_buf = 1;
+            cf->frame.first = &cf->chain;
+            cf->frame.last = &cf->chain;
+            cf->frame.handler = ngx_http_v2_frame_handler;
+        }
 
-        frame->first->buf = buf;
-        frame->last = frame->first;
+        /* the connection owns the frame until it goes idle or is closed */
+        ngx_queue_insert_tail(&h2c->frames, &cf->queue);
 
-        frame->handler = ngx_http_v2_frame_handler;
+        frame = &cf->frame;
     }
 
+    buf = frame->first->buf;
+    buf->pos = buf->start;
+
+    frame->blocked = 0;
+
 #if (NGX_DEBUG)
     if (length > NGX_HTTP_V2_FRAME_BUFFER_SIZE - NGX_HTTP_V2_FRAME_HEADER_SIZE)
     {
@@ -2706,6 +3022,70 @@ ngx_http_v2_frame_handler(ngx_http_v2_connection_t *h2c,
 }
 
 
+static void
+ngx_http_v2_free_frames(ngx_http_v2_connection_t *h2c)
+{
+    ngx_queue_t                  *q;
+    ngx_http_v2_control_frame_t  *cf;
+
+    while (!ngx_queue_empty(&h2c->frames)) {
+        q = ngx_queue_head(&h2c->frames);
+        ngx_queue_remove(q);
+
+        cf = ngx_queue_data(q, ngx_http_v2_control_frame_t, queue);
+
+        if (ngx_http_v2_ncached_frames == NGX_HTTP_V2_CACHED_FRAMES) {
+            ngx_free(cf);
+            continue;
+        }
+
+        cf->frame.next = (ngx_http_v2_out_frame_t *) ngx_http_v2_cached_frames;
+        ngx_http_v2_cached_frames = cf;
+        ngx_http_v2_ncached_frames++;
+    }
+
+    h2c->free_frames = NULL;
+}
+
+
+/*
+ * An idle connection keeps only its HPACK state: control frames and
+ * the nodes of closed streams are returned to the worker caches, and
+ * the streams index is allocated again on the next request.  Losing
+ * the priority information of closed streams is permitted by RFC 7540,
+ * section 5.3.4.
+ */
+
+static void
+ngx_http_v2_release_memory(ngx_http_v2_connection_t *h2c)
+{
+    ngx_uint_t               i, size;
+    ngx_http_v2_srv_conf_t  *h2scf;
+
+    ngx_http_v2_free_frames(h2c);
+
+    while (!ngx_queue_empty(&h2c->closed)) {
+        ngx_http_v2_free_node(ngx_http_v2_get_closed_node(h2c));
+    }
+
+    h2c->closed_nodes = 0;
+
+    h2scf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
+                                         ngx_http_v2_module);
+
+    size = ngx_http_v2_index_size(h2scf);
+
+    for (i = 0; i < size; i++) {
+        if (h2c->streams_index[i]) {
+            return;
+        }
+    }
+
+    ngx_free(h2c->streams_index);
+    h2c->streams_index = NULL;
+}
+
+
 static ngx_http_v2_stream_t *
 ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c)
 {
@@ -2834,6 +3214,8 @@ ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c)
     stream->send_window = h2c->init_window;
     stream->recv_window = h2scf->preread_size;
 
+    stream->urgency = NGX_HTTP_V2_DEFAULT_URGENCY;
+
     h2c->processing++;
 
     return stream;
@@ -2865,7 +3247,7 @@ ngx_http_v2_get_node_by_id(ngx_http_v2_connection_t *h2c, ngx_uint_t sid,
     }
 
     if (h2c->closed_nodes < 32) {
-        node = ngx_pcalloc(h2c->connection->pool, sizeof(ngx_http_v2_node_t));
+        node = ngx_http_v2_alloc_node(h2c->connection->log);
         if (node == NULL) {
             return NULL;
         }
@@ -2966,6 +3348,44 @@ ngx_http_v2_get_closed_node(ngx_http_v2_connection_t *h2c)
 }
 
 
+static ngx_http_v2_node_t *
+ngx_http_v2_alloc_node(ngx_log_t *log)
+{
+    ngx_http_v2_node_t  *node;
+
+    node = ngx_http_v2_cached_nodes;
+
+    if (node) {
+        ngx_http_v2_cached_nodes = node->index;
+        ngx_http_v2_ncached_nodes--;
+
+    } else {
+        node = ngx_alloc(sizeof(ngx_http_v2_node_t), log);
+        if (node == NULL) {
+            return NULL;
+        }
+    }
+
+    ngx_memzero(node, sizeof(ngx_http_v2_node_t));
+
+    return node;
+}
+
+
+static void
+ngx_http_v2_free_node(ngx_http_v2_node_t *node)
+{
+    if (ngx_http_v2_ncached_nodes == NGX_HTTP_V2_CACHED_NODES) {
+        ngx_free(node);
+        return;
+    }
+
+    node->index = ngx_http_v2_cached_nodes;
+    ngx_http_v2_cached_nodes = node;
+    ngx_http_v2_ncached_nodes++;
+}
+
+
 static ngx_int_t
 ngx_http_v2_validate_header(ngx_http_request_t *r, ngx_http_v2_header_t *header)
 {
@@ -3288,6 +3708,194 @@ ngx_http_v2_parse_authority(ngx_http_request_t *r, ngx_http_v2_header_t *header)
 }
 
 
+ngx_http_v2_stream_t *
+ngx_http_v2_push_stream(ngx_http_v2_stream_t *parent, ngx_str_t *path,
+    ngx_str_t *authority)
+{
+    ngx_pool_t                *pool;
+    ngx_uint_t                 i;
+    ngx_table_elt_t           *h, **ph;
+    ngx_connection_t          *fc;
+    ngx_http_request_t        *r;
+    ngx_http_v2_node_t        *node;
+    ngx_http_v2_stream_t      *stream;
+    ngx_http_v2_header_t       header;
+    ngx_http_v2_connection_t  *h2c;
+
+    /* request headers the pushed response may depend on */
+
+    static ngx_uint_t  headers[] = {
+#if (NGX_HTTP_GZIP)
+        offsetof(ngx_http_headers_in_t, accept_encoding),
+#endif
+#if (NGX_HTTP_HEADERS)
+        offsetof(ngx_http_headers_in_t, accept_language),
+#endif
+        offsetof(ngx_http_headers_in_t, user_agent)
+    };
+
+    h2c = parent->connection;
+
+    pool = ngx_create_pool(1024, h2c->connection->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    node = ngx_http_v2_get_node_by_id(h2c, h2c->last_push, 1);
+
+    if (node == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    if (node->parent) {
+        ngx_queue_remove(&node->reuse);
+        h2c->closed_nodes--;
+    }
+
+    stream = ngx_http_v2_create_stream(h2c);
+    if (stream == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    h2c->pushing++;
+
+    stream->pool = pool;
+
+    stream->in_closed = 1;
+    stream->node = node;
+
+    node->stream = stream;
+
+    node->weight = NGX_HTTP_V2_DEFAULT_WEIGHT;
+    ngx_http_v2_set_dependency(h2c, node, parent->node->id, 0);
+
+    r = stream->request;
+    fc = r->connection;
+
+    ngx_str_set(&header.value, "GET");
+
+    if (ngx_http_v2_parse_method(r, &header) != NGX_OK) {
+        goto error;
+    }
+
+#if (NGX_HTTP_SSL)
+    if (fc->ssl) {
+        ngx_str_set(&header.value, "https");
+
+    } else
+#endif
+    {
+        ngx_str_set(&header.value, "http");
+    }
+
+    if (ngx_http_v2_parse_scheme(r, &header) != NGX_OK) {
+        goto error;
+    }
+
+    header.value.len = path->len;
+    header.value.data = ngx_pstrdup(pool, path);
+    if (header.value.data == NULL) {
+        goto error;
+    }
+
+    if (ngx_http_v2_parse_path(r, &header) != NGX_OK) {
+        goto error;
+    }
+
+    header.value.len = authority->len;
+    header.value.data = ngx_pstrdup(pool, authority);
+    if (header.value.data == NULL) {
+        goto error;
+    }
+
+    if (ngx_http_v2_parse_authority(r, &header) != NGX_OK) {
+        goto error;
+    }
+
+    for (i = 0; i < sizeof(headers) / sizeof(ngx_uint_t); i++) {
+        ph = (ngx_table_elt_t **) ((char *) &parent->request->headers_in
+                                   + headers[i]);
+        h = *ph;
+
+        if (h == NULL) {
+            continue;
+        }
+
+        if (ngx_http_v2_set_request_header(r, &h->key, &h->value) != NGX_OK) {
+            goto error;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 push stream sid:%ui \"%V\"", node->id, path);
+
+    fc->write->handler = ngx_http_v2_run_request_handler;
+    ngx_post_event(fc->write, &ngx_posted_events);
+
+    return stream;
+
+error:
+
+    /* the stream is not promised yet, it is closed silently */
+
+    stream->out_closed = 1;
+
+    ngx_http_v2_close_stream(stream, NGX_HTTP_INTERNAL_SERVER_ERROR);
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_http_v2_set_request_header(ngx_http_request_t *r, ngx_str_t *name,
+    ngx_str_t *value)
+{
+    ngx_table_elt_t            *h;
+    ngx_http_header_t          *hh;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    h = ngx_list_push(&r->headers_in.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->key.len = name->len;
+    h->key.data = ngx_pstrdup(r->pool, name);
+    if (h->key.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->value.len = value->len;
+    h->value.data = ngx_pnalloc(r->pool, value->len + 1);
+    if (h->value.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(h->value.data, value->data, value->len);
+    h->value.data[value->len] = '\0';
+
+    h->lowcase_key = ngx_pnalloc(r->pool, name->len);
+    if (h->lowcase_key == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = ngx_hash_strlow(h->lowcase_key, name->data, name->len);
+
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
+    hh = ngx_hash_find(&cmcf->headers_in_hash, h->hash,
+                       h->lowcase_key, h->key.len);
+
+    if (hh && hh->handler(r, h, hh->offset) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_v2_construct_request_line(ngx_http_request_t *r)
 {
@@ -3329,6 +3937,64 @@ ngx_http_v2_construct_request_line(ngx_http_request_t *r)
 }
 
 
+static void
+ngx_http_v2_priority(ngx_http_v2_stream_t *stream, ngx_str_t *value)
+{
+    u_char      *p, *end;
+    ngx_uint_t   urgency, incremental;
+
+    /* RFC 9218: a dictionary of "u" (urgency) and "i" (incremental) */
+
+    urgency = NGX_HTTP_V2_DEFAULT_URGENCY;
+    incremental = 0;
+
+    p = value->data;
+    end = p + value->len;
+
+    while (p < end) {
+
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+
+        if (p == end) {
+            break;
+        }
+
+        if (*p == 'u' && end - p >= 3 && p[1] == '='
+            && p[2] >= '0' && p[2] <= '7'
+            && (end - p == 3 || p[3] == ',' || p[3] == ' ' || p[3] == ';'))
+        {
+            urgency = p[2] - '0';
+
+        } else if (*p == 'i'
+                   && (end - p == 1 || p[1] == ',' || p[1] == ' '
+                       || p[1] == ';'))
+        {
+            incremental = 1;
+
+        } else if (*p == 'i' && end - p >= 4 && ngx_strncmp(p, "i=?", 3) == 0
+                   && (p[3] == '0' || p[3] == '1'))
+        {
+            incremental = p[3] - '0';
+        }
+
+        /* unknown members and parameters are ignored */
+
+        while (p < end && *p != ',') {
+            p++;
+        }
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, stream->request->connection->log, 0,
+                   "http2:%ui priority urgency:%ui incremental:%ui",
+                   stream->node->id, urgency, incremental);
+
+    stream->urgency = urgency;
+    stream->sequential = !incremental;
+}
+
+
 static ngx_int_t
 ngx_http_v2_cookie(ngx_http_request_t *r, ngx_http_v2_header_t *header)
 {
@@ -3483,6 +4149,24 @@ ngx_http_v2_run_request(ngx_http_request_t *r)
 }
 
 
+static void
+ngx_http_v2_run_request_handler(ngx_event_t *ev)
+{
+    ngx_connection_t    *fc;
+    ngx_http_request_t  *r;
+
+    fc = ev->data;
+    r = fc->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                   "http2 run request handler");
+
+    ngx_http_v2_run_request(r);
+
+    ngx_http_run_posted_requests(fc);
+}
+
+
 ngx_int_t
 ngx_http_v2_read_request_body(ngx_http_request_t *r,
     ngx_http_client_body_handler_pt post_handler)
@@ -3549,6 +4233,8 @@ ngx_http_v2_read_request_body(ngx_http_request_t *r,
             len = NGX_HTTP_V2_MAX_WINDOW;
         }
 
+        len = ngx_http_v2_adaptive_window(r, (size_t) len);
+
         rb->buf = ngx_create_temp_buf(r->pool, (size_t) len);
 
     } else if (len >= 0 && len <= (off_t) clcf->client_body_buffer_size
@@ -3849,6 +4535,7 @@ ngx_http_v2_read_client_request_body_handler(ngx_http_request_t *r)
 ngx_int_t
 ngx_http_v2_read_unbuffered_request_body(ngx_http_request_t *r)
 {
+    u_char                    *p;
     size_t                     window;
     ngx_buf_t                 *buf;
     ngx_int_t                  rc;
@@ -3893,6 +4580,21 @@ ngx_http_v2_read_unbuffered_request_body(ngx_http_request_t *r)
 
     buf = r->request_body->buf;
 
+    window = ngx_http_v2_adaptive_window(r, buf->end - buf->start);
+
+    if (window > (size_t) (buf->end - buf->start)) {
+        p = ngx_palloc(r->pool, window);
+        if (p == NULL) {
+            stream->skip_data = 1;
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_pfree(r->pool, buf->start);
+
+        buf->start = p;
+        buf->end = p + window;
+    }
+
     buf->pos = buf->start;
     buf->last = buf->start;
 
@@ -4043,6 +4745,8 @@ ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc)
     ngx_queue_insert_tail(&h2c->closed, &node->reuse);
     h2c->closed_nodes++;
 
+    ngx_http_v2_window_memory -= stream->window_memory;
+
     /*
      * This pool keeps decoded request headers which can be used by log phase
      * handlers in ngx_http_free_request().
@@ -4087,6 +4791,10 @@ ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc)
 
     h2c->processing--;
 
+    if (node->id % 2 == 0) {
+        h2c->pushing--;
+    }
+
     if (h2c->processing || h2c->blocked) {
         return;
     }
@@ -4205,6 +4913,16 @@ ngx_http_v2_idle_handler(ngx_event_t *rev)
         return;
     }
 
+    if (h2c->streams_index == NULL) {
+        h2c->streams_index = ngx_calloc(ngx_http_v2_index_size(h2scf)
+                                        * sizeof(ngx_http_v2_node_t *),
+                                        c->log);
+        if (h2c->streams_index == NULL) {
+            ngx_http_v2_finalize_connection(h2c, NGX_HTTP_V2_INTERNAL_ERROR);
+            return;
+        }
+    }
+
     c->write->handler = ngx_http_v2_write_handler;
 
     rev->handler = ngx_http_v2_read_handler;
@@ -4471,6 +5189,10 @@ ngx_http_v2_pool_cleanup(void *data)
 {
     ngx_http_v2_connection_t  *h2c = data;
 
+    ngx_uint_t               i, size;
+    ngx_http_v2_node_t      *node, *next;
+    ngx_http_v2_srv_conf_t  *h2scf;
+
     if (h2c->state.pool) {
         ngx_destroy_pool(h2c->state.pool);
     }
@@ -4478,4 +5200,25 @@ ngx_http_v2_pool_cleanup(void *data)
     if (h2c->pool) {
         ngx_destroy_pool(h2c->pool);
     }
+
+    ngx_http_v2_free_frames(h2c);
+
+    if (h2c->streams_index == NULL) {
+        return;
+    }
+
+    h2scf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
+                                         ngx_http_v2_module);
+
+    size = ngx_http_v2_index_size(h2scf);
+
+    for (i = 0; i < size; i++) {
+
+        for (node = h2c->streams_index[i]; node; node = next) {
+            next = node->index;
+            ngx_http_v2_free_node(node);
+        }
+    }
+
+    ngx_free(h2c->streams_index);
 }
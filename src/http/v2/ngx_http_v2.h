@@ -24,6 +24,12 @@
 #define NGX_HTTP_V2_MAX_FIELD                                                 \
     (127 + (1 << (NGX_HTTP_V2_INT_OCTETS - 1) * 7) - 1)
 
+#define NGX_HTTP_V2_TABLE_SIZE           4096
+
+#define NGX_HTTP_V2_DEFAULT_URGENCY      3
+
+#define NGX_HTTP_V2_MAX_STREAM_ID        0x7fffffff
+
 #define NGX_HTTP_V2_FRAME_HEADER_SIZE    9
 
 /* frame types */
@@ -110,16 +116,48 @@ typedef struct {
 } ngx_http_v2_hpack_t;
 
 
+typedef struct {
+    ngx_uint_t                       hash;
+    ngx_uint_t                       name_hash;
+    ngx_str_t                        name;
+    ngx_str_t                        value;
+} ngx_http_v2_hpack_entry_t;
+
+
+/* mirror of the client's dynamic table for response headers */
+
+typedef struct {
+    ngx_http_v2_hpack_entry_t       *entries;
+
+    ngx_uint_t                       added;
+    ngx_uint_t                       deleted;
+    ngx_uint_t                       allocated;
+
+    size_t                           limit;
+    size_t                           size;
+    size_t                           min_size;
+    size_t                           free;
+
+    unsigned                         size_update:1;
+} ngx_http_v2_hpack_enc_t;
+
+
 struct ngx_http_v2_connection_s {
     ngx_connection_t                *connection;
     ngx_http_connection_t           *http_connection;
 
     ngx_uint_t                       processing;
+    ngx_uint_t                       pushing;
+    ngx_uint_t                       concurrent_pushes;
 
     size_t                           send_window;
     size_t                           recv_window;
     size_t                           init_window;
 
+    /* bandwidth-delay product estimation */
+    size_t                           bdp_received;
+    size_t                           bdp;
+
     size_t                           frame_size;
 
     ngx_queue_t                      waiting;
@@ -127,9 +165,11 @@ struct ngx_http_v2_connection_s {
     ngx_http_v2_state_t              state;
 
     ngx_http_v2_hpack_t              hpack;
+    ngx_http_v2_hpack_enc_t          hpack_enc;
 
     ngx_pool_t                      *pool;
 
+    ngx_queue_t                      frames;
     ngx_http_v2_out_frame_t         *free_frames;
     ngx_connection_t                *free_fake_connections;
 
@@ -141,11 +181,14 @@ struct ngx_http_v2_connection_s {
     ngx_queue_t                      closed;
 
     ngx_uint_t                       last_sid;
+    ngx_uint_t                       last_push;
 
     unsigned                         closed_nodes:8;
     unsigned                         settings_ack:1;
     unsigned                         blocked:1;
     unsigned                         goaway:1;
+    unsigned                         push_disabled:1;
+    unsigned                         bdp_ping:1;
 };
 
 
@@ -169,6 +212,7 @@ struct ngx_http_v2_stream_s {
     ngx_http_v2_node_t              *node;
 
     ngx_uint_t                       queued;
+    size_t                           queued_size;
 
     /*
      * A change to SETTINGS_INITIAL_WINDOW_SIZE could cause the
@@ -177,6 +221,9 @@ struct ngx_http_v2_stream_s {
     ssize_t                          send_window;
     size_t                           recv_window;
 
+    /* window memory taken from the adaptive window budget */
+    size_t                           window_memory;
+
     ngx_buf_t                       *preread;
 
     ngx_http_v2_out_frame_t         *free_frames;
@@ -199,6 +246,10 @@ struct ngx_http_v2_stream_s {
     unsigned                         rst_sent:1;
     unsigned                         no_flow_control:1;
     unsigned                         skip_data:1;
+
+    /* RFC 9218 priority parameters */
+    unsigned                         urgency:3;
+    unsigned                         sequential:1;
 };
 
 
@@ -217,6 +268,21 @@ struct ngx_http_v2_out_frame_s {
 };
 
 
+/* whether the "s" stream is to be served not later than "stream" */
+
+static ngx_inline ngx_uint_t
+ngx_http_v2_stream_ahead(ngx_http_v2_stream_t *s, ngx_http_v2_stream_t *stream)
+{
+    if (s->urgency != stream->urgency) {
+        return s->urgency < stream->urgency;
+    }
+
+    return s->node->rank < stream->node->rank
+           || (s->node->rank == stream->node->rank
+               && s->node->rel_weight >= stream->node->rel_weight);
+}
+
+
 static ngx_inline void
 ngx_http_v2_queue_frame(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame)
@@ -229,11 +295,7 @@ ngx_http_v2_queue_frame(ngx_http_v2_connection_t *h2c,
             break;
         }
 
-        if ((*out)->stream->node->rank < frame->stream->node->rank
-            || ((*out)->stream->node->rank == frame->stream->node->rank
-                && (*out)->stream->node->rel_weight
-                   >= frame->stream->node->rel_weight))
-        {
+        if (ngx_http_v2_stream_ahead((*out)->stream, frame->stream)) {
             break;
         }
     }
@@ -270,6 +332,9 @@ ngx_int_t ngx_http_v2_read_unbuffered_request_body(ngx_http_request_t *r);
 
 void ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc);
 
+ngx_http_v2_stream_t *ngx_http_v2_push_stream(ngx_http_v2_stream_t *parent,
+    ngx_str_t *path, ngx_str_t *authority);
+
 ngx_int_t ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c);
 
 
@@ -279,7 +344,16 @@ ngx_int_t ngx_http_v2_add_header(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_header_t *header);
 ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
 
+void ngx_http_v2_table_encoder_size(ngx_http_v2_connection_t *h2c,
+    size_t size);
+ngx_uint_t ngx_http_v2_table_find(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_header_t *header, ngx_uint_t name_hash, ngx_uint_t hash,
+    ngx_uint_t *name_index);
+ngx_int_t ngx_http_v2_table_insert(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_header_t *header, ngx_uint_t name_hash, ngx_uint_t hash);
+
 
+void ngx_http_v2_huff_decode_init(void);
 ngx_int_t ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len,
     u_char **dst, ngx_uint_t last, ngx_log_t *log);
 size_t ngx_http_v2_huff_encode(u_char *src, size_t len, u_char *dst,
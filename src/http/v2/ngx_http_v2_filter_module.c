@@ -50,16 +50,57 @@
 #define NGX_HTTP_V2_SERVER_INDEX          54
 #define NGX_HTTP_V2_VARY_INDEX            59
 
+#define NGX_HTTP_V2_INDEXED               0x80
+#define NGX_HTTP_V2_INC_INDEXED           0x40
+#define NGX_HTTP_V2_SIZE_UPDATE           0x20
+#define NGX_HTTP_V2_NOT_INDEXED           0x00
+
+#define NGX_HTTP_V2_AUTHORITY_INDEX       1
+#define NGX_HTTP_V2_METHOD_GET_INDEX      2
+#define NGX_HTTP_V2_PATH_INDEX            4
+#define NGX_HTTP_V2_SCHEME_HTTP_INDEX     6
+#define NGX_HTTP_V2_SCHEME_HTTPS_INDEX    7
+#define NGX_HTTP_V2_ACCEPT_ENCODING_INDEX 16
+#define NGX_HTTP_V2_ACCEPT_LANGUAGE_INDEX 17
+#define NGX_HTTP_V2_USER_AGENT_INDEX      58
+
+#define NGX_HTTP_V2_PUSH_DIGEST_SIZE      32
+
 
 static u_char *ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len,
     u_char *tmp, ngx_uint_t lower);
 static u_char *ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix,
     ngx_uint_t value);
+static u_char *ngx_http_v2_write_size_update(ngx_http_v2_connection_t *h2c,
+    u_char *pos);
+static u_char *ngx_http_v2_write_header(ngx_http_v2_connection_t *h2c,
+    u_char *pos, ngx_str_t *name, u_char *value, size_t len,
+    ngx_uint_t indexing, u_char *tmp);
+static ngx_uint_t ngx_http_v2_hpack_indexing(ngx_http_v2_loc_conf_t *h2lcf,
+    ngx_str_t *name);
 static ngx_http_v2_out_frame_t *ngx_http_v2_create_headers_frame(
-    ngx_http_request_t *r, u_char *pos, u_char *end);
+    ngx_http_request_t *r, u_char *pos, u_char *end, ngx_uint_t promised);
+
+static ngx_int_t ngx_http_v2_push_resources(ngx_http_request_t *r);
+static ngx_int_t ngx_http_v2_push_path(ngx_http_request_t *r,
+    ngx_array_t *pushes, ngx_uint_t max, u_char *path, size_t len);
+static void ngx_http_v2_parse_link(ngx_http_request_t *r,
+    ngx_array_t *pushes, ngx_uint_t max, ngx_str_t *value);
+static void ngx_http_v2_push_digest_read(ngx_http_request_t *r,
+    ngx_http_v2_loc_conf_t *h2lcf, u_char *digest);
+static ngx_uint_t ngx_http_v2_push_digest_test(u_char *digest,
+    ngx_str_t *path, ngx_uint_t set);
+static ngx_uint_t ngx_http_v2_push_digest_shared(ngx_http_request_t *r);
+static ngx_int_t ngx_http_v2_push_digest_write(ngx_http_request_t *r,
+    ngx_http_v2_loc_conf_t *h2lcf, u_char *digest);
+static ngx_int_t ngx_http_v2_push_resource(ngx_http_request_t *r,
+    ngx_str_t *path);
 
 static ngx_chain_t *ngx_http_v2_send_chain(ngx_connection_t *fc,
     ngx_chain_t *in, off_t limit);
+#if (NGX_HTTP_SSL)
+static size_t ngx_http_v2_record_frame_size(size_t record, size_t frame_size);
+#endif
 
 static ngx_chain_t *ngx_http_v2_filter_get_shadow(
     ngx_http_v2_stream_t *stream, ngx_buf_t *buf, off_t offset, off_t size);
@@ -123,21 +164,36 @@ ngx_module_t  ngx_http_v2_filter_module = {
 static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 
 
+/* sensitive or per-response headers, never added to the dynamic table */
+
+static ngx_str_t  ngx_http_v2_hpack_no_index[] = {
+    ngx_string("age"),
+    ngx_string("content-range"),
+    ngx_string("etag"),
+    ngx_string("expires"),
+    ngx_string("set-cookie"),
+    ngx_null_string
+};
+
+
 static ngx_int_t
 ngx_http_v2_header_filter(ngx_http_request_t *r)
 {
-    u_char                     status, *pos, *start, *p, *tmp;
+    u_char                     status, *pos, *start, *p, *tmp, *low;
     size_t                     len, tmp_len;
-    ngx_str_t                  host, location;
-    ngx_uint_t                 i, port;
+    ngx_str_t                  host, location, name;
+    ngx_uint_t                 i, port, hpack, indexing;
     ngx_list_part_t           *part;
     ngx_table_elt_t           *header;
     ngx_connection_t          *fc;
     ngx_http_cleanup_t        *cln;
     ngx_http_v2_out_frame_t   *frame;
+    ngx_http_v2_loc_conf_t    *h2lcf;
     ngx_http_core_loc_conf_t  *clcf;
     ngx_http_core_srv_conf_t  *cscf;
+    ngx_http_v2_connection_t  *h2c;
     u_char                     addr[NGX_SOCKADDR_STRLEN];
+    u_char                     buf[sizeof("Wed, 31 Dec 1986 18:00:00 GMT")];
 
     static const u_char nginx[5] = "\x84\xaa\x63\x55\xe7";
 #if (NGX_HTTP_GZIP)
@@ -231,6 +287,15 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
     }
 
+    /*
+     * resources are promised before the response header block is encoded,
+     * so that the digest cookie only records pushes actually made
+     */
+
+    if (ngx_http_v2_push_resources(r) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     len = status ? 1 : 1 + ngx_http_v2_literal_size("418");
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
@@ -410,6 +475,28 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
     }
 
+    h2c = r->stream->connection;
+
+    hpack = (h2c->hpack_enc.limit != 0);
+
+    if (hpack) {
+
+        /*
+         * two table size updates, and name indices of the known headers
+         * that may take two octets in the literal forms
+         */
+
+        len += 2 * (1 + NGX_HTTP_V2_INT_OCTETS) + 8;
+
+        low = ngx_pnalloc(r->pool, tmp_len);
+        if (low == NULL) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        low = NULL;
+    }
+
     tmp = ngx_palloc(r->pool, tmp_len);
     pos = ngx_pnalloc(r->pool, len);
 
@@ -419,6 +506,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
     start = pos;
 
+    pos = ngx_http_v2_write_size_update(h2c, pos);
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                    "http2 output header: \":status: %03ui\"",
                    r->headers_out.status);
@@ -426,6 +515,15 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     if (status) {
         *pos++ = status;
 
+    } else if (hpack) {
+        ngx_str_set(&name, ":status");
+        p = ngx_sprintf(buf, "%03ui", r->headers_out.status);
+
+        pos = ngx_http_v2_write_header(h2c, pos, &name, buf, p - buf, 1, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
+
     } else {
         *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_STATUS_INDEX);
         *pos++ = NGX_HTTP_V2_ENCODE_RAW | 3;
@@ -449,6 +547,30 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                            "http2 output header: \"server: nginx\"");
         }
 
+        if (hpack) {
+            ngx_str_set(&name, "server");
+
+            if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
+                p = (u_char *) NGINX_VER;
+                len = sizeof(NGINX_VER) - 1;
+
+            } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
+                p = (u_char *) NGINX_VER_BUILD;
+                len = sizeof(NGINX_VER_BUILD) - 1;
+
+            } else {
+                p = (u_char *) "nginx";
+                len = sizeof("nginx") - 1;
+            }
+
+            pos = ngx_http_v2_write_header(h2c, pos, &name, p, len, 1, tmp);
+            if (pos == NULL) {
+                goto failed;
+            }
+
+            goto server_done;
+        }
+
         *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
 
         if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
@@ -475,18 +597,35 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
     }
 
+server_done:
+
     if (r->headers_out.date == NULL) {
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                        "http2 output header: \"date: %V\"",
                        &ngx_cached_http_time);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_DATE_INDEX);
-        pos = ngx_http_v2_write_value(pos, ngx_cached_http_time.data,
-                                      ngx_cached_http_time.len, tmp);
+        if (hpack) {
+            ngx_str_set(&name, "date");
+
+            pos = ngx_http_v2_write_header(h2c, pos, &name,
+                                           ngx_cached_http_time.data,
+                                           ngx_cached_http_time.len, 0, tmp);
+            if (pos == NULL) {
+                goto failed;
+            }
+
+        } else {
+            *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_DATE_INDEX);
+            pos = ngx_http_v2_write_value(pos, ngx_cached_http_time.data,
+                                          ngx_cached_http_time.len, tmp);
+        }
     }
 
     if (r->headers_out.content_type.len) {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_TYPE_INDEX);
+
+        if (!hpack) {
+            *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_TYPE_INDEX);
+        }
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
@@ -517,8 +656,23 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-type: %V\"",
                        &r->headers_out.content_type);
 
-        pos = ngx_http_v2_write_value(pos, r->headers_out.content_type.data,
-                                      r->headers_out.content_type.len, tmp);
+        if (hpack) {
+            ngx_str_set(&name, "content-type");
+
+            pos = ngx_http_v2_write_header(h2c, pos, &name,
+                                           r->headers_out.content_type.data,
+                                           r->headers_out.content_type.len,
+                                           1, tmp);
+            if (pos == NULL) {
+                goto failed;
+            }
+
+        } else {
+            pos = ngx_http_v2_write_value(pos,
+                                          r->headers_out.content_type.data,
+                                          r->headers_out.content_type.len,
+                                          tmp);
+        }
     }
 
     if (r->headers_out.content_length == NULL
@@ -528,30 +682,59 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-length: %O\"",
                        r->headers_out.content_length_n);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_LENGTH_INDEX);
+        if (hpack) {
+            ngx_str_set(&name, "content-length");
+            p = ngx_sprintf(buf, "%O", r->headers_out.content_length_n);
 
-        p = pos;
-        pos = ngx_sprintf(pos + 1, "%O", r->headers_out.content_length_n);
-        *p = NGX_HTTP_V2_ENCODE_RAW | (u_char) (pos - p - 1);
+            pos = ngx_http_v2_write_header(h2c, pos, &name, buf, p - buf,
+                                           0, tmp);
+            if (pos == NULL) {
+                goto failed;
+            }
+
+        } else {
+            *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_LENGTH_INDEX);
+
+            p = pos;
+            pos = ngx_sprintf(pos + 1, "%O", r->headers_out.content_length_n);
+            *p = NGX_HTTP_V2_ENCODE_RAW | (u_char) (pos - p - 1);
+        }
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LAST_MODIFIED_INDEX);
+        if (hpack) {
+            ngx_str_set(&name, "last-modified");
+            p = ngx_http_time(buf, r->headers_out.last_modified_time);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                           "http2 output header: \"last-modified: %*s\"",
+                           p - buf, buf);
+
+            pos = ngx_http_v2_write_header(h2c, pos, &name, buf, p - buf,
+                                           0, tmp);
+            if (pos == NULL) {
+                goto failed;
+            }
 
-        ngx_http_time(pos, r->headers_out.last_modified_time);
-        len = sizeof("Wed, 31 Dec 1986 18:00:00 GMT") - 1;
+        } else {
+            *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LAST_MODIFIED_INDEX);
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 output header: \"last-modified: %*s\"",
-                       len, pos);
+            ngx_http_time(pos, r->headers_out.last_modified_time);
+            len = sizeof("Wed, 31 Dec 1986 18:00:00 GMT") - 1;
 
-        /*
-         * Date will always be encoded using huffman in the temporary buffer,
-         * so it's safe here to use src and dst pointing to the same address.
-         */
-        pos = ngx_http_v2_write_value(pos, pos, len, tmp);
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                           "http2 output header: \"last-modified: %*s\"",
+                           len, pos);
+
+            /*
+             * Date will always be encoded using huffman in the temporary
+             * buffer, so it's safe here to use src and dst pointing to
+             * the same address.
+             */
+            pos = ngx_http_v2_write_value(pos, pos, len, tmp);
+        }
     }
 
     if (r->headers_out.location && r->headers_out.location->value.len) {
@@ -559,9 +742,24 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"location: %V\"",
                        &r->headers_out.location->value);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LOCATION_INDEX);
-        pos = ngx_http_v2_write_value(pos, r->headers_out.location->value.data,
-                                      r->headers_out.location->value.len, tmp);
+        if (hpack) {
+            ngx_str_set(&name, "location");
+
+            pos = ngx_http_v2_write_header(h2c, pos, &name,
+                                           r->headers_out.location->value.data,
+                                           r->headers_out.location->value.len,
+                                           0, tmp);
+            if (pos == NULL) {
+                goto failed;
+            }
+
+        } else {
+            *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LOCATION_INDEX);
+            pos = ngx_http_v2_write_value(pos,
+                                        r->headers_out.location->value.data,
+                                        r->headers_out.location->value.len,
+                                        tmp);
+        }
     }
 
 #if (NGX_HTTP_GZIP)
@@ -569,11 +767,26 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                        "http2 output header: \"vary: Accept-Encoding\"");
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_VARY_INDEX);
-        pos = ngx_cpymem(pos, accept_encoding, sizeof(accept_encoding));
+        if (hpack) {
+            ngx_str_set(&name, "vary");
+
+            pos = ngx_http_v2_write_header(h2c, pos, &name,
+                                           (u_char *) "Accept-Encoding",
+                                           sizeof("Accept-Encoding") - 1,
+                                           1, tmp);
+            if (pos == NULL) {
+                goto failed;
+            }
+
+        } else {
+            *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_VARY_INDEX);
+            pos = ngx_cpymem(pos, accept_encoding, sizeof(accept_encoding));
+        }
     }
 #endif
 
+    h2lcf = ngx_http_get_module_loc_conf(r, ngx_http_v2_module);
+
     part = &r->headers_out.headers.part;
     header = part->elts;
 
@@ -603,6 +816,24 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
 #endif
 
+        if (hpack) {
+            name.len = header[i].key.len;
+            name.data = low;
+
+            ngx_strlow(low, header[i].key.data, header[i].key.len);
+
+            indexing = ngx_http_v2_hpack_indexing(h2lcf, &name);
+
+            pos = ngx_http_v2_write_header(h2c, pos, &name,
+                                           header[i].value.data,
+                                           header[i].value.len, indexing, tmp);
+            if (pos == NULL) {
+                goto failed;
+            }
+
+            continue;
+        }
+
         *pos++ = 0;
 
         pos = ngx_http_v2_write_name(pos, header[i].key.data,
@@ -612,9 +843,9 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                                       header[i].value.len, tmp);
     }
 
-    frame = ngx_http_v2_create_headers_frame(r, start, pos);
+    frame = ngx_http_v2_create_headers_frame(r, start, pos, 0);
     if (frame == NULL) {
-        return NGX_ERROR;
+        goto failed;
     }
 
     ngx_http_v2_queue_blocked_frame(r->stream->connection, frame);
@@ -627,12 +858,21 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     cln->handler = ngx_http_v2_filter_cleanup;
     cln->data = r->stream;
 
-    r->stream->queued = 1;
+    r->stream->queued++;
 
     fc->send_chain = ngx_http_v2_send_chain;
     fc->need_last_buf = 1;
 
     return ngx_http_v2_filter_send(fc, r->stream);
+
+failed:
+
+    if (hpack) {
+        /* the encoder table may not match the client's one anymore */
+        h2c->connection->error = 1;
+    }
+
+    return NGX_ERROR;
 }
 
 
@@ -684,12 +924,126 @@ ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix, ngx_uint_t value)
 }
 
 
+static u_char *
+ngx_http_v2_write_size_update(ngx_http_v2_connection_t *h2c, u_char *pos)
+{
+    ngx_http_v2_hpack_enc_t  *enc;
+
+    enc = &h2c->hpack_enc;
+
+    if (!enc->size_update) {
+        return pos;
+    }
+
+    enc->size_update = 0;
+
+    if (enc->min_size < enc->size) {
+        *pos = NGX_HTTP_V2_SIZE_UPDATE;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5),
+                                    enc->min_size);
+    }
+
+    *pos = NGX_HTTP_V2_SIZE_UPDATE;
+
+    return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5), enc->size);
+}
+
+
+static u_char *
+ngx_http_v2_write_header(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_str_t *name, u_char *value, size_t len, ngx_uint_t indexing,
+    u_char *tmp)
+{
+    ngx_int_t             rc;
+    ngx_uint_t            i, index, name_index, name_hash, hash, prefix;
+    ngx_http_v2_header_t  header;
+
+    header.name = *name;
+    header.value.len = len;
+    header.value.data = value;
+
+    name_hash = ngx_hash_key(name->data, name->len);
+
+    hash = name_hash;
+
+    for (i = 0; i < len; i++) {
+        hash = ngx_hash(hash, value[i]);
+    }
+
+    index = ngx_http_v2_table_find(h2c, &header, name_hash, hash,
+                                   &name_index);
+
+    if (index) {
+        *pos = NGX_HTTP_V2_INDEXED;
+        return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(7), index);
+    }
+
+    /* the name index refers to the table before the insertion */
+
+    rc = indexing ? ngx_http_v2_table_insert(h2c, &header, name_hash, hash)
+                  : NGX_DECLINED;
+
+    if (rc == NGX_ERROR) {
+        return NULL;
+    }
+
+    if (rc == NGX_OK) {
+        *pos = NGX_HTTP_V2_INC_INDEXED;
+        prefix = ngx_http_v2_prefix(6);
+
+    } else {
+        *pos = NGX_HTTP_V2_NOT_INDEXED;
+        prefix = ngx_http_v2_prefix(4);
+    }
+
+    pos = ngx_http_v2_write_int(pos, prefix, name_index);
+
+    if (name_index == 0) {
+        pos = ngx_http_v2_write_name(pos, name->data, name->len, tmp);
+    }
+
+    return ngx_http_v2_write_value(pos, value, len, tmp);
+}
+
+
+static ngx_uint_t
+ngx_http_v2_hpack_indexing(ngx_http_v2_loc_conf_t *h2lcf, ngx_str_t *name)
+{
+    ngx_str_t   *s;
+    ngx_uint_t   i;
+
+    for (s = ngx_http_v2_hpack_no_index; s->len; s++) {
+        if (s->len == name->len
+            && ngx_strncmp(s->data, name->data, name->len) == 0)
+        {
+            return 0;
+        }
+    }
+
+    if (h2lcf->hpack_no_index == NULL) {
+        return 1;
+    }
+
+    s = h2lcf->hpack_no_index->elts;
+
+    for (i = 0; i < h2lcf->hpack_no_index->nelts; i++) {
+        if (s[i].len == name->len
+            && ngx_strncasecmp(s[i].data, name->data, name->len) == 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
 static ngx_http_v2_out_frame_t *
 ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
-    u_char *end)
+    u_char *end, ngx_uint_t promised)
 {
     u_char                    type, flags;
-    size_t                    rest, frame_size;
+    size_t                    rest, frame_size, size, extra;
     ngx_buf_t                *b;
     ngx_chain_t              *cl, **ll;
     ngx_http_v2_stream_t     *stream;
@@ -707,13 +1061,31 @@ ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
     frame->stream = stream;
     frame->length = rest;
     frame->blocked = 1;
-    frame->fin = r->header_only;
 
     ll = &frame->first;
 
-    type = NGX_HTTP_V2_HEADERS_FRAME;
-    flags = r->header_only ? NGX_HTTP_V2_END_STREAM_FLAG : NGX_HTTP_V2_NO_FLAG;
-    frame_size = stream->connection->frame_size;
+    if (promised) {
+        /* the promised stream id precedes the header block */
+
+        extra = 4;
+
+        frame->length += extra;
+        frame->fin = 0;
+
+        type = NGX_HTTP_V2_PUSH_PROMISE_FRAME;
+        flags = NGX_HTTP_V2_NO_FLAG;
+
+    } else {
+        extra = 0;
+
+        frame->fin = r->header_only;
+
+        type = NGX_HTTP_V2_HEADERS_FRAME;
+        flags = r->header_only ? NGX_HTTP_V2_END_STREAM_FLAG
+                               : NGX_HTTP_V2_NO_FLAG;
+    }
+
+    frame_size = stream->connection->frame_size - extra;
 
     for ( ;; ) {
         if (rest <= frame_size) {
@@ -721,15 +1093,22 @@ ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
             flags |= NGX_HTTP_V2_END_HEADERS_FLAG;
         }
 
-        b = ngx_create_temp_buf(r->pool, NGX_HTTP_V2_FRAME_HEADER_SIZE);
+        b = ngx_create_temp_buf(r->pool,
+                                NGX_HTTP_V2_FRAME_HEADER_SIZE + extra);
         if (b == NULL) {
             return NULL;
         }
 
-        b->last = ngx_http_v2_write_len_and_type(b->last, frame_size, type);
+        size = frame_size + extra;
+
+        b->last = ngx_http_v2_write_len_and_type(b->last, size, type);
         *b->last++ = flags;
         b->last = ngx_http_v2_write_sid(b->last, stream->node->id);
 
+        if (extra) {
+            b->last = ngx_http_v2_write_sid(b->last, promised);
+        }
+
         b->tag = (ngx_buf_tag_t) &ngx_http_v2_module;
 
         cl = ngx_alloc_chain_link(r->pool);
@@ -773,27 +1152,655 @@ ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
 
             type = NGX_HTTP_V2_CONTINUATION_FRAME;
             flags = NGX_HTTP_V2_NO_FLAG;
+            frame_size = stream->connection->frame_size;
+            extra = 0;
             continue;
         }
 
-        b->last_buf = r->header_only;
+        b->last_buf = frame->fin;
         cl->next = NULL;
         frame->last = cl;
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http2:%ui create HEADERS frame %p: len:%uz",
-                       stream->node->id, frame, frame->length);
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http2:%ui create %s frame %p: len:%uz",
+                       stream->node->id,
+                       promised ? "PUSH_PROMISE" : "HEADERS",
+                       frame, frame->length);
 
         return frame;
     }
 }
 
 
+static ngx_int_t
+ngx_http_v2_push_resources(ngx_http_request_t *r)
+{
+    ngx_int_t                  rc;
+    ngx_str_t                  path, *paths;
+    ngx_uint_t                 i, max, changed;
+    ngx_array_t               *pushes;
+    ngx_list_part_t           *part;
+    ngx_table_elt_t           *header;
+    ngx_http_v2_loc_conf_t    *h2lcf;
+    ngx_http_complex_value_t  *pv;
+    ngx_http_v2_connection_t  *h2c;
+    u_char                     digest[NGX_HTTP_V2_PUSH_DIGEST_SIZE];
+
+    h2c = r->stream->connection;
+
+    if (h2c->push_disabled
+        || h2c->goaway
+        || r->stream->node->id % 2 == 0
+        || r->headers_out.status >= NGX_HTTP_SPECIAL_RESPONSE
+        || r->method == NGX_HTTP_HEAD
+        || h2c->pushing >= h2c->concurrent_pushes)
+    {
+        return NGX_OK;
+    }
+
+    h2lcf = ngx_http_get_module_loc_conf(r, ngx_http_v2_module);
+
+    if (!h2lcf->push || (h2lcf->pushes == NULL && !h2lcf->push_preload)) {
+        return NGX_OK;
+    }
+
+    max = ngx_min(h2c->concurrent_pushes - h2c->pushing,
+                  (NGX_HTTP_V2_MAX_STREAM_ID - h2c->last_push) / 2);
+
+    if (max == 0) {
+        return NGX_OK;
+    }
+
+    pushes = ngx_array_create(r->pool, 4, sizeof(ngx_str_t));
+    if (pushes == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (h2lcf->pushes) {
+        pv = h2lcf->pushes->elts;
+
+        for (i = 0; i < h2lcf->pushes->nelts; i++) {
+
+            if (ngx_http_complex_value(r, &pv[i], &path) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            if (ngx_http_v2_push_path(r, pushes, max, path.data, path.len)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    if (h2lcf->push_preload) {
+        part = &r->headers_out.headers.part;
+        header = part->elts;
+
+        for (i = 0; /* void */; i++) {
+
+            if (i >= part->nelts) {
+                if (part->next == NULL) {
+                    break;
+                }
+
+                part = part->next;
+                header = part->elts;
+                i = 0;
+            }
+
+            if (header[i].hash == 0
+                || header[i].key.len != sizeof("Link") - 1
+                || ngx_strncasecmp(header[i].key.data, (u_char *) "Link",
+                                   sizeof("Link") - 1)
+                   != 0)
+            {
+                continue;
+            }
+
+            ngx_http_v2_parse_link(r, pushes, max, &header[i].value);
+        }
+    }
+
+    if (h2lcf->push_digest.len) {
+        ngx_http_v2_push_digest_read(r, h2lcf, digest);
+    }
+
+    paths = pushes->elts;
+    changed = 0;
+
+    for (i = 0; i < pushes->nelts; i++) {
+
+        if (h2lcf->push_digest.len
+            && ngx_http_v2_push_digest_test(digest, &paths[i], 0))
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http2 push \"%V\" is in digest", &paths[i]);
+            continue;
+        }
+
+        rc = ngx_http_v2_push_resource(r, &paths[i]);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_OK && h2lcf->push_digest.len) {
+            (void) ngx_http_v2_push_digest_test(digest, &paths[i], 1);
+            changed = 1;
+        }
+    }
+
+    if (changed && !ngx_http_v2_push_digest_shared(r)) {
+        return ngx_http_v2_push_digest_write(r, h2lcf, digest);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_push_path(ngx_http_request_t *r, ngx_array_t *pushes,
+    ngx_uint_t max, u_char *path, size_t len)
+{
+    ngx_str_t   *p;
+    ngx_uint_t   i;
+
+    if (pushes->nelts >= max) {
+        return NGX_OK;
+    }
+
+    /* only local paths, and nothing that cannot be a request target */
+
+    if (len == 0 || path[0] != '/' || (len > 1 && path[1] == '/')) {
+        goto invalid;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (path[i] <= 0x20 || path[i] == 0x7f) {
+            goto invalid;
+        }
+    }
+
+    p = pushes->elts;
+
+    for (i = 0; i < pushes->nelts; i++) {
+        if (p[i].len == len && ngx_strncmp(p[i].data, path, len) == 0) {
+            return NGX_OK;
+        }
+    }
+
+    p = ngx_array_push(pushes);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    p->len = len;
+    p->data = path;
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "ignoring invalid push path \"%*s\"", len, path);
+
+    return NGX_OK;
+}
+
+
+/*
+ * Link: </style.css>; rel=preload; as=style, </app.js>; rel="preload"
+ *
+ * links with the "nopush" parameter are left to the client
+ */
+
+static void
+ngx_http_v2_parse_link(ngx_http_request_t *r, ngx_array_t *pushes,
+    ngx_uint_t max, ngx_str_t *value)
+{
+    u_char      *p, *end, *start, *last, *path, *param;
+    size_t       len;
+    ngx_uint_t   preload, nopush, quoted;
+
+    p = value->data;
+    end = p + value->len;
+
+    while (p < end) {
+
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+
+        if (p == end || *p != '<') {
+            return;
+        }
+
+        path = ++p;
+
+        p = ngx_strlchr(p, end, '>');
+        if (p == NULL) {
+            return;
+        }
+
+        len = p - path;
+        p++;
+
+        preload = 0;
+        nopush = 0;
+
+        /* parameters up to the next link */
+
+        while (p < end && *p != ',') {
+
+            if (*p != ';') {
+                return;
+            }
+
+            p++;
+
+            while (p < end && (*p == ' ' || *p == '\t')) {
+                p++;
+            }
+
+            param = p;
+            quoted = 0;
+
+            while (p < end) {
+                if (*p == '"') {
+                    quoted = !quoted;
+
+                } else if (!quoted && (*p == ';' || *p == ',')) {
+                    break;
+                }
+
+                p++;
+            }
+
+            last = p;
+
+            while (last > param && (last[-1] == ' ' || last[-1] == '\t')) {
+                last--;
+            }
+
+            if (last - param == sizeof("nopush") - 1
+                && ngx_strncasecmp(param, (u_char *) "nopush",
+                                   sizeof("nopush") - 1)
+                   == 0)
+            {
+                nopush = 1;
+                continue;
+            }
+
+            if (last - param < (ssize_t) sizeof("rel=") - 1
+                || ngx_strncasecmp(param, (u_char *) "rel=",
+                                   sizeof("rel=") - 1)
+                   != 0)
+            {
+                continue;
+            }
+
+            /* rel="preload prefetch" is a space separated list */
+
+            for (start = param + sizeof("rel=") - 1; start < last; start++) {
+
+                if (*start == '"' || *start == ' ') {
+                    continue;
+                }
+
+                param = start;
+
+                while (start < last && *start != '"' && *start != ' ') {
+                    start++;
+                }
+
+                if (start - param == sizeof("preload") - 1
+                    && ngx_strncasecmp(param, (u_char *) "preload",
+                                       sizeof("preload") - 1)
+                       == 0)
+                {
+                    preload = 1;
+                }
+            }
+        }
+
+        if (preload && !nopush) {
+            if (ngx_http_v2_push_path(r, pushes, max, path, len) != NGX_OK) {
+                return;
+            }
+        }
+    }
+}
+
+
+/*
+ * The digest cookie is a 256-bit Bloom filter of the paths already pushed
+ * on previous connections, two bits are set for each path.
+ */
+
+static void
+ngx_http_v2_push_digest_read(ngx_http_request_t *r,
+    ngx_http_v2_loc_conf_t *h2lcf, u_char *digest)
+{
+    ngx_int_t   n;
+    ngx_str_t   value;
+    ngx_uint_t  i;
+
+    ngx_memzero(digest, NGX_HTTP_V2_PUSH_DIGEST_SIZE);
+
+    if (ngx_http_parse_multi_header_lines(&r->headers_in.cookies,
+                                          &h2lcf->push_digest, &value)
+        == NGX_DECLINED
+        || value.len != 2 * NGX_HTTP_V2_PUSH_DIGEST_SIZE)
+    {
+        return;
+    }
+
+    for (i = 0; i < NGX_HTTP_V2_PUSH_DIGEST_SIZE; i++) {
+        n = ngx_hextoi(&value.data[2 * i], 2);
+
+        if (n == NGX_ERROR) {
+            ngx_memzero(digest, NGX_HTTP_V2_PUSH_DIGEST_SIZE);
+            return;
+        }
+
+        digest[i] = (u_char) n;
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_v2_push_digest_test(u_char *digest, ngx_str_t *path, ngx_uint_t set)
+{
+    uint32_t    hash;
+    ngx_uint_t  b1, b2;
+
+    hash = ngx_crc32_short(path->data, path->len);
+
+    b1 = hash & 0xff;
+    b2 = (hash >> 8) & 0xff;
+
+    if ((digest[b1 >> 3] & (1 << (b1 & 7)))
+        && (digest[b2 >> 3] & (1 << (b2 & 7))))
+    {
+        return 1;
+    }
+
+    if (set) {
+        digest[b1 >> 3] |= 1 << (b1 & 7);
+        digest[b2 >> 3] |= 1 << (b2 & 7);
+    }
+
+    return 0;
+}
+
+
+/*
+ * a shared cache would store the cookie with the response and return it
+ * to other clients, so it is not set on responses that may be cached
+ * publicly
+ */
+
+static ngx_uint_t
+ngx_http_v2_push_digest_shared(ngx_http_request_t *r)
+{
+    ngx_str_t          *value;
+    ngx_uint_t          i, shared;
+    ngx_table_elt_t   **cc;
+
+    shared = (r->headers_out.expires != NULL);
+
+    cc = r->headers_out.cache_control.elts;
+
+    for (i = 0; i < r->headers_out.cache_control.nelts; i++) {
+        value = &cc[i]->value;
+
+        if (ngx_strlcasestrn(value->data, value->data + value->len,
+                             (u_char *) "private", 7 - 1)
+            || ngx_strlcasestrn(value->data, value->data + value->len,
+                                (u_char *) "no-store", 8 - 1))
+        {
+            return 0;
+        }
+
+        if (ngx_strlcasestrn(value->data, value->data + value->len,
+                             (u_char *) "public", 6 - 1)
+            || ngx_strlcasestrn(value->data, value->data + value->len,
+                                (u_char *) "max-age", 7 - 1))
+        {
+            shared = 1;
+        }
+    }
+
+    if (shared) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http2 push digest not set on cacheable response");
+    }
+
+    return shared;
+}
+
+
+static ngx_int_t
+ngx_http_v2_push_digest_write(ngx_http_request_t *r,
+    ngx_http_v2_loc_conf_t *h2lcf, u_char *digest)
+{
+    u_char           *p;
+    ngx_table_elt_t  *h;
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->value.len = h2lcf->push_digest.len + 1 + 2 * NGX_HTTP_V2_PUSH_DIGEST_SIZE
+                   + sizeof("; Path=/; Max-Age=") - 1 + NGX_TIME_T_LEN;
+
+    h->value.data = ngx_pnalloc(r->pool, h->value.len);
+    if (h->value.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(h->value.data, h2lcf->push_digest.data,
+                   h2lcf->push_digest.len);
+    *p++ = '=';
+    p = ngx_hex_dump(p, digest, NGX_HTTP_V2_PUSH_DIGEST_SIZE);
+    p = ngx_sprintf(p, "; Path=/; Max-Age=%T", h2lcf->push_digest_max_age);
+
+    h->value.len = p - h->value.data;
+
+    h->hash = 1;
+    ngx_str_set(&h->key, "Set-Cookie");
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path)
+{
+    u_char                    *pos, *start, *tmp;
+    size_t                     len, tmp_len;
+    ngx_str_t                  name, authority;
+    ngx_uint_t                 i, hpack;
+    ngx_table_elt_t           *h;
+    ngx_http_v2_stream_t      *stream;
+    ngx_http_v2_out_frame_t   *frame;
+    ngx_http_core_srv_conf_t  *cscf;
+    ngx_http_v2_connection_t  *h2c;
+
+    static struct {
+        ngx_str_t   name;
+        ngx_uint_t  index;
+        ngx_uint_t  offset;
+    } headers[] = {
+#if (NGX_HTTP_GZIP)
+        { ngx_string("accept-encoding"), NGX_HTTP_V2_ACCEPT_ENCODING_INDEX,
+          offsetof(ngx_http_headers_in_t, accept_encoding) },
+#endif
+#if (NGX_HTTP_HEADERS)
+        { ngx_string("accept-language"), NGX_HTTP_V2_ACCEPT_LANGUAGE_INDEX,
+          offsetof(ngx_http_headers_in_t, accept_language) },
+#endif
+        { ngx_string("user-agent"), NGX_HTTP_V2_USER_AGENT_INDEX,
+          offsetof(ngx_http_headers_in_t, user_agent) }
+    };
+
+    h2c = r->stream->connection;
+
+    if (h2c->goaway) {
+        return NGX_DECLINED;
+    }
+
+    if (r->headers_in.host) {
+        authority = r->headers_in.host->value;
+
+    } else {
+        cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
+        authority = cscf->server_name;
+    }
+
+    hpack = (h2c->hpack_enc.limit != 0);
+
+    /* size updates, :method, :scheme, :authority, :path */
+
+    len = 2 * (1 + NGX_HTTP_V2_INT_OCTETS) + 1 + 1
+          + 2 + NGX_HTTP_V2_INT_OCTETS + authority.len
+          + 2 + NGX_HTTP_V2_INT_OCTETS + path->len;
+
+    tmp_len = ngx_max(authority.len, path->len);
+
+    for (i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+        h = *(ngx_table_elt_t **) ((char *) &r->headers_in
+                                   + headers[i].offset);
+
+        if (h == NULL) {
+            continue;
+        }
+
+        len += 2 + NGX_HTTP_V2_INT_OCTETS + h->value.len;
+
+        if (h->value.len > tmp_len) {
+            tmp_len = h->value.len;
+        }
+    }
+
+    tmp = ngx_palloc(r->pool, tmp_len);
+    pos = ngx_pnalloc(r->pool, len);
+
+    if (pos == NULL || tmp == NULL) {
+        return NGX_ERROR;
+    }
+
+    start = pos;
+
+    pos = ngx_http_v2_write_size_update(h2c, pos);
+
+    *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_METHOD_GET_INDEX);
+
+#if (NGX_HTTP_SSL)
+    if (r->connection->ssl) {
+        *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_SCHEME_HTTPS_INDEX);
+
+    } else
+#endif
+    {
+        *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
+    }
+
+    if (hpack) {
+        ngx_str_set(&name, ":authority");
+
+        pos = ngx_http_v2_write_header(h2c, pos, &name, authority.data,
+                                       authority.len, 1, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
+
+        ngx_str_set(&name, ":path");
+
+        pos = ngx_http_v2_write_header(h2c, pos, &name, path->data,
+                                       path->len, 1, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
+
+    } else {
+        *pos = NGX_HTTP_V2_NOT_INDEXED;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4),
+                                    NGX_HTTP_V2_AUTHORITY_INDEX);
+        pos = ngx_http_v2_write_value(pos, authority.data, authority.len, tmp);
+
+        *pos = NGX_HTTP_V2_NOT_INDEXED;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4),
+                                    NGX_HTTP_V2_PATH_INDEX);
+        pos = ngx_http_v2_write_value(pos, path->data, path->len, tmp);
+    }
+
+    for (i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+        h = *(ngx_table_elt_t **) ((char *) &r->headers_in
+                                   + headers[i].offset);
+
+        if (h == NULL) {
+            continue;
+        }
+
+        if (hpack) {
+            pos = ngx_http_v2_write_header(h2c, pos, &headers[i].name,
+                                           h->value.data, h->value.len, 1,
+                                           tmp);
+            if (pos == NULL) {
+                goto failed;
+            }
+
+            continue;
+        }
+
+        *pos = NGX_HTTP_V2_NOT_INDEXED;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4),
+                                    headers[i].index);
+        pos = ngx_http_v2_write_value(pos, h->value.data, h->value.len, tmp);
+    }
+
+    h2c->last_push += 2;
+
+    frame = ngx_http_v2_create_headers_frame(r, start, pos, h2c->last_push);
+    if (frame == NULL) {
+        goto failed;
+    }
+
+    stream = ngx_http_v2_push_stream(r->stream, path, &authority);
+    if (stream == NULL) {
+        goto failed;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http2 push \"%V\" promised sid:%ui",
+                   path, h2c->last_push);
+
+    ngx_http_v2_queue_blocked_frame(h2c, frame);
+
+    r->stream->queued++;
+
+    return NGX_OK;
+
+failed:
+
+    if (hpack) {
+        /* the encoder table may not match the client's one anymore */
+        h2c->connection->error = 1;
+    }
+
+    return NGX_ERROR;
+}
+
+
 static ngx_chain_t *
 ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
 {
-    off_t                      size, offset;
+    off_t                      size, offset, quantum;
     size_t                     rest, frame_size;
+    ngx_uint_t                 yield;
     ngx_chain_t               *cl, *out, **ln;
     ngx_http_request_t        *r;
     ngx_http_v2_stream_t      *stream;
@@ -872,6 +1879,43 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
     frame_size = (h2lcf->chunk_size < h2c->frame_size)
                  ? h2lcf->chunk_size : h2c->frame_size;
 
+#if (NGX_HTTP_SSL)
+    if (h2c->connection->ssl && h2c->connection->ssl->buffer) {
+        frame_size = ngx_http_v2_record_frame_size(
+                                     h2c->connection->ssl->buffer_size,
+                                     frame_size);
+    }
+#endif
+
+    /*
+     * a stream may only have its quantum of data in the output queue,
+     * scaled by its weight, so that other streams are interleaved
+     */
+
+    yield = 0;
+
+    if (h2lcf->stream_quantum && !stream->sequential) {
+        quantum = (off_t) (h2lcf->stream_quantum * 16
+                           * stream->node->rel_weight);
+
+        if (quantum < (off_t) frame_size) {
+            quantum = frame_size;
+        }
+
+        if ((off_t) stream->queued_size >= quantum) {
+            fc->write->active = 1;
+            fc->write->ready = 0;
+            return in;
+        }
+
+        quantum -= stream->queued_size;
+
+        if (limit > quantum) {
+            limit = quantum;
+            yield = 1;
+        }
+    }
+
 #if (NGX_SUPPRESS_WARN)
     cl = NULL;
 #endif
@@ -945,6 +1989,7 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
 
         stream->send_window -= frame_size;
         stream->queued++;
+        stream->queued_size += frame_size;
 
         if (in == NULL) {
             break;
@@ -974,12 +2019,43 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
     if (in && ngx_http_v2_flow_control(h2c, stream) == NGX_DECLINED) {
         fc->write->active = 1;
         fc->write->ready = 0;
+
+    } else if (in && yield && !stream->queued) {
+
+        /* the queue is flushed, let other streams run first */
+
+        ngx_post_event(fc->write, &ngx_posted_events);
     }
 
     return in;
 }
 
 
+#if (NGX_HTTP_SSL)
+
+/*
+ * DATA frames over TLS are sized so that a whole number of them,
+ * along with their headers, fills a record of ssl_buffer_size bytes
+ */
+
+static size_t
+ngx_http_v2_record_frame_size(size_t record, size_t frame_size)
+{
+    size_t  n;
+
+    n = (record + frame_size + NGX_HTTP_V2_FRAME_HEADER_SIZE - 1)
+        / (frame_size + NGX_HTTP_V2_FRAME_HEADER_SIZE);
+
+    if (record / n <= NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+        return frame_size;
+    }
+
+    return record / n - NGX_HTTP_V2_FRAME_HEADER_SIZE;
+}
+
+#endif
+
+
 static ngx_chain_t *
 ngx_http_v2_filter_get_shadow(ngx_http_v2_stream_t *stream, ngx_buf_t *buf,
     off_t offset, off_t size)
@@ -1155,10 +2231,7 @@ ngx_http_v2_waiting_queue(ngx_http_v2_connection_t *h2c,
     {
         s = ngx_queue_data(q, ngx_http_v2_stream_t, queue);
 
-        if (s->node->rank < stream->node->rank
-            || (s->node->rank == stream->node->rank
-                && s->node->rel_weight >= stream->node->rel_weight))
-        {
+        if (ngx_http_v2_stream_ahead(s, stream)) {
             break;
         }
     }
@@ -1307,6 +2380,8 @@ done:
 
     stream->request->header_size += NGX_HTTP_V2_FRAME_HEADER_SIZE;
 
+    stream->queued_size -= frame->length;
+
     ngx_http_v2_handle_frame(stream, frame);
 
     ngx_http_v2_handle_stream(h2c, stream);
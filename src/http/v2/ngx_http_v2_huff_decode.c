@@ -18,10 +18,26 @@ typedef struct {
 } ngx_http_v2_huff_decode_code_t;
 
 
+/*
+ * a byte at a time decoding table, built from the 4-bit one below:
+ * the next state, up to two symbols emitted, and flags
+ */
+
+#define NGX_HTTP_V2_HUFF_SYM0_SHIFT   8
+#define NGX_HTTP_V2_HUFF_SYM1_SHIFT   16
+#define NGX_HTTP_V2_HUFF_EMIT_SHIFT   24
+#define NGX_HTTP_V2_HUFF_EMIT_MASK    0x03000000
+#define NGX_HTTP_V2_HUFF_ENDING       0x04000000
+#define NGX_HTTP_V2_HUFF_ERROR        0x08000000
+
+
 static ngx_inline ngx_int_t ngx_http_v2_huff_decode_bits(u_char *state,
     u_char *ending, ngx_uint_t bits, u_char **dst);
 
 
+static uint32_t  ngx_http_v2_huff_decode_bytes[256][256];
+
+
 static ngx_http_v2_huff_decode_code_t  ngx_http_v2_huff_decode_codes[256][16] =
 {
     /* 0 */
@@ -2639,43 +2655,96 @@ static ngx_http_v2_huff_decode_code_t  ngx_http_v2_huff_decode_codes[256][16] =
 };
 
 
+void
+ngx_http_v2_huff_decode_init(void)
+{
+    u_char      state, ending, *p, sym[2];
+    uint32_t    code;
+    ngx_uint_t  st, ch;
+
+    for (st = 0; st < 256; st++) {
+        for (ch = 0; ch < 256; ch++) {
+            state = (u_char) st;
+            ending = 0;
+            p = sym;
+
+            if (ngx_http_v2_huff_decode_bits(&state, &ending, ch >> 4, &p)
+                != NGX_OK
+                || ngx_http_v2_huff_decode_bits(&state, &ending, ch & 0xf, &p)
+                   != NGX_OK)
+            {
+                ngx_http_v2_huff_decode_bytes[st][ch] = NGX_HTTP_V2_HUFF_ERROR;
+                continue;
+            }
+
+            code = state
+                   | (uint32_t) (p - sym) << NGX_HTTP_V2_HUFF_EMIT_SHIFT;
+
+            if (p - sym > 0) {
+                code |= (uint32_t) sym[0] << NGX_HTTP_V2_HUFF_SYM0_SHIFT;
+            }
+
+            if (p - sym > 1) {
+                code |= (uint32_t) sym[1] << NGX_HTTP_V2_HUFF_SYM1_SHIFT;
+            }
+
+            if (ending) {
+                code |= NGX_HTTP_V2_HUFF_ENDING;
+            }
+
+            ngx_http_v2_huff_decode_bytes[st][ch] = code;
+        }
+    }
+}
+
+
 ngx_int_t
 ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len, u_char **dst,
     ngx_uint_t last, ngx_log_t *log)
 {
-    u_char  *end, ch, ending;
+    u_char    *end, *p, ch;
+    uint32_t   code;
 
     ch = 0;
-    ending = 1;
+    code = NGX_HTTP_V2_HUFF_ENDING;
 
+    p = *dst;
     end = src + len;
 
     while (src != end) {
         ch = *src++;
 
-        if (ngx_http_v2_huff_decode_bits(state, &ending, ch >> 4, dst)
-            != NGX_OK)
-        {
+        code = ngx_http_v2_huff_decode_bytes[*state][ch];
+
+        if (code & NGX_HTTP_V2_HUFF_ERROR) {
+            *dst = p;
+
             ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
                            "http2 huffman decoding error at state %d: "
-                           "bad code 0x%Xd", *state, ch >> 4);
+                           "bad code 0x%Xd", *state, ch);
 
             return NGX_ERROR;
         }
 
-        if (ngx_http_v2_huff_decode_bits(state, &ending, ch & 0xf, dst)
-            != NGX_OK)
-        {
-            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
-                           "http2 huffman decoding error at state %d: "
-                           "bad code 0x%Xd", *state, ch & 0xf);
+        switch (code & NGX_HTTP_V2_HUFF_EMIT_MASK) {
 
-            return NGX_ERROR;
+        case 2 << NGX_HTTP_V2_HUFF_EMIT_SHIFT:
+            *p++ = (u_char) (code >> NGX_HTTP_V2_HUFF_SYM0_SHIFT);
+            *p++ = (u_char) (code >> NGX_HTTP_V2_HUFF_SYM1_SHIFT);
+            break;
+
+        case 1 << NGX_HTTP_V2_HUFF_EMIT_SHIFT:
+            *p++ = (u_char) (code >> NGX_HTTP_V2_HUFF_SYM0_SHIFT);
+            break;
         }
+
+        *state = (u_char) code;
     }
 
+    *dst = p;
+
     if (last) {
-        if (!ending) {
+        if (!(code & NGX_HTTP_V2_HUFF_ENDING)) {
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
                            "http2 huffman decoding error: "
                            "incomplete code 0x%Xd", ch);
@@ -2690,7 +2759,6 @@ ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len, u_char **dst,
 }
 
 
-
 static ngx_inline ngx_int_t
 ngx_http_v2_huff_decode_bits(u_char *state, u_char *ending, ngx_uint_t bits,
     u_char **dst)
@@ -17,12 +17,14 @@
 typedef struct {
     size_t                          recv_buffer_size;
     u_char                         *recv_buffer;
+    size_t                          adaptive_window_budget;
 } ngx_http_v2_main_conf_t;
 
 
 typedef struct {
     size_t                          pool_size;
     ngx_uint_t                      concurrent_streams;
+    ngx_uint_t                      concurrent_pushes;
     ngx_uint_t                      max_requests;
     size_t                          max_field_size;
     size_t                          max_header_size;
@@ -30,11 +32,23 @@ typedef struct {
     ngx_uint_t                      streams_index_mask;
     ngx_msec_t                      recv_timeout;
     ngx_msec_t                      idle_timeout;
+    size_t                          hpack_table_size;
+    ngx_flag_t                      adaptive_window;
 } ngx_http_v2_srv_conf_t;
 
 
 typedef struct {
     size_t                          chunk_size;
+    size_t                          stream_quantum;
+    ngx_array_t                    *hpack_no_index;
+
+    ngx_flag_t                      push_preload;
+
+    ngx_flag_t                      push;
+    ngx_array_t                    *pushes;
+
+    ngx_str_t                       push_digest;
+    time_t                          push_digest_max_age;
 } ngx_http_v2_loc_conf_t;
 
 
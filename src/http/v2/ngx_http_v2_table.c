@@ -10,11 +10,10 @@
 #include <ngx_http.h>
 
 
-#define NGX_HTTP_V2_TABLE_SIZE  4096
-
-
 static ngx_int_t ngx_http_v2_table_account(ngx_http_v2_connection_t *h2c,
     size_t size);
+static void ngx_http_v2_table_evict(ngx_http_v2_hpack_enc_t *enc);
+static void ngx_http_v2_table_cleanup(void *data);
 
 
 static ngx_http_v2_header_t  ngx_http_v2_static_table[] = {
@@ -347,3 +346,223 @@ ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size)
 
     return NGX_OK;
 }
+
+
+void
+ngx_http_v2_table_encoder_size(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    ngx_http_v2_hpack_enc_t  *enc;
+
+    enc = &h2c->hpack_enc;
+
+    if (size > enc->limit) {
+        size = enc->limit;
+    }
+
+    if (size == enc->size) {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 hpack encoder table size: %uz was:%uz",
+                   size, enc->size);
+
+    while (enc->size - enc->free > size) {
+        ngx_http_v2_table_evict(enc);
+    }
+
+    /*
+     * if the size was changed more than once before the next header block,
+     * the smallest size is signalled first, since entries were evicted
+     */
+
+    if (!enc->size_update || size < enc->min_size) {
+        enc->min_size = size;
+    }
+
+    enc->free = size - (enc->size - enc->free);
+    enc->size = size;
+    enc->size_update = 1;
+}
+
+
+ngx_uint_t
+ngx_http_v2_table_find(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_header_t *header, ngx_uint_t name_hash, ngx_uint_t hash,
+    ngx_uint_t *name_index)
+{
+    ngx_uint_t                  i, n;
+    ngx_http_v2_header_t       *st;
+    ngx_http_v2_hpack_enc_t    *enc;
+    ngx_http_v2_hpack_entry_t  *entry;
+
+    *name_index = 0;
+
+    for (i = 0; i < NGX_HTTP_V2_STATIC_TABLE_ENTRIES; i++) {
+        st = &ngx_http_v2_static_table[i];
+
+        if (st->name.len != header->name.len
+            || ngx_strncmp(st->name.data, header->name.data,
+                           header->name.len) != 0)
+        {
+            continue;
+        }
+
+        if (st->value.len == header->value.len
+            && ngx_strncmp(st->value.data, header->value.data,
+                           header->value.len) == 0)
+        {
+            return i + 1;
+        }
+
+        if (*name_index == 0) {
+            *name_index = i + 1;
+        }
+    }
+
+    enc = &h2c->hpack_enc;
+
+    n = enc->added - enc->deleted;
+
+    for (i = 0; i < n; i++) {
+        entry = &enc->entries[(enc->added - 1 - i) % enc->allocated];
+
+        if (entry->name_hash != name_hash
+            || entry->name.len != header->name.len
+            || ngx_strncmp(entry->name.data, header->name.data,
+                           header->name.len) != 0)
+        {
+            continue;
+        }
+
+        if (entry->hash == hash
+            && entry->value.len == header->value.len
+            && ngx_strncmp(entry->value.data, header->value.data,
+                           header->value.len) == 0)
+        {
+            return NGX_HTTP_V2_STATIC_TABLE_ENTRIES + 1 + i;
+        }
+
+        if (*name_index == 0) {
+            *name_index = NGX_HTTP_V2_STATIC_TABLE_ENTRIES + 1 + i;
+        }
+    }
+
+    return 0;
+}
+
+
+ngx_int_t
+ngx_http_v2_table_insert(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_header_t *header, ngx_uint_t name_hash, ngx_uint_t hash)
+{
+    u_char                     *p;
+    size_t                      size;
+    ngx_uint_t                  i, n, allocated;
+    ngx_pool_cleanup_t         *cln;
+    ngx_http_v2_hpack_enc_t    *enc;
+    ngx_http_v2_hpack_entry_t  *entry, *entries;
+
+    enc = &h2c->hpack_enc;
+
+    size = 32 + header->name.len + header->value.len;
+
+    if (size > enc->size) {
+        return NGX_DECLINED;
+    }
+
+    if (enc->entries == NULL) {
+        cln = ngx_pool_cleanup_add(h2c->connection->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_http_v2_table_cleanup;
+        cln->data = enc;
+    }
+
+    n = enc->added - enc->deleted;
+
+    if (n == enc->allocated) {
+
+        /* most responses fit a few dozen entries, so grow on demand */
+
+        allocated = enc->allocated ? enc->allocated * 2 : 64;
+
+        entries = ngx_alloc(sizeof(ngx_http_v2_hpack_entry_t) * allocated,
+                            h2c->connection->log);
+        if (entries == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (i = 0; i < n; i++) {
+            entries[i] = enc->entries[(enc->deleted + i) % enc->allocated];
+        }
+
+        ngx_free(enc->entries);
+
+        enc->entries = entries;
+        enc->allocated = allocated;
+        enc->deleted = 0;
+        enc->added = n;
+    }
+
+    /* allocate before evicting, the client's table is not changed on error */
+
+    p = ngx_alloc(header->name.len + header->value.len, h2c->connection->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    while (size > enc->free) {
+        ngx_http_v2_table_evict(enc);
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 hpack encoder add: \"%V: %V\" free:%uz",
+                   &header->name, &header->value, enc->free);
+
+    entry = &enc->entries[enc->added++ % enc->allocated];
+
+    entry->hash = hash;
+    entry->name_hash = name_hash;
+
+    entry->name.len = header->name.len;
+    entry->name.data = p;
+    p = ngx_cpymem(p, header->name.data, header->name.len);
+
+    entry->value.len = header->value.len;
+    entry->value.data = p;
+    ngx_memcpy(p, header->value.data, header->value.len);
+
+    enc->free -= size;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v2_table_evict(ngx_http_v2_hpack_enc_t *enc)
+{
+    ngx_http_v2_hpack_entry_t  *entry;
+
+    entry = &enc->entries[enc->deleted++ % enc->allocated];
+
+    enc->free += 32 + entry->name.len + entry->value.len;
+
+    ngx_free(entry->name.data);
+}
+
+
+static void
+ngx_http_v2_table_cleanup(void *data)
+{
+    ngx_http_v2_hpack_enc_t  *enc = data;
+
+    while (enc->deleted != enc->added) {
+        ngx_http_v2_table_evict(enc);
+    }
+
+    ngx_free(enc->entries);
+    enc->entries = NULL;
+}
@@ -0,0 +1,241 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ * pipes are kept per worker after use: creating a pipe and growing it
+ * costs several syscalls, which is noticeable on short transfers
+ */
+
+#define NGX_SPLICE_FREE_PIPES  32
+
+
+static void ngx_linux_splice_cleanup(void *data);
+
+
+static ngx_splice_pipe_t  *ngx_splice_free;
+static ngx_uint_t          ngx_splice_nfree;
+
+
+ngx_splice_pipe_t *
+ngx_linux_splice_pipe(ngx_pool_t *pool, size_t size, ngx_log_t *log)
+{
+    int                  n;
+    ngx_fd_t             fd[2];
+    ngx_pool_cleanup_t  *cln;
+    ngx_splice_pipe_t   *p;
+
+    p = ngx_splice_free;
+
+    if (p) {
+        ngx_splice_free = p->next;
+        ngx_splice_nfree--;
+
+        goto done;
+    }
+
+    if (pipe2(fd, O_NONBLOCK|O_CLOEXEC) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "pipe2() failed");
+        return NULL;
+    }
+
+    p = ngx_alloc(sizeof(ngx_splice_pipe_t), log);
+    if (p == NULL) {
+        (void) close(fd[0]);
+        (void) close(fd[1]);
+        return NULL;
+    }
+
+    p->fd[0] = fd[0];
+    p->fd[1] = fd[1];
+    p->size = 0;
+    p->capacity = 65536;
+
+#if (defined F_SETPIPE_SZ && defined F_GETPIPE_SZ)
+
+    /* the call may fail for unprivileged users over pipe-max-size */
+
+    if (size > p->capacity) {
+        (void) fcntl(fd[1], F_SETPIPE_SZ, (int) size);
+    }
+
+    n = fcntl(fd[1], F_GETPIPE_SZ);
+
+    if (n > 0) {
+        p->capacity = n;
+    }
+
+#else
+    (void) n;
+#endif
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "splice pipe: %d:%d %uz", fd[0], fd[1], p->capacity);
+
+done:
+
+    p->next = NULL;
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        ngx_linux_splice_cleanup(p);
+        return NULL;
+    }
+
+    cln->handler = ngx_linux_splice_cleanup;
+    cln->data = p;
+
+    return p;
+}
+
+
+static void
+ngx_linux_splice_cleanup(void *data)
+{
+    ngx_splice_pipe_t  *p = data;
+
+    /* a pipe with data left in it cannot be reused */
+
+    if (p->size == 0 && ngx_splice_nfree < NGX_SPLICE_FREE_PIPES) {
+        p->next = ngx_splice_free;
+        ngx_splice_free = p;
+        ngx_splice_nfree++;
+        return;
+    }
+
+    if (close(p->fd[0]) == -1 || close(p->fd[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "pipe close() failed");
+    }
+
+    ngx_free(p);
+}
+
+
+ssize_t
+ngx_linux_splice_recv(ngx_connection_t *c, ngx_splice_pipe_t *p, size_t size)
+{
+    ssize_t       n;
+    ngx_err_t     err;
+    ngx_event_t  *rev;
+
+    rev = c->read;
+
+    if (size > p->capacity - p->size) {
+        size = p->capacity - p->size;
+    }
+
+    for ( ;; ) {
+        n = splice(c->fd, NULL, p->fd[1], NULL, size,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "splice recv: fd:%d %z of %uz", c->fd, n, size);
+
+        if (n > 0) {
+            p->size += n;
+            return n;
+        }
+
+        if (n == 0) {
+            rev->ready = 0;
+            rev->eof = 1;
+            return 0;
+        }
+
+        err = ngx_errno;
+
+        if (err == NGX_EINTR) {
+            continue;
+        }
+
+        if (err == NGX_EAGAIN) {
+
+            /*
+             * the pipe may be full before its nominal capacity is reached,
+             * since every socket buffer fragment occupies a pipe slot;
+             * the socket is known to be drained only if the pipe is empty
+             */
+
+            if (p->size == 0) {
+                rev->ready = 0;
+            }
+
+            return NGX_AGAIN;
+        }
+
+        rev->ready = 0;
+        rev->error = 1;
+
+        return ngx_connection_error(c, err, "splice() failed");
+    }
+}
+
+
+ssize_t
+ngx_linux_splice_send(ngx_connection_t *c, ngx_splice_pipe_t *p, size_t limit)
+{
+    size_t        size;
+    ssize_t       n, sent;
+    ngx_err_t     err;
+    ngx_event_t  *wev;
+
+    wev = c->write;
+    sent = 0;
+
+    if (limit == 0) {
+        limit = NGX_MAX_SIZE_T_VALUE;
+    }
+
+    while (p->size && (size_t) sent < limit) {
+        size = ngx_min(p->size, limit - (size_t) sent);
+
+        n = splice(p->fd[0], NULL, c->fd, NULL, size,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "splice send: fd:%d %z of %uz", c->fd, n, size);
+
+        if (n > 0) {
+            p->size -= n;
+            c->sent += n;
+            sent += n;
+            continue;
+        }
+
+        err = (n == 0) ? NGX_EAGAIN : ngx_errno;
+
+        if (err == NGX_EINTR) {
+            continue;
+        }
+
+        if (err == NGX_EAGAIN) {
+            wev->ready = 0;
+            break;
+        }
+
+        wev->error = 1;
+        c->buffered &= ~NGX_SPLICE_BUFFERED;
+
+        (void) ngx_connection_error(c, err, "splice() failed");
+
+        return NGX_ERROR;
+    }
+
+    if (p->size) {
+        c->buffered |= NGX_SPLICE_BUFFERED;
+
+    } else {
+        c->buffered &= ~NGX_SPLICE_BUFFERED;
+    }
+
+    return sent ? sent : NGX_AGAIN;
+}
@@ -563,7 +563,7 @@ ngx_process_get_status(void)
 static void
 ngx_unlock_mutexes(ngx_pid_t pid)
 {
-    ngx_uint_t        i;
+    ngx_uint_t        i, locked;
     ngx_shm_zone_t   *shm_zone;
     ngx_list_part_t  *part;
     ngx_slab_pool_t  *sp;
@@ -598,7 +598,13 @@ ngx_unlock_mutexes(ngx_pid_t pid)
 
         sp = (ngx_slab_pool_t *) shm_zone[i].shm.addr;
 
-        if (ngx_shmtx_force_unlock(&sp->mutex, pid)) {
+        locked = ngx_shmtx_force_unlock(&sp->mutex, pid);
+
+        if (shm_zone[i].unlock && shm_zone[i].unlock(&shm_zone[i], pid)) {
+            locked = 1;
+        }
+
+        if (locked) {
             ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                           "shared memory zone \"%V\" was locked by %P",
                           &shm_zone[i].shm.name, pid);
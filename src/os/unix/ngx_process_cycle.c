@@ -763,9 +763,28 @@ static void
 ngx_master_process_exit(ngx_cycle_t *cycle)
 {
     ngx_uint_t i;
+    ngx_path_t **path;
 
     ngx_delete_pidfile(cycle);
 
+    /*
+     * all worker and helper processes have exited at this point; while
+     * a new binary runs, its processes still use the zones, and it flushes
+     * them on its own exit
+     */
+
+    if (ngx_new_binary == 0)
+    {
+        path = cycle->paths.elts;
+        for (i = 0; i < cycle->paths.nelts; i++)
+        {
+            if (path[i]->flush)
+            {
+                path[i]->flush(path[i]->data);
+            }
+        }
+    }
+
     ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "exit");
 
     for (i = 0; cycle->modules[i]; i++)
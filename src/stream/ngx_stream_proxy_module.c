@@ -30,6 +30,7 @@ typedef struct {
     ngx_uint_t                       next_upstream_tries;
     ngx_flag_t                       next_upstream;
     ngx_flag_t                       proxy_protocol;
+    ngx_flag_t                       splice;
     ngx_stream_upstream_local_t     *local;
 
 #if (NGX_STREAM_SSL)
@@ -72,6 +73,10 @@ static void ngx_stream_proxy_connect_handler(ngx_event_t *ev);
 static ngx_int_t ngx_stream_proxy_test_connect(ngx_connection_t *c);
 static void ngx_stream_proxy_process(ngx_stream_session_t *s,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
+#if (NGX_HAVE_SPLICE)
+static ngx_splice_pipe_t *ngx_stream_proxy_splice_pipe(ngx_stream_session_t *s,
+    ngx_connection_t *src, ngx_connection_t *dst);
+#endif
 static void ngx_stream_proxy_next_upstream(ngx_stream_session_t *s);
 static void ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc);
 static u_char *ngx_stream_proxy_log_error(ngx_log_t *log, u_char *buf,
@@ -218,6 +223,13 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, proxy_protocol),
       NULL },
 
+    { ngx_string("proxy_splice"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, splice),
+      NULL },
+
 #if (NGX_STREAM_SSL)
 
     { ngx_string("proxy_ssl"),
@@ -1463,6 +1475,9 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
     ngx_log_handler_pt            handler;
     ngx_stream_upstream_t        *u;
     ngx_stream_proxy_srv_conf_t  *pscf;
+#if (NGX_HAVE_SPLICE)
+    ngx_splice_pipe_t           **pipe;
+#endif
 
     u = s->upstream;
 
@@ -1494,6 +1509,9 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
         received = &u->received;
         out = &u->downstream_out;
         busy = &u->downstream_busy;
+#if (NGX_HAVE_SPLICE)
+        pipe = &u->downstream_pipe;
+#endif
 
     } else {
         src = c;
@@ -1503,12 +1521,24 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
         received = &s->received;
         out = &u->upstream_out;
         busy = &u->upstream_busy;
+#if (NGX_HAVE_SPLICE)
+        pipe = &u->upstream_pipe;
+#endif
     }
 
     for ( ;; ) {
 
         if (do_write && dst) {
 
+#if (NGX_HAVE_SPLICE)
+            if (*pipe && (*pipe)->size) {
+                if (ngx_linux_splice_send(dst, *pipe, 0) == NGX_ERROR) {
+                    ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+                    return;
+                }
+            }
+#endif
+
             if (*out || *busy || dst->buffered) {
                 rc = ngx_stream_top_filter(s, *out, from_upstream);
 
@@ -1532,7 +1562,28 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
             }
         }
 
-        size = b->end - b->last;
+#if (NGX_HAVE_SPLICE)
+
+        if (*pipe == NULL && pscf->splice && !u->splice_failed && dst
+            && *out == NULL && *busy == NULL && !dst->buffered)
+        {
+            *pipe = ngx_stream_proxy_splice_pipe(s, src, dst);
+
+            /* the session stays on the buffered path */
+
+            if (*pipe == NULL) {
+                u->splice_failed = 1;
+            }
+        }
+
+        if (*pipe) {
+            size = (*pipe)->capacity - (*pipe)->size;
+
+        } else
+#endif
+        {
+            size = b->end - b->last;
+        }
 
         if (size && src->read->ready && !src->read->delayed
             && !src->read->error)
@@ -1553,7 +1604,15 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
                 }
             }
 
-            n = src->recv(src, b->last, size);
+#if (NGX_HAVE_SPLICE)
+            if (*pipe) {
+                n = ngx_linux_splice_recv(src, *pipe, size);
+
+            } else
+#endif
+            {
+                n = src->recv(src, b->last, size);
+            }
 
             if (n == NGX_AGAIN) {
                 break;
@@ -1592,6 +1651,15 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
                     src->read->eof = 1;
                 }
 
+#if (NGX_HAVE_SPLICE)
+                if (*pipe) {
+                    *received += n;
+                    do_write = 1;
+
+                    continue;
+                }
+#endif
+
                 for (ll = out; *ll; ll = &(*ll)->next) { /* void */ }
 
                 cl = ngx_chain_get_free_buf(c->pool, &u->free);
@@ -1663,6 +1731,38 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+static ngx_splice_pipe_t *
+ngx_stream_proxy_splice_pipe(ngx_stream_session_t *s, ngx_connection_t *src,
+    ngx_connection_t *dst)
+{
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    if (src->type != SOCK_STREAM) {
+        return NULL;
+    }
+
+#if (NGX_SSL)
+    if (src->ssl || dst->ssl) {
+        return NULL;
+    }
+#endif
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "stream proxy splice");
+
+    /* on failure the data are copied through the buffer as usual */
+
+    return ngx_linux_splice_pipe(s->connection->pool, pscf->buffer_size,
+                                 s->connection->log);
+}
+
+#endif
+
+
 static void
 ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
 {
@@ -1853,6 +1953,7 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
     conf->next_upstream_tries = NGX_CONF_UNSET_UINT;
     conf->next_upstream = NGX_CONF_UNSET;
     conf->proxy_protocol = NGX_CONF_UNSET;
+    conf->splice = NGX_CONF_UNSET;
     conf->local = NGX_CONF_UNSET_PTR;
 
 #if (NGX_STREAM_SSL)
@@ -1902,6 +2003,8 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_value(conf->proxy_protocol, prev->proxy_protocol, 0);
 
+    ngx_conf_merge_value(conf->splice, prev->splice, 0);
+
     ngx_conf_merge_ptr_value(conf->local, prev->local, NULL);
 
 #if (NGX_STREAM_SSL)
@@ -126,6 +126,11 @@ typedef struct {
     ngx_chain_t                       *downstream_out;
     ngx_chain_t                       *downstream_busy;
 
+#if (NGX_HAVE_SPLICE)
+    ngx_splice_pipe_t                 *upstream_pipe;
+    ngx_splice_pipe_t                 *downstream_pipe;
+#endif
+
     off_t                              received;
     time_t                             start_sec;
     ngx_uint_t                         responses;
@@ -137,6 +142,9 @@ typedef struct {
     ngx_stream_upstream_state_t       *state;
     unsigned                           connected:1;
     unsigned                           proxy_protocol:1;
+#if (NGX_HAVE_SPLICE)
+    unsigned                           splice_failed:1;
+#endif
 } ngx_stream_upstream_t;
 
 